@@ -10,5 +10,153 @@
 #define CKR_QRYPT_TOKEN_INVALID             ((QRYPT_CKR_START) + 3)
 #define CKR_QRYPT_TOKEN_OTHER_FAIL          ((QRYPT_CKR_START) + 4)
 #define CKR_QRYPT_CA_CERT_FAILURE           ((QRYPT_CKR_START) + 5)
+#define CKR_QRYPT_CONFIG_INVALID            ((QRYPT_CKR_START) + 6)
+
+/* Operations for C_QryptProcessBatch and C_QryptSubmit */
+typedef CK_ULONG CK_QRYPT_BATCH_OPERATION;
+
+#define CKQ_BATCH_SIGN                      0UL
+#define CKQ_BATCH_VERIFY                    1UL
+#define CKQ_BATCH_ENCRYPT                   2UL
+#define CKQ_BATCH_DECRYPT                   3UL
+#define CKQ_BATCH_GENERATE_RANDOM           4UL
+
+/* One single-part operation, independent of the others in its batch.
+ * pOutput and ulOutputLen work as in C_Sign, C_Encrypt and C_Decrypt;
+ * for CKQ_BATCH_VERIFY they hold the signature and are left as is.
+ * CKQ_BATCH_GENERATE_RANDOM fills ulOutputLen bytes of pOutput, like
+ * C_GenerateRandom, and takes no mechanism, key or input. */
+typedef struct CK_QRYPT_BATCH_ITEM {
+  CK_QRYPT_BATCH_OPERATION operation;
+  CK_MECHANISM_PTR pMechanism;
+  CK_OBJECT_HANDLE hKey;
+  CK_BYTE_PTR pInput;
+  CK_ULONG ulInputLen;
+  CK_BYTE_PTR pOutput;
+  CK_ULONG ulOutputLen;
+  CK_RV rv;                 /* Result of this item */
+} CK_QRYPT_BATCH_ITEM;
+
+typedef CK_QRYPT_BATCH_ITEM CK_PTR CK_QRYPT_BATCH_ITEM_PTR;
+
+/* A finished C_QryptSubmit operation; pItem->rv holds its result */
+typedef struct CK_QRYPT_COMPLETION {
+  CK_QRYPT_BATCH_ITEM_PTR pItem;
+  CK_VOID_PTR pCookie;      /* As given to C_QryptSubmit */
+} CK_QRYPT_COMPLETION;
+
+typedef CK_QRYPT_COMPLETION CK_PTR CK_QRYPT_COMPLETION_PTR;
+
+/* Counters of the entropy pipeline, kept since the library was
+ * loaded. New fields are only ever appended, and version.minor
+ * counts them. The reservoir is the buffer of EaaS bytes fetched
+ * ahead of requests. Transfers are EaaS requests that got as far as
+ * an HTTP response, and failed transfers the ones curl gave up on
+ * before one. The phases of both are timed by curl: DNS lookup, TCP
+ * connect, TLS handshake, waiting for the server's first byte, and
+ * receiving the rest. */
+typedef struct CK_QRYPT_STATISTICS {
+  CK_VERSION version;
+  CK_ULONG ulRandomRequests;        /* Since 1.0 */
+  CK_ULONG ulRandomFailures;
+  CK_ULONG ulBytesServed;
+  CK_ULONG ulBytesFromReservoir;
+  CK_ULONG ulReservoirFill;         /* Bytes in the reservoir now, */
+  CK_ULONG ulReservoirCapacity;     /* over every NUMA node's */
+  CK_ULONG ulEaasRequests;
+  CK_ULONG ulEaasFailures;
+  CK_ULONG ulEaasRetries;           /* Requests following a failed one */
+  CK_ULONG ulBytesFetched;
+  CK_ULONG ulBytesWasted;           /* Fetched, then dropped unserved */
+  CK_ULONG ulFetchLatencyP50Us;
+  CK_ULONG ulFetchLatencyP90Us;
+  CK_ULONG ulFetchLatencyP99Us;
+  CK_ULONG ulFetchLatencyMaxUs;
+  CK_ULONG ulLockWaitUs;            /* Total wait for the reservoir's lock */
+  CK_ULONG ulLockWaitMaxUs;
+  CK_ULONG ulTransfers;             /* Since 1.1 */
+  CK_ULONG ulTransfersReusingConnection;
+  CK_ULONG ulTransfersOverHttp2;
+  CK_ULONG ulBytesDownloaded;       /* Response bodies, before decoding */
+  CK_ULONG ulDnsP50Us;              /* Phases that happened, so new */
+  CK_ULONG ulDnsP99Us;              /* connections only for DNS, */
+  CK_ULONG ulConnectP50Us;          /* connect and TLS */
+  CK_ULONG ulConnectP99Us;
+  CK_ULONG ulTlsP50Us;
+  CK_ULONG ulTlsP99Us;
+  CK_ULONG ulServerWaitP50Us;
+  CK_ULONG ulServerWaitP99Us;
+  CK_ULONG ulReceiveP50Us;
+  CK_ULONG ulReceiveP99Us;
+  CK_ULONG ulTransfersFailed;       /* Since 1.2 */
+} CK_QRYPT_STATISTICS;
+
+typedef CK_QRYPT_STATISTICS CK_PTR CK_QRYPT_STATISTICS_PTR;
+
+typedef struct CK_QRYPT_FUNCTION_LIST CK_QRYPT_FUNCTION_LIST;
+typedef CK_QRYPT_FUNCTION_LIST CK_PTR CK_QRYPT_FUNCTION_LIST_PTR;
+typedef CK_QRYPT_FUNCTION_LIST_PTR CK_PTR CK_QRYPT_FUNCTION_LIST_PTR_PTR;
+
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptGetFunctionList)(CK_QRYPT_FUNCTION_LIST_PTR_PTR ppFunctionList);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptProcessBatch)(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItems, CK_ULONG ulCount);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptSubmit)(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItem, CK_VOID_PTR pCookie);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptGetCompletionFd)(int *pFd);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptPollCompletions)(CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptGetLatencyReport)(CK_UTF8CHAR_PTR pReport, CK_ULONG_PTR pulReportLen);
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_QryptGetStatistics)(CK_QRYPT_STATISTICS_PTR pStatistics, CK_ULONG ulSize);
+
+/* Qryptoki's own functions. New functions are only ever appended, and
+ * version.minor counts them, so check it before calling newer ones. */
+struct CK_QRYPT_FUNCTION_LIST {
+  CK_VERSION version;
+  CK_C_QryptProcessBatch C_QryptProcessBatch;     /* Since 1.0 */
+  CK_C_QryptSubmit C_QryptSubmit;                 /* Since 1.1 */
+  CK_C_QryptGetCompletionFd C_QryptGetCompletionFd;
+  CK_C_QryptPollCompletions C_QryptPollCompletions;
+  CK_C_QryptGetLatencyReport C_QryptGetLatencyReport; /* Since 1.2 */
+  CK_C_QryptGetStatistics C_QryptGetStatistics;       /* Since 1.3 */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Looked up with dlsym, like C_GetFunctionList */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptGetFunctionList)(CK_QRYPT_FUNCTION_LIST_PTR_PTR ppFunctionList);
+
+/* Runs the items on several base sessions at once and sets each
+ * item's rv. Returns CKR_OK unless the batch as a whole failed. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptProcessBatch)(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItems, CK_ULONG ulCount);
+
+/* Queues the item to run on Qryptoki's own threads and base sessions,
+ * and returns without waiting for it. The item and the buffers it
+ * points to must stay valid until its completion has been polled.
+ * Returns CKR_FUNCTION_NOT_SUPPORTED unless QRYPT_ASYNC_WORKERS is set. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptSubmit)(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItem, CK_VOID_PTR pCookie);
+
+/* An eventfd that is readable while completions are waiting to be
+ * polled, for use with poll, select or epoll. Don't read or close it;
+ * it stays valid until C_Finalize. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptGetCompletionFd)(int *pFd);
+
+/* Takes up to ulMaxCount finished operations, in the order they
+ * finished, and never blocks; *pulCount is 0 if none are waiting. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptPollCompletions)(CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount);
+
+/* Copies the latency report, one line of text per PKCS#11 function
+ * called so far, not NUL-terminated. With pReport NULL, only sets
+ * *pulReportLen. Returns CKR_FUNCTION_NOT_SUPPORTED unless
+ * QRYPT_LATENCY_STATS is set. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptGetLatencyReport)(CK_UTF8CHAR_PTR pReport, CK_ULONG_PTR pulReportLen);
+
+/* Fills the first ulSize bytes of *pStatistics; pass
+ * sizeof(CK_QRYPT_STATISTICS). The version set tells which fields
+ * this library knows of. May be called at any time, even before
+ * C_Initialize. */
+CK_DECLARE_FUNCTION(CK_RV, C_QryptGetStatistics)(CK_QRYPT_STATISTICS_PTR pStatistics, CK_ULONG ulSize);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* !_QRYPTOKI_PKCS11_VENDOR_DEFS_H */
\ No newline at end of file
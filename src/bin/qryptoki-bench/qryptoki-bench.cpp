@@ -0,0 +1,494 @@
+/*****************************************************************************
+ qryptoki-bench.cpp
+
+ Measures the throughput of Qryptoki calls against the configured base
+ HSM, with and without the features that are meant to speed them up.
+
+ The environment (QRYPT_BASE_HSM_PATH, QRYPT_EAAS_TOKEN, ...) is read
+ as usual; the variables a benchmark compares are set by it.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <functional>   // std::function
+#include <string>       // std::string
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+
+#include "cryptoki.h"                       // PKCS#11 functions
+#include "qryptoki_pkcs11_vendor_defs.h"    // C_QryptProcessBatch
+
+#include "RandomBuffer.h"                   // BasicRandomBuffer
+
+struct Options {
+    CK_SLOT_ID slotID = 0;
+    std::string pin;
+    unsigned threads = 1;
+    unsigned seconds = 5;
+    CK_KEY_TYPE keyType = CKK_RSA;
+    unsigned batchSize = 1000;
+};
+
+static void usage() {
+    printf("Usage: qryptoki-bench <verify|batch|mutex|buffer> [OPTIONS]\n");
+    printf("\n");
+    printf("Benchmarks:\n");
+    printf("  verify        C_VerifyInit + C_Verify with a generated key pair, on the\n");
+    printf("                base HSM and then with QRYPT_SOFTWARE_OFFLOAD_TTL_MS set\n");
+    printf("  batch         Signatures one C_SignInit + C_Sign at a time, and then\n");
+    printf("                through C_QryptProcessBatch\n");
+    printf("  mutex         C_GetSlotInfo from the metadata cache at 1 to 128 threads,\n");
+    printf("                with Qryptoki's own mutexes and then with pthread mutexes\n");
+    printf("                passed as CK_C_INITIALIZE_ARGS callbacks\n");
+    printf("  buffer        Random requests of 16 bytes to 4 KiB from the random\n");
+    printf("                buffer alone, fed by a counter rather than EaaS: the\n");
+    printf("                library's buffer, with a virtual collector and atomics,\n");
+    printf("                against one built for a single thread and a final\n");
+    printf("                collector\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  --slot <id>       Slot to use (default 0)\n");
+    printf("  --pin <PIN>       User PIN; if omitted, no login is done\n");
+    printf("  --threads <n>     Threads, each with its own session (default 1; ignored\n");
+    printf("                    by mutex and buffer)\n");
+    printf("  --seconds <n>     Duration of each run (default 5)\n");
+    printf("  --key <rsa|ec>    Key type: RSA-2048 with CKM_SHA256_RSA_PKCS, or P-256\n");
+    printf("                    with CKM_ECDSA_SHA256 (default rsa)\n");
+    printf("  --batch-size <n>  Signatures per C_QryptProcessBatch call (default 1000)\n");
+    printf("  -h, --help        Show this help\n");
+}
+
+#define CHECK(call)                                                     \
+    do {                                                                \
+        CK_RV rv_ = (call);                                             \
+        if(rv_ != CKR_OK) {                                             \
+            fprintf(stderr, "%s failed: 0x%08lx\n", #call, rv_);        \
+            return false;                                               \
+        }                                                               \
+    } while(0)
+
+static bool openSession(const Options &options, CK_SESSION_HANDLE &hSession) {
+    CHECK(C_OpenSession(options.slotID, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL_PTR, NULL_PTR, &hSession));
+
+    if(!options.pin.empty()) {
+        CK_RV rv = C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)options.pin.c_str(), options.pin.size());
+        if(rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+            fprintf(stderr, "C_Login failed: 0x%08lx\n", rv);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Generates a session key pair and signs the data once with it
+static bool makeSignature(const Options &options, CK_SESSION_HANDLE hSession, CK_MECHANISM &mechanism,
+                          std::vector<CK_BYTE> &data, CK_OBJECT_HANDLE &hPublicKey, CK_OBJECT_HANDLE &hPrivateKey,
+                          std::vector<CK_BYTE> &signature) {
+    CK_BBOOL no = CK_FALSE;
+    CK_BBOOL yes = CK_TRUE;
+    CK_ULONG modulusBits = 2048;
+    CK_BYTE publicExponent[] = {0x01, 0x00, 0x01};
+    CK_BYTE p256[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    std::vector<CK_ATTRIBUTE> publicTemplate = {
+        {CKA_TOKEN, &no, sizeof(no)},
+        {CKA_VERIFY, &yes, sizeof(yes)}
+    };
+    CK_ATTRIBUTE privateTemplate[] = {
+        {CKA_TOKEN, &no, sizeof(no)},
+        {CKA_SIGN, &yes, sizeof(yes)}
+    };
+
+    CK_MECHANISM generate;
+    if(options.keyType == CKK_RSA) {
+        generate = {CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0};
+        mechanism = {CKM_SHA256_RSA_PKCS, NULL_PTR, 0};
+        publicTemplate.push_back({CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits)});
+        publicTemplate.push_back({CKA_PUBLIC_EXPONENT, publicExponent, sizeof(publicExponent)});
+    } else {
+        generate = {CKM_EC_KEY_PAIR_GEN, NULL_PTR, 0};
+        mechanism = {CKM_ECDSA_SHA256, NULL_PTR, 0};
+        publicTemplate.push_back({CKA_EC_PARAMS, p256, sizeof(p256)});
+    }
+
+    CHECK(C_GenerateKeyPair(hSession, &generate, publicTemplate.data(), publicTemplate.size(),
+                            privateTemplate, sizeof(privateTemplate) / sizeof(CK_ATTRIBUTE), &hPublicKey, &hPrivateKey));
+
+    data.assign(256, 0x5a);
+
+    CK_ULONG signatureLen = 0;
+    CHECK(C_SignInit(hSession, &mechanism, hPrivateKey));
+    CHECK(C_Sign(hSession, data.data(), data.size(), NULL_PTR, &signatureLen));
+    signature.resize(signatureLen);
+    CHECK(C_Sign(hSession, data.data(), data.size(), signature.data(), &signatureLen));
+    signature.resize(signatureLen);
+
+    return true;
+}
+
+// One step of a benchmark on a thread's session; returns the number of
+// operations done, or 0 on failure
+typedef std::function<unsigned long(CK_SESSION_HANDLE hSession)> Step;
+typedef std::function<Step(CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data, CK_OBJECT_HANDLE hPublicKey,
+                           CK_OBJECT_HANDLE hPrivateKey, std::vector<CK_BYTE> &signature)> StepFactory;
+
+static CK_C_INITIALIZE_ARGS osLocking() {
+    CK_C_INITIALIZE_ARGS initArgs;
+    memset(&initArgs, 0, sizeof(initArgs));
+    initArgs.flags = CKF_OS_LOCKING_OK;
+    return initArgs;
+}
+
+// Runs the step on every thread until time is up and returns the
+// operations per second. Steps that don't sign get no key pair.
+static bool runThreads(const Options &options, const StepFactory &makeStep, double &perSecond,
+                       CK_C_INITIALIZE_ARGS initArgs = osLocking(), bool signs = true) {
+    CHECK(C_Initialize(&initArgs));
+
+    CK_SESSION_HANDLE hSession;
+    CK_MECHANISM mechanism;
+    std::vector<CK_BYTE> data, signature;
+    CK_OBJECT_HANDLE hPublicKey = CK_INVALID_HANDLE, hPrivateKey = CK_INVALID_HANDLE;
+
+    if(!openSession(options, hSession) ||
+       (signs && !makeSignature(options, hSession, mechanism, data, hPublicKey, hPrivateKey, signature))) {
+        C_Finalize(NULL_PTR);
+        return false;
+    }
+
+    Step step = makeStep(mechanism, data, hPublicKey, hPrivateKey, signature);
+
+    std::atomic<bool> stop(false);
+    std::atomic<bool> failed(false);
+    std::atomic<unsigned long> completed(0);
+    std::vector<std::thread> threads;
+
+    for(unsigned i = 0; i < options.threads; i++) {
+        threads.emplace_back([&] {
+            CK_SESSION_HANDLE hThreadSession;
+            if(!openSession(options, hThreadSession)) {
+                failed = true;
+                return;
+            }
+
+            unsigned long count = 0;
+            while(!stop) {
+                unsigned long done = step(hThreadSession);
+                if(done == 0) {
+                    failed = true;
+                    break;
+                }
+                count += done;
+            }
+
+            completed += count;
+        });
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    stop = true;
+
+    for(std::thread &thread : threads) thread.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    C_Finalize(NULL_PTR);
+
+    perSecond = completed / elapsed.count();
+    return !failed;
+}
+
+static unsigned long verifyStep(CK_SESSION_HANDLE hSession, CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data,
+                                CK_OBJECT_HANDLE hPublicKey, std::vector<CK_BYTE> &signature) {
+    CK_RV rv = C_VerifyInit(hSession, &mechanism, hPublicKey);
+    if(rv == CKR_OK) rv = C_Verify(hSession, data.data(), data.size(), signature.data(), signature.size());
+
+    if(rv != CKR_OK) {
+        fprintf(stderr, "Verification failed: 0x%08lx\n", rv);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int benchmarkVerify(const Options &options) {
+    const char *modes[][2] = {
+        {"base HSM", "0"},
+        {"software", "60000"}
+    };
+
+    printf("%-10s %14s\n", "verify", "calls/s");
+
+    for(auto &mode : modes) {
+        setenv("QRYPT_SOFTWARE_OFFLOAD_TTL_MS", mode[1], 1);
+
+        StepFactory makeStep = [](CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data, CK_OBJECT_HANDLE hPublicKey,
+                                  CK_OBJECT_HANDLE, std::vector<CK_BYTE> &signature) {
+            return Step([&, hPublicKey](CK_SESSION_HANDLE hSession) {
+                return verifyStep(hSession, mechanism, data, hPublicKey, signature);
+            });
+        };
+
+        double perSecond;
+        if(!runThreads(options, makeStep, perSecond)) return 1;
+
+        printf("%-10s %14.0f\n", mode[0], perSecond);
+    }
+
+    return 0;
+}
+
+static unsigned long signStep(CK_SESSION_HANDLE hSession, CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data,
+                              CK_OBJECT_HANDLE hPrivateKey, std::vector<CK_BYTE> &signature) {
+    std::vector<CK_BYTE> output(signature.size());
+    CK_ULONG outputLen = output.size();
+
+    CK_RV rv = C_SignInit(hSession, &mechanism, hPrivateKey);
+    if(rv == CKR_OK) rv = C_Sign(hSession, data.data(), data.size(), output.data(), &outputLen);
+
+    if(rv != CKR_OK) {
+        fprintf(stderr, "Signing failed: 0x%08lx\n", rv);
+        return 0;
+    }
+
+    return 1;
+}
+
+static unsigned long batchSignStep(CK_SESSION_HANDLE hSession, CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data,
+                                   CK_OBJECT_HANDLE hPrivateKey, std::vector<CK_BYTE> &signature, unsigned batchSize) {
+    std::vector<CK_BYTE> outputs(batchSize * signature.size());
+    std::vector<CK_QRYPT_BATCH_ITEM> items(batchSize);
+
+    for(unsigned i = 0; i < batchSize; i++) {
+        items[i] = {CKQ_BATCH_SIGN, &mechanism, hPrivateKey, data.data(), data.size(),
+                    outputs.data() + i * signature.size(), signature.size(), CKR_OK};
+    }
+
+    CK_RV rv = C_QryptProcessBatch(hSession, items.data(), items.size());
+    for(unsigned i = 0; rv == CKR_OK && i < batchSize; i++) rv = items[i].rv;
+
+    if(rv != CKR_OK) {
+        fprintf(stderr, "Batch signing failed: 0x%08lx\n", rv);
+        return 0;
+    }
+
+    return batchSize;
+}
+
+static int benchmarkBatch(const Options &options) {
+    printf("%-10s %14s\n", "sign", "signatures/s");
+
+    for(int batched = 0; batched < 2; batched++) {
+        unsigned batchSize = options.batchSize;
+
+        StepFactory makeStep = [batched, batchSize](CK_MECHANISM &mechanism, std::vector<CK_BYTE> &data, CK_OBJECT_HANDLE,
+                                                    CK_OBJECT_HANDLE hPrivateKey, std::vector<CK_BYTE> &signature) {
+            return Step([&, batched, batchSize, hPrivateKey](CK_SESSION_HANDLE hSession) {
+                if(batched) return batchSignStep(hSession, mechanism, data, hPrivateKey, signature, batchSize);
+
+                return signStep(hSession, mechanism, data, hPrivateKey, signature);
+            });
+        };
+
+        double perSecond;
+        if(!runThreads(options, makeStep, perSecond)) return 1;
+
+        printf("%-10s %14.0f\n", batched ? "batched" : "one by one", perSecond);
+    }
+
+    return 0;
+}
+
+static CK_RV createPthreadMutex(CK_VOID_PTR_PTR ppMutex) {
+    pthread_mutex_t *mutex = new pthread_mutex_t;
+    pthread_mutex_init(mutex, NULL);
+
+    *ppMutex = mutex;
+    return CKR_OK;
+}
+
+static CK_RV destroyPthreadMutex(CK_VOID_PTR pMutex) {
+    pthread_mutex_destroy((pthread_mutex_t *)pMutex);
+    delete (pthread_mutex_t *)pMutex;
+    return CKR_OK;
+}
+
+static CK_RV lockPthreadMutex(CK_VOID_PTR pMutex) {
+    return pthread_mutex_lock((pthread_mutex_t *)pMutex) == 0 ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+static CK_RV unlockPthreadMutex(CK_VOID_PTR pMutex) {
+    return pthread_mutex_unlock((pthread_mutex_t *)pMutex) == 0 ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+static unsigned long slotInfoStep(CK_SLOT_ID slotID) {
+    CK_SLOT_INFO info;
+    CK_RV rv = C_GetSlotInfo(slotID, &info);
+
+    if(rv != CKR_OK) {
+        fprintf(stderr, "C_GetSlotInfo failed: 0x%08lx\n", rv);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Each call takes the metadata cache's mutex just long enough to copy
+// a CK_SLOT_INFO, so the lock itself is most of the cost
+static int benchmarkMutex(const Options &options) {
+    setenv("QRYPT_METADATA_CACHE_TTL_MS", "3600000", 1);
+
+    CK_C_INITIALIZE_ARGS pthreadLocking;
+    memset(&pthreadLocking, 0, sizeof(pthreadLocking));
+    pthreadLocking.CreateMutex = createPthreadMutex;
+    pthreadLocking.DestroyMutex = destroyPthreadMutex;
+    pthreadLocking.LockMutex = lockPthreadMutex;
+    pthreadLocking.UnlockMutex = unlockPthreadMutex;
+
+    printf("%-8s %14s %14s\n", "threads", "qryptoki/s", "pthread/s");
+
+    for(unsigned threads = 1; threads <= 128; threads *= 2) {
+        Options run = options;
+        run.threads = threads;
+
+        CK_SLOT_ID slotID = options.slotID;
+        StepFactory makeStep = [slotID](CK_MECHANISM &, std::vector<CK_BYTE> &, CK_OBJECT_HANDLE,
+                                        CK_OBJECT_HANDLE, std::vector<CK_BYTE> &) {
+            return Step([slotID](CK_SESSION_HANDLE) { return slotInfoStep(slotID); });
+        };
+
+        double adaptivePerSecond, pthreadPerSecond;
+        if(!runThreads(run, makeStep, adaptivePerSecond, osLocking(), false)) return 1;
+        if(!runThreads(run, makeStep, pthreadPerSecond, pthreadLocking, false)) return 1;
+
+        printf("%-8u %14.0f %14.0f\n", threads, adaptivePerSecond, pthreadPerSecond);
+    }
+
+    return 0;
+}
+
+// Stands in for EaaS, so that the buffer's own cost is what is timed
+class CountingCollector final : public RandomCollector {
+    public:
+        CK_RV collectRandom(uint8_t *dest, size_t goal) final {
+            memset(dest, (int)(++this->fetches), goal);
+            return CKR_OK;
+        }
+    private:
+        unsigned long fetches = 0;
+};
+
+typedef BasicRandomBuffer<CountingCollector, KB, SingleThreadBlocks, ZeroWipe> InlineRandomBuffer;
+
+// Requests are served as C_GenerateRandom serves them: from the buffer
+// if it holds them all, else through getRandom
+template <typename Buffer, typename Collector>
+static double randomPerSecond(const Options &options, size_t requestSize) {
+    Buffer buffer(std::make_shared<Collector>());
+    std::vector<uint8_t> output(requestSize);
+
+    unsigned long count = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end = start + std::chrono::seconds(options.seconds);
+
+    while(std::chrono::steady_clock::now() < end) {
+        // Between clock reads, so that they don't dominate small requests
+        for(unsigned i = 0; i < 1000; i++) {
+            if(!buffer.takeReserved(output.data(), requestSize) &&
+               buffer.getRandom(output.data(), requestSize) != CKR_OK) return 0;
+        }
+
+        count += 1000;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return count / elapsed.count();
+}
+
+static int benchmarkBuffer(const Options &options) {
+    printf("%-8s %14s %14s\n", "bytes", "shared/s", "inline/s");
+
+    for(size_t requestSize = 16; requestSize <= 4096; requestSize *= 4) {
+        double sharedPerSecond = randomPerSecond<RandomBuffer, CountingCollector>(options, requestSize);
+        double inlinePerSecond = randomPerSecond<InlineRandomBuffer, CountingCollector>(options, requestSize);
+
+        if(sharedPerSecond == 0 || inlinePerSecond == 0) return 1;
+
+        printf("%-8zu %14.0f %14.0f\n", requestSize, sharedPerSecond, inlinePerSecond);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"slot",       required_argument, NULL, 's'},
+        {"pin",        required_argument, NULL, 'p'},
+        {"threads",    required_argument, NULL, 't'},
+        {"seconds",    required_argument, NULL, 'd'},
+        {"key",        required_argument, NULL, 'k'},
+        {"batch-size", required_argument, NULL, 'b'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL,         0,                 NULL, 0}
+    };
+
+    Options options;
+    int opt;
+
+    while((opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                options.slotID = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                options.pin = optarg;
+                break;
+            case 't':
+                options.threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                options.seconds = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                if(strcmp(optarg, "rsa") == 0) {
+                    options.keyType = CKK_RSA;
+                } else if(strcmp(optarg, "ec") == 0) {
+                    options.keyType = CKK_EC;
+                } else {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'b':
+                options.batchSize = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1 || options.threads == 0 || options.seconds == 0 || options.batchSize == 0) {
+        usage();
+        return 1;
+    }
+
+    std::string benchmark = argv[optind];
+    if(benchmark == "verify") return benchmarkVerify(options);
+    if(benchmark == "batch") return benchmarkBatch(options);
+    if(benchmark == "mutex") return benchmarkMutex(options);
+    if(benchmark == "buffer") return benchmarkBuffer(options);
+
+    usage();
+    return 1;
+}
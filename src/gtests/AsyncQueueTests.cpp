@@ -0,0 +1,166 @@
+#include <poll.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "AsyncQueue.h"
+
+// Completes each job with CKR_OK without a base HSM, holding every job
+// until the test opens the gate
+class StubAsyncQueue : public AsyncQueue {
+    public:
+        StubAsyncQueue(size_t workerCount) : AsyncQueue(workerCount), open(true), running(0), ran(0) {}
+
+        void close() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->open = false;
+        }
+
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->open = true;
+            }
+            this->changed.notify_all();
+        }
+
+        void waitRunning(size_t count) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->changed.wait(lock, [this, count] { return this->running >= count; });
+        }
+
+        size_t getRan() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->ran;
+        }
+    protected:
+        void run(AsyncJob &job, AsyncWorker &) override {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->running++;
+            this->changed.notify_all();
+            this->changed.wait(lock, [this] { return this->open; });
+
+            job.completion.pItem->rv = CKR_OK;
+            this->ran++;
+        }
+    private:
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool open;
+        size_t running;
+        size_t ran;
+};
+
+static bool readable(int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return ::poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) != 0;
+}
+
+// Polls until count completions were taken, or a few seconds passed
+static CK_ULONG pollFor(AsyncQueue &queue, CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG count) {
+    CK_ULONG taken = 0;
+
+    for(int i = 0; i < 5000 && taken < count; i++) {
+        if(!readable(queue.getCompletionFd())) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        taken += queue.poll(pCompletions + taken, count - taken);
+    }
+
+    return taken;
+}
+
+TEST(AsyncQueueTests, CompletionFdReadableWhileCompletionsWait) {
+    StubAsyncQueue queue(2);
+    queue.start();
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    CK_QRYPT_BATCH_ITEM items[3];
+    int cookies[3];
+
+    EXPECT_FALSE(readable(queue.getCompletionFd()));
+
+    for(int i = 0; i < 3; i++) {
+        items[i].rv = CKR_GENERAL_ERROR;
+        EXPECT_EQ(queue.submit(session, &items[i], &cookies[i]), CKR_OK);
+    }
+
+    // Take the completions one at a time; the fd stays readable until the last
+    CK_QRYPT_COMPLETION completions[3];
+    EXPECT_EQ(pollFor(queue, completions, 1), 1);
+
+    while(queue.getRan() < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_TRUE(readable(queue.getCompletionFd()));
+    EXPECT_EQ(queue.poll(&completions[1], 1), 1);
+    EXPECT_TRUE(readable(queue.getCompletionFd()));
+    EXPECT_EQ(queue.poll(&completions[2], 1), 1);
+    EXPECT_FALSE(readable(queue.getCompletionFd()));
+    EXPECT_EQ(queue.poll(completions, 3), 0);
+
+    for(int i = 0; i < 3; i++) {
+        EXPECT_GE(completions[i].pItem, &items[0]);
+        EXPECT_LE(completions[i].pItem, &items[2]);
+        EXPECT_EQ(completions[i].pCookie, &cookies[completions[i].pItem - items]);
+        EXPECT_EQ(completions[i].pItem->rv, CKR_OK);
+    }
+
+    queue.stop();
+}
+
+TEST(AsyncQueueTests, RunsInlineWithoutWorkers) {
+    StubAsyncQueue queue(0);
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    CK_QRYPT_BATCH_ITEM item;
+    item.rv = CKR_GENERAL_ERROR;
+
+    EXPECT_EQ(queue.submit(session, &item, NULL), CKR_OK);
+    EXPECT_EQ(item.rv, CKR_OK);
+    EXPECT_TRUE(readable(queue.getCompletionFd()));
+
+    CK_QRYPT_COMPLETION completion;
+    EXPECT_EQ(queue.poll(&completion, 1), 1);
+    EXPECT_EQ(completion.pItem, &item);
+    EXPECT_FALSE(readable(queue.getCompletionFd()));
+}
+
+TEST(AsyncQueueTests, StopDropsQueuedJobs) {
+    StubAsyncQueue queue(1);
+    queue.close();
+    queue.start();
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    CK_QRYPT_BATCH_ITEM items[4];
+
+    // The only worker holds the first job while the rest queue up
+    EXPECT_EQ(queue.submit(session, &items[0], NULL), CKR_OK);
+    queue.waitRunning(1);
+    for(int i = 1; i < 4; i++) EXPECT_EQ(queue.submit(session, &items[i], NULL), CKR_OK);
+
+    std::thread stopper(&AsyncQueue::stop, &queue);
+
+    // Once stopping, submit refuses new jobs and the queued ones are gone
+    CK_QRYPT_BATCH_ITEM late;
+    while(queue.submit(session, &late, NULL) == CKR_OK) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    queue.release();
+    stopper.join();
+
+    EXPECT_EQ(queue.getRan(), 1);
+
+    CK_QRYPT_COMPLETION completions[4];
+    EXPECT_EQ(queue.poll(completions, 4), 1);
+    EXPECT_EQ(completions[0].pItem, &items[0]);
+    EXPECT_FALSE(readable(queue.getCompletionFd()));
+}
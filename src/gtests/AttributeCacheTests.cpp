@@ -0,0 +1,78 @@
+#include <chrono>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "AttributeCache.h"
+
+static void insertModulus(AttributeCache &cache, CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject, std::vector<CK_BYTE> modulus) {
+    CK_ATTRIBUTE attribute = {CKA_MODULUS, modulus.data(), modulus.size()};
+    cache.insert(slotID, hObject, cache.getGeneration(), &attribute, 1);
+}
+
+TEST(AttributeCacheTests, OnlyImmutableAttributes) {
+    EXPECT_TRUE(AttributeCache::isImmutable(CKA_MODULUS));
+    EXPECT_TRUE(AttributeCache::isImmutable(CKA_EC_POINT));
+    EXPECT_FALSE(AttributeCache::isImmutable(CKA_LABEL));
+    EXPECT_FALSE(AttributeCache::isImmutable(CKA_VALUE));
+}
+
+TEST(AttributeCacheTests, LengthThenValue) {
+    AttributeCache cache(std::chrono::milliseconds(60000), NULL);
+    insertModulus(cache, 0, 100, {1, 2, 3});
+
+    CK_RV rv;
+    CK_ATTRIBUTE attribute = {CKA_MODULUS, NULL, 0};
+    ASSERT_TRUE(cache.lookup(0, 100, &attribute, 1, rv));
+    EXPECT_EQ(rv, CKR_OK);
+    EXPECT_EQ(attribute.ulValueLen, 3);
+
+    std::vector<CK_BYTE> value(attribute.ulValueLen);
+    attribute.pValue = value.data();
+    ASSERT_TRUE(cache.lookup(0, 100, &attribute, 1, rv));
+    EXPECT_EQ(rv, CKR_OK);
+    EXPECT_EQ(value, std::vector<CK_BYTE>({1, 2, 3}));
+}
+
+TEST(AttributeCacheTests, BufferTooSmall) {
+    AttributeCache cache(std::chrono::milliseconds(60000), NULL);
+    insertModulus(cache, 0, 100, {1, 2, 3});
+
+    CK_RV rv;
+    CK_BYTE value[2];
+    CK_ATTRIBUTE attribute = {CKA_MODULUS, value, sizeof(value)};
+    ASSERT_TRUE(cache.lookup(0, 100, &attribute, 1, rv));
+    EXPECT_EQ(rv, CKR_BUFFER_TOO_SMALL);
+    EXPECT_EQ(attribute.ulValueLen, CK_UNAVAILABLE_INFORMATION);
+}
+
+TEST(AttributeCacheTests, MissWithoutEveryAttribute) {
+    AttributeCache cache(std::chrono::milliseconds(60000), NULL);
+    insertModulus(cache, 0, 100, {1, 2, 3});
+
+    CK_RV rv;
+    CK_ATTRIBUTE attributes[] = {{CKA_MODULUS, NULL, 0}, {CKA_PUBLIC_EXPONENT, NULL, 0}};
+    EXPECT_FALSE(cache.lookup(0, 100, attributes, 2, rv));
+
+    // Other slots and objects aren't touched
+    EXPECT_FALSE(cache.lookup(1, 100, attributes, 1, rv));
+    EXPECT_FALSE(cache.lookup(0, 101, attributes, 1, rv));
+}
+
+TEST(AttributeCacheTests, Invalidate) {
+    AttributeCache cache(std::chrono::milliseconds(60000), NULL);
+    insertModulus(cache, 0, 100, {1});
+    insertModulus(cache, 0, 101, {1});
+    insertModulus(cache, 1, 100, {1});
+
+    CK_RV rv;
+    CK_ATTRIBUTE attribute = {CKA_MODULUS, NULL, 0};
+
+    cache.invalidate(0, 100);
+    EXPECT_FALSE(cache.lookup(0, 100, &attribute, 1, rv));
+    EXPECT_TRUE(cache.lookup(0, 101, &attribute, 1, rv));
+
+    cache.invalidate(0);
+    EXPECT_FALSE(cache.lookup(0, 101, &attribute, 1, rv));
+    EXPECT_TRUE(cache.lookup(1, 100, &attribute, 1, rv));
+}
@@ -1,6 +1,10 @@
-#include <algorithm>    /* std::fill_n */
+#include <algorithm>    /* std::fill_n, std::equal, std::all_of */
+#include <atomic>       /* std::atomic */
+#include <mutex>        /* std::mutex */
 #include <stdlib.h>     /* srand, rand */
+#include <thread>       /* std::thread */
 #include <time.h>       /* time */
+#include <vector>       /* std::vector */
 
 #include "qryptoki_pkcs11_vendor_defs.h"
 
@@ -9,14 +13,23 @@
 
 #include "MockRandomCollector.h"
 #include "RandomBuffer.h"
+#include "copywipe.h"
 
 using ::testing::_;
 using ::testing::DoAll;
 using ::testing::SetArrayArgument;
 using ::testing::Return;
 using ::testing::InSequence;
+using ::testing::Eq;
 
-TEST(BufferTests, All255) {
+// Every test runs against the shared and the single-threaded buffer
+template <typename T>
+class BufferTests : public ::testing::Test {};
+
+typedef ::testing::Types<RandomBuffer, SingleThreadRandomBuffer> BufferTypes;
+TYPED_TEST_SUITE(BufferTests, BufferTypes);
+
+TYPED_TEST(BufferTests, All255) {
     uint8_t dest[20] = {0};
 
     uint8_t very_random[1024] = {0};
@@ -28,7 +41,7 @@ TEST(BufferTests, All255) {
         .WillOnce(DoAll(SetArrayArgument<0>(very_random, &very_random[1024]),
                         Return(CKR_OK)));
 
-    RandomBuffer randomBuffer(randomCollector);
+    TypeParam randomBuffer(randomCollector);
 
     CK_RV rv = randomBuffer.getRandom(dest, 20);
 
@@ -39,7 +52,7 @@ TEST(BufferTests, All255) {
     }
 }
 
-TEST(BufferTests, CollectReturnsNotOk) {
+TYPED_TEST(BufferTests, CollectReturnsNotOk) {
     uint8_t dest[20] = {0};
 
     std::shared_ptr<MockRandomCollector> randomCollector = std::make_shared<MockRandomCollector>();
@@ -47,7 +60,7 @@ TEST(BufferTests, CollectReturnsNotOk) {
     EXPECT_CALL(*randomCollector, collectRandom(_, 1024))
         .WillOnce(Return(CKR_QRYPT_TOKEN_INVALID));
 
-    RandomBuffer randomBuffer(randomCollector);
+    TypeParam randomBuffer(randomCollector);
 
     CK_RV rv = randomBuffer.getRandom(dest, 20);
 
@@ -58,7 +71,7 @@ TEST(BufferTests, CollectReturnsNotOk) {
     }
 }
 
-TEST(BufferTests, AllNonzero) {
+TYPED_TEST(BufferTests, AllNonzero) {
     srand(time(NULL));
 
     uint8_t dest[2000] = {0};
@@ -75,7 +88,7 @@ TEST(BufferTests, AllNonzero) {
         .WillOnce(DoAll(SetArrayArgument<0>(&very_random[1024], &very_random[2048]),
                         Return(CKR_OK)));
 
-    RandomBuffer randomBuffer(randomCollector);
+    TypeParam randomBuffer(randomCollector);
     
     for(size_t iteration = 0; iteration < 400; iteration++) {
         CK_RV rv = randomBuffer.getRandom(&dest[5 * iteration], 5);
@@ -87,7 +100,7 @@ TEST(BufferTests, AllNonzero) {
     }
 }
 
-TEST(BufferTests, MoreThan1024) {
+TYPED_TEST(BufferTests, MoreThan1024) {
     srand(time(NULL));
 
     uint8_t dest[10000] = {0};
@@ -116,7 +129,7 @@ TEST(BufferTests, MoreThan1024) {
                             Return(CKR_OK)));
     }
 
-    RandomBuffer randomBuffer(randomCollector);
+    TypeParam randomBuffer(randomCollector);
 
     CK_RV rv = randomBuffer.getRandom(dest, 4000);
     EXPECT_EQ(rv, CKR_OK);
@@ -131,6 +144,37 @@ TEST(BufferTests, MoreThan1024) {
     EXPECT_EQ(rv, CKR_OK);
 }
 
+TYPED_TEST(BufferTests, WholeKBGoesStraightToDest) {
+    uint8_t dest[2048] = {0};
+
+    uint8_t very_random[2048] = {0};
+    std::fill_n(very_random, 2048, (uint8_t)255);
+
+    std::shared_ptr<MockRandomCollector> randomCollector = std::make_shared<MockRandomCollector>();
+
+    {
+        InSequence seq;
+
+        EXPECT_CALL(*randomCollector, collectRandom(Eq(dest), 2048))
+            .WillOnce(DoAll(SetArrayArgument<0>(very_random, &very_random[2048]),
+                            Return(CKR_OK)));
+        EXPECT_CALL(*randomCollector, collectRandom(Eq(dest), 1024))
+            .WillOnce(DoAll(SetArrayArgument<0>(very_random, &very_random[1024]),
+                            Return(CKR_QRYPT_TOKEN_INVALID)));
+    }
+
+    TypeParam randomBuffer(randomCollector);
+
+    CK_RV rv = randomBuffer.getRandom(dest, 2048);
+    EXPECT_EQ(rv, CKR_OK);
+    EXPECT_TRUE(std::all_of(dest, &dest[2048], [](uint8_t b) { return b == 255; }));
+
+    // A failed fetch leaves nothing it wrote behind
+    rv = randomBuffer.getRandom(dest, 1024);
+    EXPECT_EQ(rv, CKR_QRYPT_TOKEN_INVALID);
+    EXPECT_TRUE(std::all_of(dest, &dest[1024], [](uint8_t b) { return b == 0; }));
+}
+
 /**
  * BEWARE! This test makes some assumptions about the buffer implementation.
  *  (1) Reads/writes aer to consecutive spaces in the buffer.
@@ -139,7 +183,7 @@ TEST(BufferTests, MoreThan1024) {
  * These assumptions aside, this test is super valuable because it confirms that random is not
  * reused. 
  */
-TEST(BufferTests, NoReuse) {
+TYPED_TEST(BufferTests, NoReuse) {
     srand(time(NULL));
 
     size_t total_random_in_64_bits;
@@ -201,7 +245,7 @@ TEST(BufferTests, NoReuse) {
         }
     }
 
-    RandomBuffer randomBuffer(randomCollector);
+    TypeParam randomBuffer(randomCollector);
 
     std::unique_ptr<uint64_t[]> output_stream_unique_ptr = std::make_unique<uint64_t[]>(sum_request_sizes_in_64_bits);
     uint64_t *output_stream_64_bits = output_stream_unique_ptr.get();
@@ -236,3 +280,215 @@ TEST(BufferTests, NoReuse) {
 
     EXPECT_FALSE(seen[0]);
 }
+
+TYPED_TEST(BufferTests, StatisticsCountReservoir) {
+    uint8_t dest[20] = {0};
+
+    uint8_t very_random[1024] = {0};
+    std::fill_n(very_random, 1024, (uint8_t)255);
+
+    std::shared_ptr<MockRandomCollector> randomCollector = std::make_shared<MockRandomCollector>();
+
+    EXPECT_CALL(*randomCollector, collectRandom(_, 1024))
+        .WillOnce(DoAll(SetArrayArgument<0>(very_random, &very_random[1024]),
+                        Return(CKR_OK)));
+
+    CK_QRYPT_STATISTICS before, after;
+    ASSERT_EQ(C_QryptGetStatistics(&before, sizeof(before)), CKR_OK);
+
+    {
+        TypeParam randomBuffer(randomCollector);
+
+        EXPECT_EQ(randomBuffer.getRandom(dest, 20), CKR_OK);
+        EXPECT_EQ(randomBuffer.getRandom(dest, 20), CKR_OK);
+
+        ASSERT_EQ(C_QryptGetStatistics(&after, sizeof(after)), CKR_OK);
+        EXPECT_EQ(after.ulBytesFromReservoir - before.ulBytesFromReservoir, 20);
+        EXPECT_EQ(after.ulReservoirFill, 1024 - 40);
+    }
+
+    ASSERT_EQ(C_QryptGetStatistics(&after, sizeof(after)), CKR_OK);
+    EXPECT_EQ(after.version.major, 1);
+    EXPECT_EQ(after.ulBytesWasted - before.ulBytesWasted, 1024 - 40);
+    EXPECT_EQ(after.ulReservoirFill, 0);
+}
+
+// As with one buffer per NUMA node
+TEST(BufferStatisticsTests, FillSumsOverBuffers) {
+    uint8_t dest[100] = {0};
+
+    uint8_t very_random[1024] = {0};
+    std::fill_n(very_random, 1024, (uint8_t)255);
+
+    std::shared_ptr<MockRandomCollector> randomCollector = std::make_shared<MockRandomCollector>();
+
+    EXPECT_CALL(*randomCollector, collectRandom(_, 1024))
+        .Times(2)
+        .WillRepeatedly(DoAll(SetArrayArgument<0>(very_random, &very_random[1024]),
+                              Return(CKR_OK)));
+
+    CK_QRYPT_STATISTICS statistics;
+
+    {
+        RandomBuffer first(randomCollector);
+        RandomBuffer second(randomCollector);
+
+        EXPECT_EQ(first.getRandom(dest, 20), CKR_OK);
+        EXPECT_EQ(second.getRandom(dest, 100), CKR_OK);
+
+        ASSERT_EQ(C_QryptGetStatistics(&statistics, sizeof(statistics)), CKR_OK);
+        EXPECT_EQ(statistics.ulReservoirFill, (1024 - 20) + (1024 - 100));
+        EXPECT_EQ(statistics.ulReservoirCapacity, 2 * 1024);
+    }
+
+    ASSERT_EQ(C_QryptGetStatistics(&statistics, sizeof(statistics)), CKR_OK);
+    EXPECT_EQ(statistics.ulReservoirFill, 0);
+    EXPECT_EQ(statistics.ulReservoirCapacity, 0);
+}
+
+TYPED_TEST(BufferTests, TakeReservedAllOrNothing) {
+    uint8_t dest[2048] = {0};
+
+    uint8_t very_random[1024] = {0};
+    for(size_t i = 0; i < 1024; i++)
+        very_random[i] = (i % 255) + 1;
+
+    std::shared_ptr<MockRandomCollector> randomCollector = std::make_shared<MockRandomCollector>();
+
+    EXPECT_CALL(*randomCollector, collectRandom(_, 1024))
+        .WillOnce(DoAll(SetArrayArgument<0>(very_random, &very_random[1024]),
+                        Return(CKR_OK)));
+
+    TypeParam randomBuffer(randomCollector);
+
+    // Nothing buffered yet, and takeReserved never goes to EaaS
+    EXPECT_FALSE(randomBuffer.takeReserved(dest, 20));
+
+    EXPECT_EQ(randomBuffer.getRandom(dest, 20), CKR_OK);
+
+    // Asking for more than is buffered takes nothing
+    EXPECT_FALSE(randomBuffer.takeReserved(&dest[20], 1024 - 20 + 1));
+    for(size_t i = 20; i < 2048; i++)
+        EXPECT_EQ(dest[i], 0);
+
+    // Spanning blocks, then emptying the buffer
+    EXPECT_TRUE(randomBuffer.takeReserved(&dest[20], 100));
+    EXPECT_TRUE(randomBuffer.takeReserved(&dest[120], 1024 - 120));
+    EXPECT_FALSE(randomBuffer.takeReserved(&dest[1024], 1));
+
+    for(size_t i = 0; i < 1024; i++)
+        EXPECT_NE(dest[i], 0);
+}
+
+// Hands out the bytes 1 to 255 in turn, never 0, and counts each value
+class CountingCollector : public RandomCollector {
+    public:
+        CountingCollector() : next(0) {
+            for(uint64_t &count : this->produced) count = 0;
+        }
+
+        CK_RV collectRandom(uint8_t *dest, size_t goal) override {
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            for(size_t i = 0; i < goal; i++) {
+                dest[i] = (uint8_t)(this->next++ % 255 + 1);
+                this->produced[dest[i]]++;
+            }
+
+            return CKR_OK;
+        }
+
+        std::mutex mutex;
+        uint64_t next;
+        uint64_t produced[256];
+};
+
+const size_t RESERVED_TAKERS = 4;
+const size_t STRESS_ROUNDS = 20000;
+
+static uint64_t bytesWasted() {
+    CK_QRYPT_STATISTICS statistics;
+    EntropyStats::getInstance().getStatistics(statistics);
+    return statistics.ulBytesWasted;
+}
+
+// One thread in getRandom and several in takeReserved: every byte the
+// collector made is handed out once, left in the buffer or counted as
+// wasted, and no byte is handed out twice
+TEST(BufferStressTests, ConcurrentTakeReservedAndGetRandom) {
+    std::shared_ptr<CountingCollector> collector = std::make_shared<CountingCollector>();
+    std::unique_ptr<RandomBuffer> randomBuffer(new RandomBuffer(collector));
+    uint64_t wastedBefore = bytesWasted();
+
+    std::mutex seenMutex;
+    uint64_t seen[256] = {0};
+    std::atomic<bool> done(false);
+
+    auto count = [&seenMutex, &seen](const uint8_t *bytes, size_t n) {
+        std::lock_guard<std::mutex> lock(seenMutex);
+        for(size_t i = 0; i < n; i++) seen[bytes[i]]++;
+    };
+
+    std::vector<std::thread> takers;
+    for(size_t t = 0; t < RESERVED_TAKERS; t++) {
+        takers.emplace_back([&randomBuffer, &done, &count, t] {
+            uint8_t dest[200];
+            size_t goal = 1 + t * 37;
+
+            while(!done.load()) {
+                if(randomBuffer->takeReserved(dest, goal)) count(dest, goal);
+                goal = goal % 199 + 1;
+            }
+        });
+    }
+
+    uint8_t dest[1500];
+    for(size_t round = 0; round < STRESS_ROUNDS; round++) {
+        size_t goal = (round * 131) % sizeof(dest) + 1;
+
+        ASSERT_EQ(randomBuffer->getRandom(dest, goal), CKR_OK);
+        count(dest, goal);
+    }
+
+    done = true;
+    for(std::thread &thread : takers) thread.join();
+
+    // Take what is left, one byte at a time
+    uint8_t last;
+    while(randomBuffer->takeReserved(&last, 1)) count(&last, 1);
+    randomBuffer.reset();
+
+    EXPECT_EQ(seen[0], 0);
+
+    uint64_t produced = 0;
+    uint64_t handedOut = 0;
+    for(size_t value = 1; value < 256; value++) {
+        EXPECT_LE(seen[value], collector->produced[value]) << "value " << value;
+        produced += collector->produced[value];
+        handedOut += seen[value];
+    }
+
+    EXPECT_EQ(handedOut + (bytesWasted() - wastedBefore), produced);
+}
+
+TEST(CopyAndWipeTests, CopiesAndZeroes) {
+    // Sizes either side of each way of moving the ends and of the wide
+    // threshold, and the largest the non-temporal path
+    const size_t sizes[] = {0, 1, 3, 4, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64,
+                            WIDE_COPY_THRESHOLD, WIDE_COPY_THRESHOLD + 1, 200, 1000,
+                            NON_TEMPORAL_COPY_THRESHOLD + 77};
+
+    for(size_t n : sizes) {
+        for(size_t offset = 0; offset < 3; offset++) {
+            // dest lands at a different offset, so the two are aligned
+            // differently
+            std::vector<uint8_t> source(n + offset), expected(n), dest(n + 2 * offset + 1, 0);
+            for(size_t i = 0; i < n; i++) expected[i] = source[offset + i] = (uint8_t)(i * 7 + 1);
+
+            copyAndWipe(&dest[2 * offset + 1], &source[offset], n);
+
+            EXPECT_TRUE(std::equal(expected.begin(), expected.end(), dest.begin() + 2 * offset + 1)) << n << " bytes";
+            EXPECT_TRUE(std::all_of(source.begin(), source.end(), [](uint8_t b) { return b == 0; })) << n << " bytes";
+        }
+    }
+}
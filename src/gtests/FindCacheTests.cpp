@@ -0,0 +1,79 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "FindCache.h"
+
+TEST(FindCacheTests, KeyIgnoresAttributeOrder) {
+    CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
+    CK_BYTE id[] = {0x01, 0x02};
+
+    CK_ATTRIBUTE first[] = {{CKA_CLASS, &keyClass, sizeof(keyClass)}, {CKA_ID, id, sizeof(id)}};
+    CK_ATTRIBUTE second[] = {{CKA_ID, id, sizeof(id)}, {CKA_CLASS, &keyClass, sizeof(keyClass)}};
+
+    std::string firstKey, secondKey, otherSlotKey;
+    ASSERT_TRUE(FindCache::makeKey(0, first, 2, firstKey));
+    ASSERT_TRUE(FindCache::makeKey(0, second, 2, secondKey));
+    ASSERT_TRUE(FindCache::makeKey(1, first, 2, otherSlotKey));
+
+    EXPECT_EQ(firstKey, secondKey);
+    EXPECT_NE(firstKey, otherSlotKey);
+}
+
+TEST(FindCacheTests, KeyRejectsMissingValue) {
+    CK_ATTRIBUTE search[] = {{CKA_ID, NULL, 2}};
+
+    std::string key;
+    EXPECT_FALSE(FindCache::makeKey(0, search, 1, key));
+}
+
+TEST(FindCacheTests, InsertThenLookup) {
+    FindCache cache(std::chrono::milliseconds(60000), NULL);
+    std::vector<CK_OBJECT_HANDLE> objects = {7, 8};
+
+    cache.insert("key", 0, cache.getGeneration(), objects);
+
+    std::vector<CK_OBJECT_HANDLE> found;
+    ASSERT_TRUE(cache.lookup("key", found));
+    EXPECT_EQ(found, objects);
+    EXPECT_FALSE(cache.lookup("other", found));
+}
+
+TEST(FindCacheTests, InvalidateDropsOnlyThatSlot) {
+    FindCache cache(std::chrono::milliseconds(60000), NULL);
+    std::vector<CK_OBJECT_HANDLE> objects = {7};
+
+    cache.insert("slot0", 0, cache.getGeneration(), objects);
+    cache.insert("slot1", 1, cache.getGeneration(), objects);
+    cache.invalidate(0);
+
+    std::vector<CK_OBJECT_HANDLE> found;
+    EXPECT_FALSE(cache.lookup("slot0", found));
+    EXPECT_TRUE(cache.lookup("slot1", found));
+}
+
+TEST(FindCacheTests, StaleInsertDropped) {
+    FindCache cache(std::chrono::milliseconds(60000), NULL);
+    std::vector<CK_OBJECT_HANDLE> objects = {7};
+
+    // Objects changed while the search was running
+    unsigned long long generation = cache.getGeneration();
+    cache.invalidate(0);
+    cache.insert("key", 0, generation, objects);
+
+    std::vector<CK_OBJECT_HANDLE> found;
+    EXPECT_FALSE(cache.lookup("key", found));
+}
+
+TEST(FindCacheTests, EntriesExpire) {
+    FindCache cache(std::chrono::milliseconds(1), NULL);
+    std::vector<CK_OBJECT_HANDLE> objects = {7};
+
+    cache.insert("key", 0, cache.getGeneration(), objects);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    std::vector<CK_OBJECT_HANDLE> found;
+    EXPECT_FALSE(cache.lookup("key", found));
+}
@@ -0,0 +1,87 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "KeyPairPool.h"
+
+static CK_BBOOL ckTrue = CK_TRUE;
+static CK_ULONG modulusBits = 2048;
+static CK_BYTE publicExponent[] = { 0x01, 0x00, 0x01 };
+
+TEST(KeyPairPoolTests, CanonicalizeSortsAndDropsLabelAndId) {
+    CK_BYTE label[] = "first";
+    CK_BYTE id[] = { 0x01 };
+    CK_ATTRIBUTE pTemplate[] = {
+        { CKA_PUBLIC_EXPONENT, publicExponent, sizeof(publicExponent) },
+        { CKA_LABEL, label, sizeof(label) - 1 },
+        { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) },
+        { CKA_ID, id, sizeof(id) },
+        { CKA_VERIFY, &ckTrue, sizeof(ckTrue) }
+    };
+
+    std::vector<PooledAttribute> canonical;
+    ASSERT_TRUE(canonicalizeTemplate(pTemplate, 5, canonical));
+
+    ASSERT_EQ(canonical.size(), 3);
+    EXPECT_EQ(canonical[0].type, CKA_VERIFY);
+    EXPECT_EQ(canonical[1].type, CKA_MODULUS_BITS);
+    EXPECT_EQ(canonical[2].type, CKA_PUBLIC_EXPONENT);
+    EXPECT_EQ(canonical[2].value, std::vector<CK_BYTE>(publicExponent, publicExponent + sizeof(publicExponent)));
+}
+
+TEST(KeyPairPoolTests, CanonicalizeRejects) {
+    std::vector<PooledAttribute> canonical;
+
+    EXPECT_FALSE(canonicalizeTemplate(NULL_PTR, 1, canonical));
+
+    CK_ATTRIBUTE missingValue[] = { { CKA_MODULUS_BITS, NULL_PTR, sizeof(modulusBits) } };
+    EXPECT_FALSE(canonicalizeTemplate(missingValue, 1, canonical));
+
+    CK_ULONG otherBits = 3072;
+    CK_ATTRIBUTE duplicate[] = {
+        { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) },
+        { CKA_MODULUS_BITS, &otherBits, sizeof(otherBits) }
+    };
+    EXPECT_FALSE(canonicalizeTemplate(duplicate, 2, canonical));
+
+    EXPECT_TRUE(canonicalizeTemplate(NULL_PTR, 0, canonical));
+    EXPECT_TRUE(canonical.empty());
+}
+
+TEST(KeyPairPoolTests, SameTemplateIgnoresOrderLabelAndId) {
+    CK_BYTE firstLabel[] = "first";
+    CK_BYTE secondLabel[] = "second";
+    CK_ATTRIBUTE first[] = {
+        { CKA_LABEL, firstLabel, sizeof(firstLabel) - 1 },
+        { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) },
+        { CKA_VERIFY, &ckTrue, sizeof(ckTrue) }
+    };
+    CK_ATTRIBUTE second[] = {
+        { CKA_VERIFY, &ckTrue, sizeof(ckTrue) },
+        { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) },
+        { CKA_LABEL, secondLabel, sizeof(secondLabel) - 1 }
+    };
+
+    std::vector<PooledAttribute> a, b;
+    ASSERT_TRUE(canonicalizeTemplate(first, 3, a));
+    ASSERT_TRUE(canonicalizeTemplate(second, 3, b));
+    EXPECT_TRUE(sameTemplate(a, b));
+}
+
+TEST(KeyPairPoolTests, SameTemplateComparesValues) {
+    CK_ULONG otherBits = 3072;
+    CK_ATTRIBUTE first[] = { { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) } };
+    CK_ATTRIBUTE second[] = { { CKA_MODULUS_BITS, &otherBits, sizeof(otherBits) } };
+    CK_ATTRIBUTE longer[] = {
+        { CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits) },
+        { CKA_VERIFY, &ckTrue, sizeof(ckTrue) }
+    };
+
+    std::vector<PooledAttribute> a, b, c;
+    ASSERT_TRUE(canonicalizeTemplate(first, 1, a));
+    ASSERT_TRUE(canonicalizeTemplate(second, 1, b));
+    ASSERT_TRUE(canonicalizeTemplate(longer, 2, c));
+    EXPECT_FALSE(sameTemplate(a, b));
+    EXPECT_FALSE(sameTemplate(a, c));
+    EXPECT_TRUE(sameTemplate(a, a));
+}
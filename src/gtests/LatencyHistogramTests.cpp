@@ -0,0 +1,60 @@
+#include <stdint.h>     /* uint64_t, UINT64_MAX */
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "LatencyHistogram.h"
+
+TEST(LatencyHistogramTests, BucketBoundaries) {
+    const size_t buckets = LatencyHistogram::BUCKETS;
+
+    // Below 1 microsecond the buckets are linear, 128 ns wide
+    EXPECT_EQ(LatencyHistogram::bucketIndex(0), 0);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(1023), 7);
+    EXPECT_EQ(LatencyHistogram::bucketValue(7), 960);
+
+    // From there on, 8 per power of two
+    EXPECT_EQ(LatencyHistogram::bucketIndex(1024), 8);
+    EXPECT_EQ(LatencyHistogram::bucketValue(8), 1088);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(2047), 15);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(2048), 16);
+
+    // 2^40 ns starts the last power of two, and everything past it
+    // shares the top bucket
+    const uint64_t top = (uint64_t)1 << 40;
+    EXPECT_EQ(LatencyHistogram::bucketIndex(top), buckets - 8);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(2 * top - 1), buckets - 1);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(2 * top), buckets - 1);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(UINT64_MAX), buckets - 1);
+    EXPECT_GT(LatencyHistogram::bucketValue(buckets - 1), 2 * top - (top >> 3));
+    EXPECT_LT(LatencyHistogram::bucketValue(buckets - 1), 2 * top);
+
+    // Every bucket stands for a latency that falls back in it
+    for(size_t i = 0; i < buckets; i++) {
+        EXPECT_EQ(LatencyHistogram::bucketIndex(LatencyHistogram::bucketValue(i)), i) << "bucket " << i;
+    }
+}
+
+TEST(LatencyHistogramTests, Percentiles) {
+    LatencyHistogram histogram;
+    std::vector<uint64_t> counts;
+
+    histogram.addTo(counts);
+    EXPECT_EQ(LatencyHistogram::percentile(counts, 0.5, histogram.getMax()), 0);
+
+    // 1 to 100 microseconds, once each
+    for(uint64_t us = 1; us <= 100; us++) histogram.record(us * 1000);
+
+    counts.clear();
+    histogram.addTo(counts);
+    ASSERT_EQ(counts.size(), (size_t)LatencyHistogram::BUCKETS);
+    EXPECT_EQ(histogram.getMax(), 100000);
+
+    uint64_t p50 = LatencyHistogram::percentile(counts, 0.5, histogram.getMax());
+    EXPECT_GE(p50, 51000 - 51000 / 8);
+    EXPECT_LE(p50, 51000 + 51000 / 8);
+
+    // The top bucket's value is past the largest latency, so it's capped
+    EXPECT_EQ(LatencyHistogram::percentile(counts, 0.99, histogram.getMax()), 100000);
+    EXPECT_EQ(LatencyHistogram::percentile(counts, 1.0, histogram.getMax()), 100000);
+}
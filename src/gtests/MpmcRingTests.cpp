@@ -0,0 +1,79 @@
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "MpmcRing.h"
+
+const size_t RING_PRODUCERS = 4;
+const size_t RING_CONSUMERS = 4;
+const uint32_t VALUES_PER_PRODUCER = 100000;
+
+TEST(MpmcRingTests, FullAndEmpty) {
+    MpmcRing<uint32_t, 4> ring;
+    uint32_t value;
+
+    EXPECT_FALSE(ring.pop(value));
+    for(uint32_t i = 0; i < 4; i++) EXPECT_TRUE(ring.push(i));
+    EXPECT_FALSE(ring.push(4));
+
+    for(uint32_t i = 0; i < 4; i++) {
+        EXPECT_TRUE(ring.pop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(ring.pop(value));
+}
+
+// Every value pushed is popped exactly once, however the threads interleave
+TEST(MpmcRingTests, ConcurrentPushPop) {
+    // Small, so the ring keeps running full and empty
+    MpmcRing<uint32_t, 16> ring;
+
+    const uint32_t total = RING_PRODUCERS * VALUES_PER_PRODUCER;
+    std::vector<std::atomic<uint8_t>> seen(total);
+    for(std::atomic<uint8_t> &count : seen) count = 0;
+
+    std::atomic<uint32_t> popped(0);
+    std::vector<std::thread> threads;
+
+    for(size_t p = 0; p < RING_PRODUCERS; p++) {
+        threads.emplace_back([&ring, p] {
+            for(uint32_t i = 0; i < VALUES_PER_PRODUCER; i++) {
+                uint32_t value = p * VALUES_PER_PRODUCER + i;
+                while(!ring.push(value)) std::this_thread::yield();
+            }
+        });
+    }
+
+    for(size_t c = 0; c < RING_CONSUMERS; c++) {
+        threads.emplace_back([&ring, &seen, &popped, total] {
+            uint32_t value;
+
+            while(popped.load() < total) {
+                if(!ring.pop(value)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                seen[value]++;
+                popped++;
+            }
+        });
+    }
+
+    for(std::thread &thread : threads) thread.join();
+
+    EXPECT_EQ(popped.load(), total);
+
+    size_t wrong = 0;
+    for(std::atomic<uint8_t> &count : seen) {
+        if(count.load() != 1) wrong++;
+    }
+    EXPECT_EQ(wrong, 0);
+
+    uint32_t value;
+    EXPECT_FALSE(ring.pop(value));
+}
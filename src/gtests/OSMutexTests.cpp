@@ -0,0 +1,61 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "osmutex.h"
+
+const size_t CONTENDING_THREADS = 8;
+const unsigned long INCREMENTS_PER_THREAD = 100000;
+
+static void increment(CK_VOID_PTR mutex, volatile unsigned long *counter, unsigned long times) {
+    for(unsigned long i = 0; i < times; i++) {
+        ASSERT_EQ(OSLockMutex(mutex), CKR_OK);
+        *counter = *counter + 1;
+        ASSERT_EQ(OSUnlockMutex(mutex), CKR_OK);
+    }
+}
+
+TEST(OSMutexTests, CountsExactlyUnderContention) {
+    CK_VOID_PTR mutex = NULL;
+    ASSERT_EQ(OSCreateMutex(&mutex), CKR_OK);
+
+    volatile unsigned long counter = 0;
+    std::vector<std::thread> threads;
+
+    for(size_t i = 0; i < CONTENDING_THREADS; i++)
+        threads.emplace_back(increment, mutex, &counter, INCREMENTS_PER_THREAD);
+    for(std::thread &thread : threads) thread.join();
+
+    EXPECT_EQ(counter, CONTENDING_THREADS * INCREMENTS_PER_THREAD);
+    EXPECT_EQ(OSDestroyMutex(mutex), CKR_OK);
+}
+
+TEST(OSMutexTests, WakesParkedWaiters) {
+    CK_VOID_PTR mutex = NULL;
+    ASSERT_EQ(OSCreateMutex(&mutex), CKR_OK);
+
+    volatile unsigned long counter = 0;
+    std::vector<std::thread> threads;
+
+    // Held long enough that the waiters stop spinning and park
+    ASSERT_EQ(OSLockMutex(mutex), CKR_OK);
+    for(size_t i = 0; i < CONTENDING_THREADS; i++)
+        threads.emplace_back(increment, mutex, &counter, 1000);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(counter, 0);
+    ASSERT_EQ(OSUnlockMutex(mutex), CKR_OK);
+
+    for(std::thread &thread : threads) thread.join();
+
+    EXPECT_EQ(counter, CONTENDING_THREADS * 1000);
+    EXPECT_EQ(OSDestroyMutex(mutex), CKR_OK);
+}
+
+TEST(OSMutexTests, BadArgs) {
+    EXPECT_EQ(OSDestroyMutex(NULL), CKR_ARGUMENTS_BAD);
+    EXPECT_EQ(OSLockMutex(NULL), CKR_ARGUMENTS_BAD);
+    EXPECT_EQ(OSUnlockMutex(NULL), CKR_ARGUMENTS_BAD);
+}
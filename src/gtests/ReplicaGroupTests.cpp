@@ -0,0 +1,303 @@
+#include <string.h>     /* memcpy, memset */
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "ReplicaGroup.h"
+
+// Base session handles are STUB_SESSION_BASE plus the stub's index,
+// so every stub function can tell which module it was called on
+static const CK_SESSION_HANDLE STUB_SESSION_BASE = 100;
+static const size_t STUB_COUNT = 3;
+
+// The key the application uses, as the primary knows it
+static const CK_OBJECT_HANDLE PRIMARY_KEY = 7;
+
+struct StubModule {
+    CK_FUNCTION_LIST functions;
+    BaseHSM module;
+
+    CK_RV loginRv;
+    CK_OBJECT_HANDLE keyHandle;      // This replica's copy of the key; CK_INVALID_HANDLE if it has none
+
+    // What the stub was called with
+    int signInitCount;
+    CK_MECHANISM_TYPE signInitMechanism;
+    std::vector<CK_BYTE> signInitParameter;
+    CK_OBJECT_HANDLE signInitKey;
+
+    int findCount;
+    CK_OBJECT_CLASS findClass;
+    CK_BBOOL findToken;
+    std::vector<CK_BYTE> findId;
+};
+
+static StubModule stubs[STUB_COUNT];
+
+// Attributes of PRIMARY_KEY on the primary
+static CK_OBJECT_CLASS keyClass;
+static CK_BBOOL keyToken;
+static std::vector<CK_BYTE> keyId;
+
+static StubModule &stubFor(CK_SESSION_HANDLE hSession) {
+    return stubs[hSession - STUB_SESSION_BASE];
+}
+
+static CK_RV StubOpenSession(CK_SLOT_ID slotID, CK_FLAGS, CK_VOID_PTR, CK_NOTIFY, CK_SESSION_HANDLE_PTR phSession) {
+    *phSession = STUB_SESSION_BASE + slotID;
+    return CKR_OK;
+}
+
+static CK_RV StubCloseSession(CK_SESSION_HANDLE) {
+    return CKR_OK;
+}
+
+static CK_RV StubLogin(CK_SESSION_HANDLE hSession, CK_USER_TYPE, CK_UTF8CHAR_PTR, CK_ULONG) {
+    return stubFor(hSession).loginRv;
+}
+
+static CK_RV StubGetAttributeValue(CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        switch(pTemplate[i].type) {
+            case CKA_CLASS:
+                memcpy(pTemplate[i].pValue, &keyClass, sizeof(keyClass));
+                break;
+            case CKA_TOKEN:
+                memcpy(pTemplate[i].pValue, &keyToken, sizeof(keyToken));
+                break;
+            case CKA_ID:
+                if(pTemplate[i].pValue != NULL_PTR) memcpy(pTemplate[i].pValue, keyId.data(), keyId.size());
+                pTemplate[i].ulValueLen = keyId.size();
+                break;
+            default:
+                return CKR_ATTRIBUTE_TYPE_INVALID;
+        }
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV StubFindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    StubModule &stub = stubFor(hSession);
+    stub.findCount++;
+
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        CK_BYTE_PTR value = (CK_BYTE_PTR)pTemplate[i].pValue;
+
+        if(pTemplate[i].type == CKA_CLASS) memcpy(&stub.findClass, value, sizeof(stub.findClass));
+        if(pTemplate[i].type == CKA_TOKEN) memcpy(&stub.findToken, value, sizeof(stub.findToken));
+        if(pTemplate[i].type == CKA_ID) stub.findId.assign(value, value + pTemplate[i].ulValueLen);
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV StubFindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG, CK_ULONG_PTR pulObjectCount) {
+    StubModule &stub = stubFor(hSession);
+
+    *pulObjectCount = 0;
+    if(stub.keyHandle != CK_INVALID_HANDLE && stub.findId == keyId) {
+        phObject[0] = stub.keyHandle;
+        *pulObjectCount = 1;
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV StubFindObjectsFinal(CK_SESSION_HANDLE) {
+    return CKR_OK;
+}
+
+static CK_RV StubSignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    StubModule &stub = stubFor(hSession);
+    CK_BYTE_PTR parameter = (CK_BYTE_PTR)pMechanism->pParameter;
+
+    stub.signInitCount++;
+    stub.signInitMechanism = pMechanism->mechanism;
+    stub.signInitParameter.assign(parameter, parameter + pMechanism->ulParameterLen);
+    stub.signInitKey = hKey;
+
+    return CKR_OK;
+}
+
+// A group of count stub replicas, with application slot IDs 10 and up,
+// each holding a copy of PRIMARY_KEY
+static void addStubReplicas(ReplicaGroup &group, size_t count) {
+    CK_BYTE id[] = {0x0a, 0x0b};
+
+    keyClass = CKO_PRIVATE_KEY;
+    keyToken = CK_TRUE;
+    keyId.assign(id, id + sizeof(id));
+
+    for(size_t i = 0; i < count; i++) {
+        StubModule &stub = stubs[i];
+
+        memset(&stub.functions, 0, sizeof(stub.functions));
+        stub.functions.C_OpenSession = StubOpenSession;
+        stub.functions.C_CloseSession = StubCloseSession;
+        stub.functions.C_Login = StubLogin;
+        stub.functions.C_GetAttributeValue = StubGetAttributeValue;
+        stub.functions.C_FindObjectsInit = StubFindObjectsInit;
+        stub.functions.C_FindObjects = StubFindObjects;
+        stub.functions.C_FindObjectsFinal = StubFindObjectsFinal;
+        stub.functions.C_SignInit = StubSignInit;
+        ASSERT_EQ(stub.module.initialize(&stub.functions), CKR_OK);
+
+        stub.loginRv = CKR_OK;
+        stub.keyHandle = i == 0 ? PRIMARY_KEY : 50 + i;
+        stub.signInitCount = 0;
+        stub.signInitParameter.clear();
+        stub.signInitKey = CK_INVALID_HANDLE;
+        stub.findCount = 0;
+        stub.findId.clear();
+
+        group.addReplica(&stub.module, 10 + i, i);
+    }
+}
+
+// Starts a signature and sends the single-part call wherever the
+// group binds it, returning the base session it went to
+static CK_SESSION_HANDLE signOnce(ReplicaGroup &group, Session &session, CK_MECHANISM &mechanism, bool singlePart) {
+    CK_SESSION_HANDLE used = CK_INVALID_HANDLE;
+
+    EXPECT_EQ(group.init(session, REPLICA_OP_SIGN, &mechanism, PRIMARY_KEY), CKR_OK);
+    EXPECT_EQ(group.run(session, REPLICA_OP_SIGN, singlePart, [&](BaseHSM *, CK_SESSION_HANDLE hBaseSession) {
+        used = hBaseSession;
+        return CKR_OK;
+    }), CKR_OK);
+    group.end(session, REPLICA_OP_SIGN);
+
+    return used;
+}
+
+TEST(ReplicaGroupTests, LeastOutstandingReplica) {
+    ReplicaGroup group(NULL);
+    addStubReplicas(group, 3);
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    ASSERT_EQ(group.openSession(*session, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR), CKR_OK);
+    ASSERT_EQ(session->replicaSessions.size(), 3);
+
+    CK_MECHANISM mechanism = {CKM_ECDSA, NULL_PTR, 0};
+
+    // C_SignInit is held back until the first call
+    EXPECT_EQ(group.init(*session, REPLICA_OP_SIGN, &mechanism, PRIMARY_KEY), CKR_OK);
+    for(StubModule &stub : stubs) EXPECT_EQ(stub.signInitCount, 0);
+    group.end(*session, REPLICA_OP_SIGN);
+
+    session->replicaSessions[0].replica->outstanding = 2;
+    session->replicaSessions[1].replica->outstanding = 1;
+    session->replicaSessions[2].replica->outstanding = 3;
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE + 1);
+    EXPECT_EQ(stubs[1].signInitCount, 1);
+    EXPECT_EQ(stubs[1].signInitMechanism, CKM_ECDSA);
+    EXPECT_EQ(stubs[1].signInitKey, 51);
+
+    session->replicaSessions[1].replica->outstanding = 4;
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE);
+    EXPECT_EQ(stubs[0].signInitKey, PRIMARY_KEY);
+
+    // Multi-part operations stay on the primary however busy it is
+    session->replicaSessions[0].replica->outstanding = 9;
+    EXPECT_EQ(signOnce(group, *session, mechanism, false), STUB_SESSION_BASE);
+
+    for(ReplicaSession &replicaSession : session->replicaSessions) replicaSession.replica->outstanding = 0;
+    EXPECT_EQ(group.closeSession(*session), CKR_OK);
+}
+
+TEST(ReplicaGroupTests, DeferredInitReplayedAfterFailover) {
+    ReplicaGroup group(NULL);
+    addStubReplicas(group, 3);
+
+    // Replica 1 has no copy of the key, and replica 2 won't log in
+    stubs[1].keyHandle = CK_INVALID_HANDLE;
+    stubs[2].loginRv = CKR_PIN_INCORRECT;
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    ASSERT_EQ(group.openSession(*session, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR), CKR_OK);
+
+    CK_UTF8CHAR pin[] = {'1', '2', '3', '4'};
+    EXPECT_EQ(group.login(*session, CKU_USER, pin, sizeof(pin)), CKR_OK);
+    EXPECT_FALSE(session->replicaSessions[2].usable);
+
+    CK_RSA_PKCS_PSS_PARAMS params = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+    CK_MECHANISM mechanism = {CKM_SHA256_RSA_PKCS_PSS, &params, sizeof(params)};
+
+    // With the primary busiest, replica 1 is picked; the key lookup
+    // there fails, so C_SignInit is replayed on the primary
+    session->replicaSessions[0].replica->outstanding = 1;
+    EXPECT_EQ(group.init(*session, REPLICA_OP_SIGN, &mechanism, PRIMARY_KEY), CKR_OK);
+
+    // The application's parameter may change once C_SignInit returns
+    params.sLen = 0;
+
+    CK_SESSION_HANDLE used = CK_INVALID_HANDLE;
+    EXPECT_EQ(group.run(*session, REPLICA_OP_SIGN, true, [&](BaseHSM *, CK_SESSION_HANDLE hBaseSession) {
+        used = hBaseSession;
+        return CKR_OK;
+    }), CKR_OK);
+    group.end(*session, REPLICA_OP_SIGN);
+
+    EXPECT_EQ(used, STUB_SESSION_BASE);
+    EXPECT_EQ(stubs[1].findCount, 1);
+    EXPECT_EQ(stubs[1].signInitCount, 0);
+    EXPECT_EQ(stubs[2].signInitCount, 0);
+
+    ASSERT_EQ(stubs[0].signInitCount, 1);
+    EXPECT_EQ(stubs[0].signInitMechanism, CKM_SHA256_RSA_PKCS_PSS);
+    EXPECT_EQ(stubs[0].signInitKey, PRIMARY_KEY);
+    ASSERT_EQ(stubs[0].signInitParameter.size(), sizeof(params));
+
+    CK_RSA_PKCS_PSS_PARAMS replayed;
+    memcpy(&replayed, stubs[0].signInitParameter.data(), sizeof(replayed));
+    EXPECT_EQ(replayed.hashAlg, CKM_SHA256);
+    EXPECT_EQ(replayed.mgf, CKG_MGF1_SHA256);
+    EXPECT_EQ(replayed.sLen, 32);
+
+    session->replicaSessions[0].replica->outstanding = 0;
+    EXPECT_EQ(group.closeSession(*session), CKR_OK);
+}
+
+TEST(ReplicaGroupTests, KeyMapForgetsDestroyedKeys) {
+    ReplicaGroup group(NULL);
+    addStubReplicas(group, 2);
+
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+    ASSERT_EQ(group.openSession(*session, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR), CKR_OK);
+
+    CK_MECHANISM mechanism = {CKM_ECDSA, NULL_PTR, 0};
+    session->replicaSessions[0].replica->outstanding = 1;
+
+    // The replica's copy is found by class, CKA_TOKEN and CKA_ID
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE + 1);
+    EXPECT_EQ(stubs[1].findCount, 1);
+    EXPECT_EQ(stubs[1].findClass, CKO_PRIVATE_KEY);
+    EXPECT_EQ(stubs[1].findToken, CK_TRUE);
+    EXPECT_EQ(stubs[1].findId, keyId);
+    EXPECT_EQ(stubs[1].signInitKey, 51);
+
+    // and then remembered
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE + 1);
+    EXPECT_EQ(stubs[1].findCount, 1);
+    EXPECT_EQ(stubs[1].signInitKey, 51);
+
+    // C_DestroyObject frees the handle, and the primary may hand it
+    // out again for a new key whose copy on the replica differs
+    group.forgetKey(PRIMARY_KEY);
+    stubs[1].keyHandle = 61;
+
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE + 1);
+    EXPECT_EQ(stubs[1].findCount, 2);
+    EXPECT_EQ(stubs[1].signInitKey, 61);
+
+    // Session objects are never looked for on replicas
+    group.forgetKey(PRIMARY_KEY);
+    keyToken = CK_FALSE;
+
+    EXPECT_EQ(signOnce(group, *session, mechanism, true), STUB_SESSION_BASE);
+    EXPECT_EQ(stubs[1].findCount, 2);
+
+    session->replicaSessions[0].replica->outstanding = 0;
+    EXPECT_EQ(group.closeSession(*session), CKR_OK);
+}
@@ -0,0 +1,105 @@
+#include <stdlib.h>     /* setenv, unsetenv */
+#include <string.h>     /* strlen */
+
+#include "gtest/gtest.h"
+#include "common.h"
+
+#include "SessionPool.h"
+
+// A pool with one idle session on the slot, put there without the base HSM
+static void addIdleSession(SessionPool &pool, CK_SLOT_ID slotID) {
+    Session session;
+
+    session.slotID = slotID;
+    session.module = NULL;
+    session.baseSlotID = slotID;
+    session.baseSession = 42;
+    session.flags = CKF_SERIAL_SESSION;
+    session.reusable = true;
+    session.activeOperations = 0;
+
+    ASSERT_EQ(pool.release(session), CKR_OK);
+}
+
+TEST(SessionPoolTests, LoginHeldOnlyAfterLastSessionClosed) {
+    SessionPool pool(1, NULL);
+    addIdleSession(pool, 1);
+
+    EXPECT_FALSE(pool.isLoginHeld(1));
+
+    // The application still holds the login it made
+    pool.recordLogin(1, CKU_USER);
+    EXPECT_FALSE(pool.isLoginHeld(1));
+
+    pool.lastSessionClosed(1);
+    EXPECT_TRUE(pool.isLoginHeld(1));
+
+    // Logging in again takes the login back from the pool
+    pool.recordLogin(1, CKU_USER);
+    EXPECT_FALSE(pool.isLoginHeld(1));
+}
+
+TEST(SessionPoolTests, ForgetLogin) {
+    SessionPool pool(1, NULL);
+    addIdleSession(pool, 1);
+
+    pool.recordLogin(1, CKU_SO);
+    pool.forgetLogin(1);
+    pool.lastSessionClosed(1);
+    EXPECT_FALSE(pool.isLoginHeld(1));
+}
+
+TEST(SessionPoolTests, ContextSpecificLoginNotRecorded) {
+    SessionPool pool(1, NULL);
+    addIdleSession(pool, 1);
+
+    pool.recordLogin(1, CKU_CONTEXT_SPECIFIC);
+    pool.lastSessionClosed(1);
+    EXPECT_FALSE(pool.isLoginHeld(1));
+}
+
+TEST(SessionPoolTests, UnknownSlot) {
+    SessionPool pool(1, NULL);
+
+    pool.recordLogin(7, CKU_USER);
+    pool.lastSessionClosed(7);
+    EXPECT_FALSE(pool.isLoginHeld(7));
+}
+
+static CK_RV loginSO(CK_SESSION_HANDLE session, const char *pin) {
+    return C_Login(session, CKU_SO, (CK_UTF8CHAR_PTR)pin, (CK_ULONG)strlen(pin));
+}
+
+TEST(SessionPoolTests, LoginEachSessionThroughPool) {
+    setenv("QRYPT_SESSION_POOL_SIZE", "4", 1);
+    EXPECT_EQ(CKR_OK, initializeSingleThreaded());
+
+    CK_SLOT_ID slotID;
+    EXPECT_EQ(CKR_OK, getGTestSlot(slotID));
+
+    // Open, log in, close, as applications that don't keep sessions do;
+    // the pool's idle session keeps the token logged in in between
+    for(int i = 0; i < 3; i++) {
+        CK_SESSION_HANDLE session;
+        ASSERT_EQ(CKR_OK, C_OpenSession(slotID, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL_PTR, NULL_PTR, &session));
+
+        EXPECT_EQ(CKR_OK, loginSO(session, GTEST_TOKEN_SO_PIN)) << "iteration " << i;
+
+        EXPECT_EQ(CKR_OK, C_CloseSession(session));
+    }
+
+    // The login the pool holds doesn't let a wrong PIN through
+    CK_SESSION_HANDLE session;
+    ASSERT_EQ(CKR_OK, C_OpenSession(slotID, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL_PTR, NULL_PTR, &session));
+
+    EXPECT_EQ(CKR_PIN_INCORRECT, loginSO(session, "wrongpin"));
+    EXPECT_EQ(CKR_OK, loginSO(session, GTEST_TOKEN_SO_PIN));
+
+    // Within the application's own sessions, a second login still fails
+    EXPECT_EQ(CKR_USER_ALREADY_LOGGED_IN, loginSO(session, GTEST_TOKEN_SO_PIN));
+
+    EXPECT_EQ(CKR_OK, C_CloseSession(session));
+
+    EXPECT_EQ(CKR_OK, finalize());
+    unsetenv("QRYPT_SESSION_POOL_SIZE");
+}
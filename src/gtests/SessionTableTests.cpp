@@ -0,0 +1,62 @@
+#include <memory>
+
+#include "gtest/gtest.h"
+
+#include "SessionTable.h"
+
+std::shared_ptr<Session> makeSession(CK_SLOT_ID slotID, CK_SESSION_HANDLE baseSession) {
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+
+    session->slotID = slotID;
+    session->module = NULL;
+    session->baseSlotID = slotID;
+    session->baseSession = baseSession;
+
+    return session;
+}
+
+TEST(SessionTableTests, AddThenGet) {
+    SessionTable table;
+
+    CK_SESSION_HANDLE handle = table.add(makeSession(1, 42));
+    EXPECT_NE(handle, CK_INVALID_HANDLE);
+
+    std::shared_ptr<Session> session = table.get(handle);
+    ASSERT_NE(session, nullptr);
+    EXPECT_EQ(session->handle, handle);
+    EXPECT_EQ(session->baseSession, 42);
+}
+
+TEST(SessionTableTests, UnknownHandle) {
+    SessionTable table;
+
+    EXPECT_EQ(table.get(CK_INVALID_HANDLE), nullptr);
+    EXPECT_EQ(table.get(1234), nullptr);
+    EXPECT_EQ(table.remove(1234), nullptr);
+}
+
+TEST(SessionTableTests, HandlesAreUnique) {
+    SessionTable table;
+
+    CK_SESSION_HANDLE first = table.add(makeSession(1, 42));
+    CK_SESSION_HANDLE second = table.add(makeSession(1, 42));
+    EXPECT_NE(first, second);
+
+    EXPECT_NE(table.remove(first), nullptr);
+    EXPECT_EQ(table.get(first), nullptr);
+    EXPECT_NE(table.get(second), nullptr);
+}
+
+TEST(SessionTableTests, RemoveSlot) {
+    SessionTable table;
+
+    CK_SESSION_HANDLE slot1a = table.add(makeSession(1, 10));
+    CK_SESSION_HANDLE slot2 = table.add(makeSession(2, 20));
+    CK_SESSION_HANDLE slot1b = table.add(makeSession(1, 11));
+
+    EXPECT_EQ(table.removeSlot(1).size(), 2);
+
+    EXPECT_EQ(table.get(slot1a), nullptr);
+    EXPECT_EQ(table.get(slot1b), nullptr);
+    EXPECT_NE(table.get(slot2), nullptr);
+}
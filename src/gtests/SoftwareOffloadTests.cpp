@@ -0,0 +1,148 @@
+#include <stdlib.h>     /* setenv, unsetenv */
+#include <vector>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+
+#include "gtest/gtest.h"
+#include "common.h"
+
+#include "SoftwareOffload.h"
+
+// DER encoding of the OID of P-256, as in CKA_EC_PARAMS
+static const CK_BYTE P256_PARAMS[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+TEST(SoftwareOffloadTests, DigestKnownAnswer) {
+    CK_MECHANISM mechanism = {CKM_SHA256, NULL_PTR, 0};
+    const EVP_MD *md = SoftwareDigest::getDigest(&mechanism);
+    ASSERT_NE(md, nullptr);
+
+    CK_BYTE data[] = {'a', 'b', 'c'};
+    CK_BYTE digest[32];
+    CK_ULONG digestLen = sizeof(digest);
+
+    SoftwareDigest multiPart(md);
+    EXPECT_EQ(multiPart.update(data, 1), CKR_OK);
+    EXPECT_EQ(multiPart.digest(data, 3, digest, &digestLen), CKR_OPERATION_ACTIVE);
+    EXPECT_EQ(multiPart.update(data + 1, 2), CKR_OK);
+    EXPECT_EQ(multiPart.final(digest, &digestLen), CKR_OK);
+    EXPECT_FALSE(multiPart.isActive());
+
+    std::vector<CK_BYTE> expected = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    EXPECT_EQ(std::vector<CK_BYTE>(digest, digest + digestLen), expected);
+
+    // Anything but SHA-2 stays on the base HSM
+    mechanism.mechanism = CKM_SHA_1;
+    EXPECT_EQ(SoftwareDigest::getDigest(&mechanism), nullptr);
+}
+
+TEST(SoftwareOffloadTests, EcdsaVerify) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *privateKey = NULL;
+    ASSERT_EQ(EVP_PKEY_keygen_init(ctx), 1);
+    ASSERT_GT(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1), 0);
+    ASSERT_EQ(EVP_PKEY_keygen(ctx, &privateKey), 1);
+    EVP_PKEY_CTX_free(ctx);
+
+    // CKA_EC_POINT is the point wrapped in an OCTET STRING
+    int pointLen = i2d_PublicKey(privateKey, NULL);
+    ASSERT_LT(pointLen, 128);
+    std::vector<CK_BYTE> point = {0x04, (CK_BYTE)pointLen};
+    point.resize(2 + pointLen);
+    unsigned char *p = point.data() + 2;
+    i2d_PublicKey(privateKey, &p);
+
+    CK_BYTE data[] = "data to sign";
+    unsigned char der[128];
+    size_t derLen = sizeof(der);
+    EVP_MD_CTX *mdCtx = EVP_MD_CTX_new();
+    ASSERT_EQ(EVP_DigestSignInit(mdCtx, NULL, EVP_sha256(), NULL, privateKey), 1);
+    ASSERT_EQ(EVP_DigestSign(mdCtx, der, &derLen, data, sizeof(data)), 1);
+    EVP_MD_CTX_free(mdCtx);
+    EVP_PKEY_free(privateKey);
+
+    // PKCS #11 signatures are r and s side by side
+    const unsigned char *d = der;
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &d, (long)derLen);
+    ASSERT_NE(sig, nullptr);
+    const BIGNUM *r, *s;
+    ECDSA_SIG_get0(sig, &r, &s);
+    CK_BYTE signature[64];
+    BN_bn2binpad(r, signature, 32);
+    BN_bn2binpad(s, signature + 32, 32);
+    ECDSA_SIG_free(sig);
+
+    std::shared_ptr<EVP_PKEY> key = makeEcPublicKey(P256_PARAMS, sizeof(P256_PARAMS), point.data(), point.size());
+    ASSERT_TRUE(key != NULL);
+
+    CK_MECHANISM mechanism = {CKM_ECDSA_SHA256, NULL_PTR, 0};
+    EXPECT_TRUE(SoftwareVerify::supports(&mechanism, CKK_EC));
+    EXPECT_FALSE(SoftwareVerify::supports(&mechanism, CKK_RSA));
+
+    SoftwareVerify good(key);
+    ASSERT_EQ(good.init(&mechanism), CKR_OK);
+    EXPECT_EQ(good.verify(data, sizeof(data), signature, sizeof(signature)), CKR_OK);
+    EXPECT_FALSE(good.isActive());
+
+    SoftwareVerify shortSignature(key);
+    ASSERT_EQ(shortSignature.init(&mechanism), CKR_OK);
+    EXPECT_EQ(shortSignature.verify(data, sizeof(data), signature, 10), CKR_SIGNATURE_LEN_RANGE);
+
+    signature[40] ^= 1;
+    SoftwareVerify tampered(key);
+    ASSERT_EQ(tampered.init(&mechanism), CKR_OK);
+    EXPECT_EQ(tampered.update(data, sizeof(data)), CKR_OK);
+    EXPECT_EQ(tampered.final(signature, sizeof(signature)), CKR_SIGNATURE_INVALID);
+}
+
+TEST(SoftwareOffloadTests, UnusableKeys) {
+    CK_BYTE point[] = {0x04, 0x01, 0x02};
+
+    // Trailing bytes after the OID
+    std::vector<CK_BYTE> params(P256_PARAMS, P256_PARAMS + sizeof(P256_PARAMS));
+    params.push_back(0);
+    EXPECT_TRUE(makeEcPublicKey(params.data(), params.size(), point, sizeof(point)) == NULL);
+
+    // Not a point on the curve
+    EXPECT_TRUE(makeEcPublicKey(P256_PARAMS, sizeof(P256_PARAMS), point, sizeof(point)) == NULL);
+}
+
+TEST(SoftwareOffloadTests, DigestAfterBaseDigestFails) {
+    setenv("QRYPT_SOFTWARE_OFFLOAD_TTL_MS", "1000", 1);
+    EXPECT_EQ(CKR_OK, initializeSingleThreaded());
+
+    CK_SLOT_ID slotID;
+    EXPECT_EQ(CKR_OK, getGTestSlot(slotID));
+
+    CK_SESSION_HANDLE session;
+    ASSERT_EQ(CKR_OK, newSession(slotID, session));
+
+    // SHA-1 stays on the base HSM, and an error there ends the digest
+    CK_MECHANISM mechanism = {CKM_SHA_1, NULL_PTR, 0};
+    ASSERT_EQ(CKR_OK, C_DigestInit(session, &mechanism));
+    EXPECT_NE(CKR_OK, C_DigestKey(session, CK_INVALID_HANDLE));
+
+    // So the next SHA-256 digest is still done in software
+    mechanism.mechanism = CKM_SHA256;
+    ASSERT_EQ(CKR_OK, C_DigestInit(session, &mechanism));
+
+    CK_BYTE data[] = {'a', 'b', 'c'};
+    CK_BYTE digest[32];
+    CK_ULONG digestLen = sizeof(digest);
+    EXPECT_EQ(CKR_OK, C_Digest(session, data, sizeof(data), digest, &digestLen));
+
+    std::vector<CK_BYTE> expected = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    EXPECT_EQ(std::vector<CK_BYTE>(digest, digest + digestLen), expected);
+
+    EXPECT_EQ(CKR_OK, C_CloseSession(session));
+
+    EXPECT_EQ(CKR_OK, finalize());
+    unsetenv("QRYPT_SOFTWARE_OFFLOAD_TTL_MS");
+}
@@ -0,0 +1,34 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "UpdateBuffer.h"
+
+TEST(UpdateBufferTests, AppendUntilFull) {
+    UpdateBuffer buffer(8);
+    CK_BYTE part[] = {1, 2, 3};
+
+    EXPECT_TRUE(buffer.fits(8));
+    EXPECT_FALSE(buffer.fits(9));
+
+    buffer.append(part, 3);
+    buffer.append(part, 3);
+    EXPECT_EQ(buffer.getSize(), 6);
+    EXPECT_TRUE(buffer.fits(2));
+    EXPECT_FALSE(buffer.fits(3));
+
+    std::vector<CK_BYTE> data(buffer.getData(), buffer.getData() + buffer.getSize());
+    EXPECT_EQ(data, std::vector<CK_BYTE>({1, 2, 3, 1, 2, 3}));
+}
+
+TEST(UpdateBufferTests, ClearWipes) {
+    UpdateBuffer buffer(8);
+    CK_BYTE part[] = {1, 2, 3};
+
+    buffer.append(part, 3);
+    buffer.clear();
+
+    EXPECT_EQ(buffer.getSize(), 0);
+    EXPECT_TRUE(buffer.fits(8));
+    for(int i = 0; i < 3; i++) EXPECT_EQ(buffer.getData()[i], 0);
+}
@@ -0,0 +1,222 @@
+#include <errno.h>              // errno
+#include <stdint.h>             // uint64_t
+#include <sys/eventfd.h>        // eventfd
+#include <unistd.h>             // read, write, close
+
+#include <new>                  // std::bad_alloc
+#include <system_error>         // std::system_error
+
+#include "log.h"                // logging macros
+#include "BatchRunner.h"        // runItem, worker sessions
+
+#include "AsyncQueue.h"
+
+AsyncQueue::AsyncQueue(size_t workerCount) {
+    this->workerCount = workerCount;
+    this->stopping = false;
+
+    this->submitted = 0;
+    this->completed = 0;
+
+    this->completionFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(this->completionFd < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+}
+
+AsyncQueue::~AsyncQueue() {
+    stop();
+
+    close(this->completionFd);
+}
+
+void AsyncQueue::start() {
+    for(size_t i = 0; i < this->workerCount; i++) {
+        try {
+            this->threads.emplace_back(&AsyncQueue::work, this);
+        } catch (std::system_error &ex) {
+            // Carry on with the workers there are, as long as there is one
+            if(i == 0) throw;
+
+            DEBUG_MSG("Could only start %zu of %zu async workers.", i, this->workerCount);
+            break;
+        }
+    }
+}
+
+void AsyncQueue::stop() {
+    size_t dropped;
+
+    {
+        std::lock_guard<std::mutex> lock(this->jobMutex);
+
+        this->stopping = true;
+        dropped = this->jobs.size();
+        this->jobs.clear();
+    }
+
+    this->jobAdded.notify_all();
+
+    for(std::thread &thread : this->threads) thread.join();
+    this->threads.clear();
+
+    if(dropped != 0) INFO_MSG("Dropped %zu queued async operations at C_Finalize.", dropped);
+}
+
+CK_RV AsyncQueue::submit(std::shared_ptr<Session> session, CK_QRYPT_BATCH_ITEM_PTR pItem, CK_VOID_PTR pCookie) {
+    AsyncJob job;
+    job.session = session;
+    job.completion.pItem = pItem;
+    job.completion.pCookie = pCookie;
+
+    // Without threads of our own, the operation runs here
+    if(this->workerCount == 0) {
+        this->submitted++;
+
+        AsyncWorker worker;
+        worker.open = false;
+
+        execute(job, worker);
+        closeWorker(worker);
+        return CKR_OK;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->jobMutex);
+        if(this->stopping) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+        this->jobs.push_back(job);
+        this->submitted++;
+    }
+
+    this->jobAdded.notify_one();
+    return CKR_OK;
+}
+
+int AsyncQueue::getCompletionFd() {
+    return this->completionFd;
+}
+
+CK_ULONG AsyncQueue::poll(CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG ulMaxCount) {
+    std::lock_guard<std::mutex> lock(this->completionMutex);
+
+    CK_ULONG count = 0;
+    while(count < ulMaxCount && !this->completions.empty()) {
+        pCompletions[count++] = this->completions.front();
+        this->completions.pop_front();
+    }
+
+    // The eventfd stays readable exactly while completions wait
+    if(count != 0 && this->completions.empty()) {
+        uint64_t value;
+        if(read(this->completionFd, &value, sizeof(value)) != sizeof(value))
+            DEBUG_MSG("Could not reset the completion eventfd (errno = %d).", errno);
+    }
+
+    return count;
+}
+
+void AsyncQueue::logStatistics() {
+    unsigned long submitted = this->submitted;
+    if(submitted == 0) return;
+
+    INFO_MSG("Async queue: %lu of %lu submitted operations completed.", (unsigned long)this->completed, submitted);
+}
+
+void AsyncQueue::work() {
+    AsyncWorker worker;
+    worker.open = false;
+
+    while(true) {
+        AsyncJob job;
+
+        {
+            std::unique_lock<std::mutex> lock(this->jobMutex);
+
+            // Hold no base session while idle
+            if(this->jobs.empty() && worker.open && !this->stopping) {
+                lock.unlock();
+                closeWorker(worker);
+                continue;
+            }
+
+            this->jobAdded.wait(lock, [this] { return this->stopping || !this->jobs.empty(); });
+            if(this->stopping) break;
+
+            job = this->jobs.front();
+            this->jobs.pop_front();
+        }
+
+        execute(job, worker);
+    }
+
+    closeWorker(worker);
+}
+
+void AsyncQueue::execute(AsyncJob &job, AsyncWorker &worker) {
+    run(job, worker);
+
+    try {
+        complete(job.completion);
+    } catch (...) {
+        ERROR_MSG("Could not queue the completion of an async operation.");
+    }
+}
+
+void AsyncQueue::run(AsyncJob &job, AsyncWorker &worker) {
+    CK_QRYPT_BATCH_ITEM &item = *job.completion.pItem;
+
+    // A session on another slot, or of another kind, won't do
+    if(worker.open && (worker.session.slotID != job.session->slotID || worker.session.flags != (job.session->flags & (CKF_SERIAL_SESSION | CKF_RW_SESSION))))
+        closeWorker(worker);
+
+    // Once more if the base HSM closed the worker's session under it,
+    // as C_CloseAllSessions does
+    for(int attempt = 0; attempt < 2; attempt++) {
+        if(!worker.open) {
+            BatchRunner::prepareWorker(*job.session, worker.session, worker.pooled);
+
+            item.rv = BatchRunner::openWorkerSession(worker.session, worker.pooled);
+            if(item.rv != CKR_OK) break;
+
+            worker.open = true;
+        }
+
+        try {
+            item.rv = BatchRunner::runItem(worker.session, item);
+        } catch (std::bad_alloc &ex) {
+            item.rv = CKR_HOST_MEMORY;
+        } catch (...) {
+            item.rv = CKR_GENERAL_ERROR;
+        }
+
+        // An operation the base HSM didn't end would fail the next item
+        if(worker.session.activeOperations != 0) closeWorker(worker);
+
+        if(item.rv != CKR_SESSION_HANDLE_INVALID && item.rv != CKR_SESSION_CLOSED) break;
+
+        // Don't hand the dead session to the pool
+        if(worker.open) {
+            worker.session.reusable = false;
+            closeWorker(worker);
+        }
+    }
+}
+
+void AsyncQueue::closeWorker(AsyncWorker &worker) {
+    if(!worker.open) return;
+
+    BatchRunner::closeWorkerSession(worker.session, worker.pooled);
+    worker.open = false;
+}
+
+void AsyncQueue::complete(const CK_QRYPT_COMPLETION &completion) {
+    std::lock_guard<std::mutex> lock(this->completionMutex);
+
+    this->completions.push_back(completion);
+    this->completed++;
+
+    if(this->completions.size() == 1) {
+        uint64_t value = 1;
+        if(write(this->completionFd, &value, sizeof(value)) != sizeof(value))
+            ERROR_MSG("Could not signal the completion eventfd (errno = %d).", errno);
+    }
+}
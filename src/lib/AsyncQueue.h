@@ -0,0 +1,90 @@
+/**
+ * This class carries out C_QryptSubmit calls: single-part operations
+ * that run on worker threads of Qryptoki's own, each with its own
+ * base sessions, so that an event-driven application never waits for
+ * the base HSM or the Qrypt Entropy API.
+ *
+ * Finished operations are queued until C_QryptPollCompletions takes
+ * them, and an eventfd is kept readable for as long as any are
+ * waiting, so the application can watch it in its own event loop.
+ *
+ * A worker keeps its base session while it has more operations for
+ * the same slot, and closes it (or returns it to the SessionPool) once
+ * the queue is empty. If the application forbids creating threads,
+ * operations run inside C_QryptSubmit instead.
+ */
+
+#ifndef _QRYPT_WRAPPER_ASYNCQUEUE_H
+#define _QRYPT_WRAPPER_ASYNCQUEUE_H
+
+#include <atomic>                           // std::atomic
+#include <condition_variable>               // std::condition_variable
+#include <deque>                            // std::deque
+#include <memory>                           // std::shared_ptr
+#include <mutex>                            // std::mutex
+#include <thread>                           // std::thread
+#include <vector>                           // std::vector
+
+#include "cryptoki.h"                       // PKCS#11 types
+#include "qryptoki_pkcs11_vendor_defs.h"    // CK_QRYPT_COMPLETION
+
+#include "Session.h"                        // Session
+
+struct AsyncJob {
+    std::shared_ptr<Session> session;       // The application's session
+    CK_QRYPT_COMPLETION completion;
+};
+
+// A worker thread's base session
+struct AsyncWorker {
+    Session session;
+    bool open;
+    bool pooled;
+};
+
+class AsyncQueue {
+    public:
+        // Throws std::system_error if the eventfd can't be created
+        AsyncQueue(size_t workerCount);
+        virtual ~AsyncQueue();
+
+        void start();
+
+        // Waits for the operations under way; queued ones are dropped
+        // without a completion, as the application can't poll any more
+        void stop();
+
+        CK_RV submit(std::shared_ptr<Session> session, CK_QRYPT_BATCH_ITEM_PTR pItem, CK_VOID_PTR pCookie);
+
+        int getCompletionFd();
+        CK_ULONG poll(CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG ulMaxCount);
+
+        void logStatistics();
+    protected:
+        // Runs the job on the worker's session, opening it if needed.
+        // Subclasses that override it must stop() before destruction.
+        virtual void run(AsyncJob &job, AsyncWorker &worker);
+    private:
+        size_t workerCount;
+        std::vector<std::thread> threads;
+
+        std::mutex jobMutex;
+        std::condition_variable jobAdded;
+        std::deque<AsyncJob> jobs;
+        bool stopping;
+
+        std::mutex completionMutex;
+        std::deque<CK_QRYPT_COMPLETION> completions;
+        int completionFd;
+
+        std::atomic<unsigned long> submitted;
+        std::atomic<unsigned long> completed;
+
+        void work();
+
+        void execute(AsyncJob &job, AsyncWorker &worker);
+        void closeWorker(AsyncWorker &worker);
+        void complete(const CK_QRYPT_COMPLETION &completion);
+};
+
+#endif /* !_QRYPT_WRAPPER_ASYNCQUEUE_H */
@@ -0,0 +1,225 @@
+#include <string.h>     // memcpy
+
+#include "log.h"        // logging macros
+#include "GlobalData.h" // mutex functions
+
+#include "AttributeCache.h"
+
+// Bounds memory use if an application reads many objects
+const size_t ATTRIBUTE_CACHE_MAX_ENTRIES = 4096;
+
+AttributeCache::AttributeCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex) {
+    this->ttl = ttl;
+    this->mutex = mutex;
+
+    this->generation = 0;
+    this->hits = 0;
+    this->misses = 0;
+}
+
+CK_VOID_PTR AttributeCache::getMutex() {
+    return this->mutex;
+}
+
+bool AttributeCache::isImmutable(CK_ATTRIBUTE_TYPE type) {
+    // Secret values (CKA_VALUE, CKA_PRIME_1, ...) are left out on purpose
+    switch(type) {
+        case CKA_CLASS:
+        case CKA_TOKEN:
+        case CKA_KEY_TYPE:
+        case CKA_CERTIFICATE_TYPE:
+        case CKA_LOCAL:
+        case CKA_KEY_GEN_MECHANISM:
+        case CKA_MODULUS:
+        case CKA_MODULUS_BITS:
+        case CKA_PUBLIC_EXPONENT:
+        case CKA_PRIME:
+        case CKA_SUBPRIME:
+        case CKA_BASE:
+        case CKA_PRIME_BITS:
+        case CKA_EC_PARAMS:
+        case CKA_EC_POINT:
+        case CKA_VALUE_LEN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+CK_RV AttributeCache::getAttributeValue(Session &session, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)session.module->getFunction("C_GetAttributeValue");
+    if(Base_C_GetAttributeValue == NULL) return CKR_GENERAL_ERROR;
+
+    bool allImmutable = pTemplate != NULL_PTR && ulCount > 0;
+    for(CK_ULONG i = 0; allImmutable && i < ulCount; i++)
+        allImmutable = isImmutable(pTemplate[i].type);
+
+    CK_RV rv = CKR_OK;
+
+    if(allImmutable) {
+        if(lookup(session.slotID, hObject, pTemplate, ulCount, rv)) {
+            this->hits++;
+            return rv;
+        }
+
+        this->misses++;
+
+        // Read the values now, even for a length query, so that the
+        // application's next call is answered from the cache
+        if(fetch(session, hObject, pTemplate, ulCount) == CKR_OK && lookup(session.slotID, hObject, pTemplate, ulCount, rv))
+            return rv;
+    }
+
+    // Otherwise the base HSM answers, and any immutable values it
+    // returns are kept
+    unsigned long long generation = getGeneration();
+
+    rv = (*Base_C_GetAttributeValue)(session.baseSession, hObject, pTemplate, ulCount);
+
+    if(rv == CKR_OK || rv == CKR_BUFFER_TOO_SMALL || rv == CKR_ATTRIBUTE_SENSITIVE || rv == CKR_ATTRIBUTE_TYPE_INVALID)
+        insert(session.slotID, hObject, generation, pTemplate, ulCount);
+
+    return rv;
+}
+
+bool AttributeCache::lookup(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_RV &rv) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return false;
+
+    auto it = this->entries.find(std::make_pair(slotID, hObject));
+    bool found = it != this->entries.end();
+
+    if(found && it->second.expiry <= std::chrono::steady_clock::now()) {
+        this->entries.erase(it);
+        found = false;
+    }
+
+    for(CK_ULONG i = 0; found && i < ulCount; i++)
+        found = it->second.values.count(pTemplate[i].type) != 0;
+
+    if(found) {
+        rv = CKR_OK;
+
+        for(CK_ULONG i = 0; i < ulCount; i++) {
+            const std::vector<CK_BYTE> &value = it->second.values.at(pTemplate[i].type);
+
+            if(pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = value.size();
+            } else if(pTemplate[i].ulValueLen >= value.size()) {
+                if(!value.empty()) memcpy(pTemplate[i].pValue, value.data(), value.size());
+                pTemplate[i].ulValueLen = value.size();
+            } else {
+                pTemplate[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+        }
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    return found;
+}
+
+unsigned long long AttributeCache::getGeneration() {
+    return this->generation;
+}
+
+void AttributeCache::insert(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject, unsigned long long generation, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    try {
+        std::pair<CK_SLOT_ID, CK_OBJECT_HANDLE> key(slotID, hObject);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        for(CK_ULONG i = 0; generation == this->generation && i < ulCount; i++) {
+            CK_ATTRIBUTE &attribute = pTemplate[i];
+            if(!isImmutable(attribute.type) || attribute.pValue == NULL_PTR || attribute.ulValueLen == CK_UNAVAILABLE_INFORMATION) continue;
+
+            if(this->entries.size() >= ATTRIBUTE_CACHE_MAX_ENTRIES && this->entries.count(key) == 0) {
+                for(auto it = this->entries.begin(); it != this->entries.end();) {
+                    if(it->second.expiry <= now)
+                        it = this->entries.erase(it);
+                    else
+                        it++;
+                }
+
+                if(this->entries.size() >= ATTRIBUTE_CACHE_MAX_ENTRIES) this->entries.clear();
+            }
+
+            auto it = this->entries.find(key);
+            if(it == this->entries.end()) {
+                it = this->entries.emplace(key, AttributeCacheEntry()).first;
+                it->second.expiry = now + this->ttl;
+            }
+
+            CK_BYTE_PTR value = (CK_BYTE_PTR)attribute.pValue;
+            it->second.values[attribute.type].assign(value, value + attribute.ulValueLen);
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void AttributeCache::invalidate(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject) {
+    // Reads under way can't be cached any more, even if the lock fails
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    this->entries.erase(std::make_pair(slotID, hObject));
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void AttributeCache::invalidate(CK_SLOT_ID slotID) {
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    for(auto it = this->entries.begin(); it != this->entries.end();) {
+        if(it->first.first == slotID)
+            it = this->entries.erase(it);
+        else
+            it++;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void AttributeCache::logStatistics() {
+    unsigned long hits = this->hits;
+    unsigned long misses = this->misses;
+    if(hits + misses == 0) return;
+
+    INFO_MSG("Attribute cache: %lu of %lu reads answered from the cache.", hits, hits + misses);
+}
+
+CK_RV AttributeCache::fetch(Session &session, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)session.module->getFunction("C_GetAttributeValue");
+    if(Base_C_GetAttributeValue == NULL) return CKR_GENERAL_ERROR;
+
+    unsigned long long generation = getGeneration();
+
+    std::vector<CK_ATTRIBUTE> attributes(ulCount);
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        attributes[i].type = pTemplate[i].type;
+        attributes[i].pValue = NULL_PTR;
+        attributes[i].ulValueLen = 0;
+    }
+
+    CK_RV rv = (*Base_C_GetAttributeValue)(session.baseSession, hObject, attributes.data(), ulCount);
+    if(rv != CKR_OK) return rv;
+
+    std::vector<std::vector<CK_BYTE>> values(ulCount);
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        values[i].resize(attributes[i].ulValueLen);
+        attributes[i].pValue = values[i].data();
+    }
+
+    rv = (*Base_C_GetAttributeValue)(session.baseSession, hObject, attributes.data(), ulCount);
+    if(rv != CKR_OK) return rv;
+
+    insert(session.slotID, hObject, generation, attributes.data(), ulCount);
+    return CKR_OK;
+}
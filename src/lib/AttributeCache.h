@@ -0,0 +1,72 @@
+/**
+ * This class caches object attributes that can't change for the
+ * object's lifetime, such as CKA_KEY_TYPE, CKA_MODULUS and
+ * CKA_EC_POINT, so that the usual pair of C_GetAttributeValue
+ * calls (length, then value) is answered without the base HSM
+ * once the attributes have been read.
+ *
+ * Entries are keyed by slot and object handle. Qryptoki drops an
+ * object's entry when it is destroyed or modified, and a slot's
+ * entries when handles may be reused or private objects become
+ * unreadable (logout, closing sessions); the TTL bounds how long
+ * objects destroyed by other applications go unnoticed.
+ */
+
+#ifndef _QRYPT_WRAPPER_ATTRIBUTECACHE_H
+#define _QRYPT_WRAPPER_ATTRIBUTECACHE_H
+
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <map>          // std::map
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+#include "Session.h"    // Session
+
+struct AttributeCacheEntry {
+    std::chrono::steady_clock::time_point expiry;
+    std::map<CK_ATTRIBUTE_TYPE, std::vector<CK_BYTE>> values;
+};
+
+class AttributeCache {
+    public:
+        AttributeCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex);
+
+        CK_VOID_PTR getMutex();
+
+        // Attributes whose value is fixed when the object is created
+        static bool isImmutable(CK_ATTRIBUTE_TYPE type);
+
+        // Answers C_GetAttributeValue, from the cache if every
+        // attribute asked for is immutable and readable
+        CK_RV getAttributeValue(Session &session, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+
+        // Fills the template from the cache, as C_GetAttributeValue
+        // would; returns false unless every attribute is cached
+        bool lookup(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_RV &rv);
+
+        // Stores the immutable attributes the template holds values
+        // for; results read before the generation last changed are dropped
+        unsigned long long getGeneration();
+        void insert(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject, unsigned long long generation, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+
+        void invalidate(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject);
+        void invalidate(CK_SLOT_ID slotID);
+
+        void logStatistics();
+    private:
+        std::chrono::milliseconds ttl;
+        CK_VOID_PTR mutex;
+
+        std::map<std::pair<CK_SLOT_ID, CK_OBJECT_HANDLE>, AttributeCacheEntry> entries;
+        std::atomic<unsigned long long> generation;
+
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        CK_RV fetch(Session &session, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+};
+
+#endif /* !_QRYPT_WRAPPER_ATTRIBUTECACHE_H */
@@ -3,6 +3,7 @@
 
 #include "qryptoki_pkcs11_vendor_defs.h" // CKR_QRYPT_*
 #include "log.h"                         // logging macros
+#include "LatencyStats.h"                // getTimedBaseFunctionList
 
 #include "BaseHSM.h"
 
@@ -80,18 +81,18 @@ bool allFunctionsNonNULL(CK_FUNCTION_LIST_PTR list) {
 BaseHSM::BaseHSM() {
     this->handle = NULL;
     this->baseFunctionList = NULL;
+    this->functionList = NULL;
 }
 
-CK_RV BaseHSM::initialize() {
-    char *path = getenv("QRYPT_BASE_HSM_PATH");
-    if(path == NULL || path[0] == '\0') {
+CK_RV BaseHSM::initialize(const std::string &path) {
+    if(path.empty()) {
 		ERROR_MSG("Environment variable QRYPT_BASE_HSM_PATH empty.");
 		return CKR_QRYPT_BASE_HSM_EMPTY;
 	}
 
-    void *tmp_handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL | RTLD_DEEPBIND);
+    void *tmp_handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL | RTLD_DEEPBIND);
     if(tmp_handle == NULL) {
-        ERROR_MSG("Could not find base HSM at path given by QRYPT_BASE_HSM_PATH.");
+        ERROR_MSG("Could not find base HSM at path %s given by QRYPT_BASE_HSM_PATH.", path.c_str());
         return CKR_QRYPT_BASE_HSM_OPEN_FAILED;
     }
 
@@ -99,6 +100,7 @@ CK_RV BaseHSM::initialize() {
     Base_C_GetFunctionList = (CK_C_GetFunctionList)dlsym(tmp_handle, "C_GetFunctionList");
     if(Base_C_GetFunctionList == NULL) {
         ERROR_MSG("Could not find base HSM's C_GetFunctionList.");
+        dlclose(tmp_handle);
         return CKR_QRYPT_BASE_HSM_OPEN_FAILED;
     }
 
@@ -121,11 +123,20 @@ CK_RV BaseHSM::initialize() {
 
     this->handle = tmp_handle;
     this->baseFunctionList = list;
+    this->functionList = list;
+    return CKR_OK;
+}
+
+CK_RV BaseHSM::initialize(CK_FUNCTION_LIST_PTR list) {
+    if(list == NULL) return CKR_ARGUMENTS_BAD;
+
+    this->baseFunctionList = list;
+    this->functionList = list;
     return CKR_OK;
 }
 
 bool BaseHSM::isInitialized() {
-    return this->handle != NULL;
+    return this->baseFunctionList != NULL;
 }
 
 void BaseHSM::finalize() {
@@ -135,145 +146,161 @@ void BaseHSM::finalize() {
     }
 
     baseFunctionList = NULL;
+    functionList = NULL;
+}
+
+CK_FUNCTION_LIST_PTR BaseHSM::getFunctionList() {
+    return this->baseFunctionList;
+}
+
+void BaseHSM::timeCalls(size_t moduleIndex) {
+    CK_FUNCTION_LIST_PTR timedList = LatencyStats::getTimedBaseFunctionList(moduleIndex, this->baseFunctionList);
+
+    if(timedList == NULL) {
+        INFO_MSG("Base HSM %zu is past the base HSMs whose calls are timed.", moduleIndex);
+        return;
+    }
+
+    this->functionList = timedList;
 }
 
 void *BaseHSM::getFunction(std::string fn_name) {
     if(fn_name == "C_Initialize")
-        return (void *)this->baseFunctionList->C_Initialize;
+        return (void *)this->functionList->C_Initialize;
     else if(fn_name == "C_Finalize")
-        return (void *)this->baseFunctionList->C_Finalize;
+        return (void *)this->functionList->C_Finalize;
     else if(fn_name == "C_GetInfo")
-        return (void *)this->baseFunctionList->C_GetInfo;
+        return (void *)this->functionList->C_GetInfo;
     else if(fn_name == "C_GetFunctionList")
-        return (void *)this->baseFunctionList->C_GetFunctionList;
+        return (void *)this->functionList->C_GetFunctionList;
     else if(fn_name == "C_GetSlotList")
-        return (void *)this->baseFunctionList->C_GetSlotList;
+        return (void *)this->functionList->C_GetSlotList;
     else if(fn_name == "C_GetSlotInfo")
-        return (void *)this->baseFunctionList->C_GetSlotInfo;
+        return (void *)this->functionList->C_GetSlotInfo;
     else if(fn_name == "C_GetTokenInfo")
-        return (void *)this->baseFunctionList->C_GetTokenInfo;
+        return (void *)this->functionList->C_GetTokenInfo;
     else if(fn_name == "C_WaitForSlotEvent")
-        return (void *)this->baseFunctionList->C_WaitForSlotEvent;
+        return (void *)this->functionList->C_WaitForSlotEvent;
     else if(fn_name == "C_GetMechanismList")
-        return (void *)this->baseFunctionList->C_GetMechanismList;
+        return (void *)this->functionList->C_GetMechanismList;
     else if(fn_name == "C_GetMechanismInfo")
-        return (void *)this->baseFunctionList->C_GetMechanismInfo;
+        return (void *)this->functionList->C_GetMechanismInfo;
     else if(fn_name == "C_InitToken")
-        return (void *)this->baseFunctionList->C_InitToken;
+        return (void *)this->functionList->C_InitToken;
     else if(fn_name == "C_InitPIN")
-        return (void *)this->baseFunctionList->C_InitPIN;
+        return (void *)this->functionList->C_InitPIN;
     else if(fn_name == "C_SetPIN")
-        return (void *)this->baseFunctionList->C_SetPIN;
+        return (void *)this->functionList->C_SetPIN;
     else if(fn_name == "C_OpenSession")
-        return (void *)this->baseFunctionList->C_OpenSession;
+        return (void *)this->functionList->C_OpenSession;
     else if(fn_name == "C_CloseSession")
-        return (void *)this->baseFunctionList->C_CloseSession;
+        return (void *)this->functionList->C_CloseSession;
     else if(fn_name == "C_CloseAllSessions")
-        return (void *)this->baseFunctionList->C_CloseAllSessions;
+        return (void *)this->functionList->C_CloseAllSessions;
     else if(fn_name == "C_GetSessionInfo")
-        return (void *)this->baseFunctionList->C_GetSessionInfo;
+        return (void *)this->functionList->C_GetSessionInfo;
     else if(fn_name == "C_GetOperationState")
-        return (void *)this->baseFunctionList->C_GetOperationState;
+        return (void *)this->functionList->C_GetOperationState;
     else if(fn_name == "C_SetOperationState")
-        return (void *)this->baseFunctionList->C_SetOperationState;
+        return (void *)this->functionList->C_SetOperationState;
     else if(fn_name == "C_Login")
-        return (void *)this->baseFunctionList->C_Login;
+        return (void *)this->functionList->C_Login;
     else if(fn_name == "C_Logout")
-        return (void *)this->baseFunctionList->C_Logout;
+        return (void *)this->functionList->C_Logout;
     else if(fn_name == "C_CreateObject")
-        return (void *)this->baseFunctionList->C_CreateObject;
+        return (void *)this->functionList->C_CreateObject;
     else if(fn_name == "C_CopyObject")
-        return (void *)this->baseFunctionList->C_CopyObject;
+        return (void *)this->functionList->C_CopyObject;
     else if(fn_name == "C_DestroyObject")
-        return (void *)this->baseFunctionList->C_DestroyObject;
+        return (void *)this->functionList->C_DestroyObject;
     else if(fn_name == "C_GetObjectSize")
-        return (void *)this->baseFunctionList->C_GetObjectSize;
+        return (void *)this->functionList->C_GetObjectSize;
     else if(fn_name == "C_GetAttributeValue")
-        return (void *)this->baseFunctionList->C_GetAttributeValue;
+        return (void *)this->functionList->C_GetAttributeValue;
     else if(fn_name == "C_SetAttributeValue")
-        return (void *)this->baseFunctionList->C_SetAttributeValue;
+        return (void *)this->functionList->C_SetAttributeValue;
     else if(fn_name == "C_FindObjectsInit")
-        return (void *)this->baseFunctionList->C_FindObjectsInit;
+        return (void *)this->functionList->C_FindObjectsInit;
     else if(fn_name == "C_FindObjects")
-        return (void *)this->baseFunctionList->C_FindObjects;
+        return (void *)this->functionList->C_FindObjects;
     else if(fn_name == "C_FindObjectsFinal")
-        return (void *)this->baseFunctionList->C_FindObjectsFinal;
+        return (void *)this->functionList->C_FindObjectsFinal;
     else if(fn_name == "C_EncryptInit")
-        return (void *)this->baseFunctionList->C_EncryptInit;
+        return (void *)this->functionList->C_EncryptInit;
     else if(fn_name == "C_Encrypt")
-        return (void *)this->baseFunctionList->C_Encrypt;
+        return (void *)this->functionList->C_Encrypt;
     else if(fn_name == "C_EncryptUpdate")
-        return (void *)this->baseFunctionList->C_EncryptUpdate;
+        return (void *)this->functionList->C_EncryptUpdate;
     else if(fn_name == "C_EncryptFinal")
-        return (void *)this->baseFunctionList->C_EncryptFinal;
+        return (void *)this->functionList->C_EncryptFinal;
     else if(fn_name == "C_DecryptInit")
-        return (void *)this->baseFunctionList->C_DecryptInit;
+        return (void *)this->functionList->C_DecryptInit;
     else if(fn_name == "C_Decrypt")
-        return (void *)this->baseFunctionList->C_Decrypt;
+        return (void *)this->functionList->C_Decrypt;
     else if(fn_name == "C_DecryptUpdate")
-        return (void *)this->baseFunctionList->C_DecryptUpdate;
+        return (void *)this->functionList->C_DecryptUpdate;
     else if(fn_name == "C_DecryptFinal")
-        return (void *)this->baseFunctionList->C_DecryptFinal;
+        return (void *)this->functionList->C_DecryptFinal;
     else if(fn_name == "C_DigestInit")
-        return (void *)this->baseFunctionList->C_DigestInit;
+        return (void *)this->functionList->C_DigestInit;
     else if(fn_name == "C_Digest")
-        return (void *)this->baseFunctionList->C_Digest;
+        return (void *)this->functionList->C_Digest;
     else if(fn_name == "C_DigestUpdate")
-        return (void *)this->baseFunctionList->C_DigestUpdate;
+        return (void *)this->functionList->C_DigestUpdate;
     else if(fn_name == "C_DigestKey")
-        return (void *)this->baseFunctionList->C_DigestKey;
+        return (void *)this->functionList->C_DigestKey;
     else if(fn_name == "C_DigestFinal")
-        return (void *)this->baseFunctionList->C_DigestFinal;
+        return (void *)this->functionList->C_DigestFinal;
     else if(fn_name == "C_SignInit")
-        return (void *)this->baseFunctionList->C_SignInit;
+        return (void *)this->functionList->C_SignInit;
     else if(fn_name == "C_Sign")
-        return (void *)this->baseFunctionList->C_Sign;
+        return (void *)this->functionList->C_Sign;
     else if(fn_name == "C_SignUpdate")
-        return (void *)this->baseFunctionList->C_SignUpdate;
+        return (void *)this->functionList->C_SignUpdate;
     else if(fn_name == "C_SignFinal")
-        return (void *)this->baseFunctionList->C_SignFinal;
+        return (void *)this->functionList->C_SignFinal;
     else if(fn_name == "C_SignRecoverInit")
-        return (void *)this->baseFunctionList->C_SignRecoverInit;
+        return (void *)this->functionList->C_SignRecoverInit;
     else if(fn_name == "C_SignRecover")
-        return (void *)this->baseFunctionList->C_SignRecover;
+        return (void *)this->functionList->C_SignRecover;
     else if(fn_name == "C_VerifyInit")
-        return (void *)this->baseFunctionList->C_VerifyInit;
+        return (void *)this->functionList->C_VerifyInit;
     else if(fn_name == "C_Verify")
-        return (void *)this->baseFunctionList->C_Verify;
+        return (void *)this->functionList->C_Verify;
     else if(fn_name == "C_VerifyUpdate")
-        return (void *)this->baseFunctionList->C_VerifyUpdate;
+        return (void *)this->functionList->C_VerifyUpdate;
     else if(fn_name == "C_VerifyFinal")
-        return (void *)this->baseFunctionList->C_VerifyFinal;
+        return (void *)this->functionList->C_VerifyFinal;
     else if(fn_name == "C_VerifyRecoverInit")
-        return (void *)this->baseFunctionList->C_VerifyRecoverInit;
+        return (void *)this->functionList->C_VerifyRecoverInit;
     else if(fn_name == "C_VerifyRecover")
-        return (void *)this->baseFunctionList->C_VerifyRecover;
+        return (void *)this->functionList->C_VerifyRecover;
     else if(fn_name == "C_DigestEncryptUpdate")
-        return (void *)this->baseFunctionList->C_DigestEncryptUpdate;
+        return (void *)this->functionList->C_DigestEncryptUpdate;
     else if(fn_name == "C_DecryptDigestUpdate")
-        return (void *)this->baseFunctionList->C_DecryptDigestUpdate;
+        return (void *)this->functionList->C_DecryptDigestUpdate;
     else if(fn_name == "C_SignEncryptUpdate")
-        return (void *)this->baseFunctionList->C_SignEncryptUpdate;
+        return (void *)this->functionList->C_SignEncryptUpdate;
     else if(fn_name == "C_DecryptVerifyUpdate")
-        return (void *)this->baseFunctionList->C_DecryptVerifyUpdate;
+        return (void *)this->functionList->C_DecryptVerifyUpdate;
     else if(fn_name == "C_GenerateKey")
-        return (void *)this->baseFunctionList->C_GenerateKey;
+        return (void *)this->functionList->C_GenerateKey;
     else if(fn_name == "C_GenerateKeyPair")
-        return (void *)this->baseFunctionList->C_GenerateKeyPair;
+        return (void *)this->functionList->C_GenerateKeyPair;
     else if(fn_name == "C_WrapKey")
-        return (void *)this->baseFunctionList->C_WrapKey;
+        return (void *)this->functionList->C_WrapKey;
     else if(fn_name == "C_UnwrapKey")
-        return (void *)this->baseFunctionList->C_UnwrapKey;
+        return (void *)this->functionList->C_UnwrapKey;
     else if(fn_name == "C_DeriveKey")
-        return (void *)this->baseFunctionList->C_DeriveKey;
+        return (void *)this->functionList->C_DeriveKey;
     else if(fn_name == "C_SeedRandom")
-        return (void *)this->baseFunctionList->C_SeedRandom;
+        return (void *)this->functionList->C_SeedRandom;
     else if(fn_name == "C_GenerateRandom")
-        return (void *)this->baseFunctionList->C_GenerateRandom;
+        return (void *)this->functionList->C_GenerateRandom;
     else if(fn_name == "C_GetFunctionStatus")
-        return (void *)this->baseFunctionList->C_GetFunctionStatus;
+        return (void *)this->functionList->C_GetFunctionStatus;
     else if(fn_name == "C_CancelFunction")
-        return (void *)this->baseFunctionList->C_CancelFunction;
+        return (void *)this->functionList->C_CancelFunction;
     
     return NULL;
 }
\ No newline at end of file
@@ -14,15 +14,22 @@ class BaseHSM {
     public:
         BaseHSM();
 
-        CK_RV initialize();
+        CK_RV initialize(const std::string &path);
+        // Use a function list that is already loaded, e.g. a stub in tests
+        CK_RV initialize(CK_FUNCTION_LIST_PTR list);
         bool isInitialized();
         
         void finalize();
 
         void *getFunction(std::string fn_name);
+        CK_FUNCTION_LIST_PTR getFunctionList();
+
+        // Fetch functions that time each call for LatencyStats
+        void timeCalls(size_t moduleIndex);
     private:
         void *handle;
         CK_FUNCTION_LIST_PTR baseFunctionList;
+        CK_FUNCTION_LIST_PTR functionList;     // baseFunctionList, or a timed copy
 };
 
 #endif /* !_QRYPT_BASEHSM_H */
\ No newline at end of file
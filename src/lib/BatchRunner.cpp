@@ -0,0 +1,258 @@
+#include <algorithm>            // std::min, std::max
+#include <functional>           // std::ref
+#include <new>                  // std::bad_alloc
+#include <system_error>         // std::system_error
+#include <thread>               // std::thread
+#include <vector>               // std::vector
+
+#include <openssl/crypto.h>     // OPENSSL_cleanse
+
+#include "log.h"                // logging macros
+#include "GlobalData.h"         // GlobalData
+#include "SoftwareOffload.h"    // SoftwareVerify
+
+#include "BatchRunner.h"
+
+// Per CK_QRYPT_BATCH_OPERATION: the base HSM functions and the
+// SESSION_OP_* flag of the operation they begin
+struct BatchFunctions {
+    const char *initFunction;
+    const char *function;
+    unsigned sessionOp;
+};
+
+static const BatchFunctions BATCH_FUNCTIONS[] = {
+    {"C_SignInit",    "C_Sign",    SESSION_OP_SIGN},
+    {"C_VerifyInit",  "C_Verify",  SESSION_OP_VERIFY},
+    {"C_EncryptInit", "C_Encrypt", SESSION_OP_ENCRYPT},
+    {"C_DecryptInit", "C_Decrypt", SESSION_OP_DECRYPT}
+};
+
+BatchRunner::BatchRunner(Session &session, size_t maxWorkers) : session(session) {
+    this->maxWorkers = std::max<size_t>(maxWorkers, 1);
+
+    this->items = NULL_PTR;
+    this->count = 0;
+    this->next = 0;
+}
+
+CK_RV BatchRunner::run(CK_QRYPT_BATCH_ITEM_PTR pItems, CK_ULONG ulCount) {
+    this->items = pItems;
+    this->count = ulCount;
+    this->next = 0;
+
+    size_t workerCount = std::min<size_t>(this->maxWorkers, ulCount);
+    if(workerCount == 0) return CKR_OK;
+
+    std::vector<CK_RV> openRvs(workerCount, CKR_OK);
+    std::vector<std::thread> threads;
+
+    for(size_t i = 1; i < workerCount; i++) {
+        try {
+            threads.emplace_back(&BatchRunner::work, this, std::ref(openRvs[i]));
+        } catch (std::system_error &ex) {
+            // Carry on with the workers there are
+            DEBUG_MSG("Could only start %zu of %zu batch workers.", i, workerCount);
+            break;
+        }
+    }
+
+    work(openRvs[0]);
+
+    for(std::thread &thread : threads) thread.join();
+
+    // Items are only left over if the workers lost their sessions
+    CK_RV openRv = CKR_GENERAL_ERROR;
+    for(CK_RV rv : openRvs) {
+        if(rv != CKR_OK) {
+            openRv = rv;
+            break;
+        }
+    }
+
+    for(CK_ULONG i = this->next; i < ulCount; i++) pItems[i].rv = openRv;
+
+    return CKR_OK;
+}
+
+void BatchRunner::prepareWorker(const Session &session, Session &worker, bool &pooled) {
+    worker.slotID = session.slotID;
+    worker.module = session.module;
+    worker.baseSlotID = session.baseSlotID;
+    worker.flags = session.flags & (CKF_SERIAL_SESSION | CKF_RW_SESSION);
+    worker.reusable = true;
+    worker.activeOperations = 0;
+    worker.findActive = false;
+    worker.findPosition = 0;
+    worker.replicaGroup = NULL;
+
+    // Replica groups aren't pooled (see C_OpenSession)
+    pooled = session.replicaGroup == NULL;
+}
+
+void BatchRunner::work(CK_RV &openRv) {
+    Session worker;
+    bool pooled;
+    prepareWorker(this->session, worker, pooled);
+
+    openRv = openWorkerSession(worker, pooled);
+    if(openRv != CKR_OK) return;
+
+    CK_ULONG index;
+    while((index = this->next++) < this->count) {
+        CK_QRYPT_BATCH_ITEM &item = this->items[index];
+
+        try {
+            item.rv = runItem(worker, item);
+        } catch (std::bad_alloc &ex) {
+            item.rv = CKR_HOST_MEMORY;
+        } catch (...) {
+            item.rv = CKR_GENERAL_ERROR;
+        }
+
+        // An operation the base HSM didn't end would fail the next item
+        if(worker.activeOperations != 0) {
+            closeWorkerSession(worker, pooled);
+
+            worker.activeOperations = 0;
+            openRv = openWorkerSession(worker, pooled);
+            if(openRv != CKR_OK) return;
+        }
+    }
+
+    closeWorkerSession(worker, pooled);
+}
+
+CK_RV BatchRunner::openWorkerSession(Session &worker, bool pooled) {
+    SessionPool *sessionPool = pooled ? GlobalData::getInstance().getSessionPool() : NULL;
+    if(sessionPool != NULL) return sessionPool->lease(worker, worker.flags, NULL_PTR, NULL);
+
+    CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)worker.module->getFunction("C_OpenSession");
+    if(Base_C_OpenSession == NULL) return CKR_GENERAL_ERROR;
+
+    return (*Base_C_OpenSession)(worker.baseSlotID, worker.flags, NULL_PTR, NULL, &worker.baseSession);
+}
+
+void BatchRunner::closeWorkerSession(Session &worker, bool pooled) {
+    SessionPool *sessionPool = pooled ? GlobalData::getInstance().getSessionPool() : NULL;
+
+    if(sessionPool != NULL) {
+        try {
+            sessionPool->release(worker);
+        } catch (...) {
+            ERROR_MSG("Could not return a batch worker's session to the pool.");
+        }
+        return;
+    }
+
+    CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)worker.module->getFunction("C_CloseSession");
+    if(Base_C_CloseSession != NULL) (*Base_C_CloseSession)(worker.baseSession);
+}
+
+CK_RV BatchRunner::runItem(Session &worker, CK_QRYPT_BATCH_ITEM &item) {
+    if(item.operation == CKQ_BATCH_GENERATE_RANDOM) return generateRandom(worker, item);
+
+    if(item.operation >= sizeof(BATCH_FUNCTIONS) / sizeof(BatchFunctions)) return CKR_ARGUMENTS_BAD;
+    if(item.pMechanism == NULL_PTR || (item.pInput == NULL_PTR && item.ulInputLen != 0)) return CKR_ARGUMENTS_BAD;
+
+    bool verify = item.operation == CKQ_BATCH_VERIFY;
+    if(verify && item.pOutput == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv;
+    if(verify && runInSoftware(worker, item, rv)) return rv;
+
+    const BatchFunctions &functions = BATCH_FUNCTIONS[item.operation];
+
+    // C_SignInit, C_VerifyInit, C_EncryptInit and C_DecryptInit take the same arguments
+    CK_C_SignInit Base_C_Init = (CK_C_SignInit)worker.module->getFunction(functions.initFunction);
+    if(Base_C_Init == NULL) return CKR_GENERAL_ERROR;
+
+    rv = (*Base_C_Init)(worker.baseSession, item.pMechanism, item.hKey);
+    if(rv != CKR_OK) return rv;
+
+    if(verify) {
+        CK_C_Verify Base_C_Verify = (CK_C_Verify)worker.module->getFunction(functions.function);
+        if(Base_C_Verify == NULL) {
+            worker.activeOperations |= functions.sessionOp;
+            return CKR_GENERAL_ERROR;
+        }
+
+        return (*Base_C_Verify)(worker.baseSession, item.pInput, item.ulInputLen, item.pOutput, item.ulOutputLen);
+    }
+
+    // So do C_Sign, C_Encrypt and C_Decrypt
+    CK_C_Sign Base_C_Function = (CK_C_Sign)worker.module->getFunction(functions.function);
+    if(Base_C_Function == NULL) {
+        worker.activeOperations |= functions.sessionOp;
+        return CKR_GENERAL_ERROR;
+    }
+
+    rv = (*Base_C_Function)(worker.baseSession, item.pInput, item.ulInputLen, item.pOutput, &item.ulOutputLen);
+    if(!(rv == CKR_BUFFER_TOO_SMALL || (rv == CKR_OK && item.pOutput == NULL_PTR))) return rv;
+
+    // A length query (or a short buffer) leaves the operation active;
+    // finish it into a scratch buffer so the session can be used again
+    std::vector<CK_BYTE> scratch(std::max<CK_ULONG>(item.ulOutputLen, 1));
+    CK_ULONG scratchLen = scratch.size();
+
+    CK_RV finishRv = (*Base_C_Function)(worker.baseSession, item.pInput, item.ulInputLen, scratch.data(), &scratchLen);
+    if(finishRv == CKR_BUFFER_TOO_SMALL) worker.activeOperations |= functions.sessionOp;
+
+    OPENSSL_cleanse(scratch.data(), scratch.size());
+    return rv;
+}
+
+bool BatchRunner::runInSoftware(Session &worker, CK_QRYPT_BATCH_ITEM &item, CK_RV &rv) {
+    PublicKeyCache *publicKeyCache = GlobalData::getInstance().getPublicKeyCache();
+    if(publicKeyCache == NULL) return false;
+
+    PublicKey publicKey;
+    if(!publicKeyCache->getPublicKey(worker, item.hKey, publicKey) || !publicKey.key || !publicKey.canVerify) return false;
+    if(!SoftwareVerify::supports(item.pMechanism, publicKey.keyType)) return false;
+
+    SoftwareVerify verify(publicKey.key);
+    rv = verify.init(item.pMechanism);
+    if(rv == CKR_OK) rv = verify.verify(item.pInput, item.ulInputLen, item.pOutput, item.ulOutputLen);
+
+    return true;
+}
+
+CK_RV BatchRunner::generateRandom(Session &worker, CK_QRYPT_BATCH_ITEM &item) {
+    if(item.pOutput == NULL_PTR && item.ulOutputLen != 0) return CKR_ARGUMENTS_BAD;
+
+    // As in C_GenerateRandom, the base HSM only checks the session
+    CK_C_GenerateRandom Base_C_GenerateRandom = (CK_C_GenerateRandom)worker.module->getFunction("C_GenerateRandom");
+    if(Base_C_GenerateRandom == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_GenerateRandom)(worker.baseSession, item.pOutput, 0);
+    switch (rv) {
+        case CKR_DEVICE_ERROR:
+        case CKR_DEVICE_MEMORY:
+        case CKR_DEVICE_REMOVED:
+        case CKR_FUNCTION_FAILED:
+        case CKR_HOST_MEMORY:
+        case CKR_OK:
+        case CKR_RANDOM_NO_RNG:
+            break;
+        default:
+            return rv;
+    }
+
+    if(GlobalData::getInstance().takeReservedRandom(item.pOutput, item.ulOutputLen)) return CKR_OK;
+
+    rv = GlobalData::getInstance().lockRandomBufferMutex();
+    if(rv != CKR_OK) return rv;
+
+    try {
+        rv = GlobalData::getInstance().getRandom(item.pOutput, item.ulOutputLen);
+    } catch (...) {
+        GlobalData::getInstance().unlockRandomBufferMutex();
+        throw;
+    }
+
+    GlobalData::getInstance().unlockRandomBufferMutex();
+
+    if(rv != CKR_OK) ERROR_MSG("Could not fulfill a queued random request (rv = 0x%lx).", rv);
+
+    return rv;
+}
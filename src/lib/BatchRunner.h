@@ -0,0 +1,59 @@
+/**
+ * This class carries out a C_QryptProcessBatch call: independent
+ * single-part sign, verify, encrypt and decrypt operations, spread
+ * over several base sessions that work at the same time. With a
+ * remote base HSM, a batch then costs about as many round trips as
+ * its largest share, rather than two per operation in a row.
+ *
+ * Worker sessions are leased from the SessionPool when there is one
+ * (so they stay open between batches), and are opened on the base
+ * HSM otherwise. They belong to the same application as the calling
+ * session, so they share its login and can use its session objects.
+ *
+ * AsyncQueue runs its items with the same static functions.
+ */
+
+#ifndef _QRYPT_WRAPPER_BATCHRUNNER_H
+#define _QRYPT_WRAPPER_BATCHRUNNER_H
+
+#include <atomic>                           // std::atomic
+
+#include "cryptoki.h"                       // PKCS#11 types
+#include "qryptoki_pkcs11_vendor_defs.h"    // CK_QRYPT_BATCH_ITEM
+
+#include "Session.h"                        // Session
+
+class BatchRunner {
+    public:
+        // Uses at most maxWorkers base sessions, on the calling
+        // thread and maxWorkers - 1 others
+        BatchRunner(Session &session, size_t maxWorkers);
+
+        // Sets every item's rv
+        CK_RV run(CK_QRYPT_BATCH_ITEM_PTR pItems, CK_ULONG ulCount);
+
+        // A worker session on the same slot, with the same flags, as the
+        // application's session; pooled says whether it may come from
+        // the SessionPool
+        static void prepareWorker(const Session &session, Session &worker, bool &pooled);
+        static CK_RV openWorkerSession(Session &worker, bool pooled);
+        static void closeWorkerSession(Session &worker, bool pooled);
+
+        // The item's result; leaves an operation the base HSM didn't
+        // end in worker.activeOperations
+        static CK_RV runItem(Session &worker, CK_QRYPT_BATCH_ITEM &item);
+    private:
+        Session &session;
+        size_t maxWorkers;
+
+        CK_QRYPT_BATCH_ITEM_PTR items;
+        CK_ULONG count;
+        std::atomic<CK_ULONG> next;         // First item no worker has taken
+
+        void work(CK_RV &openRv);
+
+        static bool runInSoftware(Session &worker, CK_QRYPT_BATCH_ITEM &item, CK_RV &rv);
+        static CK_RV generateRandom(Session &worker, CK_QRYPT_BATCH_ITEM &item);
+};
+
+#endif /* !_QRYPT_WRAPPER_BATCHRUNNER_H */
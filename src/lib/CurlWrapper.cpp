@@ -1,27 +1,69 @@
 #include <cstring>     // strncmp
+#include <chrono>      // std::chrono::steady_clock
 
 #include "qryptoki_pkcs11_vendor_defs.h" // CKR_QRYPT_*
 #include "log.h"                         // logging macros
 #include "base64.h"
+#include "EntropyStats.h"                // EntropyStats
+#include "probes.h"                      // QRYPT_PROBE
+#include "Tracer.h"                      // Tracer, TraceSpan
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 #include <curl/curl.h>
 
 #include "CurlWrapper.h"
 
+static void lockShare(CURL *, curl_lock_data data, curl_lock_access, void *locks) {
+    ((std::mutex *)locks)[data].lock();
+}
+
+static void unlockShare(CURL *, curl_lock_data data, void *locks) {
+    ((std::mutex *)locks)[data].unlock();
+}
+
 CurlWrapper::CurlWrapper(std::string token) {
     this->token = token;
     this->restJson.SetObject();
 
     const char *cacert_path_c_str = std::getenv("QRYPT_CA_CERT_PATH");
     this->cacert_path = cacert_path_c_str ? cacert_path_c_str : "";
+
+    this->share = curl_share_init();
+    if(this->share != NULL) {
+        curl_share_setopt(this->share, CURLSHOPT_LOCKFUNC, &lockShare);
+        curl_share_setopt(this->share, CURLSHOPT_UNLOCKFUNC, &unlockShare);
+        curl_share_setopt(this->share, CURLSHOPT_USERDATA, this->shareLocks);
+        curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    } else {
+        DEBUG_MSG("Could not create a curl share; EaaS connections won't be reused.");
+    }
 }
 
-CurlWrapper::~CurlWrapper() {}
+CurlWrapper::~CurlWrapper() {
+    // Every easy handle using it was cleaned up after its fetch
+    if(this->share != NULL) curl_share_cleanup(this->share);
+}
 
 CK_RV CurlWrapper::collectRandom(uint8_t *dest, size_t goal) {
     if (goal == 0) return CKR_OK;
-    
+
+    TraceSpan span("eaas fetch", "eaas", "bytes", goal);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t bytesFetched = 0;
+
+    CK_RV rv = this->requestRandom(dest, goal, bytesFetched);
+
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    EntropyStats::getInstance().recordFetch(ns, bytesFetched, rv);
+
+    LOG_EVENT(LOG_DEBUG, "eaas_fetch", "requested", goal, "fetched", bytesFetched, "us", ns / 1000, "rv", rv);
+
+    return rv;
+}
+
+CK_RV CurlWrapper::requestRandom(uint8_t *dest, size_t goal, uint64_t &bytesFetched) {
     CurlResponse response = this->performCURL(goal);
 
     switch (response.code) {
@@ -31,10 +73,13 @@ CK_RV CurlWrapper::collectRandom(uint8_t *dest, size_t goal) {
             } break;
             case 200: {
                 rapidjson::Document().Swap(restJson);
-                restJson.Parse(response.buffer.c_str());
+                {
+                    TraceSpan parseSpan("json parse", "eaas", "bytes", response.buffer.size());
+                    restJson.Parse(response.buffer.c_str());
+                }
                 if (restJson.HasParseError())
                 {
-                   DEBUG_MSG(::rapidjson::GetParseError_En(restJson.GetParseError()));
+                   DEBUG_MSG("Could not parse REST response at offset %zu: %s", restJson.GetErrorOffset(), ::rapidjson::GetParseError_En(restJson.GetParseError()));
                    return CKR_GENERAL_ERROR;
                 }
                 else if (!restJson.IsObject())
@@ -49,7 +94,8 @@ CK_RV CurlWrapper::collectRandom(uint8_t *dest, size_t goal) {
                 }
 
                 int bufferWritePos = 0;
-                this->writeToBuffer(dest, bufferWritePos);
+                TraceSpan decodeSpan("base64 decode", "eaas");
+                bytesFetched = std::get<1>(this->writeToBuffer(dest, bufferWritePos));
             } break;
             case 400: {
                  DEBUG_MSG("Bad Request. The request was malformed or otherwise unacceptable.");
@@ -81,10 +127,79 @@ std::size_t writeCallback(char *contents, std::size_t size, std::size_t nmemb, s
     return size * nmemb;
 }
 
+#if QRYPT_HAVE_PROBES
+// Only evaluated where a probe is compiled in
+static long totalTimeUs(CURL *curlHandle) {
+    curl_off_t us = 0;
+    curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME_T, &us);
+    return (long)us;
+}
+#endif
+
+static uint64_t phaseUs(CURL *curlHandle, CURLINFO info) {
+    curl_off_t us = 0;
+    curl_easy_getinfo(curlHandle, info, &us);
+    return us > 0 ? (uint64_t)us : 0;
+}
+
+static TransferTimes getTransferTimes(CURL *curlHandle) {
+    TransferTimes times;
+    times.nameLookupUs = phaseUs(curlHandle, CURLINFO_NAMELOOKUP_TIME_T);
+    times.connectUs = phaseUs(curlHandle, CURLINFO_CONNECT_TIME_T);
+    times.appConnectUs = phaseUs(curlHandle, CURLINFO_APPCONNECT_TIME_T);
+    times.preTransferUs = phaseUs(curlHandle, CURLINFO_PRETRANSFER_TIME_T);
+    times.startTransferUs = phaseUs(curlHandle, CURLINFO_STARTTRANSFER_TIME_T);
+    times.totalUs = phaseUs(curlHandle, CURLINFO_TOTAL_TIME_T);
+
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(curlHandle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    times.bytesDownloaded = bytes > 0 ? (uint64_t)bytes : 0;
+
+    times.httpVersion = 0;
+    curl_easy_getinfo(curlHandle, CURLINFO_HTTP_VERSION, &times.httpVersion);
+
+    // No new connection was needed for the transfer
+    long connects = 0;
+    curl_easy_getinfo(curlHandle, CURLINFO_NUM_CONNECTS, &connects);
+    times.connectionReused = connects == 0;
+
+    return times;
+}
+
+// Splits the transfer that started at startUs into its phases. Phases
+// that didn't happen (a reused connection, plain HTTP, a failed
+// transfer) are left out.
+static void traceCurlPhases(const TransferTimes &times, uint64_t startUs) {
+    const struct {
+        const char *name;
+        uint64_t endUs;
+    } phases[] = {
+        { "dns", times.nameLookupUs },
+        { "connect", times.connectUs },
+        { "tls handshake", times.appConnectUs },
+        { "send request", times.preTransferUs },
+        { "server wait", times.startTransferUs },
+        // The total time of a transfer that failed before any response
+        // is not time spent receiving
+        { "receive", times.startTransferUs != 0 ? times.totalUs : 0 },
+    };
+
+    uint64_t from = 0;
+
+    for(const auto &phase : phases) {
+        if(phase.endUs <= from) continue;
+
+        Tracer::record(phase.name, "curl", startUs + from, startUs + phase.endUs);
+        from = phase.endUs;
+    }
+}
+
 CurlResponse CurlWrapper::performCURL(size_t goal) {
 
     CurlResponse response = {};
 
+    QRYPT_PROBE(fetch__start, goal);
+
     CURL *curlHandle = curl_easy_init();
 
     std::string fullURL = "https://api-eus.qrypt.com/api/v1/quantum-entropy?size=";
@@ -110,6 +225,9 @@ CurlResponse CurlWrapper::performCURL(size_t goal) {
     curl_easy_setopt(curlHandle, CURLOPT_TCP_KEEPALIVE, 1L);
     curl_easy_setopt(curlHandle, CURLOPT_NOSIGNAL, 1L);
 
+    // So that the next fetch finds this one's connection
+    if(this->share != NULL) curl_easy_setopt(curlHandle, CURLOPT_SHARE, this->share);
+
     curl_easy_setopt(curlHandle, CURLOPT_URL, fullURL.c_str());
     curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, &writeCallback);
     curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &response.buffer);
@@ -125,9 +243,25 @@ CurlResponse CurlWrapper::performCURL(size_t goal) {
 #endif
 
     // Perform CURL command
+    uint64_t performStartUs = Tracer::isEnabled() ? Tracer::now() : 0;
     CURLcode curlCode = curl_easy_perform(curlHandle); 
+
+    TransferTimes times = getTransferTimes(curlHandle);
+
+    if (Tracer::isEnabled()) {
+        Tracer::record("curl_easy_perform", "curl", performStartUs, Tracer::now(), "result", curlCode);
+        traceCurlPhases(times, performStartUs);
+    }
+
     if (curlCode) {
         DEBUG_MSG("Entropy failed from curl_easy_perform with error code %zu", curlCode);
+        EntropyStats::getInstance().recordFailedTransfer(times);
+
+        LOG_EVENT(LOG_DEBUG, "eaas_transfer_failed", "curl_code", (int)curlCode, "reused", times.connectionReused,
+                  "dns_us", times.nameLookupUs, "connect_us", times.connectUs, "tls_us", times.appConnectUs,
+                  "total_us", times.totalUs);
+
+        QRYPT_PROBE(fetch__done, goal, -1L, totalTimeUs(curlHandle));
         curl_slist_free_all(curlSlist);
         curl_easy_cleanup(curlHandle);
         response.code = -1; 
@@ -138,11 +272,22 @@ CurlResponse CurlWrapper::performCURL(size_t goal) {
     curlCode = curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &response.code);
     if (curlCode) {
         DEBUG_MSG("Entropy failed from curl_easy_getinfo with error code %zu", curlCode);
-        curl_slist_free_all(curlSlist);
-        curl_easy_cleanup(curlHandle);
+        response.code = -1;
     }
 
-    DEBUG_MSG("Entropy completed with http response code %zu", curlCode);
+    DEBUG_MSG("Entropy completed with http response code %ld", response.code);
+
+    if (response.code != -1) {
+        EntropyStats::getInstance().recordTransfer(times);
+
+        LOG_EVENT(LOG_DEBUG, "eaas_transfer", "http_code", response.code, "http_version", times.httpVersion,
+                  "reused", times.connectionReused, "bytes", times.bytesDownloaded, "dns_us", times.nameLookupUs,
+                  "connect_us", times.connectUs, "tls_us", times.appConnectUs, "start_transfer_us", times.startTransferUs,
+                  "total_us", times.totalUs);
+    } else {
+        EntropyStats::getInstance().recordFailedTransfer(times);
+    }
+    QRYPT_PROBE(fetch__done, goal, response.code, totalTimeUs(curlHandle));
 
     curl_slist_free_all(curlSlist);
     curl_easy_cleanup(curlHandle);
@@ -6,8 +6,11 @@
 #define _CURL_WRAPPER_H
 
 #include <memory>     // std::shared_ptr
+#include <mutex>      // std::mutex
 #include <string>     // std::string
 
+#include <curl/curl.h>          // CURLSH
+
 #include "cryptoki.h"           // CK_RV
 #include "rapidjson/document.h" // json parsing
 #include "RandomCollector.h"    // RandomCollector
@@ -35,8 +38,17 @@ class CurlWrapper : public RandomCollector {
 
     std::string cacert_path;
 
+    // Connections, DNS results and TLS sessions kept between fetches,
+    // which may run on several threads at once; NULL if curl couldn't
+    // make one, and then every fetch connects anew
+    CURLSH *share;
+    std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+
     ::rapidjson::Document restJson;
     
+    // Collects random, setting bytesFetched to the bytes in the response
+    CK_RV requestRandom(uint8_t *dest, size_t goal, uint64_t &bytesFetched);
+
     std::tuple<int, uint64_t> writeToBuffer(uint8_t *inputBuffer, int bufferWritePos);
     CurlResponse performCURL(size_t goal);
 };
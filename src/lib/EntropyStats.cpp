@@ -0,0 +1,197 @@
+#include <stddef.h>             // size_t
+#include <stdint.h>             // uint64_t
+
+#include <vector>               // std::vector
+
+#include <curl/curl.h>          // CURL_HTTP_VERSION_2_0
+
+#include "log.h"                // logging macros
+
+#include "EntropyStats.h"
+
+EntropyStats::EntropyStats() {
+    this->randomRequests = 0;
+    this->randomFailures = 0;
+    this->bytesServed = 0;
+    this->bytesFromReservoir = 0;
+    this->reservoirFill = 0;
+    this->reservoirCapacity = 0;
+
+    this->eaasRequests = 0;
+    this->eaasFailures = 0;
+    this->eaasRetries = 0;
+    this->lastFetchFailed = false;
+    this->bytesFetched = 0;
+    this->bytesWasted = 0;
+
+    this->transfers = 0;
+    this->transfersFailed = 0;
+    this->transfersReusingConnection = 0;
+    this->transfersOverHttp2 = 0;
+    this->bytesDownloaded = 0;
+
+    this->lockWaitNs = 0;
+    this->lockWaitMaxNs = 0;
+}
+
+void EntropyStats::recordRequest(uint64_t bytes, uint64_t lockWaitNs, CK_RV rv) {
+    this->randomRequests.fetch_add(1, std::memory_order_relaxed);
+
+    if(rv == CKR_OK)
+        this->bytesServed.fetch_add(bytes, std::memory_order_relaxed);
+    else
+        this->randomFailures.fetch_add(1, std::memory_order_relaxed);
+
+    this->lockWaitNs.fetch_add(lockWaitNs, std::memory_order_relaxed);
+
+    uint64_t maxNs = this->lockWaitMaxNs.load(std::memory_order_relaxed);
+    while(lockWaitNs > maxNs && !this->lockWaitMaxNs.compare_exchange_weak(maxNs, lockWaitNs, std::memory_order_relaxed));
+}
+
+void EntropyStats::addReservoir(uint64_t capacity) {
+    this->reservoirCapacity.fetch_add(capacity, std::memory_order_relaxed);
+}
+
+void EntropyStats::removeReservoir(uint64_t capacity, uint64_t fill) {
+    this->reservoirCapacity.fetch_sub(capacity, std::memory_order_relaxed);
+    this->reservoirFill.fetch_sub(fill, std::memory_order_relaxed);
+}
+
+void EntropyStats::recordReservoir(uint64_t bytesServed) {
+    this->bytesFromReservoir.fetch_add(bytesServed, std::memory_order_relaxed);
+    this->reservoirFill.fetch_sub(bytesServed, std::memory_order_relaxed);
+}
+
+void EntropyStats::recordRefill(uint64_t bytes) {
+    this->reservoirFill.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void EntropyStats::recordWasted(uint64_t bytes) {
+    this->bytesWasted.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void EntropyStats::recordFetch(uint64_t ns, uint64_t bytesFetched, CK_RV rv) {
+    this->eaasRequests.fetch_add(1, std::memory_order_relaxed);
+    this->bytesFetched.fetch_add(bytesFetched, std::memory_order_relaxed);
+    this->fetchLatency.record(ns);
+
+    // A request after a failed one is counted as a retry
+    if(this->lastFetchFailed.exchange(rv != CKR_OK, std::memory_order_relaxed))
+        this->eaasRetries.fetch_add(1, std::memory_order_relaxed);
+
+    if(rv != CKR_OK) this->eaasFailures.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The time from one phase's end to the next's, if the later one
+// happened
+static void recordPhase(LatencyHistogram &histogram, uint64_t fromUs, uint64_t toUs) {
+    if(toUs == 0) return;
+
+    histogram.record(toUs > fromUs ? (toUs - fromUs) * 1000 : 0);
+}
+
+void EntropyStats::recordTransfer(const TransferTimes &times) {
+    this->transfers.fetch_add(1, std::memory_order_relaxed);
+    this->bytesDownloaded.fetch_add(times.bytesDownloaded, std::memory_order_relaxed);
+
+    if(times.connectionReused) this->transfersReusingConnection.fetch_add(1, std::memory_order_relaxed);
+    if(times.httpVersion == CURL_HTTP_VERSION_2_0) this->transfersOverHttp2.fetch_add(1, std::memory_order_relaxed);
+
+    recordPhases(times);
+}
+
+void EntropyStats::recordFailedTransfer(const TransferTimes &times) {
+    this->transfersFailed.fetch_add(1, std::memory_order_relaxed);
+
+    recordPhases(times);
+}
+
+void EntropyStats::recordPhases(const TransferTimes &times) {
+    // A reused connection has no lookup, connect or handshake of its own
+    if(!times.connectionReused) {
+        recordPhase(this->dnsLatency, 0, times.nameLookupUs);
+        recordPhase(this->connectLatency, times.nameLookupUs, times.connectUs);
+        recordPhase(this->tlsLatency, times.connectUs, times.appConnectUs);
+    }
+
+    recordPhase(this->serverWaitLatency, times.preTransferUs, times.startTransferUs);
+    recordPhase(this->receiveLatency, times.startTransferUs, times.totalUs);
+}
+
+static uint64_t percentileUs(const LatencyHistogram &histogram, double fraction) {
+    std::vector<uint64_t> counts;
+    histogram.addTo(counts);
+
+    return LatencyHistogram::percentile(counts, fraction, histogram.getMax()) / 1000;
+}
+
+void EntropyStats::getStatistics(CK_QRYPT_STATISTICS &statistics) {
+    statistics.version.major = 1;
+    statistics.version.minor = 2;
+
+    statistics.ulRandomRequests = this->randomRequests.load(std::memory_order_relaxed);
+    statistics.ulRandomFailures = this->randomFailures.load(std::memory_order_relaxed);
+    statistics.ulBytesServed = this->bytesServed.load(std::memory_order_relaxed);
+    statistics.ulBytesFromReservoir = this->bytesFromReservoir.load(std::memory_order_relaxed);
+    statistics.ulReservoirFill = this->reservoirFill.load(std::memory_order_relaxed);
+    statistics.ulReservoirCapacity = this->reservoirCapacity.load(std::memory_order_relaxed);
+
+    statistics.ulEaasRequests = this->eaasRequests.load(std::memory_order_relaxed);
+    statistics.ulEaasFailures = this->eaasFailures.load(std::memory_order_relaxed);
+    statistics.ulEaasRetries = this->eaasRetries.load(std::memory_order_relaxed);
+    statistics.ulBytesFetched = this->bytesFetched.load(std::memory_order_relaxed);
+    statistics.ulBytesWasted = this->bytesWasted.load(std::memory_order_relaxed);
+
+    std::vector<uint64_t> counts;
+    this->fetchLatency.addTo(counts);
+    uint64_t maxNs = this->fetchLatency.getMax();
+
+    statistics.ulFetchLatencyP50Us = LatencyHistogram::percentile(counts, 0.5, maxNs) / 1000;
+    statistics.ulFetchLatencyP90Us = LatencyHistogram::percentile(counts, 0.9, maxNs) / 1000;
+    statistics.ulFetchLatencyP99Us = LatencyHistogram::percentile(counts, 0.99, maxNs) / 1000;
+    statistics.ulFetchLatencyMaxUs = maxNs / 1000;
+
+    statistics.ulLockWaitUs = this->lockWaitNs.load(std::memory_order_relaxed) / 1000;
+    statistics.ulLockWaitMaxUs = this->lockWaitMaxNs.load(std::memory_order_relaxed) / 1000;
+
+    statistics.ulTransfers = this->transfers.load(std::memory_order_relaxed);
+    statistics.ulTransfersReusingConnection = this->transfersReusingConnection.load(std::memory_order_relaxed);
+    statistics.ulTransfersOverHttp2 = this->transfersOverHttp2.load(std::memory_order_relaxed);
+    statistics.ulBytesDownloaded = this->bytesDownloaded.load(std::memory_order_relaxed);
+
+    statistics.ulDnsP50Us = percentileUs(this->dnsLatency, 0.5);
+    statistics.ulDnsP99Us = percentileUs(this->dnsLatency, 0.99);
+    statistics.ulConnectP50Us = percentileUs(this->connectLatency, 0.5);
+    statistics.ulConnectP99Us = percentileUs(this->connectLatency, 0.99);
+    statistics.ulTlsP50Us = percentileUs(this->tlsLatency, 0.5);
+    statistics.ulTlsP99Us = percentileUs(this->tlsLatency, 0.99);
+    statistics.ulServerWaitP50Us = percentileUs(this->serverWaitLatency, 0.5);
+    statistics.ulServerWaitP99Us = percentileUs(this->serverWaitLatency, 0.99);
+    statistics.ulReceiveP50Us = percentileUs(this->receiveLatency, 0.5);
+    statistics.ulReceiveP99Us = percentileUs(this->receiveLatency, 0.99);
+
+    statistics.ulTransfersFailed = this->transfersFailed.load(std::memory_order_relaxed);
+}
+
+void EntropyStats::logStatistics() {
+    CK_QRYPT_STATISTICS statistics;
+    getStatistics(statistics);
+
+    if(statistics.ulRandomRequests == 0) return;
+
+    INFO_MSG("Entropy: %lu bytes served by %lu requests (%lu failed), %lu of them from the random buffer.",
+             statistics.ulBytesServed, statistics.ulRandomRequests, statistics.ulRandomFailures, statistics.ulBytesFromReservoir);
+    INFO_MSG("Entropy: %lu EaaS requests (%lu failed, %lu retries) fetched %lu bytes, %lu wasted; p50 %lu us, p99 %lu us.",
+             statistics.ulEaasRequests, statistics.ulEaasFailures, statistics.ulEaasRetries, statistics.ulBytesFetched,
+             statistics.ulBytesWasted, statistics.ulFetchLatencyP50Us, statistics.ulFetchLatencyP99Us);
+
+    if(statistics.ulTransfers == 0 && statistics.ulTransfersFailed == 0) return;
+
+    INFO_MSG("Entropy: %lu transfers (%lu failed before a response, %lu reusing a connection, %lu over HTTP/2) downloaded %lu bytes; "
+             "p50/p99 dns %lu/%lu us, connect %lu/%lu us, tls %lu/%lu us, server wait %lu/%lu us, receive %lu/%lu us.",
+             statistics.ulTransfers, statistics.ulTransfersFailed, statistics.ulTransfersReusingConnection, statistics.ulTransfersOverHttp2,
+             statistics.ulBytesDownloaded,
+             statistics.ulDnsP50Us, statistics.ulDnsP99Us, statistics.ulConnectP50Us, statistics.ulConnectP99Us,
+             statistics.ulTlsP50Us, statistics.ulTlsP99Us, statistics.ulServerWaitP50Us, statistics.ulServerWaitP99Us,
+             statistics.ulReceiveP50Us, statistics.ulReceiveP99Us);
+}
@@ -0,0 +1,118 @@
+/**
+ * This class counts what happens along the entropy pipeline, from
+ * C_GenerateRandom through the random buffer (the reservoir of
+ * leftover EaaS bytes) to the EaaS requests made by CurlWrapper. It
+ * fills the CK_QRYPT_STATISTICS returned by C_QryptGetStatistics.
+ *
+ * Counting is always on: every counter is a relaxed atomic, and
+ * most are only touched while the random buffer mutex is held
+ * anyway. The counters are kept for the life of the process, across
+ * C_Initialize and C_Finalize.
+ */
+
+#ifndef _QRYPT_WRAPPER_ENTROPYSTATS_H
+#define _QRYPT_WRAPPER_ENTROPYSTATS_H
+
+#include <stdint.h>                      // uint64_t
+
+#include <atomic>                        // std::atomic
+
+#include "cryptoki.h"                    // PKCS#11 types
+#include "qryptoki_pkcs11_vendor_defs.h" // CK_QRYPT_STATISTICS
+
+#include "LatencyHistogram.h"            // LatencyHistogram
+
+// Curl's account of one EaaS transfer. Times are microseconds from
+// the start of the transfer to the end of each phase, as curl's
+// CURLINFO_*_TIME_T give them; 0 for phases that didn't happen.
+struct TransferTimes {
+    uint64_t nameLookupUs;
+    uint64_t connectUs;
+    uint64_t appConnectUs;
+    uint64_t preTransferUs;
+    uint64_t startTransferUs;
+    uint64_t totalUs;
+    uint64_t bytesDownloaded;
+    long httpVersion;           // CURL_HTTP_VERSION_*
+    bool connectionReused;
+};
+
+class EntropyStats {
+    public:
+        static EntropyStats& getInstance() {
+            static EntropyStats instance;
+            return instance;
+        }
+
+        EntropyStats(EntropyStats const&)  = delete;
+        void operator=(EntropyStats const&) = delete;
+
+        // A random request made of Qryptoki, after the random buffer
+        // mutex was waited for for lockWaitNs
+        void recordRequest(uint64_t bytes, uint64_t lockWaitNs, CK_RV rv);
+
+        // A random buffer of capacity bytes made, and one destroyed
+        // with fill bytes left in it. There is one per NUMA node with
+        // QRYPT_NUMA_RESERVOIRS, and the fill and capacity reported
+        // are the sums over them.
+        void addReservoir(uint64_t capacity);
+        void removeReservoir(uint64_t capacity, uint64_t fill);
+
+        // Bytes served from a random buffer, and bytes put in one
+        void recordReservoir(uint64_t bytesServed);
+        void recordRefill(uint64_t bytes);
+
+        // Bytes fetched but dropped unserved, such as those left in
+        // the random buffer at C_Finalize
+        void recordWasted(uint64_t bytes);
+
+        // An EaaS request, with the bytes its response held
+        void recordFetch(uint64_t ns, uint64_t bytesFetched, CK_RV rv);
+
+        // An EaaS request that got an HTTP response
+        void recordTransfer(const TransferTimes &times);
+
+        // An EaaS request that curl gave up on, with the phases it
+        // got through
+        void recordFailedTransfer(const TransferTimes &times);
+
+        void getStatistics(CK_QRYPT_STATISTICS &statistics);
+
+        void logStatistics();
+    private:
+        EntropyStats();
+        ~EntropyStats(){};
+
+        std::atomic<uint64_t> randomRequests;
+        std::atomic<uint64_t> randomFailures;
+        std::atomic<uint64_t> bytesServed;
+        std::atomic<uint64_t> bytesFromReservoir;
+        std::atomic<uint64_t> reservoirFill;
+        std::atomic<uint64_t> reservoirCapacity;
+
+        std::atomic<uint64_t> eaasRequests;
+        std::atomic<uint64_t> eaasFailures;
+        std::atomic<uint64_t> eaasRetries;
+        std::atomic<bool> lastFetchFailed;
+        std::atomic<uint64_t> bytesFetched;
+        std::atomic<uint64_t> bytesWasted;
+        LatencyHistogram fetchLatency;
+
+        std::atomic<uint64_t> transfers;
+        std::atomic<uint64_t> transfersFailed;
+        std::atomic<uint64_t> transfersReusingConnection;
+        std::atomic<uint64_t> transfersOverHttp2;
+        std::atomic<uint64_t> bytesDownloaded;
+        LatencyHistogram dnsLatency;
+        LatencyHistogram connectLatency;
+        LatencyHistogram tlsLatency;
+        LatencyHistogram serverWaitLatency;
+        LatencyHistogram receiveLatency;
+
+        std::atomic<uint64_t> lockWaitNs;
+        std::atomic<uint64_t> lockWaitMaxNs;
+
+        void recordPhases(const TransferTimes &times);
+};
+
+#endif /* !_QRYPT_WRAPPER_ENTROPYSTATS_H */
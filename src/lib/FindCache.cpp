@@ -0,0 +1,187 @@
+#include <algorithm>    // std::stable_sort
+
+#include "log.h"        // logging macros
+#include "GlobalData.h" // mutex functions
+
+#include "FindCache.h"
+
+// Bounds memory use if an application runs many different searches
+const size_t FIND_CACHE_MAX_ENTRIES = 4096;
+
+// Handles asked for per base C_FindObjects call while filling the cache
+const CK_ULONG FIND_CACHE_FETCH_BATCH = 64;
+
+static void appendBytes(std::string &key, const void *data, size_t len) {
+    key.append((const char *)data, len);
+}
+
+FindCache::FindCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex) {
+    this->ttl = ttl;
+    this->mutex = mutex;
+
+    this->generation = 0;
+    this->hits = 0;
+    this->misses = 0;
+}
+
+CK_VOID_PTR FindCache::getMutex() {
+    return this->mutex;
+}
+
+bool FindCache::makeKey(CK_SLOT_ID slotID, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::string &key) {
+    if(pTemplate == NULL_PTR && ulCount != 0) return false;
+
+    std::vector<CK_ATTRIBUTE_PTR> attributes;
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        if(pTemplate[i].pValue == NULL_PTR && pTemplate[i].ulValueLen != 0) return false;
+        attributes.push_back(&pTemplate[i]);
+    }
+
+    // Templates that differ only in attribute order match the same objects
+    std::stable_sort(attributes.begin(), attributes.end(), [](CK_ATTRIBUTE_PTR a, CK_ATTRIBUTE_PTR b) {
+        return a->type < b->type;
+    });
+
+    key.clear();
+    appendBytes(key, &slotID, sizeof(slotID));
+
+    for(CK_ATTRIBUTE_PTR attribute : attributes) {
+        appendBytes(key, &attribute->type, sizeof(attribute->type));
+        appendBytes(key, &attribute->ulValueLen, sizeof(attribute->ulValueLen));
+        appendBytes(key, attribute->pValue, attribute->ulValueLen);
+    }
+
+    return true;
+}
+
+CK_RV FindCache::search(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, const std::string &key, std::vector<CK_OBJECT_HANDLE> &objects) {
+    if(lookup(key, objects)) {
+        this->hits++;
+        return CKR_OK;
+    }
+
+    this->misses++;
+
+    unsigned long long generation = getGeneration();
+
+    CK_RV rv = fetch(session, pTemplate, ulCount, objects);
+    if(rv != CKR_OK) return rv;
+
+    insert(key, session.slotID, generation, objects);
+    return CKR_OK;
+}
+
+bool FindCache::lookup(const std::string &key, std::vector<CK_OBJECT_HANDLE> &objects) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return false;
+
+    bool found = false;
+
+    try {
+        auto it = this->entries.find(key);
+        if(it != this->entries.end()) {
+            if(it->second.expiry > std::chrono::steady_clock::now()) {
+                objects = it->second.objects;
+                found = true;
+            } else {
+                this->entries.erase(it);
+            }
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    return found;
+}
+
+unsigned long long FindCache::getGeneration() {
+    return this->generation;
+}
+
+void FindCache::insert(const std::string &key, CK_SLOT_ID slotID, unsigned long long generation, const std::vector<CK_OBJECT_HANDLE> &objects) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    try {
+        if(generation == this->generation) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            if(this->entries.size() >= FIND_CACHE_MAX_ENTRIES && this->entries.count(key) == 0) {
+                for(auto it = this->entries.begin(); it != this->entries.end();) {
+                    if(it->second.expiry <= now)
+                        it = this->entries.erase(it);
+                    else
+                        it++;
+                }
+
+                if(this->entries.size() >= FIND_CACHE_MAX_ENTRIES) this->entries.clear();
+            }
+
+            FindCacheEntry &entry = this->entries[key];
+            entry.slotID = slotID;
+            entry.expiry = now + this->ttl;
+            entry.objects = objects;
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void FindCache::invalidate(CK_SLOT_ID slotID) {
+    // Searches under way can't be cached any more, even if the lock fails
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    for(auto it = this->entries.begin(); it != this->entries.end();) {
+        if(it->second.slotID == slotID)
+            it = this->entries.erase(it);
+        else
+            it++;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void FindCache::logStatistics() {
+    unsigned long hits = this->hits;
+    unsigned long misses = this->misses;
+    if(hits + misses == 0) return;
+
+    INFO_MSG("Find cache: %lu of %lu searches answered from the cache.", hits, hits + misses);
+}
+
+CK_RV FindCache::fetch(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::vector<CK_OBJECT_HANDLE> &objects) {
+    CK_C_FindObjectsInit Base_C_FindObjectsInit = (CK_C_FindObjectsInit)session.module->getFunction("C_FindObjectsInit");
+    CK_C_FindObjects Base_C_FindObjects = (CK_C_FindObjects)session.module->getFunction("C_FindObjects");
+    CK_C_FindObjectsFinal Base_C_FindObjectsFinal = (CK_C_FindObjectsFinal)session.module->getFunction("C_FindObjectsFinal");
+    if(Base_C_FindObjectsInit == NULL || Base_C_FindObjects == NULL || Base_C_FindObjectsFinal == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_FindObjectsInit)(session.baseSession, pTemplate, ulCount);
+    if(rv != CKR_OK) return rv;
+
+    // Read the whole result so later calls never need the base HSM
+    objects.clear();
+
+    try {
+        CK_ULONG found = 0;
+        do {
+            size_t offset = objects.size();
+            objects.resize(offset + FIND_CACHE_FETCH_BATCH);
+
+            rv = (*Base_C_FindObjects)(session.baseSession, &objects[offset], FIND_CACHE_FETCH_BATCH, &found);
+            if(rv != CKR_OK) found = 0;
+
+            objects.resize(offset + found);
+        } while(found == FIND_CACHE_FETCH_BATCH);
+    } catch (...) {
+        (*Base_C_FindObjectsFinal)(session.baseSession);
+        throw;
+    }
+
+    CK_RV finalRv = (*Base_C_FindObjectsFinal)(session.baseSession);
+    return rv != CKR_OK ? rv : finalRv;
+}
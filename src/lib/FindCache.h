@@ -0,0 +1,69 @@
+/**
+ * This class caches the results of object searches, so that an
+ * application looking up the same key before every operation
+ * doesn't send a C_FindObjectsInit/C_FindObjects/C_FindObjectsFinal
+ * round of calls to the base HSM each time.
+ *
+ * Entries are keyed by slot and by the search template with its
+ * attributes in a canonical order. Qryptoki drops a slot's
+ * entries whenever its objects, or which of them the application
+ * can see (login state), may have changed; the TTL bounds how
+ * long changes made by other applications go unnoticed.
+ */
+
+#ifndef _QRYPT_WRAPPER_FINDCACHE_H
+#define _QRYPT_WRAPPER_FINDCACHE_H
+
+#include <atomic>           // std::atomic
+#include <chrono>           // std::chrono::steady_clock
+#include <string>           // std::string
+#include <unordered_map>    // std::unordered_map
+#include <vector>           // std::vector
+
+#include "cryptoki.h"       // PKCS#11 types
+
+#include "Session.h"        // Session
+
+struct FindCacheEntry {
+    CK_SLOT_ID slotID;
+    std::chrono::steady_clock::time_point expiry;
+    std::vector<CK_OBJECT_HANDLE> objects;
+};
+
+class FindCache {
+    public:
+        FindCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex);
+
+        CK_VOID_PTR getMutex();
+
+        // Builds the key for a search; returns false if the template
+        // can't be cached (e.g. an attribute without a value)
+        static bool makeKey(CK_SLOT_ID slotID, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::string &key);
+
+        // Fills objects with every match, from the cache if possible
+        CK_RV search(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, const std::string &key, std::vector<CK_OBJECT_HANDLE> &objects);
+
+        bool lookup(const std::string &key, std::vector<CK_OBJECT_HANDLE> &objects);
+
+        // Results fetched before the generation last changed may be
+        // stale, so insert() drops them
+        unsigned long long getGeneration();
+        void insert(const std::string &key, CK_SLOT_ID slotID, unsigned long long generation, const std::vector<CK_OBJECT_HANDLE> &objects);
+
+        void invalidate(CK_SLOT_ID slotID);
+
+        void logStatistics();
+    private:
+        std::chrono::milliseconds ttl;
+        CK_VOID_PTR mutex;
+
+        std::unordered_map<std::string, FindCacheEntry> entries;
+        std::atomic<unsigned long long> generation;
+
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        CK_RV fetch(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::vector<CK_OBJECT_HANDLE> &objects);
+};
+
+#endif /* !_QRYPT_WRAPPER_FINDCACHE_H */
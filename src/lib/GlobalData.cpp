@@ -1,30 +1,78 @@
 #include <stdlib.h>
+#include <errno.h>       // EINVAL
+#include <string.h>      // strcmp
+#include <chrono>        // std::chrono::steady_clock
+#include <sstream>       // std::stringstream
 #include <stdexcept>     // std::runtime_error
+#include <system_error>  // std::system_error
 
 #include "qryptoki_pkcs11_vendor_defs.h" // CKR_QRYPT_*
 #include "log.h"                         // logging macros
 #include "osmutex.h"                     // mutex functions
+#include "probes.h"                      // QRYPT_PROBE
 #include "CurlWrapper.h"                 // CurlWrapper
+#include "EntropyStats.h"                // EntropyStats
+#include "LatencyStats.h"                // LatencyStats
+#include "LockStats.h"                   // LockStats
+#include "NumaNodes.h"                   // NumaNodes
+#include "Tracer.h"                      // Tracer, TraceSpan
 
 #include "GlobalData.h"
 
+// The top byte of an application-facing slot ID holds the index of
+// the owning base HSM, so the first base HSM's slot IDs are unchanged.
+const unsigned SLOT_MODULE_SHIFT = sizeof(CK_SLOT_ID) * 8 - 8;
+const CK_SLOT_ID SLOT_BASE_MASK = ((CK_SLOT_ID)1 << SLOT_MODULE_SHIFT) - 1;
+const size_t MAX_BASE_HSMS = 255;
+
+// Update buffers are locked in memory, so keep them modest
+const unsigned long MAX_UPDATE_BUFFER_SIZE = 1024 * 1024;
+
+// Base sessions a C_QryptProcessBatch call works on at once, and
+// the most threads running C_QryptSubmit operations
+const unsigned long DEFAULT_BATCH_WORKERS = 8;
+const unsigned long MAX_BATCH_WORKERS = 256;
+
+// Pooled key pairs are real objects on the token, so keep few
+const unsigned long MAX_KEYPAIR_POOL_DEPTH = 64;
+
+// Curves QRYPT_KEYPAIR_POOL knows by name, as DER-encoded OIDs
+struct NamedCurve {
+    const char *name;
+    std::vector<CK_BYTE> oid;
+};
+
+static const NamedCurve NAMED_CURVES[] = {
+    {"P-256", {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07}},
+    {"P-384", {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22}},
+    {"P-521", {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23}}
+};
+
 GlobalData::GlobalData() {
     this->isMultithreaded = false;
+    this->canCreateThreads = true;
 
     this->customCreateMutex = NULL;
     this->customDestroyMutex = NULL;
     this->customLockMutex = NULL;
     this->customUnlockMutex = NULL;
 
+    this->sessionTableMutex = NULL;
     this->randomBufferMutex = NULL;
+    this->randomBufferLockWaitNs = 0;
+
+    this->updateBufferSize = 0;
+    this->batchWorkers = DEFAULT_BATCH_WORKERS;
 
     this->randomCollector = std::shared_ptr<RandomCollector>(nullptr);
-    this->randomBuffer = std::unique_ptr<RandomBuffer>(nullptr);
+    this->randomBuffersReady = false;
+    this->numaReservoirs = false;
 }
 
 CK_RV GlobalData::setThreadSettings(CK_C_INITIALIZE_ARGS_PTR pInitArgs) {
     if(pInitArgs == NULL) {
         this->isMultithreaded = false;
+        this->canCreateThreads = true;
 
         this->customCreateMutex = NULL;
         this->customDestroyMutex = NULL;
@@ -44,6 +92,7 @@ CK_RV GlobalData::setThreadSettings(CK_C_INITIALIZE_ARGS_PTR pInitArgs) {
         if(oneNonNull && !allNonNull) return CKR_ARGUMENTS_BAD;
 
         this->isMultithreaded = osLockingOk || allNonNull;
+        this->canCreateThreads = !(pInitArgs->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS);
 
         this->customCreateMutex = create;
         this->customDestroyMutex = destroy;
@@ -54,31 +103,674 @@ CK_RV GlobalData::setThreadSettings(CK_C_INITIALIZE_ARGS_PTR pInitArgs) {
     return CKR_OK;
 }
 
+CK_RV GlobalData::loadBaseHSMs() {
+    // QRYPT_BASE_HSM_PATH is a colon-separated list, like PATH
+    const char *path_c_str = getenv("QRYPT_BASE_HSM_PATH");
+    std::stringstream paths(path_c_str ? path_c_str : "");
+
+    std::string path;
+    while(std::getline(paths, path, ':')) {
+        if(path.empty()) continue;
+
+        if(this->baseHSMs.size() == MAX_BASE_HSMS) {
+            ERROR_MSG("QRYPT_BASE_HSM_PATH lists more than %zu base HSMs.", MAX_BASE_HSMS);
+            return CKR_QRYPT_BASE_HSM_OPEN_FAILED;
+        }
+
+        std::unique_ptr<BaseHSM> module = std::make_unique<BaseHSM>();
+
+        CK_RV rv = module->initialize(path);
+        if(rv != CKR_OK) return rv;
+
+        this->baseHSMs.push_back(std::move(module));
+    }
+
+    if(this->baseHSMs.empty()) {
+        ERROR_MSG("Environment variable QRYPT_BASE_HSM_PATH empty.");
+        return CKR_QRYPT_BASE_HSM_EMPTY;
+    }
+
+    // QRYPT_LATENCY_STATS=1 times the calls on the base HSMs too
+    const char *latency_c_str = getenv("QRYPT_LATENCY_STATS");
+    if(latency_c_str == NULL || *latency_c_str == '\0' || strcmp(latency_c_str, "0") == 0) return CKR_OK;
+
+    if(strcmp(latency_c_str, "1") != 0) {
+        ERROR_MSG("QRYPT_LATENCY_STATS: \"%s\" is not 0 or 1.", latency_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    for(size_t i = 0; i < this->baseHSMs.size(); i++) this->baseHSMs[i]->timeCalls(i);
+
+    return CKR_OK;
+}
+
 CK_RV GlobalData::initialize(CK_C_INITIALIZE_ARGS_PTR pInitArgs) {
-    CK_RV rv = this->baseHSM.initialize();
+    CK_RV rv = loadBaseHSMs();
     if(rv != CKR_OK) return rv;
 
     rv = setThreadSettings(pInitArgs);
     if(rv != CKR_OK) return rv;
 
-    // Create mutex for access to random buffer
+    // Keep crypto threads from waiting on std::cerr
+    if(this->canCreateThreads) {
+        try {
+            qryptokiStartLogWriter();
+        } catch (std::system_error &ex) {
+            DEBUG_MSG("Logging synchronously, since the log writer could not be started: %s", ex.what());
+        }
+    }
+
+    // Create mutex for access to session table
     CK_VOID_PTR mutex = NULL;
+
+    rv = createMutexIfNecessary(&mutex, "session table");
+    if(rv != CKR_OK) return rv;
+
+    this->sessionTableMutex = mutex;
+
+    // Create mutex for access to random buffer
+    mutex = NULL;
     
-    rv = createMutexIfNecessary(&mutex);
+    rv = createMutexIfNecessary(&mutex, "random buffer");
     if(rv != CKR_OK) return rv;
 
     this->randomBufferMutex = mutex;
 
+    rv = loadNumaReservoirs();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadSessionPool();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadUpdateBufferSize();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadBatchWorkers();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadAsyncQueue();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadKeyPairPool();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadMetricsExporter();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadTracer();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadFindCache();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadAttributeCache();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadMetadataCache();
+    if(rv != CKR_OK) return rv;
+
+    rv = loadPublicKeyCache();
+    if(rv != CKR_OK) return rv;
+
+    return loadReplicaGroups();
+}
+
+CK_RV GlobalData::loadNumaReservoirs() {
+    // QRYPT_NUMA_RESERVOIRS=1 keeps a random buffer on each NUMA node,
+    // used by the threads running there
+    this->numaReservoirs = false;
+
+    const char *numa_c_str = getenv("QRYPT_NUMA_RESERVOIRS");
+    if(numa_c_str == NULL || *numa_c_str == '\0' || strcmp(numa_c_str, "0") == 0) return CKR_OK;
+
+    if(strcmp(numa_c_str, "1") != 0) {
+        ERROR_MSG("QRYPT_NUMA_RESERVOIRS: \"%s\" is not 0 or 1.", numa_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    this->numaReservoirs = true;
+
+    DEBUG_MSG("Keeping a random buffer on each of %zu NUMA nodes.", NumaNodes::count());
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadSessionPool() {
+    // QRYPT_SESSION_POOL_SIZE is the number of idle base sessions
+    // kept per slot and session type; unset or 0 turns pooling off
+    const char *size_c_str = getenv("QRYPT_SESSION_POOL_SIZE");
+    if(size_c_str == NULL || *size_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long maxIdle = strtoul(size_c_str, &end, 10);
+    if(*end != '\0' || *size_c_str == '-') {
+        ERROR_MSG("QRYPT_SESSION_POOL_SIZE: \"%s\" is not a valid size.", size_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(maxIdle == 0) return CKR_OK;
+
+    CK_VOID_PTR mutex = NULL;
+    CK_RV rv = createMutexIfNecessary(&mutex, "session pool");
+    if(rv != CKR_OK) return rv;
+
+    this->sessionPool = std::make_unique<SessionPool>(maxIdle, mutex);
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadFindCache() {
+    // QRYPT_FIND_CACHE_TTL_MS is how long search results may be
+    // reused; unset or 0 turns the cache off
+    const char *ttl_c_str = getenv("QRYPT_FIND_CACHE_TTL_MS");
+    if(ttl_c_str == NULL || *ttl_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long ttlMs = strtoul(ttl_c_str, &end, 10);
+    if(*end != '\0' || *ttl_c_str == '-') {
+        ERROR_MSG("QRYPT_FIND_CACHE_TTL_MS: \"%s\" is not a valid duration.", ttl_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(ttlMs == 0) return CKR_OK;
+
+    CK_VOID_PTR mutex = NULL;
+    CK_RV rv = createMutexIfNecessary(&mutex, "find cache");
+    if(rv != CKR_OK) return rv;
+
+    this->findCache = std::make_unique<FindCache>(std::chrono::milliseconds(ttlMs), mutex);
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadUpdateBufferSize() {
+    // QRYPT_UPDATE_BUFFER_SIZE is how many bytes of C_DigestUpdate,
+    // C_SignUpdate and C_VerifyUpdate data are gathered per session
+    // before being passed on; unset or 0 passes every call straight on
+    const char *size_c_str = getenv("QRYPT_UPDATE_BUFFER_SIZE");
+    if(size_c_str == NULL || *size_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long size = strtoul(size_c_str, &end, 10);
+    if(*end != '\0' || *size_c_str == '-' || size > MAX_UPDATE_BUFFER_SIZE) {
+        ERROR_MSG("QRYPT_UPDATE_BUFFER_SIZE: \"%s\" is not a valid size (at most %lu).", size_c_str, MAX_UPDATE_BUFFER_SIZE);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    this->updateBufferSize = size;
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadBatchWorkers() {
+    // QRYPT_BATCH_WORKERS is how many base sessions a batch is spread
+    // over; unset or 0 means the default
+    this->batchWorkers = DEFAULT_BATCH_WORKERS;
+
+    const char *workers_c_str = getenv("QRYPT_BATCH_WORKERS");
+    if(workers_c_str == NULL || *workers_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long workers = strtoul(workers_c_str, &end, 10);
+    if(*end != '\0' || *workers_c_str == '-' || workers > MAX_BATCH_WORKERS) {
+        ERROR_MSG("QRYPT_BATCH_WORKERS: \"%s\" is not a valid number of sessions (at most %lu).", workers_c_str, MAX_BATCH_WORKERS);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(workers != 0) this->batchWorkers = workers;
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadAsyncQueue() {
+    // QRYPT_ASYNC_WORKERS is how many threads run C_QryptSubmit
+    // operations; unset or 0 turns the async API off
+    const char *workers_c_str = getenv("QRYPT_ASYNC_WORKERS");
+    if(workers_c_str == NULL || *workers_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long workers = strtoul(workers_c_str, &end, 10);
+    if(*end != '\0' || *workers_c_str == '-' || workers > MAX_BATCH_WORKERS) {
+        ERROR_MSG("QRYPT_ASYNC_WORKERS: \"%s\" is not a valid number of threads (at most %lu).", workers_c_str, MAX_BATCH_WORKERS);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(workers == 0) return CKR_OK;
+
+    if(!this->canCreateThreads) {
+        INFO_MSG("Running async operations in C_QryptSubmit, since the application forbids creating threads.");
+        workers = 0;
+    }
+
+    try {
+        this->asyncQueue = std::make_unique<AsyncQueue>(workers);
+    } catch (std::system_error &ex) {
+        ERROR_MSG("Could not set up the async queue: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::startAsyncQueue() {
+    if(!this->asyncQueue) return CKR_OK;
+
+    try {
+        this->asyncQueue->start();
+    } catch (std::system_error &ex) {
+        ERROR_MSG("Could not start the async workers: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadMetricsExporter() {
+    // QRYPT_METRICS_LISTEN is a Unix socket path or a localhost port
+    // to serve metrics on; unset turns the exporter off
+    const char *listen_c_str = getenv("QRYPT_METRICS_LISTEN");
+    if(listen_c_str == NULL || *listen_c_str == '\0') return CKR_OK;
+
+    if(!this->canCreateThreads) {
+        INFO_MSG("Not exporting metrics, since the application forbids creating threads.");
+        return CKR_OK;
+    }
+
+    try {
+        this->metricsExporter = std::make_unique<MetricsExporter>(listen_c_str);
+    } catch (std::system_error &ex) {
+        if(ex.code().value() == EINVAL) {
+            ERROR_MSG("QRYPT_METRICS_LISTEN: \"%s\" is not a socket path or port.", listen_c_str);
+            return CKR_QRYPT_CONFIG_INVALID;
+        }
+
+        ERROR_MSG("Could not listen for metrics scrapes: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadTracer() {
+    // QRYPT_TRACE_FILE turns the tracer on; QRYPT_TRACE_SIGNAL is a
+    // signal number that dumps the trace without finalizing
+    if(!Tracer::installSignalHandler()) return CKR_QRYPT_CONFIG_INVALID;
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::startMetricsExporter() {
+    if(!this->metricsExporter) return CKR_OK;
+
+    try {
+        this->metricsExporter->start();
+    } catch (std::system_error &ex) {
+        ERROR_MSG("Could not start the metrics exporter: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+// Parses one QRYPT_KEYPAIR_POOL entry: key type, size and depth
+static bool parseKeyPairPoolSpec(const std::string &entry, KeyPairPoolSpec &spec) {
+    std::stringstream fields(entry);
+    std::string keyType, size, depth;
+
+    if(!std::getline(fields, keyType, ':') || !std::getline(fields, size, ':') || !std::getline(fields, depth, ':')) return false;
+    if(!fields.eof()) return false;
+
+    char *end = NULL;
+    spec.depth = strtoul(depth.c_str(), &end, 10);
+    if(depth.empty() || *end != '\0' || depth[0] == '-' || spec.depth == 0 || spec.depth > MAX_KEYPAIR_POOL_DEPTH) return false;
+
+    if(keyType == "rsa") {
+        spec.keyType = CKK_RSA;
+        spec.modulusBits = strtoul(size.c_str(), &end, 10);
+        return !size.empty() && *end == '\0' && size[0] != '-' && spec.modulusBits != 0;
+    }
+
+    if(keyType == "ec") {
+        spec.keyType = CKK_EC;
+        spec.modulusBits = 0;
+
+        for(const NamedCurve &curve : NAMED_CURVES) {
+            if(size == curve.name) {
+                spec.ecParams = curve.oid;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+CK_RV GlobalData::loadKeyPairPool() {
+    // QRYPT_KEYPAIR_POOL holds semicolon-separated entries such as
+    // "rsa:3072:4" or "ec:P-256:8": key type, modulus bits or curve,
+    // and how many pairs to keep ready; unset turns the pool off
+    const char *pool_c_str = getenv("QRYPT_KEYPAIR_POOL");
+    if(pool_c_str == NULL || *pool_c_str == '\0') return CKR_OK;
+
+    std::vector<KeyPairPoolSpec> specs;
+    std::stringstream entries(pool_c_str);
+
+    std::string entry;
+    while(std::getline(entries, entry, ';')) {
+        if(entry.empty()) continue;
+
+        KeyPairPoolSpec spec;
+        if(!parseKeyPairPoolSpec(entry, spec)) {
+            ERROR_MSG("QRYPT_KEYPAIR_POOL: \"%s\" is not a valid entry (such as rsa:3072:4 or ec:P-256:8, keeping at most %lu pairs).", entry.c_str(), MAX_KEYPAIR_POOL_DEPTH);
+            return CKR_QRYPT_CONFIG_INVALID;
+        }
+
+        specs.push_back(spec);
+    }
+
+    if(specs.empty()) return CKR_OK;
+
+    if(!this->canCreateThreads) {
+        INFO_MSG("Not pooling key pairs, since the application forbids creating threads.");
+        return CKR_OK;
+    }
+
+    this->keyPairPool = std::make_unique<KeyPairPool>(specs);
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::startKeyPairPool() {
+    if(!this->keyPairPool) return CKR_OK;
+
+    try {
+        this->keyPairPool->start();
+    } catch (std::system_error &ex) {
+        ERROR_MSG("Could not start generating pooled key pairs: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadAttributeCache() {
+    // QRYPT_ATTRIBUTE_CACHE_TTL_MS is how long immutable attribute
+    // values may be reused; unset or 0 turns the cache off
+    const char *ttl_c_str = getenv("QRYPT_ATTRIBUTE_CACHE_TTL_MS");
+    if(ttl_c_str == NULL || *ttl_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long ttlMs = strtoul(ttl_c_str, &end, 10);
+    if(*end != '\0' || *ttl_c_str == '-') {
+        ERROR_MSG("QRYPT_ATTRIBUTE_CACHE_TTL_MS: \"%s\" is not a valid duration.", ttl_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(ttlMs == 0) return CKR_OK;
+
+    CK_VOID_PTR mutex = NULL;
+    CK_RV rv = createMutexIfNecessary(&mutex, "attribute cache");
+    if(rv != CKR_OK) return rv;
+
+    this->attributeCache = std::make_unique<AttributeCache>(std::chrono::milliseconds(ttlMs), mutex);
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadPublicKeyCache() {
+    // QRYPT_SOFTWARE_OFFLOAD_TTL_MS is how long public keys read for
+    // software verification may be reused; unset or 0 turns software
+    // offload off
+    const char *ttl_c_str = getenv("QRYPT_SOFTWARE_OFFLOAD_TTL_MS");
+    if(ttl_c_str == NULL || *ttl_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long ttlMs = strtoul(ttl_c_str, &end, 10);
+    if(*end != '\0' || *ttl_c_str == '-') {
+        ERROR_MSG("QRYPT_SOFTWARE_OFFLOAD_TTL_MS: \"%s\" is not a valid duration.", ttl_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(ttlMs == 0) return CKR_OK;
+
+    CK_VOID_PTR mutex = NULL;
+    CK_RV rv = createMutexIfNecessary(&mutex, "public key cache");
+    if(rv != CKR_OK) return rv;
+
+    this->publicKeyCache = std::make_unique<PublicKeyCache>(std::chrono::milliseconds(ttlMs), mutex);
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::loadMetadataCache() {
+    // QRYPT_METADATA_CACHE_TTL_MS is how long slot, token and mechanism
+    // information may be reused; unset or 0 turns the cache off
+    const char *ttl_c_str = getenv("QRYPT_METADATA_CACHE_TTL_MS");
+    if(ttl_c_str == NULL || *ttl_c_str == '\0') return CKR_OK;
+
+    char *end = NULL;
+    unsigned long ttlMs = strtoul(ttl_c_str, &end, 10);
+    if(*end != '\0' || *ttl_c_str == '-') {
+        ERROR_MSG("QRYPT_METADATA_CACHE_TTL_MS: \"%s\" is not a valid duration.", ttl_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(ttlMs == 0) return CKR_OK;
+
+    CK_VOID_PTR mutex = NULL;
+    CK_RV rv = createMutexIfNecessary(&mutex, "metadata cache");
+    if(rv != CKR_OK) return rv;
+
+    this->metadataCache = std::make_unique<MetadataCache>(std::chrono::milliseconds(ttlMs), mutex);
+
+    // QRYPT_SLOT_EVENT_WATCHER=1 drops a slot's entries as soon as
+    // the base HSM reports an event on it
+    const char *watcher_c_str = getenv("QRYPT_SLOT_EVENT_WATCHER");
+    if(watcher_c_str == NULL || *watcher_c_str == '\0' || strcmp(watcher_c_str, "0") == 0) return CKR_OK;
+
+    if(strcmp(watcher_c_str, "1") != 0) {
+        ERROR_MSG("QRYPT_SLOT_EVENT_WATCHER: \"%s\" is not 0 or 1.", watcher_c_str);
+        return CKR_QRYPT_CONFIG_INVALID;
+    }
+
+    if(!this->canCreateThreads) {
+        INFO_MSG("Not watching for slot events, since the application forbids creating threads.");
+        return CKR_OK;
+    }
+
+    this->slotEventWatcher = std::make_unique<SlotEventWatcher>(this->metadataCache.get());
+
+    return CKR_OK;
+}
+
+CK_RV GlobalData::startSlotEventWatcher() {
+    if(!this->slotEventWatcher) return CKR_OK;
+
+    try {
+        this->slotEventWatcher->start();
+    } catch (std::system_error &ex) {
+        ERROR_MSG("Could not start watching for slot events: %s", ex.what());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+// Whether the base HSM has the slot, asked via C_GetSlotInfo
+static bool slotExists(BaseHSM *module, CK_SLOT_ID baseSlotID) {
+    CK_C_GetSlotInfo Base_C_GetSlotInfo = (CK_C_GetSlotInfo)module->getFunction("C_GetSlotInfo");
+    if(Base_C_GetSlotInfo == NULL) return false;
+
+    CK_SLOT_INFO info;
+    return (*Base_C_GetSlotInfo)(baseSlotID, &info) == CKR_OK;
+}
+
+CK_RV GlobalData::loadReplicaGroups() {
+    // QRYPT_REPLICA_SLOTS holds semicolon-separated groups of
+    // comma-separated slot IDs; the first slot of a group stands in
+    // for the whole group, and the others are hidden from C_GetSlotList
+    const char *groups_c_str = getenv("QRYPT_REPLICA_SLOTS");
+    std::stringstream groups(groups_c_str ? groups_c_str : "");
+
+    std::string group;
+    while(std::getline(groups, group, ';')) {
+        if(group.empty()) continue;
+
+        CK_VOID_PTR mutex = NULL;
+        CK_RV rv = createMutexIfNecessary(&mutex, "replica key map");
+        if(rv != CKR_OK) return rv;
+
+        this->replicaGroups.push_back(std::make_unique<ReplicaGroup>(mutex));
+        ReplicaGroup *replicaGroup = this->replicaGroups.back().get();
+
+        std::stringstream members(group);
+        std::string member;
+        size_t memberCount = 0;
+
+        while(std::getline(members, member, ',')) {
+            char *end = NULL;
+            CK_SLOT_ID slotID = strtoul(member.c_str(), &end, 0);
+
+            BaseHSM *module;
+            CK_SLOT_ID baseSlotID;
+
+            if(member.empty() || *end != '\0' || getSlot(slotID, module, baseSlotID) != CKR_OK || !slotExists(module, baseSlotID)) {
+                ERROR_MSG("QRYPT_REPLICA_SLOTS: \"%s\" is not a valid slot ID.", member.c_str());
+                return CKR_QRYPT_CONFIG_INVALID;
+            }
+
+            if(isReplicaSlot(slotID)) {
+                ERROR_MSG("QRYPT_REPLICA_SLOTS: slot %lu is listed twice.", slotID);
+                return CKR_QRYPT_CONFIG_INVALID;
+            }
+
+            replicaGroup->addReplica(module, slotID, baseSlotID);
+            memberCount++;
+        }
+
+        if(memberCount < 2) {
+            ERROR_MSG("QRYPT_REPLICA_SLOTS: group \"%s\" needs at least two slots.", group.c_str());
+            return CKR_QRYPT_CONFIG_INVALID;
+        }
+    }
+
     return CKR_OK;
 }
 
 CK_RV GlobalData::finalize() {
+    CK_RV rv = releaseState();
+
+    qryptokiStopLogWriter();
+
+    return rv;
+}
+
+CK_RV GlobalData::releaseState() {
+    // Only reads counters, so it can go first
+    metricsExporter.reset();
+
+    // The workers use the mutexes below. C_Finalize has normally
+    // stopped them already, before finalizing the base HSMs.
+    if(asyncQueue) {
+        asyncQueue->stop();
+        asyncQueue->logStatistics();
+    }
+    asyncQueue.reset();
+
+    // C_Finalize has destroyed the pooled pairs already
+    if(keyPairPool) {
+        keyPairPool->stop();
+        keyPairPool->logStatistics();
+    }
+    keyPairPool.reset();
+
     if(randomBufferMutex != NULL) {
         CK_RV rv = destroyMutexIfNecessary(randomBufferMutex);
         if(rv != CKR_OK) return rv;
     }
 
-    baseHSM.finalize();
+    if(sessionTableMutex != NULL) {
+        CK_RV rv = destroyMutexIfNecessary(sessionTableMutex);
+        if(rv != CKR_OK) return rv;
+    }
+
+    sessionTable.clear();
+
+    // The base HSMs' C_Finalize already closed the idle sessions
+    if(sessionPool) {
+        sessionPool->logStatistics();
+
+        if(sessionPool->getMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(sessionPool->getMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    sessionPool.reset();
+
+    updateBufferSize = 0;
+
+    if(findCache) {
+        findCache->logStatistics();
+
+        if(findCache->getMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(findCache->getMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    findCache.reset();
+
+    if(attributeCache) {
+        attributeCache->logStatistics();
+
+        if(attributeCache->getMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(attributeCache->getMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    attributeCache.reset();
+
+    // The base HSMs' C_Finalize has already woken the watcher threads
+    if(slotEventWatcher) slotEventWatcher->join();
+    slotEventWatcher.reset();
+
+    if(metadataCache) {
+        metadataCache->logStatistics();
+
+        if(metadataCache->getMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(metadataCache->getMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    metadataCache.reset();
+
+    if(publicKeyCache) {
+        publicKeyCache->logStatistics();
+
+        if(publicKeyCache->getMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(publicKeyCache->getMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    publicKeyCache.reset();
+
+    for(auto &replicaGroup : replicaGroups) {
+        replicaGroup->logStatistics();
+
+        if(replicaGroup->getKeyMapMutex() != NULL) {
+            CK_RV rv = destroyMutexIfNecessary(replicaGroup->getKeyMapMutex());
+            if(rv != CKR_OK) return rv;
+        }
+    }
+    replicaGroups.clear();
+
+    // Kept across C_Initialize calls, like the timed function lists
+    LatencyStats::logStatistics();
+    LockStats::logStatistics();
+    Tracer::dump();
+
+    for(auto &module : baseHSMs)
+        module->finalize();
+    baseHSMs.clear();
 
     isMultithreaded = false;
 
@@ -87,23 +779,237 @@ CK_RV GlobalData::finalize() {
     customLockMutex = NULL;
     customUnlockMutex = NULL;
 
+    sessionTableMutex = NULL;
     randomBufferMutex = NULL;
 
-    randomBuffer.reset();
+    // Counts what was left in the buffer as wasted
+    randomBuffersReady = false;
+    randomBuffers.clear();
+    singleThreadRandomBuffer.reset();
     randomCollector.reset();
 
+    EntropyStats::getInstance().logStatistics();
+
     return CKR_OK;
 }
 
 bool GlobalData::isCryptokiInitialized() {
-    return this->baseHSM.isInitialized();
+    return !this->baseHSMs.empty();
 }
 
 void *GlobalData::getBaseFunction(std::string fn_name) {
-    return this->baseHSM.getFunction(fn_name);
+    return this->baseHSMs[0]->getFunction(fn_name);
+}
+
+size_t GlobalData::getModuleCount() {
+    return this->baseHSMs.size();
+}
+
+BaseHSM *GlobalData::getModule(size_t moduleIndex) {
+    if(moduleIndex >= this->baseHSMs.size()) return NULL;
+
+    return this->baseHSMs[moduleIndex].get();
+}
+
+bool GlobalData::canMapSlot(CK_SLOT_ID baseSlotID) {
+    // With a single base HSM, slot IDs pass through untouched
+    if(this->baseHSMs.size() == 1) return true;
+
+    return (baseSlotID & ~SLOT_BASE_MASK) == 0;
+}
+
+CK_SLOT_ID GlobalData::toSlotID(size_t moduleIndex, CK_SLOT_ID baseSlotID) {
+    if(this->baseHSMs.size() == 1) return baseSlotID;
+
+    return ((CK_SLOT_ID)moduleIndex << SLOT_MODULE_SHIFT) | baseSlotID;
+}
+
+CK_RV GlobalData::getSlot(CK_SLOT_ID slotID, BaseHSM *&module, CK_SLOT_ID &baseSlotID) {
+    if(this->baseHSMs.size() == 1) {
+        module = this->baseHSMs[0].get();
+        baseSlotID = slotID;
+        return CKR_OK;
+    }
+
+    module = getModule(slotID >> SLOT_MODULE_SHIFT);
+    if(module == NULL) return CKR_SLOT_ID_INVALID;
+
+    baseSlotID = slotID & SLOT_BASE_MASK;
+    return CKR_OK;
+}
+
+CK_RV GlobalData::getSlotList(CK_BBOOL tokenPresent, std::vector<CK_SLOT_ID> &slotList) {
+    slotList.clear();
+
+    for(size_t i = 0; i < this->baseHSMs.size(); i++) {
+        CK_C_GetSlotList Base_C_GetSlotList = (CK_C_GetSlotList)this->baseHSMs[i]->getFunction("C_GetSlotList");
+        if(Base_C_GetSlotList == NULL) return CKR_GENERAL_ERROR;
+
+        // Slots can appear between the two calls, so retry until the list fits
+        std::vector<CK_SLOT_ID> baseSlotList;
+        CK_RV rv;
+        do {
+            CK_ULONG count = 0;
+            rv = (*Base_C_GetSlotList)(tokenPresent, NULL_PTR, &count);
+            if(rv != CKR_OK) return rv;
+
+            baseSlotList.resize(count);
+            if(count == 0) break;
+
+            rv = (*Base_C_GetSlotList)(tokenPresent, baseSlotList.data(), &count);
+            if(rv == CKR_OK) baseSlotList.resize(count);
+        } while(rv == CKR_BUFFER_TOO_SMALL);
+
+        if(rv != CKR_OK) return rv;
+
+        for(CK_SLOT_ID baseSlotID : baseSlotList) {
+            if(!canMapSlot(baseSlotID)) {
+                WARNING_MSG("Hiding slot %lu of base HSM %zu, its ID is too large to remap.", baseSlotID, i);
+                continue;
+            }
+
+            CK_SLOT_ID slotID = toSlotID(i, baseSlotID);
+
+            // Replicas are reached through their group's first slot
+            if(isReplicaSlot(slotID) && getReplicaGroup(slotID) == NULL) continue;
+
+            slotList.push_back(slotID);
+        }
+    }
+
+    return CKR_OK;
+}
+
+bool GlobalData::hasReplicaGroups() {
+    return !this->replicaGroups.empty();
 }
 
-CK_RV GlobalData::createMutexIfNecessary(CK_VOID_PTR_PTR ppMutex) {
+ReplicaGroup *GlobalData::getReplicaGroup(CK_SLOT_ID slotID) {
+    for(auto &replicaGroup : this->replicaGroups) {
+        if(replicaGroup->getSlotID() == slotID) return replicaGroup.get();
+    }
+
+    return NULL;
+}
+
+bool GlobalData::isReplicaSlot(CK_SLOT_ID slotID) {
+    for(auto &replicaGroup : this->replicaGroups) {
+        if(replicaGroup->hasMember(slotID)) return true;
+    }
+
+    return false;
+}
+
+SessionPool *GlobalData::getSessionPool() {
+    return this->sessionPool.get();
+}
+
+FindCache *GlobalData::getFindCache() {
+    return this->findCache.get();
+}
+
+AttributeCache *GlobalData::getAttributeCache() {
+    return this->attributeCache.get();
+}
+
+PublicKeyCache *GlobalData::getPublicKeyCache() {
+    return this->publicKeyCache.get();
+}
+
+size_t GlobalData::getBatchWorkers() {
+    // Without threads of our own, the batch runs on the calling thread
+    return this->canCreateThreads ? this->batchWorkers : 1;
+}
+
+KeyPairPool *GlobalData::getKeyPairPool() {
+    return this->keyPairPool.get();
+}
+
+AsyncQueue *GlobalData::getAsyncQueue() {
+    return this->asyncQueue.get();
+}
+
+size_t GlobalData::getUpdateBufferSize() {
+    return this->updateBufferSize;
+}
+
+MetadataCache *GlobalData::getMetadataCache() {
+    return this->metadataCache.get();
+}
+
+SlotEventWatcher *GlobalData::getSlotEventWatcher() {
+    return this->slotEventWatcher.get();
+}
+
+bool GlobalData::hasSlotSessions(CK_SLOT_ID slotID) {
+    // If the lock fails, guess that sessions remain
+    if(lockMutexIfNecessary(this->sessionTableMutex) != CKR_OK) return true;
+
+    bool found = this->sessionTable.hasSlot(slotID);
+
+    unlockMutexIfNecessary(this->sessionTableMutex);
+    return found;
+}
+
+CK_RV GlobalData::countSlotSessions(CK_SLOT_ID slotID, CK_ULONG &sessionCount, CK_ULONG &rwSessionCount) {
+    CK_RV rv = lockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    this->sessionTable.countSlot(slotID, sessionCount, rwSessionCount);
+
+    return unlockMutexIfNecessary(this->sessionTableMutex);
+}
+
+CK_RV GlobalData::addSession(std::shared_ptr<Session> session) {
+    CK_RV rv = lockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    try {
+        this->sessionTable.add(session);
+    } catch (...) {
+        unlockMutexIfNecessary(this->sessionTableMutex);
+        throw;
+    }
+
+    return unlockMutexIfNecessary(this->sessionTableMutex);
+}
+
+CK_RV GlobalData::getSession(CK_SESSION_HANDLE hSession, std::shared_ptr<Session> &session) {
+    CK_RV rv = lockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    session = this->sessionTable.get(hSession);
+
+    rv = unlockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    return session == NULL ? CKR_SESSION_HANDLE_INVALID : CKR_OK;
+}
+
+CK_RV GlobalData::removeSession(CK_SESSION_HANDLE hSession) {
+    CK_RV rv = lockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    this->sessionTable.remove(hSession);
+
+    return unlockMutexIfNecessary(this->sessionTableMutex);
+}
+
+CK_RV GlobalData::removeSlotSessions(CK_SLOT_ID slotID) {
+    CK_RV rv = lockMutexIfNecessary(this->sessionTableMutex);
+    if(rv != CKR_OK) return rv;
+
+    try {
+        this->sessionTable.removeSlot(slotID);
+    } catch (...) {
+        unlockMutexIfNecessary(this->sessionTableMutex);
+        throw;
+    }
+
+    return unlockMutexIfNecessary(this->sessionTableMutex);
+}
+
+CK_RV GlobalData::createMutexIfNecessary(CK_VOID_PTR_PTR ppMutex, const char *name) {
     if(ppMutex == NULL) return CKR_ARGUMENTS_BAD;
 
     if(!this->isMultithreaded) {
@@ -111,15 +1017,21 @@ CK_RV GlobalData::createMutexIfNecessary(CK_VOID_PTR_PTR ppMutex) {
         return CKR_OK;
     }
 
+    CK_RV rv;
     if(this->customCreateMutex == NULL)
-        return OSCreateMutex(ppMutex);
+        rv = OSCreateMutex(ppMutex);
     else
-        return (this->customCreateMutex)(ppMutex);
+        rv = (this->customCreateMutex)(ppMutex);
+
+    if(rv == CKR_OK) LockStats::registerMutex(*ppMutex, name);
+    return rv;
 }
 
 CK_RV GlobalData::destroyMutexIfNecessary(CK_VOID_PTR pMutex) {
     if(!this->isMultithreaded) return CKR_OK;
 
+    LockStats::unregisterMutex(pMutex);
+
     if(this->customDestroyMutex == NULL)
         return OSDestroyMutex(pMutex);
     else
@@ -127,17 +1039,40 @@ CK_RV GlobalData::destroyMutexIfNecessary(CK_VOID_PTR pMutex) {
 }
 
 CK_RV GlobalData::lockMutexIfNecessary(CK_VOID_PTR pMutex) {
+    return lockMutex(pMutex, QRYPT_CALL_SITE());
+}
+
+CK_RV GlobalData::lockMutex(CK_VOID_PTR pMutex, void *site) {
     if(!this->isMultithreaded) return CKR_OK;
 
+    QRYPT_PROBE(mutex__wait, pMutex);
+
+    std::chrono::steady_clock::time_point start;
+    if(LockStats::isEnabled()) start = std::chrono::steady_clock::now();
+
+    CK_RV rv;
     if(this->customLockMutex == NULL)
-        return OSLockMutex(pMutex);
+        rv = OSLockMutex(pMutex);
     else
-        return (this->customLockMutex)(pMutex);
+        rv = (this->customLockMutex)(pMutex);
+
+    if(rv != CKR_OK) return rv;
+
+    QRYPT_PROBE(mutex__acquired, pMutex);
+
+    if(LockStats::isEnabled())
+        LockStats::acquired(pMutex, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), site);
+
+    return CKR_OK;
 }
 
 CK_RV GlobalData::unlockMutexIfNecessary(CK_VOID_PTR pMutex) {
     if(!this->isMultithreaded) return CKR_OK;
 
+    QRYPT_PROBE(mutex__release, pMutex);
+
+    if(LockStats::isEnabled()) LockStats::released(pMutex);
+
     if(this->customUnlockMutex == NULL)
         return OSUnlockMutex(pMutex);
     else
@@ -145,15 +1080,29 @@ CK_RV GlobalData::unlockMutexIfNecessary(CK_VOID_PTR pMutex) {
 }
 
 CK_RV GlobalData::lockRandomBufferMutex() {
-    return lockMutexIfNecessary(this->randomBufferMutex);
+    TraceSpan span("random buffer lock", "lock");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    CK_RV rv = lockMutex(this->randomBufferMutex, QRYPT_CALL_SITE());
+    if(rv != CKR_OK) return rv;
+
+    this->randomBufferLockWaitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return CKR_OK;
 }
 
 CK_RV GlobalData::unlockRandomBufferMutex() {
     return unlockMutexIfNecessary(this->randomBufferMutex);
 }
 
+bool GlobalData::randomFromOneThread() {
+    return !this->isMultithreaded &&
+           (this->asyncQueue == NULL || !this->canCreateThreads) &&
+           this->keyPairPool == NULL &&
+           this->getBatchWorkers() == 1;
+}
+
 CK_RV GlobalData::setupRandomBuffer() {
-    if(this->randomBuffer != NULL) return CKR_GENERAL_ERROR;
+    if(this->randomBuffersReady) return CKR_GENERAL_ERROR;
 
 	const char *token_c_str = std::getenv("QRYPT_EAAS_TOKEN");
 
@@ -165,22 +1114,81 @@ CK_RV GlobalData::setupRandomBuffer() {
     this->randomCollector = std::make_unique<CurlWrapper>(token);
 
     try {
-        this->randomBuffer = std::make_unique<RandomBuffer>(this->randomCollector);
+        if(this->randomFromOneThread()) {
+            this->singleThreadRandomBuffer = std::make_unique<SingleThreadRandomBuffer>(this->randomCollector);
+        } else if(this->numaReservoirs) {
+            for(size_t node = 0; node < NumaNodes::count(); node++)
+                this->randomBuffers.push_back(std::make_unique<RandomBuffer>(this->randomCollector, node));
+        } else {
+            this->randomBuffers.push_back(std::make_unique<RandomBuffer>(this->randomCollector));
+        }
     } catch (std::runtime_error &ex) {
         // Failed to valloc or mlock buffer
         ERROR_MSG("%s", ex.what());
+        this->randomBuffers.clear();
         return CKR_GENERAL_ERROR;
     }
 
+    this->randomBuffersReady.store(true, std::memory_order_release);
+
     return CKR_OK;
 }
 
+size_t GlobalData::localRandomBuffer() {
+    if(this->randomBuffers.size() == 1) return 0;
+
+    size_t node = NumaNodes::current();
+    return node < this->randomBuffers.size() ? node : 0;
+}
+
+bool GlobalData::stealReservedRandom(size_t local, CK_BYTE_PTR data, CK_ULONG len) {
+    for(size_t i = 1; i < this->randomBuffers.size(); i++) {
+        size_t node = (local + i) % this->randomBuffers.size();
+        if(this->randomBuffers[node]->takeReserved(data, len)) return true;
+    }
+
+    return false;
+}
+
 CK_RV GlobalData::getRandom(CK_BYTE_PTR data, CK_ULONG len) {
-    if(this->randomBuffer == NULL) {
-        CK_RV rv = setupRandomBuffer();
-        
-        if(rv != CKR_OK) return rv;
+    CK_RV rv = CKR_OK;
+
+    if(!this->randomBuffersReady) rv = setupRandomBuffer();
+
+    if(rv == CKR_OK && this->singleThreadRandomBuffer != NULL) {
+        rv = this->singleThreadRandomBuffer->getRandom(data, len);
+    } else if(rv == CKR_OK) {
+        size_t local = this->localRandomBuffer();
+
+        // Bytes another node has spare are cheaper than an EaaS fetch
+        bool reserved = this->randomBuffers.size() > 1 &&
+                        (this->randomBuffers[local]->takeReserved(data, len) || this->stealReservedRandom(local, data, len));
+
+        if(!reserved) rv = this->randomBuffers[local]->getRandom(data, len);
+    }
+
+    // The caller holds the random buffer mutex
+    EntropyStats::getInstance().recordRequest(len, this->randomBufferLockWaitNs, rv);
+    this->randomBufferLockWaitNs = 0;
+
+    return rv;
+}
+
+bool GlobalData::takeReservedRandom(CK_BYTE_PTR data, CK_ULONG len) {
+    // Application mutexes may do more than exclude, so keep to them
+    if(this->customLockMutex != NULL) return false;
+
+    if(!this->randomBuffersReady.load(std::memory_order_acquire)) return false;
+
+    if(this->singleThreadRandomBuffer != NULL) {
+        if(!this->singleThreadRandomBuffer->takeReserved(data, len)) return false;
+    } else {
+        size_t local = this->localRandomBuffer();
+
+        if(!this->randomBuffers[local]->takeReserved(data, len) && !this->stealReservedRandom(local, data, len))
+            return false;
     }
 
-    return this->randomBuffer->getRandom(data, len);
+    EntropyStats::getInstance().recordRequest(len, 0, CKR_OK);
+    return true;
 }
@@ -8,13 +8,27 @@
 #ifndef _QRYPT_WRAPPER_GLOBALDATA_H
 #define _QRYPT_WRAPPER_GLOBALDATA_H
 
+#include <atomic>             // std::atomic
 #include <memory>             // std::shared_ptr
+#include <vector>             // std::vector
 
 #include "cryptoki.h"         // PKCS#11 types
 
+#include "AsyncQueue.h"       // AsyncQueue
+#include "AttributeCache.h"   // AttributeCache
 #include "BaseHSM.h"          // BaseHSM
+#include "FindCache.h"        // FindCache
+#include "KeyPairPool.h"      // KeyPairPool
+#include "MetadataCache.h"    // MetadataCache
+#include "MetricsExporter.h"  // MetricsExporter
+#include "PublicKeyCache.h"   // PublicKeyCache
 #include "RandomCollector.h"  // RandomCollector
 #include "RandomBuffer.h"     // RandomBuffer
+#include "ReplicaGroup.h"     // ReplicaGroup
+#include "Session.h"          // Session
+#include "SessionPool.h"      // SessionPool
+#include "SessionTable.h"     // SessionTable
+#include "SlotEventWatcher.h" // SlotEventWatcher
 
 class GlobalData {
     public:
@@ -32,18 +46,113 @@ class GlobalData {
         bool isCryptokiInitialized();
         void *getBaseFunction(std::string fn_name);
 
+        // Base HSMs, in the order given by QRYPT_BASE_HSM_PATH
+        size_t getModuleCount();
+        BaseHSM *getModule(size_t moduleIndex);
+
+        // Slot IDs seen by applications encode the owning base HSM
+        bool canMapSlot(CK_SLOT_ID baseSlotID);
+        CK_SLOT_ID toSlotID(size_t moduleIndex, CK_SLOT_ID baseSlotID);
+        CK_RV getSlot(CK_SLOT_ID slotID, BaseHSM *&module, CK_SLOT_ID &baseSlotID);
+        CK_RV getSlotList(CK_BBOOL tokenPresent, std::vector<CK_SLOT_ID> &slotList);
+
+        // Slots configured by QRYPT_REPLICA_SLOTS
+        bool hasReplicaGroups();
+        ReplicaGroup *getReplicaGroup(CK_SLOT_ID slotID);
+
+        // NULL unless QRYPT_SESSION_POOL_SIZE is set
+        SessionPool *getSessionPool();
+
+        // NULL unless QRYPT_FIND_CACHE_TTL_MS is set
+        FindCache *getFindCache();
+
+        // NULL unless QRYPT_ATTRIBUTE_CACHE_TTL_MS is set
+        AttributeCache *getAttributeCache();
+
+        // NULL unless QRYPT_METADATA_CACHE_TTL_MS is set
+        MetadataCache *getMetadataCache();
+
+        // NULL unless QRYPT_SOFTWARE_OFFLOAD_TTL_MS is set, in which
+        // case digests and public-key verification are done in software
+        PublicKeyCache *getPublicKeyCache();
+
+        // NULL unless QRYPT_SLOT_EVENT_WATCHER is also set. The
+        // watcher threads are started once the base HSMs are
+        // initialized and joined by finalize().
+        SlotEventWatcher *getSlotEventWatcher();
+        CK_RV startSlotEventWatcher();
+
+        // Capacity of each session's update buffers, 0 unless
+        // QRYPT_UPDATE_BUFFER_SIZE is set
+        size_t getUpdateBufferSize();
+
+        // Base sessions each C_QryptProcessBatch call may use at once,
+        // from QRYPT_BATCH_WORKERS
+        size_t getBatchWorkers();
+
+        // NULL unless QRYPT_ASYNC_WORKERS is set. The workers are
+        // started once the base HSMs are initialized, and must be
+        // stopped before they are finalized.
+        AsyncQueue *getAsyncQueue();
+        CK_RV startAsyncQueue();
+
+        // NULL unless QRYPT_KEYPAIR_POOL is set. Its thread is started
+        // once the base HSMs are initialized, and it must be stopped and
+        // drained before they are finalized.
+        KeyPairPool *getKeyPairPool();
+        CK_RV startKeyPairPool();
+
+        // Unless QRYPT_METRICS_LISTEN is set, does nothing. Its thread
+        // is started once the base HSMs are initialized and stopped by
+        // finalize().
+        CK_RV startMetricsExporter();
+
+        // Whether the application has any session open on the slot;
+        // once it has none, the token is logged out as far as it knows
+        bool hasSlotSessions(CK_SLOT_ID slotID);
+
+        // Sessions the application has open on the slot
+        CK_RV countSlotSessions(CK_SLOT_ID slotID, CK_ULONG &sessionCount, CK_ULONG &rwSessionCount);
+
+        CK_RV addSession(std::shared_ptr<Session> session);
+        CK_RV getSession(CK_SESSION_HANDLE hSession, std::shared_ptr<Session> &session);
+        CK_RV removeSession(CK_SESSION_HANDLE hSession);
+        CK_RV removeSlotSessions(CK_SLOT_ID slotID);
+
         CK_RV lockRandomBufferMutex();
         CK_RV unlockRandomBufferMutex();
 
+        // The name groups the mutex's lock statistics
+        CK_RV createMutexIfNecessary(CK_VOID_PTR_PTR ppMutex, const char *name = NULL);
+        CK_RV destroyMutexIfNecessary(CK_VOID_PTR pMutex);
+        CK_RV lockMutexIfNecessary(CK_VOID_PTR pMutex);
+        CK_RV unlockMutexIfNecessary(CK_VOID_PTR pMutex);
+
         CK_RV getRandom(CK_BYTE_PTR data, CK_ULONG len);
+
+        // Fills data from the random buffer without taking its mutex,
+        // if the buffer holds len bytes and the application didn't
+        // supply its own mutex callbacks. False means call getRandom.
+        // With per-node buffers, another node's is used only when the
+        // caller's node's is short.
+        bool takeReservedRandom(CK_BYTE_PTR data, CK_ULONG len);
     private:
         GlobalData();
         ~GlobalData(){};
 
-        BaseHSM baseHSM;
+        // site is the code taking the mutex, for lock statistics
+        CK_RV lockMutex(CK_VOID_PTR pMutex, void *site);
+
+        std::vector<std::unique_ptr<BaseHSM>> baseHSMs;
+        CK_RV loadBaseHSMs();
+
+        // finalize() less stopping the log writer, which it does
+        // however this ends
+        CK_RV releaseState();
 
         // Mutex stuff
         bool isMultithreaded;
+        bool canCreateThreads;
 
         CK_CREATEMUTEX customCreateMutex;
         CK_DESTROYMUTEX customDestroyMutex;
@@ -52,17 +161,75 @@ class GlobalData {
 
         CK_RV setThreadSettings(CK_C_INITIALIZE_ARGS_PTR pInitArgs);
 
-        CK_RV createMutexIfNecessary(CK_VOID_PTR_PTR ppMutex);
-        CK_RV destroyMutexIfNecessary(CK_VOID_PTR pMutex);
-        CK_RV lockMutexIfNecessary(CK_VOID_PTR pMutex);
-        CK_RV unlockMutexIfNecessary(CK_VOID_PTR pMutex);
+        // Replica stuff
+        std::vector<std::unique_ptr<ReplicaGroup>> replicaGroups;
+        CK_RV loadReplicaGroups();
+        bool isReplicaSlot(CK_SLOT_ID slotID);
+
+        // Session stuff
+        CK_VOID_PTR sessionTableMutex;
+        SessionTable sessionTable;
+
+        std::unique_ptr<SessionPool> sessionPool;
+        CK_RV loadSessionPool();
+
+        size_t updateBufferSize;
+        CK_RV loadUpdateBufferSize();
+
+        size_t batchWorkers;
+        CK_RV loadBatchWorkers();
+
+        std::unique_ptr<AsyncQueue> asyncQueue;
+        CK_RV loadAsyncQueue();
+
+        std::unique_ptr<KeyPairPool> keyPairPool;
+        CK_RV loadKeyPairPool();
+
+        std::unique_ptr<MetricsExporter> metricsExporter;
+        CK_RV loadMetricsExporter();
+
+        CK_RV loadTracer();
+
+        // Cache stuff
+        std::unique_ptr<FindCache> findCache;
+        CK_RV loadFindCache();
+
+        std::unique_ptr<AttributeCache> attributeCache;
+        CK_RV loadAttributeCache();
+
+        std::unique_ptr<MetadataCache> metadataCache;
+        std::unique_ptr<SlotEventWatcher> slotEventWatcher;
+        CK_RV loadMetadataCache();
+
+        std::unique_ptr<PublicKeyCache> publicKeyCache;
+        CK_RV loadPublicKeyCache();
 
         // Random buffer stuff
         CK_VOID_PTR randomBufferMutex;
+        uint64_t randomBufferLockWaitNs;    // Of the mutex's current holder
 
         std::shared_ptr<RandomCollector> randomCollector;
-        std::unique_ptr<RandomBuffer>    randomBuffer;
+        // One per NUMA node with QRYPT_NUMA_RESERVOIRS, else one; or
+        // the single-threaded buffer, if randomFromOneThread
+        std::vector<std::unique_ptr<RandomBuffer>> randomBuffers;
+        std::unique_ptr<SingleThreadRandomBuffer> singleThreadRandomBuffer;
+        std::atomic<bool> randomBuffersReady;
         CK_RV setupRandomBuffer();
+
+        // Whether the random buffer can only ever be used by one thread
+        // at a time: the application asked for no locking, and no
+        // Qryptoki thread (async worker, batch worker or key pair pool)
+        // draws random
+        bool randomFromOneThread();
+
+        bool numaReservoirs;
+        CK_RV loadNumaReservoirs();
+
+        // The caller's node's buffer
+        size_t localRandomBuffer();
+
+        // Fills data from another node's buffer, if one holds len bytes
+        bool stealReservedRandom(size_t local, CK_BYTE_PTR data, CK_ULONG len);
 };
 
 #endif /* !_QRYPT_WRAPPER_GLOBALDATA_H */
\ No newline at end of file
@@ -0,0 +1,480 @@
+#include <algorithm>            // std::sort
+#include <string.h>             // memcmp
+
+#include <openssl/crypto.h>     // OPENSSL_cleanse
+
+#include "log.h"                // logging macros
+#include "GlobalData.h"         // getRandom
+
+#include "KeyPairPool.h"
+
+// Bounds the pairs kept if an application generates with many
+// different templates
+const size_t MAX_KEYPAIR_TEMPLATES = 32;
+
+// Qrypt random mixed into the base HSM's generator before each pair
+const CK_ULONG KEYPAIR_SEED_LEN = 32;
+
+bool canonicalizeTemplate(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::vector<PooledAttribute> &canonical) {
+    if(pTemplate == NULL_PTR && ulCount != 0) return false;
+
+    canonical.clear();
+
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        if(pTemplate[i].type == CKA_LABEL || pTemplate[i].type == CKA_ID) continue;
+        if(pTemplate[i].pValue == NULL_PTR && pTemplate[i].ulValueLen != 0) return false;
+
+        PooledAttribute attribute;
+        attribute.type = pTemplate[i].type;
+        attribute.value.assign((CK_BYTE_PTR)pTemplate[i].pValue, (CK_BYTE_PTR)pTemplate[i].pValue + pTemplate[i].ulValueLen);
+        canonical.push_back(attribute);
+    }
+
+    std::sort(canonical.begin(), canonical.end(), [](const PooledAttribute &a, const PooledAttribute &b) { return a.type < b.type; });
+
+    // The base HSM decides which of two values wins, so don't guess
+    for(size_t i = 1; i < canonical.size(); i++) {
+        if(canonical[i].type == canonical[i - 1].type) return false;
+    }
+
+    return true;
+}
+
+bool sameTemplate(const std::vector<PooledAttribute> &a, const std::vector<PooledAttribute> &b) {
+    if(a.size() != b.size()) return false;
+
+    for(size_t i = 0; i < a.size(); i++) {
+        if(a[i].type != b[i].type || a[i].value != b[i].value) return false;
+    }
+
+    return true;
+}
+
+static const PooledAttribute *findAttribute(const std::vector<PooledAttribute> &canonical, CK_ATTRIBUTE_TYPE type) {
+    for(const PooledAttribute &attribute : canonical) {
+        if(attribute.type == type) return &attribute;
+    }
+
+    return NULL;
+}
+
+static std::vector<CK_ATTRIBUTE> toTemplate(std::vector<PooledAttribute> &canonical) {
+    std::vector<CK_ATTRIBUTE> attributes;
+
+    for(PooledAttribute &attribute : canonical) {
+        CK_ATTRIBUTE entry = {attribute.type, attribute.value.empty() ? NULL_PTR : attribute.value.data(), (CK_ULONG)attribute.value.size()};
+        attributes.push_back(entry);
+    }
+
+    return attributes;
+}
+
+KeyPairPool::KeyPairPool(const std::vector<KeyPairPoolSpec> &specs) {
+    this->specs = specs;
+    this->stopping = false;
+
+    this->served = 0;
+    this->missed = 0;
+    this->generated = 0;
+}
+
+void KeyPairPool::start() {
+    this->thread = std::thread(&KeyPairPool::work, this);
+}
+
+void KeyPairPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+
+    this->changed.notify_all();
+
+    if(this->thread.joinable()) this->thread.join();
+}
+
+bool KeyPairPool::take(Session &session, CK_MECHANISM_PTR pMechanism,
+                       CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+                       CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+                       CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey, CK_RV &rv) {
+    // Replica groups spread keys over several slots, so they aren't pooled
+    if(session.replicaGroup != NULL) return false;
+
+    if(pMechanism == NULL_PTR || pMechanism->pParameter != NULL_PTR || pMechanism->ulParameterLen != 0) return false;
+    if(phPublicKey == NULL_PTR || phPrivateKey == NULL_PTR) return false;
+
+    std::vector<PooledAttribute> publicTemplate, privateTemplate;
+    if(!canonicalizeTemplate(pPublicKeyTemplate, ulPublicKeyAttributeCount, publicTemplate)) return false;
+    if(!canonicalizeTemplate(pPrivateKeyTemplate, ulPrivateKeyAttributeCount, privateTemplate)) return false;
+
+    std::pair<CK_OBJECT_HANDLE, CK_OBJECT_HANDLE> pair;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        KeyPairTemplate *keyPairTemplate = NULL;
+        for(auto &candidate : this->templates) {
+            if(candidate->slotID == session.slotID && candidate->mechanism == pMechanism->mechanism &&
+               sameTemplate(candidate->publicTemplate, publicTemplate) && sameTemplate(candidate->privateTemplate, privateTemplate)) {
+                keyPairTemplate = candidate.get();
+                break;
+            }
+        }
+
+        if(keyPairTemplate == NULL) {
+            size_t depth;
+            if(!matchesSpec(pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, depth)) return false;
+
+            this->missed++;
+
+            if(this->templates.size() == MAX_KEYPAIR_TEMPLATES) {
+                DEBUG_MSG("Not pooling another key pair template; there are already %zu.", MAX_KEYPAIR_TEMPLATES);
+                return false;
+            }
+
+            std::unique_ptr<KeyPairTemplate> added = std::make_unique<KeyPairTemplate>();
+            added->slotID = session.slotID;
+            added->mechanism = pMechanism->mechanism;
+            added->publicTemplate = publicTemplate;
+            added->privateTemplate = privateTemplate;
+            added->depth = depth;
+            added->failed = false;
+
+            if(this->slots.count(session.slotID) == 0) {
+                KeyPairSlot &slot = this->slots[session.slotID];
+                slot.module = session.module;
+                slot.baseSlotID = session.baseSlotID;
+                slot.baseSession = CK_INVALID_HANDLE;
+                slot.open = false;
+                slot.loggedOut = false;
+            }
+
+            this->templates.push_back(std::move(added));
+            this->changed.notify_one();
+            return false;
+        }
+
+        if(keyPairTemplate->pairs.empty()) {
+            this->missed++;
+            return false;
+        }
+
+        // Token keys are relabelled, which a read-only session can't do
+        const PooledAttribute *publicToken = findAttribute(publicTemplate, CKA_TOKEN);
+        const PooledAttribute *privateToken = findAttribute(privateTemplate, CKA_TOKEN);
+        bool token = (publicToken != NULL && publicToken->value == std::vector<CK_BYTE>(1, CK_TRUE)) ||
+                     (privateToken != NULL && privateToken->value == std::vector<CK_BYTE>(1, CK_TRUE));
+        if(token && !(session.flags & CKF_RW_SESSION)) return false;
+
+        pair = keyPairTemplate->pairs.front();
+        keyPairTemplate->pairs.pop_front();
+    }
+
+    this->changed.notify_one();
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+
+    if(!hand(session, pPublicKeyTemplate, ulPublicKeyAttributeCount, pair.first, hPublicKey)) {
+        destroy(session, pair.first, pair.second);
+        return false;
+    }
+
+    if(!hand(session, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, pair.second, hPrivateKey)) {
+        destroy(session, hPublicKey, pair.second);
+        return false;
+    }
+
+    *phPublicKey = hPublicKey;
+    *phPrivateKey = hPrivateKey;
+
+    this->served++;
+    rv = CKR_OK;
+    return true;
+}
+
+bool KeyPairPool::matchesSpec(CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, size_t &depth) {
+    for(const KeyPairPoolSpec &spec : this->specs) {
+        CK_MECHANISM_TYPE mechanism = spec.keyType == CKK_RSA ? CKM_RSA_PKCS_KEY_PAIR_GEN : CKM_EC_KEY_PAIR_GEN;
+        if(pMechanism->mechanism != mechanism) continue;
+
+        for(CK_ULONG i = 0; i < ulPublicKeyAttributeCount; i++) {
+            const CK_ATTRIBUTE &attribute = pPublicKeyTemplate[i];
+            if(attribute.pValue == NULL_PTR) continue;
+
+            bool matches = false;
+            if(spec.keyType == CKK_RSA && attribute.type == CKA_MODULUS_BITS && attribute.ulValueLen == sizeof(CK_ULONG))
+                matches = *(CK_ULONG *)attribute.pValue == spec.modulusBits;
+            else if(spec.keyType == CKK_EC && attribute.type == CKA_EC_PARAMS && attribute.ulValueLen == spec.ecParams.size())
+                matches = memcmp(attribute.pValue, spec.ecParams.data(), spec.ecParams.size()) == 0;
+
+            if(matches) {
+                depth = spec.depth;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Gives a pooled key the request's CKA_LABEL and CKA_ID: a token key
+// in place, and a session key by copying it into the session
+bool KeyPairPool::hand(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE hPooled, CK_OBJECT_HANDLE &hKey) {
+    std::vector<CK_ATTRIBUTE> labels;
+    bool token = false;
+
+    for(CK_ULONG i = 0; i < ulCount; i++) {
+        if(pTemplate[i].type == CKA_LABEL || pTemplate[i].type == CKA_ID) labels.push_back(pTemplate[i]);
+        if(pTemplate[i].type == CKA_TOKEN && pTemplate[i].ulValueLen == sizeof(CK_BBOOL)) token = *(CK_BBOOL *)pTemplate[i].pValue == CK_TRUE;
+    }
+
+    CK_RV rv;
+
+    if(token) {
+        hKey = hPooled;
+        if(labels.empty()) return true;
+
+        CK_C_SetAttributeValue Base_C_SetAttributeValue = (CK_C_SetAttributeValue)session.module->getFunction("C_SetAttributeValue");
+        if(Base_C_SetAttributeValue == NULL) return false;
+
+        rv = (*Base_C_SetAttributeValue)(session.baseSession, hPooled, labels.data(), labels.size());
+    } else {
+        CK_C_CopyObject Base_C_CopyObject = (CK_C_CopyObject)session.module->getFunction("C_CopyObject");
+        if(Base_C_CopyObject == NULL) return false;
+
+        rv = (*Base_C_CopyObject)(session.baseSession, hPooled, labels.empty() ? NULL_PTR : labels.data(), labels.size(), &hKey);
+        if(rv == CKR_OK) destroy(session, hPooled, CK_INVALID_HANDLE);
+    }
+
+    if(rv != CKR_OK) DEBUG_MSG("Could not hand out pooled key %lu (rv = 0x%lx); generating on the base HSM.", hPooled, rv);
+
+    return rv == CKR_OK;
+}
+
+void KeyPairPool::destroy(Session &session, CK_OBJECT_HANDLE hPublicKey, CK_OBJECT_HANDLE hPrivateKey) {
+    CK_C_DestroyObject Base_C_DestroyObject = (CK_C_DestroyObject)session.module->getFunction("C_DestroyObject");
+    if(Base_C_DestroyObject == NULL) return;
+
+    CK_OBJECT_HANDLE keys[] = {hPublicKey, hPrivateKey};
+    for(CK_OBJECT_HANDLE hKey : keys) {
+        if(hKey == CK_INVALID_HANDLE) continue;
+
+        CK_RV rv = (*Base_C_DestroyObject)(session.baseSession, hKey);
+        if(rv != CKR_OK) ERROR_MSG("Could not destroy pooled key %lu (rv = 0x%lx).", hKey, rv);
+    }
+}
+
+void KeyPairPool::drain(CK_SLOT_ID slotID) {
+    std::lock_guard<std::mutex> generateLock(this->generateMutex);
+
+    std::vector<CK_OBJECT_HANDLE> keys;
+    KeyPairSlot *slot;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        auto it = this->slots.find(slotID);
+        if(it == this->slots.end()) return;
+
+        slot = &it->second;
+        slot->loggedOut = true;
+
+        for(auto &keyPairTemplate : this->templates) {
+            if(keyPairTemplate->slotID != slotID) continue;
+
+            for(auto &pair : keyPairTemplate->pairs) {
+                keys.push_back(pair.first);
+                keys.push_back(pair.second);
+            }
+            keyPairTemplate->pairs.clear();
+        }
+    }
+
+    // Only generate and drain use the slot's session, and both hold generateMutex
+    if(!keys.empty()) {
+        CK_C_DestroyObject Base_C_DestroyObject = (CK_C_DestroyObject)slot->module->getFunction("C_DestroyObject");
+
+        for(CK_OBJECT_HANDLE hKey : keys) {
+            CK_RV rv = slot->open && Base_C_DestroyObject != NULL ? (*Base_C_DestroyObject)(slot->baseSession, hKey) : CKR_SESSION_CLOSED;
+            if(rv != CKR_OK) ERROR_MSG("Could not destroy pooled key %lu on slot %lu (rv = 0x%lx).", hKey, slotID, rv);
+        }
+    }
+
+    closeSlot(*slot);
+}
+
+void KeyPairPool::drainAll() {
+    std::vector<CK_SLOT_ID> slotIDs;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for(auto &entry : this->slots) slotIDs.push_back(entry.first);
+    }
+
+    for(CK_SLOT_ID slotID : slotIDs) drain(slotID);
+}
+
+void KeyPairPool::wake() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        for(auto &entry : this->slots) entry.second.loggedOut = false;
+        for(auto &keyPairTemplate : this->templates) keyPairTemplate->failed = false;
+    }
+
+    this->changed.notify_one();
+}
+
+void KeyPairPool::logStatistics() {
+    unsigned long served = this->served;
+    unsigned long missed = this->missed;
+    if(served + missed == 0) return;
+
+    INFO_MSG("Key pair pool: %lu of %lu matching key pairs served from the pool; %lu generated ahead.", served, served + missed, (unsigned long)this->generated);
+}
+
+void KeyPairPool::work() {
+    while(true) {
+        KeyPairTemplate *keyPairTemplate = NULL;
+
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->changed.wait(lock, [this, &keyPairTemplate] { return this->stopping || (keyPairTemplate = nextToFill()) != NULL; });
+            if(this->stopping) break;
+        }
+
+        std::lock_guard<std::mutex> generateLock(this->generateMutex);
+
+        try {
+            generate(*keyPairTemplate);
+        } catch (...) {
+            ERROR_MSG("Could not generate a key pair for the pool.");
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            keyPairTemplate->failed = true;
+        }
+    }
+}
+
+KeyPairTemplate *KeyPairPool::nextToFill() {
+    for(auto &keyPairTemplate : this->templates) {
+        if(keyPairTemplate->failed || keyPairTemplate->pairs.size() >= keyPairTemplate->depth) continue;
+        if(this->slots[keyPairTemplate->slotID].loggedOut) continue;
+
+        return keyPairTemplate.get();
+    }
+
+    return NULL;
+}
+
+bool KeyPairPool::generate(KeyPairTemplate &keyPairTemplate) {
+    KeyPairSlot *slot;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        slot = &this->slots[keyPairTemplate.slotID];
+
+        // The slot may have been drained after work() picked the
+        // template and before it got generateMutex; a pair generated
+        // now would outlive the logout
+        if(slot->loggedOut) return false;
+    }
+
+    if(!openSlot(*slot)) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        slot->loggedOut = true;
+        return false;
+    }
+
+    seed(*slot);
+
+    CK_C_GenerateKeyPair Base_C_GenerateKeyPair = (CK_C_GenerateKeyPair)slot->module->getFunction("C_GenerateKeyPair");
+    if(Base_C_GenerateKeyPair == NULL) return false;
+
+    // The templates never change once added
+    CK_MECHANISM mechanism = {keyPairTemplate.mechanism, NULL_PTR, 0};
+    std::vector<CK_ATTRIBUTE> publicTemplate = toTemplate(keyPairTemplate.publicTemplate);
+    std::vector<CK_ATTRIBUTE> privateTemplate = toTemplate(keyPairTemplate.privateTemplate);
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = (*Base_C_GenerateKeyPair)(slot->baseSession, &mechanism, publicTemplate.data(), publicTemplate.size(),
+                                         privateTemplate.data(), privateTemplate.size(), &hPublicKey, &hPrivateKey);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if(rv == CKR_USER_NOT_LOGGED_IN || rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED) {
+        slot->loggedOut = true;
+        return false;
+    }
+
+    if(rv != CKR_OK) {
+        ERROR_MSG("Could not generate a key pair for the pool on slot %lu (rv = 0x%lx).", keyPairTemplate.slotID, rv);
+        keyPairTemplate.failed = true;
+        return false;
+    }
+
+    keyPairTemplate.pairs.push_back(std::make_pair(hPublicKey, hPrivateKey));
+    this->generated++;
+
+    return true;
+}
+
+// Opens the slot's session if needed; false unless the user is logged in
+bool KeyPairPool::openSlot(KeyPairSlot &slot) {
+    if(!slot.open) {
+        CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)slot.module->getFunction("C_OpenSession");
+        if(Base_C_OpenSession == NULL) return false;
+
+        CK_RV rv = (*Base_C_OpenSession)(slot.baseSlotID, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL_PTR, NULL, &slot.baseSession);
+        if(rv != CKR_OK) return false;
+
+        slot.open = true;
+    }
+
+    CK_C_GetSessionInfo Base_C_GetSessionInfo = (CK_C_GetSessionInfo)slot.module->getFunction("C_GetSessionInfo");
+    if(Base_C_GetSessionInfo == NULL) return false;
+
+    CK_SESSION_INFO info;
+    CK_RV rv = (*Base_C_GetSessionInfo)(slot.baseSession, &info);
+
+    // Don't keep the token logged in for no one
+    if(rv != CKR_OK || info.state != CKS_RW_USER_FUNCTIONS) {
+        closeSlot(slot);
+        return false;
+    }
+
+    return true;
+}
+
+void KeyPairPool::closeSlot(KeyPairSlot &slot) {
+    if(!slot.open) return;
+
+    CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)slot.module->getFunction("C_CloseSession");
+    if(Base_C_CloseSession != NULL) (*Base_C_CloseSession)(slot.baseSession);
+
+    slot.open = false;
+}
+
+void KeyPairPool::seed(KeyPairSlot &slot) {
+    CK_BYTE seed[KEYPAIR_SEED_LEN];
+
+    if(GlobalData::getInstance().lockRandomBufferMutex() != CKR_OK) return;
+
+    CK_RV rv;
+    try {
+        rv = GlobalData::getInstance().getRandom(seed, sizeof(seed));
+    } catch (...) {
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    GlobalData::getInstance().unlockRandomBufferMutex();
+
+    if(rv == CKR_OK) {
+        CK_C_SeedRandom Base_C_SeedRandom = (CK_C_SeedRandom)slot.module->getFunction("C_SeedRandom");
+        if(Base_C_SeedRandom != NULL) rv = (*Base_C_SeedRandom)(slot.baseSession, seed, sizeof(seed));
+    }
+
+    if(rv != CKR_OK) DEBUG_MSG("Key pair pool: base HSM not seeded with Qrypt entropy (rv = 0x%lx).", rv);
+
+    OPENSSL_cleanse(seed, sizeof(seed));
+}
@@ -0,0 +1,133 @@
+/**
+ * This class keeps key pairs generated ahead of time, so that a
+ * C_GenerateKeyPair for a slow key type (large RSA keys, mostly) can
+ * be answered at once. QRYPT_KEYPAIR_POOL picks the key types and
+ * sizes; the first C_GenerateKeyPair for one of them on a slot sets
+ * the rest of the templates, and a thread then keeps that many pairs
+ * ready, seeding the base HSM with Qrypt entropy before each one.
+ *
+ * Pairs are generated without CKA_LABEL and CKA_ID, which are the
+ * only attributes allowed to differ between requests. A served token
+ * key is given the request's values with C_SetAttributeValue; a
+ * session key is copied into the application's session with them,
+ * and the pooled one destroyed.
+ *
+ * Pooled pairs are generated on a base session of the pool's own
+ * while the application is logged in, so its objects are visible to
+ * the application. They are destroyed before the application logs
+ * out, closes the slot's last session or finalizes.
+ */
+
+#ifndef _QRYPT_WRAPPER_KEYPAIRPOOL_H
+#define _QRYPT_WRAPPER_KEYPAIRPOOL_H
+
+#include <atomic>              // std::atomic
+#include <condition_variable>  // std::condition_variable
+#include <deque>               // std::deque
+#include <map>                 // std::map
+#include <memory>              // std::unique_ptr
+#include <mutex>               // std::mutex
+#include <thread>              // std::thread
+#include <utility>             // std::pair
+#include <vector>              // std::vector
+
+#include "cryptoki.h"          // PKCS#11 types
+
+#include "BaseHSM.h"           // BaseHSM
+#include "Session.h"           // Session
+
+// One QRYPT_KEYPAIR_POOL entry
+struct KeyPairPoolSpec {
+    CK_KEY_TYPE keyType;
+    CK_ULONG modulusBits;              // For CKK_RSA
+    std::vector<CK_BYTE> ecParams;     // For CKK_EC, a DER-encoded curve OID
+    size_t depth;                      // Pairs to keep ready
+};
+
+struct PooledAttribute {
+    CK_ATTRIBUTE_TYPE type;
+    std::vector<CK_BYTE> value;
+};
+
+// The attribute values, sorted by type and without the ones a pooled
+// key is given when it is served; false if they can't be pooled
+bool canonicalizeTemplate(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, std::vector<PooledAttribute> &canonical);
+bool sameTemplate(const std::vector<PooledAttribute> &a, const std::vector<PooledAttribute> &b);
+
+// Pairs kept for one slot, mechanism and pair of templates
+struct KeyPairTemplate {
+    CK_SLOT_ID slotID;
+    CK_MECHANISM_TYPE mechanism;
+    std::vector<PooledAttribute> publicTemplate;   // Sorted, without CKA_LABEL and CKA_ID
+    std::vector<PooledAttribute> privateTemplate;
+    size_t depth;
+
+    std::deque<std::pair<CK_OBJECT_HANDLE, CK_OBJECT_HANDLE>> pairs;
+    bool failed;                       // The base HSM refused the templates
+};
+
+// The pool's base session on a slot
+struct KeyPairSlot {
+    BaseHSM *module;
+    CK_SLOT_ID baseSlotID;
+    CK_SESSION_HANDLE baseSession;
+    bool open;
+    bool loggedOut;                    // Wait for a login before generating
+};
+
+class KeyPairPool {
+    public:
+        KeyPairPool(const std::vector<KeyPairPoolSpec> &specs);
+
+        void start();
+        void stop();
+
+        // Serves the request from the pool if it matches a template,
+        // and learns the templates of requests that match a spec. False
+        // means the pair must be generated on the base HSM.
+        bool take(Session &session, CK_MECHANISM_PTR pMechanism,
+                  CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+                  CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+                  CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey, CK_RV &rv);
+
+        // Destroys the slot's pooled pairs and closes the pool's session
+        // on it, waiting for a pair being generated; generation resumes
+        // after the next login
+        void drain(CK_SLOT_ID slotID);
+        void drainAll();
+
+        // Called after a login
+        void wake();
+
+        void logStatistics();
+    private:
+        std::vector<KeyPairPoolSpec> specs;
+
+        std::thread thread;
+        std::mutex mutex;                  // Guards everything below
+        std::condition_variable changed;
+        bool stopping;
+
+        std::vector<std::unique_ptr<KeyPairTemplate>> templates;
+        std::map<CK_SLOT_ID, KeyPairSlot> slots;
+
+        // Held while a pair is being generated, so drain can wait for it
+        std::mutex generateMutex;
+
+        std::atomic<unsigned long> served;
+        std::atomic<unsigned long> missed;
+        std::atomic<unsigned long> generated;
+
+        void work();
+        KeyPairTemplate *nextToFill();
+        bool generate(KeyPairTemplate &keyPairTemplate);
+        bool openSlot(KeyPairSlot &slot);
+        void closeSlot(KeyPairSlot &slot);
+        void seed(KeyPairSlot &slot);
+
+        bool matchesSpec(CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, size_t &depth);
+        bool hand(Session &session, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE hPooled, CK_OBJECT_HANDLE &hKey);
+        void destroy(Session &session, CK_OBJECT_HANDLE hPublicKey, CK_OBJECT_HANDLE hPrivateKey);
+};
+
+#endif /* !_QRYPT_WRAPPER_KEYPAIRPOOL_H */
@@ -0,0 +1,68 @@
+#include <algorithm>            // std::min
+
+#include "LatencyHistogram.h"
+
+const unsigned SUB_BUCKET_BITS = 3;
+const unsigned MIN_EXPONENT = 10;
+// The last power of two with buckets of its own, 2^40 to 2^41 ns; its
+// top bucket also takes every longer latency
+const unsigned MAX_EXPONENT = 40;
+
+LatencyHistogram::LatencyHistogram() {
+    for(std::atomic<uint64_t> &bucket : this->buckets) bucket = 0;
+    this->maxNs = 0;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    this->buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t maxNs = this->maxNs.load(std::memory_order_relaxed);
+    while(ns > maxNs && !this->maxNs.compare_exchange_weak(maxNs, ns, std::memory_order_relaxed));
+}
+
+void LatencyHistogram::addTo(std::vector<uint64_t> &counts) const {
+    counts.resize(BUCKETS, 0);
+
+    for(size_t i = 0; i < BUCKETS; i++) counts[i] += this->buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMax() const {
+    return this->maxNs.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(const std::vector<uint64_t> &counts, double fraction, uint64_t maxNs) {
+    uint64_t total = 0;
+    for(uint64_t count : counts) total += count;
+    if(total == 0) return 0;
+
+    uint64_t target = (uint64_t)(fraction * total);
+    if(target >= total) target = total - 1;
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if(seen > target) return std::min(bucketValue(i), maxNs);
+    }
+
+    return maxNs;
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t ns) {
+    if(ns < ((uint64_t)1 << MIN_EXPONENT)) return ns >> (MIN_EXPONENT - SUB_BUCKET_BITS);
+
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    if(exponent > MAX_EXPONENT) return BUCKETS - 1;
+
+    size_t subBucket = (ns >> (exponent - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+    return ((exponent - MIN_EXPONENT + 1) << SUB_BUCKET_BITS) + subBucket;
+}
+
+// The middle of the bucket
+uint64_t LatencyHistogram::bucketValue(size_t index) {
+    unsigned subBuckets = 1 << SUB_BUCKET_BITS;
+    if(index < subBuckets) return (index << (MIN_EXPONENT - SUB_BUCKET_BITS)) + (1 << (MIN_EXPONENT - SUB_BUCKET_BITS - 1));
+
+    unsigned exponent = index / subBuckets + MIN_EXPONENT - 1;
+    uint64_t width = (uint64_t)1 << (exponent - SUB_BUCKET_BITS);
+    return ((uint64_t)1 << exponent) + (index % subBuckets) * width + width / 2;
+}
@@ -0,0 +1,42 @@
+/**
+ * This class is a latency histogram that threads can record into
+ * at once without a lock. Buckets are log-linear, 8 per power of
+ * two, so any percentile read back is within 12.5%, from 1
+ * microsecond to 2^41 ns, about 37 minutes. Anything longer is
+ * counted in the top bucket, which starts at 2^41 - 2^37 ns.
+ */
+
+#ifndef _QRYPT_WRAPPER_LATENCYHISTOGRAM_H
+#define _QRYPT_WRAPPER_LATENCYHISTOGRAM_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+#include <atomic>       // std::atomic
+#include <vector>       // std::vector
+
+class LatencyHistogram {
+    public:
+        static const size_t BUCKETS = 256;
+
+        LatencyHistogram();
+
+        void record(uint64_t ns);
+
+        // Adds the counts into a vector of BUCKETS counts, so that
+        // several histograms can be merged
+        void addTo(std::vector<uint64_t> &counts) const;
+        uint64_t getMax() const;
+
+        // From merged counts; 0 if there are none
+        static uint64_t percentile(const std::vector<uint64_t> &counts, double fraction, uint64_t maxNs);
+
+        // The bucket a latency falls in, and the latency a bucket stands for
+        static size_t bucketIndex(uint64_t ns);
+        static uint64_t bucketValue(size_t index);
+    private:
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> maxNs;
+};
+
+#endif /* !_QRYPT_WRAPPER_LATENCYHISTOGRAM_H */
@@ -0,0 +1,310 @@
+#include <stdint.h>             // uint64_t
+#include <stdio.h>              // snprintf
+#include <stdlib.h>             // getenv
+#include <string.h>             // strcmp
+
+#include <algorithm>            // std::sort
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::steady_clock
+#include <new>                  // std::nothrow
+#include <sstream>              // std::stringstream
+#include <utility>              // std::pair
+#include <vector>               // std::vector
+
+#include "log.h"                // logging macros
+#include "LatencyHistogram.h"   // LatencyHistogram
+#include "probes.h"             // QRYPT_PROBE
+#include "Tracer.h"             // Tracer
+
+#include "LatencyStats.h"
+
+enum LatencyFunction {
+#define X(name) LATENCY_##name,
+    QRYPT_PKCS11_FUNCTIONS(X)
+#undef X
+    LATENCY_FUNCTION_COUNT
+};
+
+static const char *const LATENCY_FUNCTION_NAMES[LATENCY_FUNCTION_COUNT] = {
+#define X(name) #name,
+    QRYPT_PKCS11_FUNCTIONS(X)
+#undef X
+};
+
+// Threads beyond this many share shards
+const size_t LATENCY_SHARDS = 16;
+
+// Base HSMs past this many aren't timed, to bound the code generated
+const size_t MAX_TIMED_MODULES = 4;
+
+// Distinct error codes counted per function and shard; the rest are
+// only counted as errors
+const size_t LATENCY_ERROR_SLOTS = 8;
+
+struct LatencyErrorCount {
+    std::atomic<CK_RV> rv;                  // CKR_OK while the slot is free
+    std::atomic<uint64_t> count;
+};
+
+struct FunctionLatency {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> baseNs;           // Of totalNs, spent in base HSM calls
+    LatencyHistogram histogram;
+    LatencyErrorCount errorCodes[LATENCY_ERROR_SLOTS];
+};
+
+// Application-facing functions first, then the base HSMs' functions
+struct LatencyShard {
+    FunctionLatency functions[2 * LATENCY_FUNCTION_COUNT];
+};
+
+static std::atomic<LatencyShard *> shards[LATENCY_SHARDS];
+static std::atomic<size_t> nextShard(0);
+
+// Time spent in base HSM calls during the current application call
+static thread_local uint64_t baseNsInCall = 0;
+
+static LatencyShard *getShard() {
+    static thread_local size_t shardIndex = nextShard++ % LATENCY_SHARDS;
+
+    LatencyShard *shard = shards[shardIndex].load(std::memory_order_acquire);
+    if(shard != NULL) return shard;
+
+    // Value-initialized, so every counter starts at 0
+    LatencyShard *created = new (std::nothrow) LatencyShard();
+    if(created == NULL) return NULL;
+
+    if(!shards[shardIndex].compare_exchange_strong(shard, created, std::memory_order_acq_rel)) {
+        delete created;
+        return shard;
+    }
+
+    return created;
+}
+
+static void record(size_t index, uint64_t ns, uint64_t baseNs, CK_RV rv) {
+    LatencyShard *shard = getShard();
+    if(shard == NULL) return;
+
+    FunctionLatency &function = shard->functions[index];
+    function.calls.fetch_add(1, std::memory_order_relaxed);
+    function.totalNs.fetch_add(ns, std::memory_order_relaxed);
+    function.baseNs.fetch_add(baseNs, std::memory_order_relaxed);
+    function.histogram.record(ns);
+
+    if(rv == CKR_OK) return;
+
+    function.errors.fetch_add(1, std::memory_order_relaxed);
+
+    for(LatencyErrorCount &errorCount : function.errorCodes) {
+        CK_RV slotRv = errorCount.rv.load(std::memory_order_relaxed);
+        if(slotRv == CKR_OK && errorCount.rv.compare_exchange_strong(slotRv, rv, std::memory_order_relaxed)) slotRv = rv;
+
+        if(slotRv == rv) {
+            errorCount.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Qryptoki's Function, timed, and traced where probes are compiled in
+// or the tracer is on
+template <size_t Index, typename F, F Function> struct TimedEntry;
+
+template <size_t Index, typename... Args, CK_RV (*Function)(Args...)>
+struct TimedEntry<Index, CK_RV (*)(Args...), Function> {
+    static CK_RV call(Args... args) {
+        QRYPT_PROBE(call__entry, Index, LATENCY_FUNCTION_NAMES[Index]);
+
+        if(!LatencyStats::isEnabled()) {
+            uint64_t startUs = Tracer::isEnabled() ? Tracer::now() : 0;
+            CK_RV rv = Function(args...);
+
+            if(Tracer::isEnabled()) Tracer::record(LATENCY_FUNCTION_NAMES[Index], "api", startUs, Tracer::now(), "rv", rv);
+
+            QRYPT_PROBE(call__return, Index, LATENCY_FUNCTION_NAMES[Index], rv);
+            return rv;
+        }
+
+        uint64_t outerBaseNs = baseNsInCall;
+        baseNsInCall = 0;
+
+        uint64_t startUs = Tracer::isEnabled() ? Tracer::now() : 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CK_RV rv = Function(args...);
+
+        record(Index, elapsedNs(start), baseNsInCall, rv);
+
+        if(Tracer::isEnabled()) Tracer::record(LATENCY_FUNCTION_NAMES[Index], "api", startUs, Tracer::now(), "rv", rv);
+
+        baseNsInCall = outerBaseNs;
+
+        QRYPT_PROBE(call__return, Index, LATENCY_FUNCTION_NAMES[Index], rv);
+        return rv;
+    }
+};
+
+static CK_FUNCTION_LIST_PTR baseFunctionLists[MAX_TIMED_MODULES];
+static CK_FUNCTION_LIST timedBaseFunctionLists[MAX_TIMED_MODULES];
+
+// The Member of a base HSM's function list, timed
+template <size_t Module, size_t Index, typename F, F CK_FUNCTION_LIST::*Member> struct TimedBase;
+
+template <size_t Module, size_t Index, typename... Args, CK_RV (*CK_FUNCTION_LIST::*Member)(Args...)>
+struct TimedBase<Module, Index, CK_RV (*)(Args...), Member> {
+    static CK_RV call(Args... args) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CK_RV rv = (baseFunctionLists[Module]->*Member)(args...);
+
+        uint64_t ns = elapsedNs(start);
+        record(LATENCY_FUNCTION_COUNT + Index, ns, ns, rv);
+
+        baseNsInCall += ns;
+        return rv;
+    }
+};
+
+template <size_t Module>
+static void timeBaseFunctions(CK_FUNCTION_LIST &list) {
+#define X(name) list.name = TimedBase<Module, LATENCY_##name, decltype(CK_FUNCTION_LIST::name), &CK_FUNCTION_LIST::name>::call;
+    QRYPT_PKCS11_FUNCTIONS(X)
+#undef X
+}
+
+bool LatencyStats::isEnabled() {
+    static const bool enabled = [] {
+        const char *enabled_c_str = getenv("QRYPT_LATENCY_STATS");
+        return enabled_c_str != NULL && strcmp(enabled_c_str, "1") == 0;
+    }();
+
+    return enabled;
+}
+
+bool LatencyStats::wrapsFunctionList() {
+    return isEnabled() || Tracer::isEnabled() || QRYPT_HAVE_PROBES;
+}
+
+CK_FUNCTION_LIST_PTR LatencyStats::getTimedFunctionList(const CK_FUNCTION_LIST &functionList) {
+    static CK_FUNCTION_LIST timedFunctionList = [&functionList] {
+        CK_FUNCTION_LIST list;
+        list.version = functionList.version;
+
+#define X(name) list.name = TimedEntry<LATENCY_##name, decltype(CK_FUNCTION_LIST::name), &::name>::call;
+        QRYPT_PKCS11_FUNCTIONS(X)
+#undef X
+
+        return list;
+    }();
+
+    return &timedFunctionList;
+}
+
+CK_FUNCTION_LIST_PTR LatencyStats::getTimedBaseFunctionList(size_t moduleIndex, CK_FUNCTION_LIST_PTR baseFunctionList) {
+    if(moduleIndex >= MAX_TIMED_MODULES) return NULL;
+
+    baseFunctionLists[moduleIndex] = baseFunctionList;
+
+    CK_FUNCTION_LIST &list = timedBaseFunctionLists[moduleIndex];
+    list.version = baseFunctionList->version;
+
+    switch(moduleIndex) {
+        case 0: timeBaseFunctions<0>(list); break;
+        case 1: timeBaseFunctions<1>(list); break;
+        case 2: timeBaseFunctions<2>(list); break;
+        case 3: timeBaseFunctions<3>(list); break;
+    }
+
+    return &list;
+}
+
+// Merges the shards of one function
+static void merge(size_t index, FunctionLatencySummary &summary) {
+    std::vector<uint64_t> buckets(LatencyHistogram::BUCKETS, 0);
+
+    summary.function = LATENCY_FUNCTION_NAMES[index % LATENCY_FUNCTION_COUNT];
+    summary.base = index >= LATENCY_FUNCTION_COUNT;
+    summary.calls = summary.errors = summary.totalNs = summary.baseNs = summary.maxNs = 0;
+    summary.errorCodes.clear();
+
+    for(std::atomic<LatencyShard *> &slot : shards) {
+        LatencyShard *shard = slot.load(std::memory_order_acquire);
+        if(shard == NULL) continue;
+
+        FunctionLatency &function = shard->functions[index];
+        summary.calls += function.calls.load(std::memory_order_relaxed);
+        summary.errors += function.errors.load(std::memory_order_relaxed);
+        summary.totalNs += function.totalNs.load(std::memory_order_relaxed);
+        summary.baseNs += function.baseNs.load(std::memory_order_relaxed);
+        summary.maxNs = std::max(summary.maxNs, function.histogram.getMax());
+        function.histogram.addTo(buckets);
+
+        for(LatencyErrorCount &errorCount : function.errorCodes) {
+            CK_RV rv = errorCount.rv.load(std::memory_order_relaxed);
+            if(rv == CKR_OK) break;
+
+            uint64_t count = errorCount.count.load(std::memory_order_relaxed);
+            auto it = std::find_if(summary.errorCodes.begin(), summary.errorCodes.end(), [rv](const std::pair<uint64_t, CK_RV> &entry) { return entry.second == rv; });
+
+            if(it == summary.errorCodes.end())
+                summary.errorCodes.push_back(std::make_pair(count, rv));
+            else
+                it->first += count;
+        }
+    }
+
+    std::sort(summary.errorCodes.rbegin(), summary.errorCodes.rend());
+
+    summary.p50Ns = LatencyHistogram::percentile(buckets, 0.5, summary.maxNs);
+    summary.p90Ns = LatencyHistogram::percentile(buckets, 0.9, summary.maxNs);
+    summary.p99Ns = LatencyHistogram::percentile(buckets, 0.99, summary.maxNs);
+}
+
+std::vector<FunctionLatencySummary> LatencyStats::summarize() {
+    std::vector<FunctionLatencySummary> summaries;
+    FunctionLatencySummary summary;
+
+    for(size_t index = 0; index < 2 * LATENCY_FUNCTION_COUNT; index++) {
+        merge(index, summary);
+        if(summary.calls != 0) summaries.push_back(summary);
+    }
+
+    return summaries;
+}
+
+std::string LatencyStats::report() {
+    std::stringstream report;
+
+    for(const FunctionLatencySummary &summary : summarize()) {
+        char line[256];
+        snprintf(line, sizeof(line), "%s%s calls=%llu errors=%llu p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus mean=%.1fus base=%.1fus",
+                 summary.base ? "base " : "", summary.function,
+                 (unsigned long long)summary.calls, (unsigned long long)summary.errors,
+                 summary.p50Ns / 1000.0, summary.p90Ns / 1000.0, summary.p99Ns / 1000.0, summary.maxNs / 1000.0,
+                 summary.totalNs / 1000.0 / summary.calls, summary.baseNs / 1000.0 / summary.calls);
+        report << line;
+
+        for(size_t i = 0; i < summary.errorCodes.size() && i < 3; i++) {
+            snprintf(line, sizeof(line), " rv=0x%lx:%llu", summary.errorCodes[i].second, (unsigned long long)summary.errorCodes[i].first);
+            report << line;
+        }
+
+        report << "\n";
+    }
+
+    return report.str();
+}
+
+void LatencyStats::logStatistics() {
+    if(!isEnabled()) return;
+
+    std::stringstream report(LatencyStats::report());
+
+    std::string line;
+    while(std::getline(report, line)) INFO_MSG("Latency: %s", line.c_str());
+}
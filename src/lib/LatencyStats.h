@@ -0,0 +1,94 @@
+/**
+ * This class keeps latency histograms for every PKCS#11 function,
+ * both as called by the application and as called on the base HSMs,
+ * so that time spent in Qryptoki can be told apart from time spent
+ * in the base HSM. It is turned on by QRYPT_LATENCY_STATS=1.
+ *
+ * Timing works by handing out function lists whose entries time the
+ * call and then forward it: the application gets one from
+ * C_GetFunctionList, and each base HSM's functions are fetched from
+ * one. Calls made straight to the exported C_* symbols, rather than
+ * through the function list, are not timed.
+ *
+ * Every thread records into a shard of its own (shared only once
+ * there are more threads than shards) with relaxed atomic adds, so
+ * recording takes no lock; the shards are merged when the report is
+ * read through C_QryptGetLatencyReport or logged by C_Finalize.
+ */
+
+#ifndef _QRYPT_WRAPPER_LATENCYSTATS_H
+#define _QRYPT_WRAPPER_LATENCYSTATS_H
+
+#include <stdint.h>     // uint64_t
+
+#include <string>       // std::string
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+// The functions of CK_FUNCTION_LIST, in order
+#define QRYPT_PKCS11_FUNCTIONS(X) \
+    X(C_Initialize) X(C_Finalize) X(C_GetInfo) X(C_GetFunctionList) \
+    X(C_GetSlotList) X(C_GetSlotInfo) X(C_GetTokenInfo) X(C_GetMechanismList) \
+    X(C_GetMechanismInfo) X(C_InitToken) X(C_InitPIN) X(C_SetPIN) \
+    X(C_OpenSession) X(C_CloseSession) X(C_CloseAllSessions) X(C_GetSessionInfo) \
+    X(C_GetOperationState) X(C_SetOperationState) X(C_Login) X(C_Logout) \
+    X(C_CreateObject) X(C_CopyObject) X(C_DestroyObject) X(C_GetObjectSize) \
+    X(C_GetAttributeValue) X(C_SetAttributeValue) X(C_FindObjectsInit) X(C_FindObjects) \
+    X(C_FindObjectsFinal) X(C_EncryptInit) X(C_Encrypt) X(C_EncryptUpdate) \
+    X(C_EncryptFinal) X(C_DecryptInit) X(C_Decrypt) X(C_DecryptUpdate) \
+    X(C_DecryptFinal) X(C_DigestInit) X(C_Digest) X(C_DigestUpdate) \
+    X(C_DigestKey) X(C_DigestFinal) X(C_SignInit) X(C_Sign) \
+    X(C_SignUpdate) X(C_SignFinal) X(C_SignRecoverInit) X(C_SignRecover) \
+    X(C_VerifyInit) X(C_Verify) X(C_VerifyUpdate) X(C_VerifyFinal) \
+    X(C_VerifyRecoverInit) X(C_VerifyRecover) X(C_DigestEncryptUpdate) X(C_DecryptDigestUpdate) \
+    X(C_SignEncryptUpdate) X(C_DecryptVerifyUpdate) X(C_GenerateKey) X(C_GenerateKeyPair) \
+    X(C_WrapKey) X(C_UnwrapKey) X(C_DeriveKey) X(C_SeedRandom) \
+    X(C_GenerateRandom) X(C_GetFunctionStatus) X(C_CancelFunction) X(C_WaitForSlotEvent)
+
+// One function's calls, over all threads
+struct FunctionLatencySummary {
+    const char *function;
+    bool base;                  // As called on the base HSMs
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t totalNs;
+    uint64_t baseNs;            // Of totalNs, spent in base HSM calls
+    uint64_t p50Ns;
+    uint64_t p90Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+    std::vector<std::pair<uint64_t, CK_RV>> errorCodes;    // Counts, most common first
+};
+
+class LatencyStats {
+    public:
+        // Read from QRYPT_LATENCY_STATS once, as C_GetFunctionList may
+        // come before C_Initialize
+        static bool isEnabled();
+
+        // Whether C_GetFunctionList hands out the timed function list,
+        // which also fires the call__entry and call__return probes and
+        // records the calls for the tracer
+        static bool wrapsFunctionList();
+
+        // Qryptoki's own functions, timed
+        static CK_FUNCTION_LIST_PTR getTimedFunctionList(const CK_FUNCTION_LIST &functionList);
+
+        // The base HSM's functions, timed; NULL if the base HSM is past
+        // the first MAX_TIMED_MODULES
+        static CK_FUNCTION_LIST_PTR getTimedBaseFunctionList(size_t moduleIndex, CK_FUNCTION_LIST_PTR baseFunctionList);
+
+        // The functions called so far
+        static std::vector<FunctionLatencySummary> summarize();
+
+        // One line per function called: calls, errors, latency
+        // percentiles, mean time in the base HSM and the most common
+        // error codes
+        static std::string report();
+
+        static void logStatistics();
+};
+
+#endif /* !_QRYPT_WRAPPER_LATENCYSTATS_H */
@@ -0,0 +1,224 @@
+#include <cxxabi.h>             // abi::__cxa_demangle
+#include <dlfcn.h>              // dladdr
+#include <stdio.h>              // snprintf
+#include <stdlib.h>             // getenv, free
+#include <string.h>             // strcmp
+
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::steady_clock
+#include <mutex>                // std::mutex
+
+#include "log.h"                // logging macros
+#include "LatencyHistogram.h"   // LatencyHistogram
+
+#include "LockStats.h"
+
+// Names beyond this many aren't measured
+const size_t MAX_LOCK_NAMES = 16;
+
+// Mutexes registered at once
+const size_t MAX_LOCK_MUTEXES = 32;
+
+struct LockCounters {
+    std::atomic<const char *> name;         // NULL while free
+    std::atomic<uint64_t> acquisitions;
+    std::atomic<uint64_t> waitNs;
+    std::atomic<uint64_t> holdNs;
+    std::atomic<uint64_t> holdMaxNs;
+    std::atomic<void *> holdMaxSite;
+    LatencyHistogram waitHistogram;
+    LatencyHistogram holdHistogram;
+};
+
+struct LockedMutex {
+    std::atomic<CK_VOID_PTR> mutex;         // NULL while free
+    LockCounters *counters;
+
+    // Only touched by the thread holding the mutex
+    uint64_t acquiredNs;
+    void *site;
+};
+
+static LockCounters lockCounters[MAX_LOCK_NAMES];
+static LockedMutex lockedMutexes[MAX_LOCK_MUTEXES];
+
+// Taken only to register and unregister
+static std::mutex registryMutex;
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static LockedMutex *find(CK_VOID_PTR mutex) {
+    if(mutex == NULL) return NULL;
+
+    for(LockedMutex &lockedMutex : lockedMutexes)
+        if(lockedMutex.mutex.load(std::memory_order_acquire) == mutex) return &lockedMutex;
+
+    return NULL;
+}
+
+bool LockStats::isEnabled() {
+    static const bool enabled = [] {
+        const char *enabled_c_str = getenv("QRYPT_LOCK_STATS");
+        return enabled_c_str != NULL && strcmp(enabled_c_str, "1") == 0;
+    }();
+
+    return enabled;
+}
+
+void LockStats::registerMutex(CK_VOID_PTR mutex, const char *name) {
+    if(!isEnabled() || mutex == NULL || name == NULL) return;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    LockCounters *counters = NULL;
+    for(LockCounters &candidate : lockCounters) {
+        const char *candidateName = candidate.name.load(std::memory_order_relaxed);
+
+        if(candidateName == NULL) {
+            candidate.name.store(name, std::memory_order_release);
+            counters = &candidate;
+            break;
+        }
+
+        if(strcmp(candidateName, name) == 0) {
+            counters = &candidate;
+            break;
+        }
+    }
+
+    if(counters == NULL) return;
+
+    for(LockedMutex &lockedMutex : lockedMutexes) {
+        if(lockedMutex.mutex.load(std::memory_order_relaxed) != NULL) continue;
+
+        lockedMutex.counters = counters;
+        lockedMutex.mutex.store(mutex, std::memory_order_release);
+        return;
+    }
+}
+
+void LockStats::unregisterMutex(CK_VOID_PTR mutex) {
+    if(!isEnabled()) return;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    LockedMutex *lockedMutex = find(mutex);
+    if(lockedMutex != NULL) lockedMutex->mutex.store(NULL, std::memory_order_release);
+}
+
+void LockStats::acquired(CK_VOID_PTR mutex, uint64_t waitNs, void *site) {
+    LockedMutex *lockedMutex = find(mutex);
+    if(lockedMutex == NULL) return;
+
+    LockCounters &counters = *lockedMutex->counters;
+    counters.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    counters.waitNs.fetch_add(waitNs, std::memory_order_relaxed);
+    counters.waitHistogram.record(waitNs);
+
+    lockedMutex->acquiredNs = nowNs();
+    lockedMutex->site = site;
+}
+
+void LockStats::released(CK_VOID_PTR mutex) {
+    LockedMutex *lockedMutex = find(mutex);
+    if(lockedMutex == NULL || lockedMutex->acquiredNs == 0) return;
+
+    uint64_t holdNs = nowNs() - lockedMutex->acquiredNs;
+    lockedMutex->acquiredNs = 0;
+
+    LockCounters &counters = *lockedMutex->counters;
+    counters.holdNs.fetch_add(holdNs, std::memory_order_relaxed);
+    counters.holdHistogram.record(holdNs);
+
+    // Mutexes of one name may set the maximum at once, so its site
+    // may belong to a hold just short of the maximum
+    uint64_t holdMaxNs = counters.holdMaxNs.load(std::memory_order_relaxed);
+    while(holdNs > holdMaxNs) {
+        if(counters.holdMaxNs.compare_exchange_weak(holdMaxNs, holdNs, std::memory_order_relaxed)) {
+            counters.holdMaxSite.store(lockedMutex->site, std::memory_order_relaxed);
+            break;
+        }
+    }
+}
+
+// The function the address is in, and how far into it
+static std::string describeSite(void *site) {
+    if(site == NULL) return "unknown";
+
+    char description[256];
+
+    Dl_info info;
+    if(dladdr(site, &info) == 0) {
+        snprintf(description, sizeof(description), "%p", site);
+        return description;
+    }
+
+    if(info.dli_sname == NULL) {
+        const char *file = info.dli_fname != NULL ? strrchr(info.dli_fname, '/') : NULL;
+        snprintf(description, sizeof(description), "%s+0x%lx", file != NULL ? file + 1 : "?",
+                 (unsigned long)((char *)site - (char *)info.dli_fbase));
+        return description;
+    }
+
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+
+    // Without the parameter list
+    std::string function = status == 0 ? demangled : info.dli_sname;
+    free(demangled);
+
+    size_t parameters = function.find('(');
+    if(parameters != std::string::npos) function.erase(parameters);
+
+    snprintf(description, sizeof(description), "+0x%lx", (unsigned long)((char *)site - (char *)info.dli_saddr));
+    return function + description;
+}
+
+std::vector<LockSummary> LockStats::summarize() {
+    std::vector<LockSummary> summaries;
+
+    for(LockCounters &counters : lockCounters) {
+        LockSummary summary;
+        summary.name = counters.name.load(std::memory_order_acquire);
+        if(summary.name == NULL) break;
+
+        summary.acquisitions = counters.acquisitions.load(std::memory_order_relaxed);
+        if(summary.acquisitions == 0) continue;
+
+        std::vector<uint64_t> buckets(LatencyHistogram::BUCKETS, 0);
+        counters.waitHistogram.addTo(buckets);
+
+        summary.waitNs = counters.waitNs.load(std::memory_order_relaxed);
+        summary.waitMaxNs = counters.waitHistogram.getMax();
+        summary.waitP50Ns = LatencyHistogram::percentile(buckets, 0.5, summary.waitMaxNs);
+        summary.waitP99Ns = LatencyHistogram::percentile(buckets, 0.99, summary.waitMaxNs);
+
+        buckets.assign(LatencyHistogram::BUCKETS, 0);
+        counters.holdHistogram.addTo(buckets);
+
+        summary.holdNs = counters.holdNs.load(std::memory_order_relaxed);
+        summary.holdMaxNs = counters.holdMaxNs.load(std::memory_order_relaxed);
+        summary.holdP50Ns = LatencyHistogram::percentile(buckets, 0.5, summary.holdMaxNs);
+        summary.holdP99Ns = LatencyHistogram::percentile(buckets, 0.99, summary.holdMaxNs);
+        summary.holdMaxSite = describeSite(counters.holdMaxSite.load(std::memory_order_relaxed));
+
+        summaries.push_back(summary);
+    }
+
+    return summaries;
+}
+
+void LockStats::logStatistics() {
+    if(!isEnabled()) return;
+
+    for(const LockSummary &summary : summarize()) {
+        INFO_MSG("Lock %s: %llu acquisitions, wait %.1f us total, p50 %.1f us, p99 %.1f us, max %.1f us; "
+                 "hold %.1f us total, p50 %.1f us, p99 %.1f us, max %.1f us in %s.",
+                 summary.name, (unsigned long long)summary.acquisitions,
+                 summary.waitNs / 1000.0, summary.waitP50Ns / 1000.0, summary.waitP99Ns / 1000.0, summary.waitMaxNs / 1000.0,
+                 summary.holdNs / 1000.0, summary.holdP50Ns / 1000.0, summary.holdP99Ns / 1000.0, summary.holdMaxNs / 1000.0,
+                 summary.holdMaxSite.c_str());
+    }
+}
@@ -0,0 +1,68 @@
+/**
+ * This class measures Qryptoki's own mutexes, turned on by
+ * QRYPT_LOCK_STATS=1: how long threads wait to take each lock, how
+ * long they hold it, and the code that held it longest. It covers
+ * the OS mutexes and those made by the application's CK_CREATEMUTEX
+ * alike, since it times GlobalData's lock and unlock wrappers rather
+ * than the mutexes themselves.
+ *
+ * Mutexes are registered under a name when GlobalData creates them;
+ * mutexes of the same name (one per replica group, say) are counted
+ * together. Counts are kept for the life of the process, and are
+ * logged by C_Finalize and served by the metrics exporter.
+ */
+
+#ifndef _QRYPT_WRAPPER_LOCKSTATS_H
+#define _QRYPT_WRAPPER_LOCKSTATS_H
+
+#include <stdint.h>     // uint64_t
+
+#include <string>       // std::string
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+// The code that called the function this is used in
+#ifdef __GNUC__
+#define QRYPT_CALL_SITE() __builtin_return_address(0)
+#else
+#define QRYPT_CALL_SITE() NULL
+#endif
+
+// One name's mutexes
+struct LockSummary {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t waitNs;
+    uint64_t waitP50Ns;
+    uint64_t waitP99Ns;
+    uint64_t waitMaxNs;
+    uint64_t holdNs;
+    uint64_t holdP50Ns;
+    uint64_t holdP99Ns;
+    uint64_t holdMaxNs;
+    std::string holdMaxSite;    // Function and offset that took the lock
+};
+
+class LockStats {
+    public:
+        // Read from QRYPT_LOCK_STATS once
+        static bool isEnabled();
+
+        // Mutexes past the first 32 registered aren't measured
+        static void registerMutex(CK_VOID_PTR mutex, const char *name);
+        static void unregisterMutex(CK_VOID_PTR mutex);
+
+        // Once the mutex is taken, after a wait of waitNs
+        static void acquired(CK_VOID_PTR mutex, uint64_t waitNs, void *site);
+
+        // Just before the mutex is given back
+        static void released(CK_VOID_PTR mutex);
+
+        // The names whose mutexes were taken so far
+        static std::vector<LockSummary> summarize();
+
+        static void logStatistics();
+};
+
+#endif /* !_QRYPT_WRAPPER_LOCKSTATS_H */
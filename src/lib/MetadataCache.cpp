@@ -0,0 +1,191 @@
+#include "log.h"        // logging macros
+#include "GlobalData.h" // GlobalData
+
+#include "MetadataCache.h"
+
+MetadataCache::MetadataCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex) {
+    this->ttl = ttl;
+    this->mutex = mutex;
+
+    this->generation = 0;
+    this->hits = 0;
+    this->misses = 0;
+}
+
+CK_VOID_PTR MetadataCache::getMutex() {
+    return this->mutex;
+}
+
+template<typename K, typename T>
+bool MetadataCache::lookup(std::map<K, MetadataEntry<T>> &entries, const K &key, T &value) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return false;
+
+    bool found = false;
+
+    try {
+        auto it = entries.find(key);
+        if(it != entries.end()) {
+            if(it->second.expiry > std::chrono::steady_clock::now()) {
+                value = it->second.value;
+                found = true;
+            } else {
+                entries.erase(it);
+            }
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+
+    if(found)
+        this->hits++;
+    else
+        this->misses++;
+
+    return found;
+}
+
+template<typename K, typename T>
+void MetadataCache::insert(std::map<K, MetadataEntry<T>> &entries, const K &key, unsigned long long generation, const T &value) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    try {
+        if(generation == this->generation) {
+            MetadataEntry<T> &entry = entries[key];
+            entry.expiry = std::chrono::steady_clock::now() + this->ttl;
+            entry.value = value;
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+CK_RV MetadataCache::getSlotList(CK_BBOOL tokenPresent, std::vector<CK_SLOT_ID> &slotList) {
+    CK_BBOOL key = tokenPresent ? CK_TRUE : CK_FALSE;
+    if(lookup(this->slotLists, key, slotList)) return CKR_OK;
+
+    unsigned long long generation = this->generation;
+
+    CK_RV rv = GlobalData::getInstance().getSlotList(tokenPresent, slotList);
+    if(rv != CKR_OK) return rv;
+
+    insert(this->slotLists, key, generation, slotList);
+    return CKR_OK;
+}
+
+CK_RV MetadataCache::getSlotInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_SLOT_INFO &info) {
+    if(lookup(this->slotInfo, slotID, info)) return CKR_OK;
+
+    unsigned long long generation = this->generation;
+
+    CK_C_GetSlotInfo Base_C_GetSlotInfo = (CK_C_GetSlotInfo)module->getFunction("C_GetSlotInfo");
+    if(Base_C_GetSlotInfo == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_GetSlotInfo)(baseSlotID, &info);
+    if(rv != CKR_OK) return rv;
+
+    insert(this->slotInfo, slotID, generation, info);
+    return CKR_OK;
+}
+
+CK_RV MetadataCache::getTokenInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_TOKEN_INFO &info) {
+    if(lookup(this->tokenInfo, slotID, info)) return CKR_OK;
+
+    unsigned long long generation = this->generation;
+
+    CK_C_GetTokenInfo Base_C_GetTokenInfo = (CK_C_GetTokenInfo)module->getFunction("C_GetTokenInfo");
+    if(Base_C_GetTokenInfo == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_GetTokenInfo)(baseSlotID, &info);
+    if(rv != CKR_OK) return rv;
+
+    insert(this->tokenInfo, slotID, generation, info);
+    return CKR_OK;
+}
+
+CK_RV MetadataCache::getMechanismList(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, std::vector<CK_MECHANISM_TYPE> &mechanisms) {
+    if(lookup(this->mechanismLists, slotID, mechanisms)) return CKR_OK;
+
+    unsigned long long generation = this->generation;
+
+    CK_C_GetMechanismList Base_C_GetMechanismList = (CK_C_GetMechanismList)module->getFunction("C_GetMechanismList");
+    if(Base_C_GetMechanismList == NULL) return CKR_GENERAL_ERROR;
+
+    // The list can't grow between the two calls unless the token
+    // changes, but retry if it does
+    CK_RV rv;
+    do {
+        CK_ULONG count = 0;
+        rv = (*Base_C_GetMechanismList)(baseSlotID, NULL_PTR, &count);
+        if(rv != CKR_OK) return rv;
+
+        mechanisms.resize(count);
+        rv = (*Base_C_GetMechanismList)(baseSlotID, mechanisms.data(), &count);
+        if(rv == CKR_OK) mechanisms.resize(count);
+    } while(rv == CKR_BUFFER_TOO_SMALL);
+
+    if(rv != CKR_OK) return rv;
+
+    insert(this->mechanismLists, slotID, generation, mechanisms);
+    return CKR_OK;
+}
+
+CK_RV MetadataCache::getMechanismInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO &info) {
+    std::pair<CK_SLOT_ID, CK_MECHANISM_TYPE> key(slotID, type);
+    if(lookup(this->mechanismInfo, key, info)) return CKR_OK;
+
+    unsigned long long generation = this->generation;
+
+    CK_C_GetMechanismInfo Base_C_GetMechanismInfo = (CK_C_GetMechanismInfo)module->getFunction("C_GetMechanismInfo");
+    if(Base_C_GetMechanismInfo == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_GetMechanismInfo)(baseSlotID, type, &info);
+    if(rv != CKR_OK) return rv;
+
+    insert(this->mechanismInfo, key, generation, info);
+    return CKR_OK;
+}
+
+void MetadataCache::slotChanged(CK_SLOT_ID slotID) {
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    // Which slots have a token may have changed too
+    this->slotLists.clear();
+    this->slotInfo.erase(slotID);
+    this->tokenInfo.erase(slotID);
+    this->mechanismLists.erase(slotID);
+
+    for(auto it = this->mechanismInfo.begin(); it != this->mechanismInfo.end();) {
+        if(it->first.first == slotID)
+            it = this->mechanismInfo.erase(it);
+        else
+            it++;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void MetadataCache::tokenChanged(CK_SLOT_ID slotID) {
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    this->tokenInfo.erase(slotID);
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void MetadataCache::logStatistics() {
+    unsigned long hits = this->hits;
+    unsigned long misses = this->misses;
+    if(hits + misses == 0) return;
+
+    INFO_MSG("Metadata cache: %lu of %lu queries answered from the cache.", hits, hits + misses);
+}
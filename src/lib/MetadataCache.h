@@ -0,0 +1,79 @@
+/**
+ * This class caches slot, token and mechanism metadata, which
+ * OpenSSL engines and NSS re-read on every connection setup but
+ * which only changes when a token is inserted, removed or
+ * (re)initialized.
+ *
+ * Entries expire after the TTL, and a slot's entries are dropped
+ * when a slot event for it is seen, either by the application's
+ * own C_WaitForSlotEvent or by SlotEventWatcher. Token info is
+ * also dropped when Qryptoki sees a call that changes its PIN
+ * flags or free memory, and its session counts are always filled
+ * in from Qryptoki's own session table.
+ */
+
+#ifndef _QRYPT_WRAPPER_METADATACACHE_H
+#define _QRYPT_WRAPPER_METADATACACHE_H
+
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <map>          // std::map
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+#include "BaseHSM.h"    // BaseHSM
+
+template<typename T>
+struct MetadataEntry {
+    std::chrono::steady_clock::time_point expiry;
+    T value;
+};
+
+class MetadataCache {
+    public:
+        MetadataCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex);
+
+        CK_VOID_PTR getMutex();
+
+        // Each of these answers from the cache, or asks the base HSM
+        // and caches a successful answer
+        CK_RV getSlotList(CK_BBOOL tokenPresent, std::vector<CK_SLOT_ID> &slotList);
+        CK_RV getSlotInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_SLOT_INFO &info);
+        CK_RV getTokenInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_TOKEN_INFO &info);
+        CK_RV getMechanismList(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, std::vector<CK_MECHANISM_TYPE> &mechanisms);
+        CK_RV getMechanismInfo(CK_SLOT_ID slotID, BaseHSM *module, CK_SLOT_ID baseSlotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO &info);
+
+        // A token was inserted, removed or replaced
+        void slotChanged(CK_SLOT_ID slotID);
+
+        // The token's PIN state, label or free memory may have changed
+        void tokenChanged(CK_SLOT_ID slotID);
+
+        void logStatistics();
+    private:
+        std::chrono::milliseconds ttl;
+        CK_VOID_PTR mutex;
+
+        std::map<CK_BBOOL, MetadataEntry<std::vector<CK_SLOT_ID>>> slotLists;
+        std::map<CK_SLOT_ID, MetadataEntry<CK_SLOT_INFO>> slotInfo;
+        std::map<CK_SLOT_ID, MetadataEntry<CK_TOKEN_INFO>> tokenInfo;
+        std::map<CK_SLOT_ID, MetadataEntry<std::vector<CK_MECHANISM_TYPE>>> mechanismLists;
+        std::map<std::pair<CK_SLOT_ID, CK_MECHANISM_TYPE>, MetadataEntry<CK_MECHANISM_INFO>> mechanismInfo;
+
+        // Bumped by every invalidation, so answers fetched across one
+        // aren't cached
+        std::atomic<unsigned long long> generation;
+
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        template<typename K, typename T>
+        bool lookup(std::map<K, MetadataEntry<T>> &entries, const K &key, T &value);
+
+        template<typename K, typename T>
+        void insert(std::map<K, MetadataEntry<T>> &entries, const K &key, unsigned long long generation, const T &value);
+};
+
+#endif /* !_QRYPT_WRAPPER_METADATACACHE_H */
@@ -0,0 +1,314 @@
+#include <errno.h>              // errno
+#include <netinet/in.h>         // sockaddr_in
+#include <poll.h>               // poll
+#include <stdint.h>             // uint64_t
+#include <stdio.h>              // snprintf
+#include <stdlib.h>             // strtoul
+#include <string.h>             // memset, strncpy
+#include <sys/eventfd.h>        // eventfd
+#include <sys/socket.h>         // socket, bind, listen, accept
+#include <sys/un.h>             // sockaddr_un
+#include <unistd.h>             // close, getpid, unlink
+
+#include <sstream>              // std::stringstream
+#include <system_error>         // std::system_error
+
+#include "qryptoki_pkcs11_vendor_defs.h" // CK_QRYPT_STATISTICS
+#include "log.h"                // logging macros
+#include "EntropyStats.h"       // EntropyStats
+#include "LatencyStats.h"       // LatencyStats
+#include "LockStats.h"          // LockStats
+
+#include "MetricsExporter.h"
+
+// Scrapes are small; a client that doesn't send its request by then
+// is dropped, so it can't hold up the next one
+const int METRICS_REQUEST_TIMEOUT_MS = 1000;
+
+static std::system_error socketError(const char *what) {
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+MetricsExporter::MetricsExporter(const std::string &address) {
+    this->listenFd = -1;
+
+    this->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(this->stopFd < 0) throw socketError("eventfd");
+
+    if(!address.empty() && address[0] == '/') {
+        // Per-process sockets: %p is the process ID
+        std::string path = address;
+        size_t pid = path.find("%p");
+        if(pid != std::string::npos) path.replace(pid, 2, std::to_string(getpid()));
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if(path.size() >= sizeof(addr.sun_path)) {
+            close(this->stopFd);
+            throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+        }
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        this->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        // A socket left behind by an earlier process with the same ID
+        unlink(path.c_str());
+
+        if(this->listenFd < 0 || bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            std::system_error error = socketError(path.c_str());
+            if(this->listenFd >= 0) close(this->listenFd);
+            close(this->stopFd);
+            throw error;
+        }
+
+        this->socketPath = path;
+    } else {
+        char *end;
+        unsigned long port = strtoul(address.c_str(), &end, 10);
+        if(address.empty() || *end != '\0' || port == 0 || port > 65535) {
+            close(this->stopFd);
+            throw std::system_error(EINVAL, std::generic_category(), address);
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        this->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        int reuse = 1;
+        if(this->listenFd >= 0) setsockopt(this->listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if(this->listenFd < 0 || bind(this->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            std::system_error error = socketError(address.c_str());
+            if(this->listenFd >= 0) close(this->listenFd);
+            close(this->stopFd);
+            throw error;
+        }
+    }
+
+    if(listen(this->listenFd, 8) != 0) {
+        std::system_error error = socketError("listen");
+        close(this->listenFd);
+        close(this->stopFd);
+        if(!this->socketPath.empty()) unlink(this->socketPath.c_str());
+        throw error;
+    }
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+
+    close(this->listenFd);
+    close(this->stopFd);
+
+    if(!this->socketPath.empty()) unlink(this->socketPath.c_str());
+}
+
+void MetricsExporter::start() {
+    this->thread = std::thread(&MetricsExporter::serve, this);
+}
+
+void MetricsExporter::stop() {
+    if(!this->thread.joinable()) return;
+
+    uint64_t value = 1;
+    if(write(this->stopFd, &value, sizeof(value)) != sizeof(value))
+        ERROR_MSG("Could not signal the metrics exporter to stop (errno = %d).", errno);
+
+    this->thread.join();
+}
+
+void MetricsExporter::serve() {
+    struct pollfd fds[2];
+    fds[0].fd = this->listenFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = this->stopFd;
+    fds[1].events = POLLIN;
+
+    while(true) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+
+            ERROR_MSG("Metrics exporter stopped: poll failed (errno = %d).", errno);
+            return;
+        }
+
+        if(fds[1].revents != 0) return;
+        if(fds[0].revents == 0) continue;
+
+        int clientFd = accept4(this->listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if(clientFd < 0) continue;
+
+        try {
+            answer(clientFd);
+        } catch (...) {
+            DEBUG_MSG("Could not answer a metrics scrape.");
+        }
+
+        close(clientFd);
+    }
+}
+
+void MetricsExporter::answer(int clientFd) {
+    // Any request gets the metrics; read until the end of its headers
+    std::string request;
+    char buffer[1024];
+
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        struct pollfd fd = { clientFd, POLLIN, 0 };
+        if(poll(&fd, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0) return;
+
+        ssize_t received = read(clientFd, buffer, sizeof(buffer));
+        if(received <= 0) return;
+
+        request.append(buffer, received);
+    }
+
+    std::string body = render();
+
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while(sent < response.size()) {
+        ssize_t written = send(clientFd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if(written <= 0) return;
+
+        sent += written;
+    }
+}
+
+static void metric(std::stringstream &out, const char *name, const char *type, const char *help, unsigned long value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << value << "\n";
+}
+
+static void secondsMetric(std::stringstream &out, const char *name, const char *type, const char *help, unsigned long us) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << us / 1e6 << "\n";
+}
+
+static void renderLocks(std::stringstream &out) {
+    std::vector<LockSummary> summaries = LockStats::summarize();
+
+    out << "# HELP qryptoki_lock_wait_seconds Time spent waiting to take Qryptoki's mutexes, by lock.\n";
+    out << "# TYPE qryptoki_lock_wait_seconds summary\n";
+    for(const LockSummary &summary : summaries) {
+        std::string labels = std::string("lock=\"") + summary.name + "\"";
+
+        out << "qryptoki_lock_wait_seconds{" << labels << ",quantile=\"0.5\"} " << summary.waitP50Ns / 1e9 << "\n";
+        out << "qryptoki_lock_wait_seconds{" << labels << ",quantile=\"0.99\"} " << summary.waitP99Ns / 1e9 << "\n";
+        out << "qryptoki_lock_wait_seconds{" << labels << ",quantile=\"1\"} " << summary.waitMaxNs / 1e9 << "\n";
+        out << "qryptoki_lock_wait_seconds_sum{" << labels << "} " << summary.waitNs / 1e9 << "\n";
+        out << "qryptoki_lock_wait_seconds_count{" << labels << "} " << summary.acquisitions << "\n";
+    }
+
+    out << "# HELP qryptoki_lock_hold_seconds Time Qryptoki's mutexes were held, by lock.\n";
+    out << "# TYPE qryptoki_lock_hold_seconds summary\n";
+    for(const LockSummary &summary : summaries) {
+        std::string labels = std::string("lock=\"") + summary.name + "\"";
+
+        out << "qryptoki_lock_hold_seconds{" << labels << ",quantile=\"0.5\"} " << summary.holdP50Ns / 1e9 << "\n";
+        out << "qryptoki_lock_hold_seconds{" << labels << ",quantile=\"0.99\"} " << summary.holdP99Ns / 1e9 << "\n";
+        out << "qryptoki_lock_hold_seconds{" << labels << ",quantile=\"1\"} " << summary.holdMaxNs / 1e9 << "\n";
+        out << "qryptoki_lock_hold_seconds_sum{" << labels << "} " << summary.holdNs / 1e9 << "\n";
+        out << "qryptoki_lock_hold_seconds_count{" << labels << "} " << summary.acquisitions << "\n";
+    }
+}
+
+std::string MetricsExporter::render() {
+    std::stringstream out;
+
+    CK_QRYPT_STATISTICS statistics;
+    EntropyStats::getInstance().getStatistics(statistics);
+
+    metric(out, "qryptoki_random_requests_total", "counter", "Random requests made of Qryptoki.", statistics.ulRandomRequests);
+    metric(out, "qryptoki_random_failures_total", "counter", "Random requests that failed.", statistics.ulRandomFailures);
+    metric(out, "qryptoki_random_bytes_served_total", "counter", "Random bytes returned.", statistics.ulBytesServed);
+    metric(out, "qryptoki_random_buffer_bytes_served_total", "counter", "Random bytes returned from the buffer of EaaS leftovers.", statistics.ulBytesFromReservoir);
+    metric(out, "qryptoki_random_buffer_bytes", "gauge", "Random bytes waiting in the buffers.", statistics.ulReservoirFill);
+    metric(out, "qryptoki_random_buffer_capacity_bytes", "gauge", "Size of the random buffers.", statistics.ulReservoirCapacity);
+    secondsMetric(out, "qryptoki_random_lock_wait_seconds_total", "counter", "Time spent waiting for the random buffer lock.", statistics.ulLockWaitUs);
+    secondsMetric(out, "qryptoki_random_lock_wait_max_seconds", "gauge", "Longest wait for the random buffer lock.", statistics.ulLockWaitMaxUs);
+
+    metric(out, "qryptoki_eaas_requests_total", "counter", "Requests made to EaaS.", statistics.ulEaasRequests);
+    metric(out, "qryptoki_eaas_failures_total", "counter", "EaaS requests that failed.", statistics.ulEaasFailures);
+    metric(out, "qryptoki_eaas_retries_total", "counter", "EaaS requests following a failed one.", statistics.ulEaasRetries);
+    metric(out, "qryptoki_eaas_bytes_fetched_total", "counter", "Random bytes received from EaaS.", statistics.ulBytesFetched);
+    metric(out, "qryptoki_eaas_bytes_wasted_total", "counter", "Random bytes received from EaaS and dropped unserved.", statistics.ulBytesWasted);
+
+    out << "# HELP qryptoki_eaas_fetch_seconds Latency of EaaS requests.\n";
+    out << "# TYPE qryptoki_eaas_fetch_seconds summary\n";
+    out << "qryptoki_eaas_fetch_seconds{quantile=\"0.5\"} " << statistics.ulFetchLatencyP50Us / 1e6 << "\n";
+    out << "qryptoki_eaas_fetch_seconds{quantile=\"0.9\"} " << statistics.ulFetchLatencyP90Us / 1e6 << "\n";
+    out << "qryptoki_eaas_fetch_seconds{quantile=\"0.99\"} " << statistics.ulFetchLatencyP99Us / 1e6 << "\n";
+    out << "qryptoki_eaas_fetch_seconds{quantile=\"1\"} " << statistics.ulFetchLatencyMaxUs / 1e6 << "\n";
+    out << "qryptoki_eaas_fetch_seconds_count " << statistics.ulEaasRequests << "\n";
+
+    metric(out, "qryptoki_eaas_transfers_total", "counter", "EaaS requests that got an HTTP response.", statistics.ulTransfers);
+    metric(out, "qryptoki_eaas_transfers_failed_total", "counter", "EaaS requests that curl gave up on before an HTTP response.", statistics.ulTransfersFailed);
+    metric(out, "qryptoki_eaas_transfers_reusing_connection_total", "counter", "EaaS transfers that needed no new connection.", statistics.ulTransfersReusingConnection);
+    metric(out, "qryptoki_eaas_transfers_http2_total", "counter", "EaaS transfers made over HTTP/2.", statistics.ulTransfersOverHttp2);
+    metric(out, "qryptoki_eaas_bytes_downloaded_total", "counter", "Bytes of EaaS response bodies, before decoding.", statistics.ulBytesDownloaded);
+
+    const struct {
+        const char *phase;
+        unsigned long p50Us;
+        unsigned long p99Us;
+    } phases[] = {
+        { "dns", statistics.ulDnsP50Us, statistics.ulDnsP99Us },
+        { "connect", statistics.ulConnectP50Us, statistics.ulConnectP99Us },
+        { "tls", statistics.ulTlsP50Us, statistics.ulTlsP99Us },
+        { "server_wait", statistics.ulServerWaitP50Us, statistics.ulServerWaitP99Us },
+        { "receive", statistics.ulReceiveP50Us, statistics.ulReceiveP99Us },
+    };
+
+    out << "# HELP qryptoki_eaas_phase_seconds Time EaaS transfers spent in each phase; dns, connect and tls only for new connections.\n";
+    out << "# TYPE qryptoki_eaas_phase_seconds summary\n";
+    for(const auto &phase : phases) {
+        out << "qryptoki_eaas_phase_seconds{phase=\"" << phase.phase << "\",quantile=\"0.5\"} " << phase.p50Us / 1e6 << "\n";
+        out << "qryptoki_eaas_phase_seconds{phase=\"" << phase.phase << "\",quantile=\"0.99\"} " << phase.p99Us / 1e6 << "\n";
+    }
+
+    if(LockStats::isEnabled()) renderLocks(out);
+
+    if(!LatencyStats::isEnabled()) return out.str();
+
+    std::vector<FunctionLatencySummary> summaries = LatencyStats::summarize();
+
+    out << "# HELP qryptoki_pkcs11_errors_total PKCS#11 calls that returned an error, by function.\n";
+    out << "# TYPE qryptoki_pkcs11_errors_total counter\n";
+    for(const FunctionLatencySummary &summary : summaries) {
+        const char *side = summary.base ? "base" : "application";
+        out << "qryptoki_pkcs11_errors_total{function=\"" << summary.function << "\",side=\"" << side << "\"} " << summary.errors << "\n";
+    }
+
+    out << "# HELP qryptoki_pkcs11_call_seconds Latency of PKCS#11 calls made by the application and on the base HSMs.\n";
+    out << "# TYPE qryptoki_pkcs11_call_seconds summary\n";
+    for(const FunctionLatencySummary &summary : summaries) {
+        std::string labels = std::string("function=\"") + summary.function + "\",side=\"" + (summary.base ? "base" : "application") + "\"";
+
+        out << "qryptoki_pkcs11_call_seconds{" << labels << ",quantile=\"0.5\"} " << summary.p50Ns / 1e9 << "\n";
+        out << "qryptoki_pkcs11_call_seconds{" << labels << ",quantile=\"0.9\"} " << summary.p90Ns / 1e9 << "\n";
+        out << "qryptoki_pkcs11_call_seconds{" << labels << ",quantile=\"0.99\"} " << summary.p99Ns / 1e9 << "\n";
+        out << "qryptoki_pkcs11_call_seconds_sum{" << labels << "} " << summary.totalNs / 1e9 << "\n";
+        out << "qryptoki_pkcs11_call_seconds_count{" << labels << "} " << summary.calls << "\n";
+    }
+
+    out << "# HELP qryptoki_pkcs11_base_seconds_total Time application calls spent in base HSM calls.\n";
+    out << "# TYPE qryptoki_pkcs11_base_seconds_total counter\n";
+    for(const FunctionLatencySummary &summary : summaries) {
+        if(summary.base) continue;
+
+        out << "qryptoki_pkcs11_base_seconds_total{function=\"" << summary.function << "\"} " << summary.baseNs / 1e9 << "\n";
+    }
+
+    return out.str();
+}
@@ -0,0 +1,42 @@
+/**
+ * This class serves Qryptoki's counters in the Prometheus text
+ * format, over HTTP on a Unix socket or a localhost TCP port given
+ * by QRYPT_METRICS_LISTEN, so a scraper (or a proxy in front of the
+ * socket) can read them from inside any host process.
+ *
+ * One thread accepts and answers scrapes. It only reads the relaxed
+ * atomic counters kept by EntropyStats and LatencyStats, so scraping
+ * never holds up the calls being counted.
+ */
+
+#ifndef _QRYPT_WRAPPER_METRICSEXPORTER_H
+#define _QRYPT_WRAPPER_METRICSEXPORTER_H
+
+#include <string>       // std::string
+#include <thread>       // std::thread
+
+class MetricsExporter {
+    public:
+        // A Unix socket path starting with '/', in which %p stands for
+        // the process ID, or a TCP port to listen on at 127.0.0.1.
+        // Throws std::system_error if it can't listen there.
+        MetricsExporter(const std::string &address);
+        ~MetricsExporter();
+
+        void start();
+        void stop();
+
+        // The scrape body
+        static std::string render();
+    private:
+        std::string socketPath;     // Empty for TCP
+        int listenFd;
+        int stopFd;                 // An eventfd that wakes the thread to stop
+
+        std::thread thread;
+
+        void serve();
+        void answer(int clientFd);
+};
+
+#endif /* !_QRYPT_WRAPPER_METRICSEXPORTER_H */
@@ -0,0 +1,126 @@
+/**
+ * This class is a bounded queue that any number of threads can push
+ * to and pop from at once without a lock (Dmitry Vyukov's design, as
+ * in the log ring). Each slot's sequence number says whether it is
+ * free for the push with that ticket or holds the value for the pop
+ * with it, so threads only contend on the two ticket counters.
+ *
+ * LocalRing has the same interface for a queue only one thread uses.
+ */
+
+#ifndef _QRYPT_WRAPPER_MPMCRING_H
+#define _QRYPT_WRAPPER_MPMCRING_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // intptr_t
+
+#include <atomic>       // std::atomic
+
+template <typename T, size_t Capacity>
+class MpmcRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+        MpmcRing() {
+            for(size_t i = 0; i < Capacity; i++) this->slots[i].sequence.store(i, std::memory_order_relaxed);
+
+            this->pushTicket.store(0, std::memory_order_relaxed);
+            this->popTicket.store(0, std::memory_order_relaxed);
+        }
+
+        MpmcRing(MpmcRing const&) = delete;
+        void operator=(MpmcRing const&) = delete;
+
+        // False if the ring is full
+        bool push(const T &value) {
+            size_t ticket = this->pushTicket.load(std::memory_order_relaxed);
+
+            while(true) {
+                Slot &slot = this->slots[ticket & (Capacity - 1)];
+                intptr_t lag = (intptr_t)(slot.sequence.load(std::memory_order_acquire) - ticket);
+
+                if(lag == 0) {
+                    if(this->pushTicket.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                        slot.value = value;
+                        slot.sequence.store(ticket + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if(lag < 0) {
+                    return false;
+                } else {
+                    ticket = this->pushTicket.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // False if the ring is empty
+        bool pop(T &value) {
+            size_t ticket = this->popTicket.load(std::memory_order_relaxed);
+
+            while(true) {
+                Slot &slot = this->slots[ticket & (Capacity - 1)];
+                intptr_t lag = (intptr_t)(slot.sequence.load(std::memory_order_acquire) - (ticket + 1));
+
+                if(lag == 0) {
+                    if(this->popTicket.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                        value = slot.value;
+                        slot.sequence.store(ticket + Capacity, std::memory_order_release);
+                        return true;
+                    }
+                } else if(lag < 0) {
+                    return false;
+                } else {
+                    ticket = this->popTicket.load(std::memory_order_relaxed);
+                }
+            }
+        }
+    private:
+        struct Slot {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        Slot slots[Capacity];
+
+        // Apart by a cache line, as pushers and poppers are usually
+        // different threads. Padded rather than aligned, since C++14's
+        // new doesn't honour over-alignment.
+        char padding[64];
+        std::atomic<size_t> pushTicket;
+        char morePadding[64];
+        std::atomic<size_t> popTicket;
+};
+
+template <typename T, size_t Capacity>
+class LocalRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+        LocalRing() : pushTicket(0), popTicket(0) {}
+
+        LocalRing(LocalRing const&) = delete;
+        void operator=(LocalRing const&) = delete;
+
+        // False if the ring is full
+        bool push(const T &value) {
+            if(this->pushTicket - this->popTicket == Capacity) return false;
+
+            this->slots[this->pushTicket++ & (Capacity - 1)] = value;
+            return true;
+        }
+
+        // False if the ring is empty
+        bool pop(T &value) {
+            if(this->pushTicket == this->popTicket) return false;
+
+            value = this->slots[this->popTicket++ & (Capacity - 1)];
+            return true;
+        }
+    private:
+        T slots[Capacity];
+
+        size_t pushTicket;
+        size_t popTicket;
+};
+
+#endif /* !_QRYPT_WRAPPER_MPMCRING_H */
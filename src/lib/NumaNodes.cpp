@@ -0,0 +1,115 @@
+#include <stdio.h>              // fopen, fscanf
+
+#ifdef __linux__
+#include <linux/mempolicy.h>    // MPOL_BIND
+#include <sched.h>              // sched_getcpu
+#include <sys/syscall.h>        // SYS_mbind
+#include <unistd.h>             // syscall
+#endif
+
+#include <string>               // std::string
+#include <vector>               // std::vector
+
+#include "NumaNodes.h"
+
+#ifdef __linux__
+const char NODE_SYSFS[] = "/sys/devices/system/node";
+
+// Reads a sysfs list such as "0-3,8,10-11", calling f on each number
+template <typename F>
+static bool readList(const std::string &path, F f) {
+    FILE *file = fopen(path.c_str(), "r");
+    if(file == NULL) return false;
+
+    unsigned long lo, hi;
+    char separator;
+
+    while(fscanf(file, "%lu", &lo) == 1) {
+        hi = lo;
+        separator = '\n';
+
+        if(fscanf(file, "%c", &separator) == 1 && separator == '-') {
+            if(fscanf(file, "%lu", &hi) != 1) break;
+            if(fscanf(file, "%c", &separator) != 1) separator = '\n';
+        }
+
+        for(unsigned long i = lo; i <= hi; i++) f(i);
+
+        if(separator != ',') break;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Each CPU's node, indexed by CPU number
+static const std::vector<size_t> &cpuNodes() {
+    static const std::vector<size_t> nodes = [] {
+        std::vector<size_t> nodes;
+
+        for(size_t node = 0; node < NumaNodes::count(); node++) {
+            std::string path = std::string(NODE_SYSFS) + "/node" + std::to_string(node) + "/cpulist";
+
+            readList(path, [&](unsigned long cpu) {
+                if(cpu >= nodes.size()) nodes.resize(cpu + 1, 0);
+                nodes[cpu] = node;
+            });
+        }
+
+        return nodes;
+    }();
+
+    return nodes;
+}
+
+size_t NumaNodes::count() {
+    static const size_t nodes = [] {
+        size_t nodes = 1;
+
+        // Not "possible", which on many systems lists nodes that
+        // will never exist
+        readList(std::string(NODE_SYSFS) + "/online", [&](unsigned long node) {
+            if(node + 1 > nodes) nodes = node + 1;
+        });
+
+        return nodes;
+    }();
+
+    return nodes;
+}
+
+size_t NumaNodes::current() {
+    if(count() == 1) return 0;
+
+    // From the vDSO or rseq, so no system call
+    int cpu = sched_getcpu();
+
+    const std::vector<size_t> &nodes = cpuNodes();
+    if(cpu < 0 || (size_t)cpu >= nodes.size()) return 0;
+
+    return nodes[cpu];
+}
+
+bool NumaNodes::bindMemory(void *addr, size_t len, size_t node) {
+    const size_t BITS = 8 * sizeof(unsigned long);
+
+    std::vector<unsigned long> mask(count() / BITS + 1, 0);
+    mask[node / BITS] |= 1UL << (node % BITS);
+
+    // Moves pages the allocator had already touched elsewhere. The
+    // kernel reads one bit fewer than maxnode says.
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, mask.data(), mask.size() * BITS + 1, MPOL_MF_MOVE) == 0;
+}
+#else
+size_t NumaNodes::count() {
+    return 1;
+}
+
+size_t NumaNodes::current() {
+    return 0;
+}
+
+bool NumaNodes::bindMemory(void *addr, size_t len, size_t node) {
+    return false;
+}
+#endif
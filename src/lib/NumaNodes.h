@@ -0,0 +1,28 @@
+/**
+ * This class tells which NUMA node the calling thread runs on and
+ * binds memory to a node, for the per-node random buffers. It reads
+ * the topology from sysfs and calls mbind directly, so Qryptoki needs
+ * no libnuma. Off Linux, or where sysfs doesn't say, there is one
+ * node, 0.
+ */
+
+#ifndef _QRYPT_WRAPPER_NUMANODES_H
+#define _QRYPT_WRAPPER_NUMANODES_H
+
+#include <stddef.h>     // size_t
+
+class NumaNodes {
+    public:
+        // One more than the highest online node, read once
+        static size_t count();
+
+        // The node of the CPU the caller is running on, which may have
+        // changed by the time it is used
+        static size_t current();
+
+        // Puts addr's pages, which must be page aligned, on node;
+        // false if the kernel wouldn't
+        static bool bindMemory(void *addr, size_t len, size_t node);
+};
+
+#endif /* !_QRYPT_WRAPPER_NUMANODES_H */
@@ -0,0 +1,192 @@
+#include <vector>               // std::vector
+
+#include "log.h"                // logging macros
+#include "GlobalData.h"         // mutex functions
+#include "SoftwareOffload.h"    // make*PublicKey
+
+#include "PublicKeyCache.h"
+
+// Bounds memory use if an application verifies with many keys
+const size_t PUBLIC_KEY_CACHE_MAX_ENTRIES = 1024;
+
+PublicKeyCache::PublicKeyCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex) {
+    this->ttl = ttl;
+    this->mutex = mutex;
+
+    this->generation = 0;
+    this->hits = 0;
+    this->misses = 0;
+}
+
+CK_VOID_PTR PublicKeyCache::getMutex() {
+    return this->mutex;
+}
+
+bool PublicKeyCache::getPublicKey(Session &session, CK_OBJECT_HANDLE hKey, PublicKey &publicKey) {
+    if(lookup(session.slotID, hKey, publicKey)) {
+        this->hits++;
+        return true;
+    }
+
+    this->misses++;
+
+    unsigned long long generation = this->generation;
+    if(!fetch(session, hKey, publicKey)) return false;
+
+    insert(session.slotID, hKey, generation, publicKey);
+    return true;
+}
+
+bool PublicKeyCache::lookup(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey, PublicKey &publicKey) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return false;
+
+    auto it = this->entries.find(std::make_pair(slotID, hKey));
+    bool found = it != this->entries.end();
+
+    if(found && it->second.expiry <= std::chrono::steady_clock::now()) {
+        this->entries.erase(it);
+        found = false;
+    }
+
+    if(found) publicKey = it->second.publicKey;
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    return found;
+}
+
+void PublicKeyCache::insert(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey, unsigned long long generation, const PublicKey &publicKey) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    try {
+        std::pair<CK_SLOT_ID, CK_OBJECT_HANDLE> key(slotID, hKey);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if(generation == this->generation) {
+            if(this->entries.size() >= PUBLIC_KEY_CACHE_MAX_ENTRIES && this->entries.count(key) == 0) {
+                for(auto it = this->entries.begin(); it != this->entries.end();) {
+                    if(it->second.expiry <= now)
+                        it = this->entries.erase(it);
+                    else
+                        it++;
+                }
+
+                if(this->entries.size() >= PUBLIC_KEY_CACHE_MAX_ENTRIES) this->entries.clear();
+            }
+
+            PublicKeyCacheEntry &entry = this->entries[key];
+            entry.expiry = now + this->ttl;
+            entry.publicKey = publicKey;
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void PublicKeyCache::invalidate(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey) {
+    // Reads under way can't be cached any more, even if the lock fails
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    this->entries.erase(std::make_pair(slotID, hKey));
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void PublicKeyCache::invalidate(CK_SLOT_ID slotID) {
+    this->generation++;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    for(auto it = this->entries.begin(); it != this->entries.end();) {
+        if(it->first.first == slotID)
+            it = this->entries.erase(it);
+        else
+            it++;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void PublicKeyCache::logStatistics() {
+    unsigned long hits = this->hits;
+    unsigned long misses = this->misses;
+    if(hits + misses == 0) return;
+
+    INFO_MSG("Public key cache: %lu of %lu keys found in the cache.", hits, hits + misses);
+}
+
+// Reads two variable-length attributes; false if either is missing
+static bool readPair(CK_C_GetAttributeValue Base_C_GetAttributeValue, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey,
+                     CK_ATTRIBUTE_TYPE first, CK_ATTRIBUTE_TYPE second, std::vector<CK_BYTE> &firstValue, std::vector<CK_BYTE> &secondValue, CK_RV &rv) {
+    CK_ATTRIBUTE attributes[] = {
+        {first, NULL_PTR, 0},
+        {second, NULL_PTR, 0}
+    };
+
+    rv = (*Base_C_GetAttributeValue)(hSession, hKey, attributes, 2);
+    if(rv != CKR_OK) return false;
+
+    firstValue.resize(attributes[0].ulValueLen);
+    secondValue.resize(attributes[1].ulValueLen);
+    attributes[0].pValue = firstValue.data();
+    attributes[1].pValue = secondValue.data();
+
+    rv = (*Base_C_GetAttributeValue)(hSession, hKey, attributes, 2);
+    if(rv != CKR_OK) return false;
+
+    firstValue.resize(attributes[0].ulValueLen);
+    secondValue.resize(attributes[1].ulValueLen);
+    return !firstValue.empty() && !secondValue.empty();
+}
+
+// Whether the base HSM's answer says for certain the object can't be used
+static bool isDefinite(CK_RV rv) {
+    return rv == CKR_OK || rv == CKR_ATTRIBUTE_SENSITIVE || rv == CKR_ATTRIBUTE_TYPE_INVALID;
+}
+
+bool PublicKeyCache::fetch(Session &session, CK_OBJECT_HANDLE hKey, PublicKey &publicKey) {
+    CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)session.module->getFunction("C_GetAttributeValue");
+    if(Base_C_GetAttributeValue == NULL) return false;
+
+    CK_OBJECT_CLASS objectClass = CK_UNAVAILABLE_INFORMATION;
+    CK_KEY_TYPE keyType = CK_UNAVAILABLE_INFORMATION;
+    CK_BBOOL canVerify = CK_FALSE;
+    CK_BBOOL canVerifyRecover = CK_FALSE;
+
+    CK_ATTRIBUTE attributes[] = {
+        {CKA_CLASS, &objectClass, sizeof(objectClass)},
+        {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+        {CKA_VERIFY, &canVerify, sizeof(canVerify)},
+        {CKA_VERIFY_RECOVER, &canVerifyRecover, sizeof(canVerifyRecover)}
+    };
+
+    CK_RV rv = (*Base_C_GetAttributeValue)(session.baseSession, hKey, attributes, sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    if(!isDefinite(rv)) return false;
+
+    publicKey.keyType = attributes[1].ulValueLen == sizeof(keyType) ? keyType : CK_UNAVAILABLE_INFORMATION;
+    publicKey.canVerify = attributes[2].ulValueLen == sizeof(canVerify) && canVerify == CK_TRUE;
+    publicKey.canVerifyRecover = attributes[3].ulValueLen == sizeof(canVerifyRecover) && canVerifyRecover == CK_TRUE;
+    publicKey.key.reset();
+
+    if(attributes[0].ulValueLen != sizeof(objectClass) || objectClass != CKO_PUBLIC_KEY) return true;
+
+    std::vector<CK_BYTE> first, second;
+
+    if(publicKey.keyType == CKK_RSA) {
+        if(readPair(Base_C_GetAttributeValue, session.baseSession, hKey, CKA_MODULUS, CKA_PUBLIC_EXPONENT, first, second, rv))
+            publicKey.key = makeRsaPublicKey(first.data(), first.size(), second.data(), second.size());
+    } else if(publicKey.keyType == CKK_EC) {
+        if(readPair(Base_C_GetAttributeValue, session.baseSession, hKey, CKA_EC_PARAMS, CKA_EC_POINT, first, second, rv))
+            publicKey.key = makeEcPublicKey(first.data(), first.size(), second.data(), second.size());
+    }
+
+    if(publicKey.key == NULL && !isDefinite(rv)) return false;
+
+    if(publicKey.key == NULL) DEBUG_MSG("Public key %lu can't be used in software; verifying with it on the base HSM.", hKey);
+
+    return true;
+}
@@ -0,0 +1,70 @@
+/**
+ * This class caches public keys read from the base HSM in a form
+ * OpenSSL can use, so that verify operations with them can be done
+ * in software (see SoftwareOffload.h) without reading the key's
+ * attributes each time.
+ *
+ * Entries are keyed by slot and object handle, and dropped on the
+ * same events as AttributeCache entries. Objects that can't be used
+ * in software are cached too, so that they go straight to the base
+ * HSM.
+ */
+
+#ifndef _QRYPT_WRAPPER_PUBLICKEYCACHE_H
+#define _QRYPT_WRAPPER_PUBLICKEYCACHE_H
+
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::steady_clock
+#include <map>                  // std::map
+#include <memory>               // std::shared_ptr
+#include <utility>              // std::pair
+
+#include <openssl/evp.h>        // EVP_PKEY
+
+#include "cryptoki.h"           // PKCS#11 types
+
+#include "Session.h"            // Session
+
+struct PublicKey {
+    CK_KEY_TYPE keyType;
+    bool canVerify;
+    bool canVerifyRecover;
+    std::shared_ptr<EVP_PKEY> key;  // NULL if the object can't be used in software
+};
+
+struct PublicKeyCacheEntry {
+    std::chrono::steady_clock::time_point expiry;
+    PublicKey publicKey;
+};
+
+class PublicKeyCache {
+    public:
+        PublicKeyCache(std::chrono::milliseconds ttl, CK_VOID_PTR mutex);
+
+        CK_VOID_PTR getMutex();
+
+        // The key, read through the session's base session if it isn't
+        // cached. Returns false if it couldn't be read; key is NULL for
+        // objects that can't be used in software.
+        bool getPublicKey(Session &session, CK_OBJECT_HANDLE hKey, PublicKey &publicKey);
+
+        void invalidate(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey);
+        void invalidate(CK_SLOT_ID slotID);
+
+        void logStatistics();
+    private:
+        std::chrono::milliseconds ttl;
+        CK_VOID_PTR mutex;
+
+        std::map<std::pair<CK_SLOT_ID, CK_OBJECT_HANDLE>, PublicKeyCacheEntry> entries;
+        std::atomic<unsigned long long> generation;
+
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        bool lookup(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey, PublicKey &publicKey);
+        void insert(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hKey, unsigned long long generation, const PublicKey &publicKey);
+        bool fetch(Session &session, CK_OBJECT_HANDLE hKey, PublicKey &publicKey);
+};
+
+#endif /* !_QRYPT_WRAPPER_PUBLICKEYCACHE_H */
@@ -1,36 +1,317 @@
 /**
  * This class stores extra random from EaaS to prevent waste.
+ *
+ * The leftovers are cut into blocks that are handed out through a
+ * lock-free ring, so that a request the buffer can serve whole needs
+ * no lock (takeReserved). A block partly used goes back on the ring
+ * with what is left of it. Requests that need EaaS go through
+ * getRandom, one thread at a time.
+ *
+ * With QRYPT_NUMA_RESERVOIRS, GlobalData keeps one per NUMA node.
+ *
+ * The buffer is a template, so that each use gets code built for it:
+ *  - Collector is the RandomCollector type; a final class has its
+ *    collectRandom called directly.
+ *  - Capacity is the buffer's size in bytes.
+ *  - Blocks is ConcurrentBlocks, for a buffer threads share, or
+ *    SingleThreadBlocks, which keeps the same books without atomics.
+ *  - Wipe moves bytes out of the buffer, zeroing them as it goes, and
+ *    wipes what is left.
+ * RandomBuffer and SingleThreadRandomBuffer are the library's two,
+ * built once in RandomBuffer.cpp.
  */
 
 #ifndef _QRYPT_WRAPPER_RANDOMBUFFER_H
 #define _QRYPT_WRAPPER_RANDOMBUFFER_H
 
+#include <atomic>
+#include <cstdlib>             // free
 #include <memory>
 #include <sys/mman.h>          // m(un)lock
 
+#include <openssl/crypto.h>    // OPENSSL_cleanse
+
 #include "cryptoki.h"          // CK_RV
 
+#include "copywipe.h"          // copyAndWipe
+#include "log.h"               // DEBUG_MSG
+#include "EntropyStats.h"      // EntropyStats
+#include "MpmcRing.h"          // MpmcRing, LocalRing
 #include "RandomCollector.h"   // RandomCollector
+#include "probes.h"            // QRYPT_PROBE
+
+// The buffer is handed out in blocks of this many bytes
+const size_t RANDOM_BLOCK_SIZE = 64;
 
 struct BufferDeleter {
+    size_t size;
+
     void operator() (uint8_t *buffer_ptr) const {
-        munlock(buffer_ptr, KB * sizeof(uint8_t));
+        munlock(buffer_ptr, this->size);
         free(buffer_ptr);
     }
 };
 
-class RandomBuffer {
+// Returns size zeroed bytes, page aligned and locked in memory (on
+// node, if it isn't -1); throws std::runtime_error if it can't
+uint8_t *allocateRandomBuffer(size_t size, int node);
+
+// For a buffer any number of threads use at once
+struct ConcurrentBlocks {
+    template <size_t Count>
+    using Ring = MpmcRing<uint8_t, Count>;
+
+    typedef std::atomic<size_t> Counter;
+};
+
+// For a buffer only one thread ever uses
+struct SingleThreadBlocks {
+    template <size_t Count>
+    using Ring = LocalRing<uint8_t, Count>;
+
+    typedef size_t Counter;
+};
+
+struct ZeroWipe {
+    // Copies n bytes from source to dest and zeroes them in source
+    static void take(uint8_t *dest, uint8_t *source, size_t n) {
+        copyAndWipe(dest, source, n);
+    }
+
+    static void wipe(uint8_t *buffer, size_t n) {
+        OPENSSL_cleanse(buffer, n);
+    }
+};
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+class BasicRandomBuffer {
+    static_assert(Capacity % RANDOM_BLOCK_SIZE == 0 && Capacity / RANDOM_BLOCK_SIZE <= 256,
+                  "Capacity must be whole blocks, at most 256 of them");
+
     public:
-        RandomBuffer(std::shared_ptr<RandomCollector> randomCollector);
-        ~RandomBuffer();
+        // With a node, the buffer's pages are put on that NUMA node
+        BasicRandomBuffer(std::shared_ptr<Collector> randomCollector, int node = -1);
+        ~BasicRandomBuffer();
 
+        // Takes all goal bytes from the buffer, or none if it holds
+        // fewer. Any number of threads may call it, along with the
+        // thread in getRandom.
+        bool takeReserved(uint8_t *dest, size_t goal);
+
+        // Takes what the buffer holds and the rest from EaaS. Only one
+        // thread at a time.
         CK_RV getRandom(uint8_t *dest, size_t goal);
-        void wipe();
     private:
+        static const size_t BLOCKS = Capacity / RANDOM_BLOCK_SIZE;
+
         std::unique_ptr<uint8_t, BufferDeleter> buffer;
-        size_t buffer_len;
 
-        std::shared_ptr<RandomCollector> randomCollector;
+        // Bytes left at the start of each block, touched only by the
+        // thread that popped the block
+        size_t blockLength[BLOCKS];
+
+        typename Blocks::template Ring<BLOCKS> fullBlocks;  // Holding bytes
+        typename Blocks::template Ring<BLOCKS> freeBlocks;
+        typename Blocks::Counter buffer_len;
+
+        std::shared_ptr<Collector> randomCollector;
+
+        // Copies and wipes up to goal bytes from the end of a popped
+        // block, then pushes it back where it belongs
+        size_t takeFromBlock(uint8_t block, uint8_t *dest, size_t goal);
+
+        // Moves source into free blocks; bytes that find none are
+        // wasted. Leaves source zeroed.
+        void putLeftovers(uint8_t *source, size_t length);
 };
 
-#endif /* !_QRYPT_WRAPPER_RANDOMBUFFER_H */
\ No newline at end of file
+typedef BasicRandomBuffer<RandomCollector, KB, ConcurrentBlocks, ZeroWipe> RandomBuffer;
+
+// For when the application asks for no locking and Qryptoki starts no
+// thread that draws random
+typedef BasicRandomBuffer<RandomCollector, KB, SingleThreadBlocks, ZeroWipe> SingleThreadRandomBuffer;
+
+extern template class BasicRandomBuffer<RandomCollector, KB, ConcurrentBlocks, ZeroWipe>;
+extern template class BasicRandomBuffer<RandomCollector, KB, SingleThreadBlocks, ZeroWipe>;
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::BasicRandomBuffer(std::shared_ptr<Collector> randomCollector, int node) {
+    this->randomCollector = randomCollector;
+
+    this->buffer = std::unique_ptr<uint8_t, BufferDeleter>(allocateRandomBuffer(Capacity, node), BufferDeleter{Capacity});
+    this->buffer_len = 0;
+
+    for(size_t block = 0; block < BLOCKS; block++) {
+        this->blockLength[block] = 0;
+        this->freeBlocks.push((uint8_t)block);
+    }
+
+    EntropyStats::getInstance().addReservoir(Capacity);
+}
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::~BasicRandomBuffer() {
+    EntropyStats::getInstance().recordWasted(this->buffer_len);
+    EntropyStats::getInstance().removeReservoir(Capacity, this->buffer_len);
+
+    // Bytes are zeroed as they are taken, so only what is left at the
+    // start of each block still holds random
+    for(size_t block = 0; block < BLOCKS; block++)
+        Wipe::wipe(&this->buffer.get()[block * RANDOM_BLOCK_SIZE], this->blockLength[block]);
+
+    this->buffer_len = 0;
+}
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+size_t BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::takeFromBlock(uint8_t block, uint8_t *dest, size_t goal) {
+    uint8_t *blockStart = &this->buffer.get()[block * RANDOM_BLOCK_SIZE];
+
+    size_t bytesFromBlock = goal < this->blockLength[block] ? goal : this->blockLength[block];
+
+    size_t lo = this->blockLength[block] - bytesFromBlock;
+    Wipe::take(dest, &blockStart[lo], bytesFromBlock);
+
+    this->blockLength[block] = lo;
+    this->buffer_len -= bytesFromBlock;
+
+    // Neither ring can be full, as each block is on at most one
+    if(lo != 0)
+        this->fullBlocks.push(block);
+    else
+        this->freeBlocks.push(block);
+
+    return bytesFromBlock;
+}
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+void BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::putLeftovers(uint8_t *source, size_t length) {
+    uint8_t block;
+    size_t stored = 0;
+
+    while(length != 0 && this->freeBlocks.pop(block)) {
+        size_t bytesToBlock = length < RANDOM_BLOCK_SIZE ? length : RANDOM_BLOCK_SIZE;
+
+        Wipe::take(&this->buffer.get()[block * RANDOM_BLOCK_SIZE], source, bytesToBlock);
+        this->blockLength[block] = bytesToBlock;
+        this->buffer_len += bytesToBlock;
+
+        this->fullBlocks.push(block);
+
+        source += bytesToBlock;
+        length -= bytesToBlock;
+        stored += bytesToBlock;
+    }
+
+    EntropyStats::getInstance().recordRefill(stored);
+
+    // Blocks were still out with takeReserved callers
+    if(length != 0) {
+        Wipe::wipe(source, length);
+        EntropyStats::getInstance().recordWasted(length);
+    }
+}
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+bool BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::takeReserved(uint8_t *dest, size_t goal) {
+    if(this->buffer_len < goal) return false;
+
+    // Gather enough blocks before taking from any, so that a request
+    // the buffer can't cover leaves it as it was
+    uint8_t held[BLOCKS];
+    size_t heldCount = 0;
+    size_t available = 0;
+
+    while(available < goal && this->fullBlocks.pop(held[heldCount])) {
+        available += this->blockLength[held[heldCount]];
+        heldCount++;
+    }
+
+    if(available < goal) {
+        for(size_t i = 0; i < heldCount; i++) this->fullBlocks.push(held[i]);
+        return false;
+    }
+
+    size_t bytesFromBuffer = 0;
+    for(size_t i = 0; i < heldCount; i++)
+        bytesFromBuffer += this->takeFromBlock(held[i], &dest[bytesFromBuffer], goal - bytesFromBuffer);
+
+    if(bytesFromBuffer > 0) {
+        EntropyStats::getInstance().recordReservoir(bytesFromBuffer);
+        QRYPT_PROBE(reservoir__hit, bytesFromBuffer, (size_t)this->buffer_len);
+    }
+
+    return true;
+}
+
+template <typename Collector, size_t Capacity, typename Blocks, typename Wipe>
+CK_RV BasicRandomBuffer<Collector, Capacity, Blocks, Wipe>::getRandom(uint8_t *dest, size_t goal) {
+    // First... take all you can/need from buffer
+
+    size_t bytesFromBuffer = 0;
+    uint8_t block;
+
+    while(bytesFromBuffer < goal && this->fullBlocks.pop(block))
+        bytesFromBuffer += this->takeFromBlock(block, &dest[bytesFromBuffer], goal - bytesFromBuffer);
+
+    DEBUG_MSG("Put %zu bytes from buffer into output", bytesFromBuffer);
+
+    if(bytesFromBuffer > 0) {
+        EntropyStats::getInstance().recordReservoir(bytesFromBuffer);
+        QRYPT_PROBE(reservoir__hit, bytesFromBuffer, (size_t)this->buffer_len);
+    }
+
+    if(goal == bytesFromBuffer) return CKR_OK;
+
+    // Then... take from EaaS
+
+    uint8_t *next_dest = &dest[bytesFromBuffer];
+    size_t bytesFromEaaS = goal - bytesFromBuffer;
+    size_t bytesFromEaasRoundUp = ((bytesFromEaaS + KB - 1) / KB) * KB;
+
+    QRYPT_PROBE(reservoir__miss, bytesFromEaaS);
+
+    // Whole KBs need no leftovers kept, so they go straight to dest
+    if(bytesFromEaaS == bytesFromEaasRoundUp) {
+        CK_RV rv = this->randomCollector->collectRandom(next_dest, bytesFromEaaS);
+
+        if(rv != CKR_OK) {
+            // A failed fetch may have written part of it
+            Wipe::wipe(next_dest, bytesFromEaaS);
+            return rv;
+        }
+
+        DEBUG_MSG("Pulled %zu bytes from EaaS into output", bytesFromEaaS);
+
+        return CKR_OK;
+    }
+
+    // Not make_unique, which would zero it first
+    std::unique_ptr<uint8_t[]> outputEaaS(new uint8_t[bytesFromEaasRoundUp]);
+    CK_RV rv = this->randomCollector->collectRandom(outputEaaS.get(), bytesFromEaasRoundUp);
+
+    if(rv != CKR_OK) {
+        // A failed fetch may have written part of it
+        Wipe::wipe(outputEaaS.get(), bytesFromEaasRoundUp);
+        return rv;
+    }
+
+    DEBUG_MSG("Pulled %zu bytes from EaaS", bytesFromEaasRoundUp);
+
+    // Zeroing outputEaaS as it goes, so nothing is left in it once
+    // freed
+    Wipe::take(next_dest, outputEaaS.get(), bytesFromEaaS);
+
+    DEBUG_MSG("Put %zu bytes from EaaS into output", bytesFromEaaS);
+
+    // ... and put leftovers in buffer
+
+    size_t leftover = bytesFromEaasRoundUp - bytesFromEaaS;
+
+    this->putLeftovers(&outputEaaS.get()[bytesFromEaaS], leftover);
+
+    DEBUG_MSG("Put %zu bytes from EaaS into buffer", leftover);
+
+    return CKR_OK;
+}
+
+#endif /* !_QRYPT_WRAPPER_RANDOMBUFFER_H */
@@ -0,0 +1,404 @@
+#include <climits>       // ULONG_MAX
+
+#include "log.h"         // logging macros
+#include "GlobalData.h"  // mutex functions
+
+#include "ReplicaGroup.h"
+
+// Whether a mechanism's parameter can be copied byte for byte, so
+// its C_*Init may be replayed later on another replica.
+bool isFlatMechanism(CK_MECHANISM_PTR pMechanism) {
+    if(pMechanism->pParameter == NULL_PTR || pMechanism->ulParameterLen == 0) return true;
+
+    switch(pMechanism->mechanism) {
+        case CKM_RSA_PKCS_PSS:
+        case CKM_SHA1_RSA_PKCS_PSS:
+        case CKM_SHA224_RSA_PKCS_PSS:
+        case CKM_SHA256_RSA_PKCS_PSS:
+        case CKM_SHA384_RSA_PKCS_PSS:
+        case CKM_SHA512_RSA_PKCS_PSS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char *initFunctionName(ReplicaOperationType type) {
+    switch(type) {
+        case REPLICA_OP_SIGN:
+            return "C_SignInit";
+        case REPLICA_OP_VERIFY:
+            return "C_VerifyInit";
+        case REPLICA_OP_ENCRYPT:
+            return "C_EncryptInit";
+        default:
+            return "";
+    }
+}
+
+ReplicaGroup::ReplicaGroup(CK_VOID_PTR keyMapMutex) {
+    this->keyMapMutex = keyMapMutex;
+    this->nextStart = 0;
+}
+
+void ReplicaGroup::addReplica(BaseHSM *module, CK_SLOT_ID slotID, CK_SLOT_ID baseSlotID) {
+    std::unique_ptr<Replica> replica = std::make_unique<Replica>();
+
+    replica->module = module;
+    replica->slotID = slotID;
+    replica->baseSlotID = baseSlotID;
+
+    replica->outstanding = 0;
+    replica->requests = 0;
+    replica->totalLatencyNs = 0;
+    replica->maxLatencyNs = 0;
+
+    this->replicas.push_back(std::move(replica));
+}
+
+CK_SLOT_ID ReplicaGroup::getSlotID() {
+    return this->replicas[0]->slotID;
+}
+
+bool ReplicaGroup::hasMember(CK_SLOT_ID slotID) {
+    for(auto &replica : this->replicas) {
+        if(replica->slotID == slotID) return true;
+    }
+
+    return false;
+}
+
+CK_VOID_PTR ReplicaGroup::getKeyMapMutex() {
+    return this->keyMapMutex;
+}
+
+CK_RV ReplicaGroup::openSession(Session &session, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify) {
+    session.replicaGroup = this;
+    session.replicaSessions.clear();
+
+    for(size_t i = 0; i < this->replicas.size(); i++) {
+        Replica *replica = this->replicas[i].get();
+
+        CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)replica->module->getFunction("C_OpenSession");
+        if(Base_C_OpenSession == NULL) return CKR_GENERAL_ERROR;
+
+        // Only the primary's session is visible to the application
+        ReplicaSession replicaSession = { replica, CK_INVALID_HANDLE, true };
+        CK_RV rv = (i == 0) ?
+            (*Base_C_OpenSession)(replica->baseSlotID, flags, pApplication, notify, &replicaSession.baseSession) :
+            (*Base_C_OpenSession)(replica->baseSlotID, flags, NULL_PTR, NULL_PTR, &replicaSession.baseSession);
+
+        if(rv != CKR_OK && i == 0) return rv;
+
+        if(rv != CKR_OK) {
+            WARNING_MSG("Could not open session on replica slot %lu (rv = %lu), leaving it out.", replica->slotID, rv);
+            replicaSession.usable = false;
+        }
+
+        session.replicaSessions.push_back(replicaSession);
+    }
+
+    session.module = this->replicas[0]->module;
+    session.baseSlotID = this->replicas[0]->baseSlotID;
+    session.baseSession = session.replicaSessions[0].baseSession;
+
+    return CKR_OK;
+}
+
+CK_RV ReplicaGroup::closeSession(Session &session) {
+    // Close the replicas first; only the primary's result matters
+    for(size_t i = 1; i < session.replicaSessions.size(); i++) {
+        ReplicaSession &replicaSession = session.replicaSessions[i];
+        if(replicaSession.baseSession == CK_INVALID_HANDLE) continue;
+
+        CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)replicaSession.replica->module->getFunction("C_CloseSession");
+        if(Base_C_CloseSession != NULL) (*Base_C_CloseSession)(replicaSession.baseSession);
+
+        replicaSession.baseSession = CK_INVALID_HANDLE;
+        replicaSession.usable = false;
+    }
+
+    CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)session.module->getFunction("C_CloseSession");
+    if(Base_C_CloseSession == NULL) return CKR_GENERAL_ERROR;
+
+    return (*Base_C_CloseSession)(session.baseSession);
+}
+
+CK_RV ReplicaGroup::closeAllSessions() {
+    CK_RV primaryRv = CKR_OK;
+
+    for(size_t i = 0; i < this->replicas.size(); i++) {
+        Replica *replica = this->replicas[i].get();
+
+        CK_C_CloseAllSessions Base_C_CloseAllSessions = (CK_C_CloseAllSessions)replica->module->getFunction("C_CloseAllSessions");
+        CK_RV rv = Base_C_CloseAllSessions == NULL ? CKR_GENERAL_ERROR : (*Base_C_CloseAllSessions)(replica->baseSlotID);
+
+        if(i == 0) primaryRv = rv;
+    }
+
+    return primaryRv;
+}
+
+CK_RV ReplicaGroup::login(Session &session, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    CK_C_Login Base_C_Login = (CK_C_Login)session.module->getFunction("C_Login");
+    if(Base_C_Login == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_Login)(session.baseSession, userType, pPin, ulPinLen);
+    if(rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) return rv;
+
+    // Every replica is a separate token, so each needs its own login
+    for(size_t i = 1; i < session.replicaSessions.size(); i++) {
+        ReplicaSession &replicaSession = session.replicaSessions[i];
+        if(!replicaSession.usable) continue;
+
+        CK_C_Login Replica_C_Login = (CK_C_Login)replicaSession.replica->module->getFunction("C_Login");
+        CK_RV replicaRv = Replica_C_Login == NULL ? CKR_GENERAL_ERROR : (*Replica_C_Login)(replicaSession.baseSession, userType, pPin, ulPinLen);
+
+        if(replicaRv != CKR_OK && replicaRv != CKR_USER_ALREADY_LOGGED_IN) {
+            WARNING_MSG("Login failed on replica slot %lu (rv = %lu), leaving it out.", replicaSession.replica->slotID, replicaRv);
+            replicaSession.usable = false;
+        }
+    }
+
+    return rv;
+}
+
+CK_RV ReplicaGroup::logout(Session &session) {
+    CK_C_Logout Base_C_Logout = (CK_C_Logout)session.module->getFunction("C_Logout");
+    if(Base_C_Logout == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_Logout)(session.baseSession);
+
+    for(size_t i = 1; i < session.replicaSessions.size(); i++) {
+        ReplicaSession &replicaSession = session.replicaSessions[i];
+        if(replicaSession.baseSession == CK_INVALID_HANDLE) continue;
+
+        CK_C_Logout Replica_C_Logout = (CK_C_Logout)replicaSession.replica->module->getFunction("C_Logout");
+        if(Replica_C_Logout != NULL) (*Replica_C_Logout)(replicaSession.baseSession);
+    }
+
+    return rv;
+}
+
+void ReplicaGroup::forgetKey(CK_OBJECT_HANDLE hKey) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->keyMapMutex) != CKR_OK) return;
+
+    for(auto it = this->keyMap.begin(); it != this->keyMap.end();) {
+        if(it->first.second == hKey)
+            it = this->keyMap.erase(it);
+        else
+            it++;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->keyMapMutex);
+}
+
+CK_RV ReplicaGroup::init(Session &session, ReplicaOperationType type, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    ReplicaOperation &operation = session.operations[type];
+
+    if(operation.active) return CKR_OPERATION_ACTIVE;
+    if(pMechanism == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+    operation.bound = false;
+    operation.replicaIndex = 0;
+    operation.mechanism = pMechanism->mechanism;
+    operation.hKey = hKey;
+
+    CK_BYTE_PTR parameter = (CK_BYTE_PTR)pMechanism->pParameter;
+    if(parameter == NULL_PTR)
+        operation.parameter.clear();
+    else
+        operation.parameter.assign(parameter, parameter + pMechanism->ulParameterLen);
+
+    operation.active = true;
+
+    // Parameters holding pointers can't be replayed later, so the
+    // operation is pinned to the primary right away
+    if(!isFlatMechanism(pMechanism)) {
+        CK_RV rv = bind(session, type, false);
+        if(rv != CKR_OK) operation.active = false;
+
+        return rv;
+    }
+
+    return CKR_OK;
+}
+
+void ReplicaGroup::end(Session &session, ReplicaOperationType type) {
+    session.operations[type].active = false;
+    session.operations[type].bound = false;
+}
+
+size_t ReplicaGroup::pickReplica(Session &session) {
+    size_t count = session.replicaSessions.size();
+
+    // Rotate the starting point so ties don't all land on one replica
+    size_t start = this->nextStart++ % count;
+
+    size_t best = 0;
+    unsigned long bestOutstanding = ULONG_MAX;
+
+    for(size_t k = 0; k < count; k++) {
+        size_t i = (start + k) % count;
+
+        ReplicaSession &replicaSession = session.replicaSessions[i];
+        if(!replicaSession.usable) continue;
+
+        unsigned long outstanding = replicaSession.replica->outstanding;
+        if(outstanding < bestOutstanding) {
+            best = i;
+            bestOutstanding = outstanding;
+        }
+    }
+
+    return best;
+}
+
+CK_RV ReplicaGroup::translateKey(Session &session, size_t replicaIndex, CK_OBJECT_HANDLE hKey, CK_OBJECT_HANDLE &hReplicaKey) {
+    if(replicaIndex == 0) {
+        hReplicaKey = hKey;
+        return CKR_OK;
+    }
+
+    std::pair<size_t, CK_OBJECT_HANDLE> key(replicaIndex, hKey);
+
+    CK_RV rv = GlobalData::getInstance().lockMutexIfNecessary(this->keyMapMutex);
+    if(rv != CKR_OK) return rv;
+
+    auto it = this->keyMap.find(key);
+    bool found = it != this->keyMap.end();
+    if(found) hReplicaKey = it->second;
+
+    rv = GlobalData::getInstance().unlockMutexIfNecessary(this->keyMapMutex);
+    if(rv != CKR_OK || found) return rv;
+
+    // Replicas share key material, not object handles, so find the
+    // replica's copy of the key by its class and CKA_ID
+    CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)session.module->getFunction("C_GetAttributeValue");
+    if(Base_C_GetAttributeValue == NULL) return CKR_GENERAL_ERROR;
+
+    CK_OBJECT_CLASS keyClass;
+    CK_BBOOL isToken;
+    CK_ATTRIBUTE attributes[] = {
+        { CKA_CLASS, &keyClass, sizeof(keyClass) },
+        { CKA_TOKEN, &isToken, sizeof(isToken) },
+        { CKA_ID, NULL_PTR, 0 }
+    };
+
+    rv = (*Base_C_GetAttributeValue)(session.baseSession, hKey, attributes, 3);
+    if(rv != CKR_OK) return rv;
+
+    // Session objects and keys without an ID only live on the primary
+    if(isToken != CK_TRUE || attributes[2].ulValueLen == 0) return CKR_KEY_HANDLE_INVALID;
+
+    std::vector<CK_BYTE> id(attributes[2].ulValueLen);
+    attributes[2].pValue = id.data();
+
+    rv = (*Base_C_GetAttributeValue)(session.baseSession, hKey, &attributes[2], 1);
+    if(rv != CKR_OK) return rv;
+
+    ReplicaSession &replicaSession = session.replicaSessions[replicaIndex];
+    BaseHSM *module = replicaSession.replica->module;
+
+    CK_C_FindObjectsInit Base_C_FindObjectsInit = (CK_C_FindObjectsInit)module->getFunction("C_FindObjectsInit");
+    CK_C_FindObjects Base_C_FindObjects = (CK_C_FindObjects)module->getFunction("C_FindObjects");
+    CK_C_FindObjectsFinal Base_C_FindObjectsFinal = (CK_C_FindObjectsFinal)module->getFunction("C_FindObjectsFinal");
+    if(Base_C_FindObjectsInit == NULL || Base_C_FindObjects == NULL || Base_C_FindObjectsFinal == NULL) return CKR_GENERAL_ERROR;
+
+    rv = (*Base_C_FindObjectsInit)(replicaSession.baseSession, attributes, 3);
+    if(rv != CKR_OK) return rv;
+
+    CK_OBJECT_HANDLE matches[2];
+    CK_ULONG matchCount = 0;
+    rv = (*Base_C_FindObjects)(replicaSession.baseSession, matches, 2, &matchCount);
+    (*Base_C_FindObjectsFinal)(replicaSession.baseSession);
+
+    if(rv != CKR_OK) return rv;
+    if(matchCount != 1) return CKR_KEY_HANDLE_INVALID;
+
+    rv = GlobalData::getInstance().lockMutexIfNecessary(this->keyMapMutex);
+    if(rv != CKR_OK) return rv;
+
+    try {
+        this->keyMap[key] = matches[0];
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->keyMapMutex);
+        throw;
+    }
+
+    hReplicaKey = matches[0];
+    return GlobalData::getInstance().unlockMutexIfNecessary(this->keyMapMutex);
+}
+
+CK_RV ReplicaGroup::bind(Session &session, ReplicaOperationType type, bool singlePart) {
+    ReplicaOperation &operation = session.operations[type];
+    if(operation.bound) return CKR_OK;
+
+    // Only single-part calls are spread out; multi-part ones stay on the primary
+    size_t replicaIndex = singlePart ? pickReplica(session) : 0;
+
+    CK_OBJECT_HANDLE hReplicaKey;
+    CK_RV rv = translateKey(session, replicaIndex, operation.hKey, hReplicaKey);
+    if(rv != CKR_OK) {
+        if(replicaIndex == 0) return rv;
+
+        DEBUG_MSG("Key %lu not found on replica slot %lu, using the primary.", operation.hKey, session.replicaSessions[replicaIndex].replica->slotID);
+        replicaIndex = 0;
+        hReplicaKey = operation.hKey;
+    }
+
+    ReplicaSession &target = session.replicaSessions[replicaIndex];
+
+    CK_C_SignInit Base_C_Init = (CK_C_SignInit)target.replica->module->getFunction(initFunctionName(type));
+    if(Base_C_Init == NULL) return CKR_GENERAL_ERROR;
+
+    CK_MECHANISM mechanism;
+    mechanism.mechanism = operation.mechanism;
+    mechanism.pParameter = operation.parameter.empty() ? NULL_PTR : operation.parameter.data();
+    mechanism.ulParameterLen = operation.parameter.size();
+
+    rv = (*Base_C_Init)(target.baseSession, &mechanism, hReplicaKey);
+    if(rv != CKR_OK) return rv;
+
+    operation.bound = true;
+    operation.replicaIndex = replicaIndex;
+
+    return CKR_OK;
+}
+
+void ReplicaGroup::record(Replica &replica, unsigned long long latencyNs) {
+    replica.requests++;
+    replica.totalLatencyNs += latencyNs;
+
+    unsigned long long max = replica.maxLatencyNs;
+    while(latencyNs > max && !replica.maxLatencyNs.compare_exchange_weak(max, latencyNs));
+}
+
+std::vector<ReplicaStatistics> ReplicaGroup::getStatistics() {
+    std::vector<ReplicaStatistics> statistics;
+
+    for(auto &replica : this->replicas) {
+        ReplicaStatistics entry;
+
+        entry.slotID = replica->slotID;
+        entry.outstanding = replica->outstanding;
+        entry.requests = replica->requests;
+        entry.totalLatencyNs = replica->totalLatencyNs;
+        entry.maxLatencyNs = replica->maxLatencyNs;
+
+        statistics.push_back(entry);
+    }
+
+    return statistics;
+}
+
+void ReplicaGroup::logStatistics() {
+    for(ReplicaStatistics &entry : getStatistics()) {
+        if(entry.requests == 0) continue;
+
+        unsigned long long meanUs = entry.requests == 0 ? 0 : entry.totalLatencyNs / entry.requests / 1000;
+
+        INFO_MSG("Replica slot %lu: %lu requests, mean latency %llu us, max latency %llu us.",
+            entry.slotID, entry.requests, meanUs, entry.maxLatencyNs / 1000);
+    }
+}
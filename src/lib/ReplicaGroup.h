@@ -0,0 +1,114 @@
+/**
+ * This class treats several base HSM slots holding the same key
+ * material as one logical token. Each Qryptoki session on the
+ * group holds a base session on every replica; single-part
+ * C_Sign, C_Verify and C_Encrypt calls go to whichever replica
+ * has the fewest requests in flight, while everything else stays
+ * on the primary (first) replica.
+ */
+
+#ifndef _QRYPT_WRAPPER_REPLICAGROUP_H
+#define _QRYPT_WRAPPER_REPLICAGROUP_H
+
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <map>          // std::map
+#include <memory>       // std::unique_ptr
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+#include "BaseHSM.h"    // BaseHSM
+#include "Session.h"    // Session, ReplicaSession, ReplicaOperation
+
+struct Replica {
+    BaseHSM *module;
+    CK_SLOT_ID slotID;        // Slot ID given to applications
+    CK_SLOT_ID baseSlotID;    // Slot ID on the base HSM
+
+    // Load and latency bookkeeping
+    std::atomic<unsigned long> outstanding;
+    std::atomic<unsigned long> requests;
+    std::atomic<unsigned long long> totalLatencyNs;
+    std::atomic<unsigned long long> maxLatencyNs;
+};
+
+struct ReplicaStatistics {
+    CK_SLOT_ID slotID;
+    unsigned long outstanding;
+    unsigned long requests;
+    unsigned long long totalLatencyNs;
+    unsigned long long maxLatencyNs;
+};
+
+class ReplicaGroup {
+    public:
+        ReplicaGroup(CK_VOID_PTR keyMapMutex);
+
+        void addReplica(BaseHSM *module, CK_SLOT_ID slotID, CK_SLOT_ID baseSlotID);
+
+        CK_SLOT_ID getSlotID();
+        bool hasMember(CK_SLOT_ID slotID);
+        CK_VOID_PTR getKeyMapMutex();
+
+        // Session lifetime, fanned out over every replica
+        CK_RV openSession(Session &session, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify);
+        CK_RV closeSession(Session &session);
+        CK_RV closeAllSessions();
+        CK_RV login(Session &session, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+        CK_RV logout(Session &session);
+        void forgetKey(CK_OBJECT_HANDLE hKey);
+
+        // Operations whose C_*Init is held back until the first call
+        // shows whether it is single-part (balanced) or multi-part (primary)
+        CK_RV init(Session &session, ReplicaOperationType type, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+
+        template<typename BaseCall>
+        CK_RV run(Session &session, ReplicaOperationType type, bool singlePart, BaseCall baseCall);
+        void end(Session &session, ReplicaOperationType type);
+
+        std::vector<ReplicaStatistics> getStatistics();
+        void logStatistics();
+    private:
+        std::vector<std::unique_ptr<Replica>> replicas;
+        std::atomic<unsigned long> nextStart;
+
+        // (replica index, primary object handle) -> object handle on that replica
+        std::map<std::pair<size_t, CK_OBJECT_HANDLE>, CK_OBJECT_HANDLE> keyMap;
+        CK_VOID_PTR keyMapMutex;
+
+        size_t pickReplica(Session &session);
+        CK_RV translateKey(Session &session, size_t replicaIndex, CK_OBJECT_HANDLE hKey, CK_OBJECT_HANDLE &hReplicaKey);
+        CK_RV bind(Session &session, ReplicaOperationType type, bool singlePart);
+        void record(Replica &replica, unsigned long long latencyNs);
+};
+
+template<typename BaseCall>
+CK_RV ReplicaGroup::run(Session &session, ReplicaOperationType type, bool singlePart, BaseCall baseCall) {
+    ReplicaOperation &operation = session.operations[type];
+
+    if(!operation.active) return CKR_OPERATION_NOT_INITIALIZED;
+
+    // Latency includes any C_*Init that bind() replays on the replica
+    auto start = std::chrono::steady_clock::now();
+
+    CK_RV rv = bind(session, type, singlePart);
+    if(rv != CKR_OK) {
+        end(session, type);
+        return rv;
+    }
+
+    ReplicaSession &target = session.replicaSessions[operation.replicaIndex];
+    Replica &replica = *target.replica;
+
+    replica.outstanding++;
+    rv = baseCall(replica.module, target.baseSession);
+    replica.outstanding--;
+
+    auto latency = std::chrono::steady_clock::now() - start;
+    record(replica, std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+
+    return rv;
+}
+
+#endif /* !_QRYPT_WRAPPER_REPLICAGROUP_H */
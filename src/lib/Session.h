@@ -0,0 +1,105 @@
+/**
+ * A session handed out by Qryptoki. Applications only ever see
+ * Qryptoki's handle; the base HSM (and the base session on it)
+ * that actually owns the session are recorded here.
+ */
+
+#ifndef _QRYPT_WRAPPER_SESSION_H
+#define _QRYPT_WRAPPER_SESSION_H
+
+#include <memory>             // std::unique_ptr
+#include <vector>             // std::vector
+
+#include "cryptoki.h"         // PKCS#11 types
+
+#include "BaseHSM.h"          // BaseHSM
+#include "SoftwareOffload.h"  // SoftwareDigest, SoftwareVerify
+#include "UpdateBuffer.h"     // UpdateBuffer
+
+class ReplicaGroup;
+struct Replica;
+
+// Operations that a ReplicaGroup may send to any replica
+enum ReplicaOperationType {
+    REPLICA_OP_SIGN = 0,
+    REPLICA_OP_VERIFY,
+    REPLICA_OP_ENCRYPT,
+    REPLICA_OP_COUNT
+};
+
+// Operations begun by a C_*Init call, as bits of Session::activeOperations
+enum SessionOperationFlags {
+    SESSION_OP_FIND           = 1 << 0,
+    SESSION_OP_ENCRYPT        = 1 << 1,
+    SESSION_OP_DECRYPT        = 1 << 2,
+    SESSION_OP_DIGEST         = 1 << 3,
+    SESSION_OP_SIGN           = 1 << 4,
+    SESSION_OP_SIGN_RECOVER   = 1 << 5,
+    SESSION_OP_VERIFY         = 1 << 6,
+    SESSION_OP_VERIFY_RECOVER = 1 << 7
+};
+
+// Multi-part operations whose C_*Update data may be gathered into
+// larger base HSM calls (see UpdateBuffer)
+enum BufferedOperationType {
+    BUFFERED_OP_DIGEST = 0,
+    BUFFERED_OP_SIGN,
+    BUFFERED_OP_VERIFY,
+    BUFFERED_OP_COUNT
+};
+
+struct ReplicaSession {
+    Replica *replica;
+    CK_SESSION_HANDLE baseSession;
+    bool usable;                     // False once a login on it failed
+};
+
+struct ReplicaOperation {
+    bool active;                     // C_*Init seen, operation not yet over
+    bool bound;                      // C_*Init sent to replicaSessions[replicaIndex]
+    size_t replicaIndex;
+
+    CK_MECHANISM_TYPE mechanism;
+    std::vector<CK_BYTE> parameter;  // Copy of the mechanism parameter
+    CK_OBJECT_HANDLE hKey;           // Key handle on the primary replica
+};
+
+struct Session {
+    CK_SESSION_HANDLE handle;        // Handle given to the application
+    CK_SLOT_ID slotID;               // Slot ID given to the application
+
+    BaseHSM *module;                 // Base HSM owning the session
+    CK_SLOT_ID baseSlotID;           // Slot ID on that base HSM
+    CK_SESSION_HANDLE baseSession;   // Session handle on that base HSM
+    CK_FLAGS flags;                  // Flags given to C_OpenSession
+
+    // Whether the base session may be handed to another application
+    // session once this one is closed (see SessionPool). Operations
+    // still in activeOperations then, such as a digest never
+    // finished, make the session be closed rather than reused.
+    bool reusable;                   // False once the base session holds objects or restored state
+    unsigned activeOperations;       // SESSION_OP_* flags begun and not seen to finish
+
+    // Search being answered from memory (see FindCache)
+    bool findActive;
+    std::vector<CK_OBJECT_HANDLE> findResults;
+    size_t findPosition;
+
+    // Update data not yet passed to the base HSM; allocated on first
+    // use when QRYPT_UPDATE_BUFFER_SIZE is set
+    std::unique_ptr<UpdateBuffer> pendingUpdates[BUFFERED_OP_COUNT];
+
+    // Operations done in software instead of on the base HSM, when
+    // QRYPT_SOFTWARE_OFFLOAD_TTL_MS is set; NULL or inactive otherwise
+    std::unique_ptr<SoftwareDigest> softwareDigest;
+    std::unique_ptr<SoftwareVerify> softwareVerify;
+    std::unique_ptr<SoftwareVerify> softwareVerifyRecover;
+
+    // Only used when slotID is a replica group. replicaSessions[0]
+    // is always the primary, i.e. module/baseSession above.
+    ReplicaGroup *replicaGroup;
+    std::vector<ReplicaSession> replicaSessions;
+    ReplicaOperation operations[REPLICA_OP_COUNT];
+};
+
+#endif /* !_QRYPT_WRAPPER_SESSION_H */
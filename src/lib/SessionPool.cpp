@@ -0,0 +1,215 @@
+#include "log.h"          // logging macros
+#include "GlobalData.h"   // GlobalData
+
+#include "SessionPool.h"
+
+SessionPool::SessionPool(size_t maxIdle, CK_VOID_PTR mutex) {
+    this->maxIdle = maxIdle;
+    this->mutex = mutex;
+
+    this->leases = 0;
+    this->reuses = 0;
+}
+
+CK_VOID_PTR SessionPool::getMutex() {
+    return this->mutex;
+}
+
+// Must be called with the mutex held
+PooledSlot &SessionPool::getPooledSlot(Session &session) {
+    auto it = this->slots.find(session.slotID);
+    if(it != this->slots.end()) return it->second;
+
+    PooledSlot &slot = this->slots[session.slotID];
+    slot.module = session.module;
+    slot.baseSlotID = session.baseSlotID;
+    slot.openSessions = 0;
+    slot.loggedIn = false;
+    slot.loginHeld = false;
+
+    return slot;
+}
+
+CK_RV SessionPool::lease(Session &session, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify) {
+    size_t rw = (flags & CKF_RW_SESSION) ? 1 : 0;
+
+    this->leases++;
+
+    // Notification callbacks are bound to the base session, so
+    // sessions that want them always get a fresh one
+    if(notify == NULL) {
+        CK_RV rv = GlobalData::getInstance().lockMutexIfNecessary(this->mutex);
+        if(rv != CKR_OK) return rv;
+
+        try {
+            PooledSlot &slot = getPooledSlot(session);
+            if(!slot.idle[rw].empty()) {
+                session.baseSession = slot.idle[rw].back();
+                slot.idle[rw].pop_back();
+
+                this->reuses++;
+                return GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+            }
+        } catch (...) {
+            GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+            throw;
+        }
+
+        rv = GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        if(rv != CKR_OK) return rv;
+    }
+
+    CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)session.module->getFunction("C_OpenSession");
+    if(Base_C_OpenSession == NULL) return CKR_GENERAL_ERROR;
+
+    CK_RV rv = (*Base_C_OpenSession)(session.baseSlotID, flags, pApplication, notify, &session.baseSession);
+    if(rv != CKR_OK) return rv;
+
+    rv = GlobalData::getInstance().lockMutexIfNecessary(this->mutex);
+    if(rv != CKR_OK) {
+        closeBaseSession(session.module, session.baseSession);
+        return rv;
+    }
+
+    try {
+        getPooledSlot(session).openSessions++;
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        closeBaseSession(session.module, session.baseSession);
+        throw;
+    }
+
+    return GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+CK_RV SessionPool::release(Session &session) {
+    size_t rw = (session.flags & CKF_RW_SESSION) ? 1 : 0;
+    bool clean = session.reusable && session.activeOperations == 0;
+
+    CK_RV rv = GlobalData::getInstance().lockMutexIfNecessary(this->mutex);
+    if(rv != CKR_OK) return rv;
+
+    try {
+        PooledSlot &slot = getPooledSlot(session);
+        if(clean && slot.idle[rw].size() < this->maxIdle) {
+            slot.idle[rw].push_back(session.baseSession);
+            return GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        }
+    } catch (...) {
+        GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+        throw;
+    }
+
+    rv = GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    if(rv != CKR_OK) return rv;
+
+    rv = closeBaseSession(session.module, session.baseSession);
+    if(rv == CKR_OK || rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED)
+        sessionClosed(session.slotID);
+
+    return rv;
+}
+
+CK_RV SessionPool::closeIdle(CK_SLOT_ID slotID) {
+    CK_RV rv = GlobalData::getInstance().lockMutexIfNecessary(this->mutex);
+    if(rv != CKR_OK) return rv;
+
+    auto it = this->slots.find(slotID);
+    if(it == this->slots.end()) return GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+
+    BaseHSM *module = it->second.module;
+    std::vector<CK_SESSION_HANDLE> idle[2];
+    idle[0].swap(it->second.idle[0]);
+    idle[1].swap(it->second.idle[1]);
+
+    rv = GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    if(rv != CKR_OK) return rv;
+
+    for(size_t rw = 0; rw < 2; rw++) {
+        for(CK_SESSION_HANDLE hBaseSession : idle[rw]) {
+            closeBaseSession(module, hBaseSession);
+            sessionClosed(slotID);
+        }
+    }
+
+    return CKR_OK;
+}
+
+void SessionPool::resetSlot(CK_SLOT_ID slotID) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    this->slots.erase(slotID);
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+bool SessionPool::isLoginHeld(CK_SLOT_ID slotID) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return false;
+
+    auto it = this->slots.find(slotID);
+    bool held = it != this->slots.end() && it->second.loggedIn && it->second.loginHeld;
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+    return held;
+}
+
+void SessionPool::recordLogin(CK_SLOT_ID slotID, CK_USER_TYPE userType) {
+    // Context-specific logins only cover the next operation
+    if(userType != CKU_USER && userType != CKU_SO) return;
+
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    auto it = this->slots.find(slotID);
+    if(it != this->slots.end()) {
+        it->second.loggedIn = true;
+        it->second.loginHeld = false;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void SessionPool::lastSessionClosed(CK_SLOT_ID slotID) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    auto it = this->slots.find(slotID);
+    if(it != this->slots.end()) it->second.loginHeld = it->second.loggedIn;
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void SessionPool::forgetLogin(CK_SLOT_ID slotID) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    auto it = this->slots.find(slotID);
+    if(it != this->slots.end()) it->second.loggedIn = false;
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
+
+void SessionPool::logStatistics() {
+    unsigned long leases = this->leases;
+    if(leases == 0) return;
+
+    INFO_MSG("Session pool: %lu of %lu sessions reused an idle base session.", (unsigned long)this->reuses, leases);
+}
+
+CK_RV SessionPool::closeBaseSession(BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+    CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)module->getFunction("C_CloseSession");
+    if(Base_C_CloseSession == NULL) return CKR_GENERAL_ERROR;
+
+    return (*Base_C_CloseSession)(hBaseSession);
+}
+
+void SessionPool::sessionClosed(CK_SLOT_ID slotID) {
+    if(GlobalData::getInstance().lockMutexIfNecessary(this->mutex) != CKR_OK) return;
+
+    auto it = this->slots.find(slotID);
+    if(it != this->slots.end() && it->second.openSessions > 0) {
+        it->second.openSessions--;
+
+        // Closing the last session logs the token out
+        if(it->second.openSessions == 0) it->second.loggedIn = false;
+    }
+
+    GlobalData::getInstance().unlockMutexIfNecessary(this->mutex);
+}
@@ -0,0 +1,84 @@
+/**
+ * This class keeps closed sessions' base sessions open for reuse,
+ * so that applications which open, log in, sign and close a
+ * session per request don't pay for C_OpenSession and
+ * C_CloseSession round trips to the base HSM each time.
+ *
+ * Only base sessions that are clean (no operation in progress,
+ * no session objects created) go back to the pool. Idle sessions
+ * keep the token logged in after the application closed its last
+ * session, so the pool remembers which slots it holds a login for.
+ */
+
+#ifndef _QRYPT_WRAPPER_SESSIONPOOL_H
+#define _QRYPT_WRAPPER_SESSIONPOOL_H
+
+#include <atomic>       // std::atomic
+#include <map>          // std::map
+#include <vector>       // std::vector
+
+#include "cryptoki.h"   // PKCS#11 types
+
+#include "BaseHSM.h"    // BaseHSM
+#include "Session.h"    // Session
+
+struct PooledSlot {
+    BaseHSM *module;
+    CK_SLOT_ID baseSlotID;
+
+    // Idle base sessions, indexed by whether CKF_RW_SESSION is set
+    std::vector<CK_SESSION_HANDLE> idle[2];
+
+    // Base sessions opened through the pool, leased or idle. The
+    // base HSM logs the token out when this drops to zero.
+    unsigned long openSessions;
+
+    // Login held by the slot's sessions, if known, and whether only
+    // idle sessions still hold it
+    bool loggedIn;
+    bool loginHeld;
+};
+
+class SessionPool {
+    public:
+        SessionPool(size_t maxIdle, CK_VOID_PTR mutex);
+
+        CK_VOID_PTR getMutex();
+
+        // Gives the session an idle base session, or opens a new one
+        CK_RV lease(Session &session, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify);
+
+        // Keeps the session's base session if it is clean and there
+        // is room, and closes it otherwise
+        CK_RV release(Session &session);
+
+        // Closes the slot's idle sessions, e.g. before C_InitToken
+        CK_RV closeIdle(CK_SLOT_ID slotID);
+
+        // Forgets the slot's sessions once the base HSM closed them all
+        void resetSlot(CK_SLOT_ID slotID);
+
+        // Login state shared by the slot's sessions. Once the
+        // application closed its last session on the slot, the login
+        // is held by the pool alone; the application's next C_Login
+        // must log it out first, so that the base HSM checks the PIN.
+        bool isLoginHeld(CK_SLOT_ID slotID);
+        void recordLogin(CK_SLOT_ID slotID, CK_USER_TYPE userType);
+        void lastSessionClosed(CK_SLOT_ID slotID);
+        void forgetLogin(CK_SLOT_ID slotID);
+
+        void logStatistics();
+    private:
+        size_t maxIdle;
+        CK_VOID_PTR mutex;
+        std::map<CK_SLOT_ID, PooledSlot> slots;
+
+        std::atomic<unsigned long> leases;
+        std::atomic<unsigned long> reuses;
+
+        PooledSlot &getPooledSlot(Session &session);
+        CK_RV closeBaseSession(BaseHSM *module, CK_SESSION_HANDLE hBaseSession);
+        void sessionClosed(CK_SLOT_ID slotID);
+};
+
+#endif /* !_QRYPT_WRAPPER_SESSIONPOOL_H */
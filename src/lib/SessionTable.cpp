@@ -0,0 +1,73 @@
+#include "SessionTable.h"
+
+SessionTable::SessionTable() {
+    this->nextHandle = 1;
+}
+
+CK_SESSION_HANDLE SessionTable::add(std::shared_ptr<Session> session) {
+    // Skip CK_INVALID_HANDLE (and any handle still in use) on wraparound
+    while(this->nextHandle == CK_INVALID_HANDLE || this->sessions.count(this->nextHandle) != 0)
+        this->nextHandle++;
+
+    session->handle = this->nextHandle++;
+    this->sessions[session->handle] = session;
+
+    return session->handle;
+}
+
+std::shared_ptr<Session> SessionTable::get(CK_SESSION_HANDLE handle) {
+    auto it = this->sessions.find(handle);
+    if(it == this->sessions.end()) return NULL;
+
+    return it->second;
+}
+
+std::shared_ptr<Session> SessionTable::remove(CK_SESSION_HANDLE handle) {
+    auto it = this->sessions.find(handle);
+    if(it == this->sessions.end()) return NULL;
+
+    std::shared_ptr<Session> session = it->second;
+    this->sessions.erase(it);
+
+    return session;
+}
+
+bool SessionTable::hasSlot(CK_SLOT_ID slotID) {
+    for(auto &entry : this->sessions) {
+        if(entry.second->slotID == slotID) return true;
+    }
+
+    return false;
+}
+
+void SessionTable::countSlot(CK_SLOT_ID slotID, CK_ULONG &sessionCount, CK_ULONG &rwSessionCount) {
+    sessionCount = 0;
+    rwSessionCount = 0;
+
+    for(auto &entry : this->sessions) {
+        if(entry.second->slotID != slotID) continue;
+
+        sessionCount++;
+        if(entry.second->flags & CKF_RW_SESSION) rwSessionCount++;
+    }
+}
+
+std::vector<std::shared_ptr<Session>> SessionTable::removeSlot(CK_SLOT_ID slotID) {
+    std::vector<std::shared_ptr<Session>> removed;
+
+    for(auto it = this->sessions.begin(); it != this->sessions.end();) {
+        if(it->second->slotID == slotID) {
+            removed.push_back(it->second);
+            it = this->sessions.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    return removed;
+}
+
+void SessionTable::clear() {
+    this->sessions.clear();
+    this->nextHandle = 1;
+}
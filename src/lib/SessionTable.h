@@ -0,0 +1,41 @@
+/**
+ * This class maps the session handles Qryptoki gives to
+ * applications onto sessions of the base HSMs. It does no
+ * locking of its own; GlobalData guards it with a mutex.
+ */
+
+#ifndef _QRYPT_WRAPPER_SESSIONTABLE_H
+#define _QRYPT_WRAPPER_SESSIONTABLE_H
+
+#include <memory>           // std::shared_ptr
+#include <unordered_map>    // std::unordered_map
+#include <vector>           // std::vector
+
+#include "cryptoki.h"       // PKCS#11 types
+
+#include "Session.h"        // Session
+
+class SessionTable {
+    public:
+        SessionTable();
+
+        // Assigns session->handle and stores the session
+        CK_SESSION_HANDLE add(std::shared_ptr<Session> session);
+
+        // Returns NULL if no session has the given handle
+        std::shared_ptr<Session> get(CK_SESSION_HANDLE handle);
+        std::shared_ptr<Session> remove(CK_SESSION_HANDLE handle);
+
+        bool hasSlot(CK_SLOT_ID slotID);
+        void countSlot(CK_SLOT_ID slotID, CK_ULONG &sessionCount, CK_ULONG &rwSessionCount);
+
+        // Removes (and returns) every session on the given slot
+        std::vector<std::shared_ptr<Session>> removeSlot(CK_SLOT_ID slotID);
+
+        void clear();
+    private:
+        std::unordered_map<CK_SESSION_HANDLE, std::shared_ptr<Session>> sessions;
+        CK_SESSION_HANDLE nextHandle;
+};
+
+#endif /* !_QRYPT_WRAPPER_SESSIONTABLE_H */
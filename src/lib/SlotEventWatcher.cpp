@@ -0,0 +1,149 @@
+#include <algorithm>    // std::find
+#include <chrono>       // std::chrono::milliseconds
+
+#include "log.h"        // logging macros
+#include "GlobalData.h" // GlobalData
+
+#include "SlotEventWatcher.h"
+
+// How often base HSMs that can't block are polled for slot events
+const std::chrono::milliseconds WATCHER_POLL_INTERVAL(100);
+
+SlotEventWatcher::SlotEventWatcher(MetadataCache *metadataCache) {
+    this->metadataCache = metadataCache;
+
+    this->watching = 0;
+    this->waiters = 0;
+    this->stopping = false;
+}
+
+void SlotEventWatcher::start() {
+    size_t moduleCount = GlobalData::getInstance().getModuleCount();
+
+    for(size_t i = 0; i < moduleCount; i++) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->watching++;
+        }
+
+        try {
+            this->threads.emplace_back(&SlotEventWatcher::watch, this, i);
+        } catch (...) {
+            finishWatching();
+            throw;
+        }
+    }
+}
+
+void SlotEventWatcher::requestStop() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->stopping = true;
+    this->changed.notify_all();
+}
+
+void SlotEventWatcher::join() {
+    requestStop();
+
+    for(std::thread &thread : this->threads) {
+        if(thread.joinable()) thread.join();
+    }
+    this->threads.clear();
+
+    // Let woken application threads leave waitForEvent
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [this] { return this->waiters == 0; });
+}
+
+CK_RV SlotEventWatcher::waitForEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot) {
+    if(pSlot == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->waiters++;
+
+    CK_RV rv;
+    while(true) {
+        if(!this->events.empty()) {
+            *pSlot = this->events.front();
+            this->events.pop_front();
+            rv = CKR_OK;
+            break;
+        }
+
+        if(this->stopping) {
+            rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+            break;
+        }
+
+        // No base HSM can report events any more
+        if(this->watching == 0) {
+            rv = CKR_FUNCTION_NOT_SUPPORTED;
+            break;
+        }
+
+        if(flags & CKF_DONT_BLOCK) {
+            rv = CKR_NO_EVENT;
+            break;
+        }
+
+        this->changed.wait(lock);
+    }
+
+    this->waiters--;
+    this->changed.notify_all();
+
+    return rv;
+}
+
+void SlotEventWatcher::watch(size_t moduleIndex) {
+    BaseHSM *module = GlobalData::getInstance().getModule(moduleIndex);
+
+    CK_C_WaitForSlotEvent Base_C_WaitForSlotEvent = (CK_C_WaitForSlotEvent)module->getFunction("C_WaitForSlotEvent");
+    if(Base_C_WaitForSlotEvent == NULL) {
+        finishWatching();
+        return;
+    }
+
+    CK_FLAGS flags = 0;
+
+    while(true) {
+        CK_SLOT_ID baseSlotID;
+        CK_RV rv = (*Base_C_WaitForSlotEvent)(flags, &baseSlotID, NULL_PTR);
+
+        if(rv == CKR_OK) {
+            if(!GlobalData::getInstance().canMapSlot(baseSlotID)) continue;
+
+            CK_SLOT_ID slotID = GlobalData::getInstance().toSlotID(moduleIndex, baseSlotID);
+            this->metadataCache->slotChanged(slotID);
+
+            // Several events on one slot may be reported as one
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if(std::find(this->events.begin(), this->events.end(), slotID) == this->events.end()) {
+                this->events.push_back(slotID);
+                this->changed.notify_all();
+            }
+            continue;
+        }
+
+        if(rv == CKR_FUNCTION_NOT_SUPPORTED && flags == 0) {
+            DEBUG_MSG("Base HSM %zu can't block in C_WaitForSlotEvent, polling it instead.", moduleIndex);
+            flags = CKF_DONT_BLOCK;
+            continue;
+        }
+
+        if(rv == CKR_CRYPTOKI_NOT_INITIALIZED || rv == CKR_FUNCTION_NOT_SUPPORTED) break;
+
+        // No event yet, or a transient error: wait before asking again
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if(this->changed.wait_for(lock, WATCHER_POLL_INTERVAL, [this] { return this->stopping; })) break;
+    }
+
+    finishWatching();
+}
+
+void SlotEventWatcher::finishWatching() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->watching--;
+    this->changed.notify_all();
+}
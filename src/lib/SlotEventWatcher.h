@@ -0,0 +1,57 @@
+/**
+ * This class runs one thread per base HSM that waits for slot
+ * events, so the metadata cache is refreshed as soon as a token
+ * is inserted or removed rather than when its entries expire.
+ *
+ * Because a base HSM reports each event only once, the events
+ * are also queued and handed to the application's own
+ * C_WaitForSlotEvent calls. Base HSMs that can't block in
+ * C_WaitForSlotEvent are polled instead.
+ *
+ * The threads rely on the base HSM's C_Finalize unblocking
+ * C_WaitForSlotEvent, as PKCS#11 requires.
+ */
+
+#ifndef _QRYPT_WRAPPER_SLOTEVENTWATCHER_H
+#define _QRYPT_WRAPPER_SLOTEVENTWATCHER_H
+
+#include <condition_variable>  // std::condition_variable
+#include <deque>               // std::deque
+#include <mutex>               // std::mutex
+#include <thread>              // std::thread
+#include <vector>              // std::vector
+
+#include "cryptoki.h"          // PKCS#11 types
+
+#include "MetadataCache.h"     // MetadataCache
+
+class SlotEventWatcher {
+    public:
+        SlotEventWatcher(MetadataCache *metadataCache);
+
+        void start();
+
+        // Wakes the application's waiting C_WaitForSlotEvent calls;
+        // the threads themselves end once the base HSMs finalize
+        void requestStop();
+        void join();
+
+        // C_WaitForSlotEvent for the application
+        CK_RV waitForEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot);
+    private:
+        MetadataCache *metadataCache;
+
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<CK_SLOT_ID> events;
+        size_t watching;    // Threads still able to report events
+        size_t waiters;     // Application threads in waitForEvent
+        bool stopping;
+
+        void watch(size_t moduleIndex);
+        void finishWatching();
+};
+
+#endif /* !_QRYPT_WRAPPER_SLOTEVENTWATCHER_H */
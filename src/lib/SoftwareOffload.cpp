@@ -0,0 +1,563 @@
+#include <string.h>                 // memcpy
+#include <stdexcept>                // std::runtime_error
+#include <vector>                   // std::vector
+
+#include <openssl/asn1.h>           // d2i_ASN1_*
+#include <openssl/ec.h>             // ECDSA_SIG
+#include <openssl/err.h>            // ERR_clear_error
+#include <openssl/objects.h>        // OBJ_*
+#include <openssl/rsa.h>            // RSA_*_PADDING
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>     // OSSL_PKEY_PARAM_*
+#include <openssl/param_build.h>    // OSSL_PARAM_BLD
+#endif
+
+#include "SoftwareOffload.h"
+
+// Largest PSS salt accepted; real ones are at most a hash long
+const CK_ULONG MAX_PSS_SALT_LENGTH = 1024;
+
+struct VerifyMechanism {
+    CK_MECHANISM_TYPE type;
+    CK_KEY_TYPE keyType;
+    const EVP_MD *(*md)();      // NULL if the data is hashed already
+    int padding;
+    bool pss;
+};
+
+static const VerifyMechanism VERIFY_MECHANISMS[] = {
+    {CKM_RSA_PKCS,            CKK_RSA, NULL,        RSA_PKCS1_PADDING,     false},
+    {CKM_SHA224_RSA_PKCS,     CKK_RSA, EVP_sha224,  RSA_PKCS1_PADDING,     false},
+    {CKM_SHA256_RSA_PKCS,     CKK_RSA, EVP_sha256,  RSA_PKCS1_PADDING,     false},
+    {CKM_SHA384_RSA_PKCS,     CKK_RSA, EVP_sha384,  RSA_PKCS1_PADDING,     false},
+    {CKM_SHA512_RSA_PKCS,     CKK_RSA, EVP_sha512,  RSA_PKCS1_PADDING,     false},
+    {CKM_RSA_PKCS_PSS,        CKK_RSA, NULL,        RSA_PKCS1_PSS_PADDING, true},
+    {CKM_SHA224_RSA_PKCS_PSS, CKK_RSA, EVP_sha224,  RSA_PKCS1_PSS_PADDING, true},
+    {CKM_SHA256_RSA_PKCS_PSS, CKK_RSA, EVP_sha256,  RSA_PKCS1_PSS_PADDING, true},
+    {CKM_SHA384_RSA_PKCS_PSS, CKK_RSA, EVP_sha384,  RSA_PKCS1_PSS_PADDING, true},
+    {CKM_SHA512_RSA_PKCS_PSS, CKK_RSA, EVP_sha512,  RSA_PKCS1_PSS_PADDING, true},
+    {CKM_ECDSA,               CKK_EC,  NULL,        0,                     false},
+    {CKM_ECDSA_SHA224,        CKK_EC,  EVP_sha224,  0,                     false},
+    {CKM_ECDSA_SHA256,        CKK_EC,  EVP_sha256,  0,                     false},
+    {CKM_ECDSA_SHA384,        CKK_EC,  EVP_sha384,  0,                     false},
+    {CKM_ECDSA_SHA512,        CKK_EC,  EVP_sha512,  0,                     false}
+};
+
+static const VerifyMechanism *findVerifyMechanism(CK_MECHANISM_TYPE type) {
+    for(const VerifyMechanism &mechanism : VERIFY_MECHANISMS) {
+        if(mechanism.type == type) return &mechanism;
+    }
+
+    return NULL;
+}
+
+// SHA-2 hash named by a digest mechanism or PSS parameter
+static const EVP_MD *hashFromMechanism(CK_MECHANISM_TYPE type) {
+    switch(type) {
+        case CKM_SHA224: return EVP_sha224();
+        case CKM_SHA256: return EVP_sha256();
+        case CKM_SHA384: return EVP_sha384();
+        case CKM_SHA512: return EVP_sha512();
+        default:         return NULL;
+    }
+}
+
+static const EVP_MD *hashFromMgf(CK_RSA_PKCS_MGF_TYPE mgf) {
+    switch(mgf) {
+        case CKG_MGF1_SHA224: return EVP_sha224();
+        case CKG_MGF1_SHA256: return EVP_sha256();
+        case CKG_MGF1_SHA384: return EVP_sha384();
+        case CKG_MGF1_SHA512: return EVP_sha512();
+        default:              return NULL;
+    }
+}
+
+const EVP_MD *SoftwareDigest::getDigest(CK_MECHANISM_PTR pMechanism) {
+    if(pMechanism == NULL_PTR || pMechanism->pParameter != NULL_PTR || pMechanism->ulParameterLen != 0) return NULL;
+
+    return hashFromMechanism(pMechanism->mechanism);
+}
+
+SoftwareDigest::SoftwareDigest(const EVP_MD *md) {
+    this->ctx = EVP_MD_CTX_new();
+    if(this->ctx == NULL) throw std::bad_alloc();
+
+    if(EVP_DigestInit_ex(this->ctx, md, NULL) != 1) {
+        EVP_MD_CTX_free(this->ctx);
+        throw std::runtime_error("Could not start software digest");
+    }
+
+    this->updated = false;
+    this->active = true;
+}
+
+SoftwareDigest::~SoftwareDigest() {
+    EVP_MD_CTX_free(this->ctx);
+}
+
+CK_RV SoftwareDigest::digest(CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) {
+    if(pulDigestLen == NULL_PTR || (pData == NULL_PTR && ulDataLen != 0)) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // C_Digest can't finish a multi-part digest
+    if(this->updated) return CKR_OPERATION_ACTIVE;
+
+    CK_ULONG digestLen = EVP_MD_CTX_size(this->ctx);
+
+    if(pDigest == NULL_PTR) {
+        *pulDigestLen = digestLen;
+        return CKR_OK;
+    }
+
+    if(*pulDigestLen < digestLen) {
+        *pulDigestLen = digestLen;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    CK_RV rv = update(pData, ulDataLen);
+    if(rv != CKR_OK) return rv;
+
+    return final(pDigest, pulDigestLen);
+}
+
+CK_RV SoftwareDigest::update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    if(pPart == NULL_PTR && ulPartLen != 0) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if(EVP_DigestUpdate(this->ctx, pPart, ulPartLen) != 1) {
+        end();
+        return CKR_GENERAL_ERROR;
+    }
+
+    this->updated = true;
+    return CKR_OK;
+}
+
+CK_RV SoftwareDigest::final(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) {
+    if(pulDigestLen == NULL_PTR) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG digestLen = EVP_MD_CTX_size(this->ctx);
+
+    if(pDigest == NULL_PTR) {
+        *pulDigestLen = digestLen;
+        return CKR_OK;
+    }
+
+    if(*pulDigestLen < digestLen) {
+        *pulDigestLen = digestLen;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    unsigned int len = 0;
+    int ok = EVP_DigestFinal_ex(this->ctx, pDigest, &len);
+    end();
+
+    if(ok != 1) return CKR_GENERAL_ERROR;
+
+    *pulDigestLen = len;
+    return CKR_OK;
+}
+
+bool SoftwareDigest::isActive() {
+    return this->active;
+}
+
+void SoftwareDigest::end() {
+    this->active = false;
+}
+
+bool SoftwareVerify::supports(CK_MECHANISM_PTR pMechanism, CK_KEY_TYPE keyType) {
+    if(pMechanism == NULL_PTR) return false;
+
+    const VerifyMechanism *mechanism = findVerifyMechanism(pMechanism->mechanism);
+    if(mechanism == NULL || mechanism->keyType != keyType) return false;
+
+    if(!mechanism->pss) return pMechanism->pParameter == NULL_PTR && pMechanism->ulParameterLen == 0;
+
+    // Leave unusual PSS parameters (and bad ones) to the base HSM
+    if(pMechanism->pParameter == NULL_PTR || pMechanism->ulParameterLen != sizeof(CK_RSA_PKCS_PSS_PARAMS)) return false;
+
+    CK_RSA_PKCS_PSS_PARAMS *params = (CK_RSA_PKCS_PSS_PARAMS *)pMechanism->pParameter;
+
+    const EVP_MD *hash = hashFromMechanism(params->hashAlg);
+    if(hash == NULL || hashFromMgf(params->mgf) == NULL || params->sLen > MAX_PSS_SALT_LENGTH) return false;
+
+    // The hash-and-sign mechanisms must hash with the parameter's hash
+    return mechanism->md == NULL || EVP_MD_type(mechanism->md()) == EVP_MD_type(hash);
+}
+
+SoftwareVerify::SoftwareVerify(std::shared_ptr<EVP_PKEY> key) {
+    this->key = key;
+
+    this->ecdsa = false;
+    this->md = NULL;
+    this->signatureMd = NULL;
+    this->padding = 0;
+    this->mgf1Md = NULL;
+    this->saltLength = 0;
+
+    this->mdCtx = NULL;
+    this->updated = false;
+    this->active = true;
+}
+
+SoftwareVerify::~SoftwareVerify() {
+    EVP_MD_CTX_free(this->mdCtx);
+}
+
+CK_RV SoftwareVerify::init(CK_MECHANISM_PTR pMechanism) {
+    const VerifyMechanism *mechanism = findVerifyMechanism(pMechanism->mechanism);
+    if(mechanism == NULL) return CKR_MECHANISM_INVALID;
+
+    this->ecdsa = mechanism->keyType == CKK_EC;
+    this->md = mechanism->md != NULL ? mechanism->md() : NULL;
+    this->padding = mechanism->padding;
+
+    if(mechanism->pss) {
+        CK_RSA_PKCS_PSS_PARAMS *params = (CK_RSA_PKCS_PSS_PARAMS *)pMechanism->pParameter;
+
+        this->signatureMd = hashFromMechanism(params->hashAlg);
+        this->mgf1Md = hashFromMgf(params->mgf);
+        this->saltLength = (int)params->sLen;
+    }
+
+    if(this->md == NULL) return CKR_OK;
+
+    this->mdCtx = EVP_MD_CTX_new();
+    if(this->mdCtx == NULL) throw std::bad_alloc();
+
+    EVP_PKEY_CTX *pkeyCtx = NULL;
+    if(EVP_DigestVerifyInit(this->mdCtx, &pkeyCtx, this->md, NULL, this->key.get()) != 1) {
+        ERR_clear_error();
+        return CKR_GENERAL_ERROR;
+    }
+
+    return configure(pkeyCtx);
+}
+
+CK_RV SoftwareVerify::configure(EVP_PKEY_CTX *pkeyCtx) {
+    if(this->ecdsa) return CKR_OK;
+
+    bool ok = EVP_PKEY_CTX_set_rsa_padding(pkeyCtx, this->padding) > 0;
+
+    if(ok && this->padding == RSA_PKCS1_PSS_PADDING) {
+        ok = EVP_PKEY_CTX_set_rsa_pss_saltlen(pkeyCtx, this->saltLength) > 0 &&
+             EVP_PKEY_CTX_set_rsa_mgf1_md(pkeyCtx, this->mgf1Md) > 0;
+    }
+
+    if(ok && this->md == NULL && this->signatureMd != NULL) ok = EVP_PKEY_CTX_set_signature_md(pkeyCtx, this->signatureMd) > 0;
+
+    if(!ok) {
+        ERR_clear_error();
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+// PKCS #11 ECDSA signatures are r and s side by side; OpenSSL wants DER
+CK_RV SoftwareVerify::toOpenSSLSignature(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, std::vector<unsigned char> &signature) {
+    if(!this->ecdsa) {
+        if(ulSignatureLen != (CK_ULONG)EVP_PKEY_size(this->key.get())) return CKR_SIGNATURE_LEN_RANGE;
+
+        signature.assign(pSignature, pSignature + ulSignatureLen);
+        return CKR_OK;
+    }
+
+    CK_ULONG orderLen = (EVP_PKEY_bits(this->key.get()) + 7) / 8;
+    if(ulSignatureLen != 2 * orderLen) return CKR_SIGNATURE_LEN_RANGE;
+
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    BIGNUM *r = BN_bin2bn(pSignature, (int)orderLen, NULL);
+    BIGNUM *s = BN_bin2bn(pSignature + orderLen, (int)orderLen, NULL);
+
+    if(sig == NULL || r == NULL || s == NULL || ECDSA_SIG_set0(sig, r, s) != 1) {
+        ECDSA_SIG_free(sig);
+        BN_free(r);
+        BN_free(s);
+        throw std::bad_alloc();
+    }
+
+    int derLen = i2d_ECDSA_SIG(sig, NULL);
+    if(derLen <= 0) {
+        ECDSA_SIG_free(sig);
+        return CKR_GENERAL_ERROR;
+    }
+
+    signature.resize(derLen);
+    unsigned char *p = signature.data();
+    i2d_ECDSA_SIG(sig, &p);
+
+    ECDSA_SIG_free(sig);
+    return CKR_OK;
+}
+
+CK_RV SoftwareVerify::verify(CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    if((pData == NULL_PTR && ulDataLen != 0) || pSignature == NULL_PTR) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // C_Verify can't finish a multi-part verification
+    if(this->updated) return CKR_OPERATION_ACTIVE;
+
+    // Verification always ends the operation
+    end();
+
+    std::vector<unsigned char> signature;
+    CK_RV rv = toOpenSSLSignature(pSignature, ulSignatureLen, signature);
+    if(rv != CKR_OK) return rv;
+
+    int result;
+
+    if(this->md != NULL) {
+        result = EVP_DigestVerify(this->mdCtx, signature.data(), signature.size(), pData, ulDataLen);
+    } else {
+        if(this->signatureMd != NULL && ulDataLen != (CK_ULONG)EVP_MD_size(this->signatureMd)) return CKR_DATA_LEN_RANGE;
+        if(this->padding == RSA_PKCS1_PADDING && ulDataLen + RSA_PKCS1_PADDING_SIZE > (CK_ULONG)EVP_PKEY_size(this->key.get())) return CKR_DATA_LEN_RANGE;
+
+        EVP_PKEY_CTX *pkeyCtx = EVP_PKEY_CTX_new(this->key.get(), NULL);
+        if(pkeyCtx == NULL) throw std::bad_alloc();
+
+        if(EVP_PKEY_verify_init(pkeyCtx) != 1 || configure(pkeyCtx) != CKR_OK) {
+            EVP_PKEY_CTX_free(pkeyCtx);
+            ERR_clear_error();
+            return CKR_GENERAL_ERROR;
+        }
+
+        result = EVP_PKEY_verify(pkeyCtx, signature.data(), signature.size(), pData, ulDataLen);
+        EVP_PKEY_CTX_free(pkeyCtx);
+    }
+
+    // A bad signature leaves errors on OpenSSL's queue
+    ERR_clear_error();
+
+    return result == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+CK_RV SoftwareVerify::update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    if(pPart == NULL_PTR && ulPartLen != 0) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // Mechanisms on hashed data are single-part only
+    if(this->md == NULL) {
+        end();
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    if(EVP_DigestVerifyUpdate(this->mdCtx, pPart, ulPartLen) != 1) {
+        end();
+        ERR_clear_error();
+        return CKR_GENERAL_ERROR;
+    }
+
+    this->updated = true;
+    return CKR_OK;
+}
+
+CK_RV SoftwareVerify::final(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    end();
+
+    if(pSignature == NULL_PTR) return CKR_ARGUMENTS_BAD;
+    if(this->md == NULL) return CKR_FUNCTION_NOT_SUPPORTED;
+
+    std::vector<unsigned char> signature;
+    CK_RV rv = toOpenSSLSignature(pSignature, ulSignatureLen, signature);
+    if(rv != CKR_OK) return rv;
+
+    int result = EVP_DigestVerifyFinal(this->mdCtx, signature.data(), signature.size());
+    ERR_clear_error();
+
+    return result == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+CK_RV SoftwareVerify::verifyRecover(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen) {
+    if(pSignature == NULL_PTR || pulDataLen == NULL_PTR) {
+        end();
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG keyLen = EVP_PKEY_size(this->key.get());
+    if(ulSignatureLen != keyLen) {
+        end();
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    // The recovered data is at most as long as the modulus
+    if(pData == NULL_PTR) {
+        *pulDataLen = keyLen;
+        return CKR_OK;
+    }
+
+    std::vector<unsigned char> recovered(keyLen);
+
+    EVP_PKEY_CTX *pkeyCtx = EVP_PKEY_CTX_new(this->key.get(), NULL);
+    if(pkeyCtx == NULL) throw std::bad_alloc();
+
+    if(EVP_PKEY_verify_recover_init(pkeyCtx) != 1 || configure(pkeyCtx) != CKR_OK) {
+        EVP_PKEY_CTX_free(pkeyCtx);
+        ERR_clear_error();
+        end();
+        return CKR_GENERAL_ERROR;
+    }
+
+    size_t recoveredLen = recovered.size();
+    int result = EVP_PKEY_verify_recover(pkeyCtx, recovered.data(), &recoveredLen, pSignature, ulSignatureLen);
+    EVP_PKEY_CTX_free(pkeyCtx);
+    ERR_clear_error();
+
+    if(result != 1) {
+        end();
+        return CKR_SIGNATURE_INVALID;
+    }
+
+    if(*pulDataLen < recoveredLen) {
+        *pulDataLen = recoveredLen;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(pData, recovered.data(), recoveredLen);
+    *pulDataLen = recoveredLen;
+
+    end();
+    return CKR_OK;
+}
+
+bool SoftwareVerify::isActive() {
+    return this->active;
+}
+
+void SoftwareVerify::end() {
+    this->active = false;
+}
+
+static std::shared_ptr<EVP_PKEY> toSharedKey(EVP_PKEY *pkey) {
+    if(pkey == NULL) return std::shared_ptr<EVP_PKEY>();
+
+    return std::shared_ptr<EVP_PKEY>(pkey, EVP_PKEY_free);
+}
+
+std::shared_ptr<EVP_PKEY> makeRsaPublicKey(const unsigned char *modulus, size_t modulusLen, const unsigned char *exponent, size_t exponentLen) {
+    EVP_PKEY *pkey = NULL;
+
+    BIGNUM *n = BN_bin2bn(modulus, (int)modulusLen, NULL);
+    BIGNUM *e = BN_bin2bn(exponent, (int)exponentLen, NULL);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM_BLD *builder = OSSL_PARAM_BLD_new();
+    OSSL_PARAM *params = NULL;
+    EVP_PKEY_CTX *ctx = NULL;
+
+    if(n != NULL && e != NULL && builder != NULL &&
+       OSSL_PARAM_BLD_push_BN(builder, OSSL_PKEY_PARAM_RSA_N, n) == 1 &&
+       OSSL_PARAM_BLD_push_BN(builder, OSSL_PKEY_PARAM_RSA_E, e) == 1 &&
+       (params = OSSL_PARAM_BLD_to_param(builder)) != NULL &&
+       (ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL)) != NULL &&
+       EVP_PKEY_fromdata_init(ctx) == 1) {
+        EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params);
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(builder);
+    BN_free(n);
+    BN_free(e);
+#else
+    RSA *rsa = RSA_new();
+
+    if(rsa != NULL && n != NULL && e != NULL && RSA_set0_key(rsa, n, e, NULL) == 1) {
+        // The RSA key owns them now
+        n = NULL;
+        e = NULL;
+
+        pkey = EVP_PKEY_new();
+        if(pkey != NULL && EVP_PKEY_assign_RSA(pkey, rsa) == 1) {
+            rsa = NULL;
+        } else {
+            EVP_PKEY_free(pkey);
+            pkey = NULL;
+        }
+    }
+
+    RSA_free(rsa);
+    BN_free(n);
+    BN_free(e);
+#endif
+
+    ERR_clear_error();
+    return toSharedKey(pkey);
+}
+
+static EVP_PKEY *makeEcKey(int curve, const unsigned char *point, size_t pointLen) {
+    EVP_PKEY *pkey = NULL;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM_BLD *builder = OSSL_PARAM_BLD_new();
+    OSSL_PARAM *params = NULL;
+    EVP_PKEY_CTX *ctx = NULL;
+
+    if(builder != NULL &&
+       OSSL_PARAM_BLD_push_utf8_string(builder, OSSL_PKEY_PARAM_GROUP_NAME, OBJ_nid2sn(curve), 0) == 1 &&
+       OSSL_PARAM_BLD_push_octet_string(builder, OSSL_PKEY_PARAM_PUB_KEY, point, pointLen) == 1 &&
+       (params = OSSL_PARAM_BLD_to_param(builder)) != NULL &&
+       (ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL)) != NULL &&
+       EVP_PKEY_fromdata_init(ctx) == 1) {
+        EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params);
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(builder);
+#else
+    EC_KEY *ec = EC_KEY_new_by_curve_name(curve);
+    const unsigned char *p = point;
+
+    if(ec != NULL && o2i_ECPublicKey(&ec, &p, (long)pointLen) != NULL) {
+        pkey = EVP_PKEY_new();
+        if(pkey != NULL && EVP_PKEY_assign_EC_KEY(pkey, ec) == 1) {
+            ec = NULL;
+        } else {
+            EVP_PKEY_free(pkey);
+            pkey = NULL;
+        }
+    }
+
+    EC_KEY_free(ec);
+#endif
+
+    return pkey;
+}
+
+std::shared_ptr<EVP_PKEY> makeEcPublicKey(const unsigned char *params, size_t paramsLen, const unsigned char *point, size_t pointLen) {
+    // Only named curves, given by their OID
+    const unsigned char *p = params;
+    ASN1_OBJECT *oid = d2i_ASN1_OBJECT(NULL, &p, (long)paramsLen);
+    int curve = (oid != NULL && p == params + paramsLen) ? OBJ_obj2nid(oid) : NID_undef;
+    ASN1_OBJECT_free(oid);
+
+    EVP_PKEY *pkey = NULL;
+
+    if(curve != NID_undef) {
+        // CKA_EC_POINT should be a DER OCTET STRING, but some HSMs
+        // give the bare point
+        p = point;
+        ASN1_OCTET_STRING *octets = d2i_ASN1_OCTET_STRING(NULL, &p, (long)pointLen);
+
+        if(octets != NULL && p == point + pointLen) pkey = makeEcKey(curve, ASN1_STRING_get0_data(octets), ASN1_STRING_length(octets));
+        ASN1_OCTET_STRING_free(octets);
+
+        if(pkey == NULL) pkey = makeEcKey(curve, point, pointLen);
+    }
+
+    ERR_clear_error();
+    return toSharedKey(pkey);
+}
@@ -0,0 +1,95 @@
+/**
+ * These classes carry out operations that need no secret material
+ * (digests, and verification with a public key) in-process with
+ * OpenSSL, so that they don't queue behind private-key operations
+ * on the base HSM.
+ *
+ * Only mechanisms without vendor-specific behaviour are handled:
+ * SHA-2 digests, RSA PKCS #1 v1.5 and PSS, and ECDSA on named
+ * curves. Anything else goes to the base HSM as before.
+ */
+
+#ifndef _QRYPT_WRAPPER_SOFTWAREOFFLOAD_H
+#define _QRYPT_WRAPPER_SOFTWAREOFFLOAD_H
+
+#include <memory>           // std::shared_ptr
+#include <vector>           // std::vector
+
+#include <openssl/evp.h>    // EVP_*
+
+#include "cryptoki.h"       // PKCS#11 types
+
+class SoftwareDigest {
+    public:
+        // NULL unless the mechanism is a digest done in software
+        static const EVP_MD *getDigest(CK_MECHANISM_PTR pMechanism);
+
+        // Throws std::bad_alloc
+        SoftwareDigest(const EVP_MD *md);
+        ~SoftwareDigest();
+
+        SoftwareDigest(SoftwareDigest const&) = delete;
+        void operator=(SoftwareDigest const&) = delete;
+
+        CK_RV digest(CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+        CK_RV update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
+        CK_RV final(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+
+        // False once a call has ended the operation
+        bool isActive();
+        void end();
+    private:
+        EVP_MD_CTX *ctx;
+        bool updated;
+        bool active;
+};
+
+class SoftwareVerify {
+    public:
+        // Whether the mechanism is done in software for keys of this type
+        static bool supports(CK_MECHANISM_PTR pMechanism, CK_KEY_TYPE keyType);
+
+        // Throws std::bad_alloc
+        SoftwareVerify(std::shared_ptr<EVP_PKEY> key);
+        ~SoftwareVerify();
+
+        SoftwareVerify(SoftwareVerify const&) = delete;
+        void operator=(SoftwareVerify const&) = delete;
+
+        // Checks the mechanism parameter; for supported mechanisms only
+        CK_RV init(CK_MECHANISM_PTR pMechanism);
+
+        CK_RV verify(CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen);
+        CK_RV update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
+        CK_RV final(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen);
+        CK_RV verifyRecover(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen);
+
+        // False once a call has ended the operation
+        bool isActive();
+        void end();
+    private:
+        std::shared_ptr<EVP_PKEY> key;
+
+        bool ecdsa;
+        const EVP_MD *md;           // Hash the mechanism applies, NULL if the data is hashed already
+        const EVP_MD *signatureMd;  // Hash named in the signature, for PSS on hashed data
+        int padding;                // RSA only
+        const EVP_MD *mgf1Md;       // PSS only
+        int saltLength;             // PSS only
+
+        EVP_MD_CTX *mdCtx;          // For mechanisms that hash
+        bool updated;
+        bool active;
+
+        CK_RV configure(EVP_PKEY_CTX *pkeyCtx);
+        CK_RV toOpenSSLSignature(CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, std::vector<unsigned char> &signature);
+};
+
+// Builds a public key from its PKCS #11 attributes: CKA_MODULUS and
+// CKA_PUBLIC_EXPONENT for RSA, CKA_EC_PARAMS and CKA_EC_POINT for EC.
+// Returns NULL if OpenSSL can't use the key (e.g. explicit curve
+// parameters).
+std::shared_ptr<EVP_PKEY> makeRsaPublicKey(const unsigned char *modulus, size_t modulusLen, const unsigned char *exponent, size_t exponentLen);
+std::shared_ptr<EVP_PKEY> makeEcPublicKey(const unsigned char *params, size_t paramsLen, const unsigned char *point, size_t pointLen);
+
+#endif /* !_QRYPT_WRAPPER_SOFTWAREOFFLOAD_H */
@@ -0,0 +1,194 @@
+#include <signal.h>             // sigaction
+#include <stdio.h>              // fopen, fprintf
+#include <stdlib.h>             // getenv, strtol
+#include <string.h>             // memset
+#include <sys/syscall.h>        // SYS_gettid
+#include <unistd.h>             // getpid, syscall
+
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::steady_clock
+#include <memory>               // std::unique_ptr
+#include <mutex>                // std::mutex
+#include <new>                  // std::nothrow
+#include <string>               // std::string
+#include <vector>               // std::vector
+
+#include "log.h"                // logging macros
+
+#include "Tracer.h"
+
+// Spans kept per thread
+const size_t TRACE_RING_SPANS = 4096;
+
+struct TraceEvent {
+    const char *name;
+    const char *category;
+    const char *argName;
+    uint64_t argValue;
+    uint64_t startUs;
+    uint64_t durationUs;
+};
+
+struct TraceRing {
+    long tid;
+    std::atomic<uint64_t> written;          // Spans ever recorded
+    TraceEvent events[TRACE_RING_SPANS];
+};
+
+// Rings live until the process exits, since a dump may still read the
+// ring of a thread that has ended
+static std::mutex ringsMutex;
+static std::vector<TraceRing *> rings;
+
+static std::mutex dumpMutex;
+static std::atomic<bool> dumpRequested(false);
+
+static const std::chrono::steady_clock::time_point traceStart = std::chrono::steady_clock::now();
+
+static const char *getTraceFile() {
+    static const char *traceFile = getenv("QRYPT_TRACE_FILE");
+    return traceFile != NULL && *traceFile != '\0' ? traceFile : NULL;
+}
+
+static TraceRing *getRing() {
+    static thread_local TraceRing *ring = NULL;
+    if(ring != NULL) return ring;
+
+    TraceRing *created = new (std::nothrow) TraceRing();
+    if(created == NULL) return NULL;
+
+    created->tid = syscall(SYS_gettid);
+    created->written = 0;
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+
+    try {
+        rings.push_back(created);
+    } catch (...) {
+        delete created;
+        return NULL;
+    }
+
+    ring = created;
+    return ring;
+}
+
+bool Tracer::isEnabled() {
+    return getTraceFile() != NULL;
+}
+
+uint64_t Tracer::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+void Tracer::record(const char *name, const char *category, uint64_t startUs, uint64_t endUs, const char *argName, uint64_t argValue) {
+    if(!isEnabled()) return;
+
+    TraceRing *ring = getRing();
+    if(ring == NULL) return;
+
+    uint64_t index = ring->written.load(std::memory_order_relaxed);
+
+    TraceEvent &event = ring->events[index % TRACE_RING_SPANS];
+    event.name = name;
+    event.category = category;
+    event.argName = argName;
+    event.argValue = argValue;
+    event.startUs = startUs;
+    event.durationUs = endUs > startUs ? endUs - startUs : 0;
+
+    ring->written.store(index + 1, std::memory_order_release);
+
+    if(dumpRequested.load(std::memory_order_relaxed) && dumpRequested.exchange(false)) dump();
+}
+
+static void requestDump(int) {
+    dumpRequested.store(true);
+}
+
+bool Tracer::installSignalHandler() {
+    const char *signal_c_str = getenv("QRYPT_TRACE_SIGNAL");
+    if(signal_c_str == NULL || *signal_c_str == '\0') return true;
+
+    char *end;
+    long signalNumber = strtol(signal_c_str, &end, 10);
+    if(*end != '\0' || signalNumber <= 0 || signalNumber >= NSIG || signalNumber == SIGKILL || signalNumber == SIGSTOP) {
+        ERROR_MSG("QRYPT_TRACE_SIGNAL: \"%s\" is not a signal number.", signal_c_str);
+        return false;
+    }
+
+    if(!isEnabled()) return true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestDump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if(sigaction((int)signalNumber, &action, NULL) != 0) {
+        ERROR_MSG("Could not catch signal %ld to dump the trace.", signalNumber);
+        return false;
+    }
+
+    return true;
+}
+
+// JSON strings here are literals of our own, with nothing to escape
+void Tracer::dump() {
+    const char *traceFile = getTraceFile();
+    if(traceFile == NULL) return;
+
+    std::lock_guard<std::mutex> dumpLock(dumpMutex);
+
+    std::string path = traceFile;
+    size_t pid = path.find("%p");
+    if(pid != std::string::npos) path.replace(pid, 2, std::to_string(getpid()));
+
+    FILE *file = fopen(path.c_str(), "w");
+    if(file == NULL) {
+        ERROR_MSG("Could not write the trace to %s.", path.c_str());
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    long processID = getpid();
+
+    std::lock_guard<std::mutex> ringsLock(ringsMutex);
+
+    for(TraceRing *ring : rings) {
+        uint64_t written = ring->written.load(std::memory_order_acquire);
+        uint64_t oldest = written > TRACE_RING_SPANS ? written - TRACE_RING_SPANS : 0;
+
+        for(uint64_t index = oldest; index < written; index++) {
+            const TraceEvent &event = ring->events[index % TRACE_RING_SPANS];
+
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%llu,\"dur\":%llu",
+                    first ? "" : ",\n", event.name, event.category, processID, ring->tid,
+                    (unsigned long long)event.startUs, (unsigned long long)event.durationUs);
+
+            if(event.argName != NULL) fprintf(file, ",\"args\":{\"%s\":%llu}", event.argName, (unsigned long long)event.argValue);
+
+            fprintf(file, "}");
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    INFO_MSG("Wrote the trace to %s.", path.c_str());
+}
+
+TraceSpan::TraceSpan(const char *name, const char *category, const char *argName, uint64_t argValue) {
+    this->name = name;
+    this->category = category;
+    this->argName = argName;
+    this->argValue = argValue;
+    this->startUs = Tracer::isEnabled() ? Tracer::now() : 0;
+}
+
+TraceSpan::~TraceSpan() {
+    if(Tracer::isEnabled()) Tracer::record(this->name, this->category, this->startUs, Tracer::now(), this->argName, this->argValue);
+}
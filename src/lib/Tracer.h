@@ -0,0 +1,53 @@
+/**
+ * This class records a timeline of the entropy path for the Chrome
+ * trace viewer (chrome://tracing, or ui.perfetto.dev), turned on by
+ * QRYPT_TRACE_FILE: PKCS#11 calls made through the function list
+ * from C_GetFunctionList, waits for the random buffer lock, EaaS
+ * fetches with their curl phases, and the JSON parse and base64
+ * decode of each response.
+ *
+ * Each thread records finished spans into a ring of its own, so
+ * recording takes no lock; a thread's oldest spans are overwritten
+ * once its ring is full. The rings are written out as one trace at
+ * C_Finalize, and when the signal given by QRYPT_TRACE_SIGNAL
+ * arrives (by the next thread to record a span).
+ */
+
+#ifndef _QRYPT_WRAPPER_TRACER_H
+#define _QRYPT_WRAPPER_TRACER_H
+
+#include <stdint.h>     // uint64_t
+
+class Tracer {
+    public:
+        // Read from QRYPT_TRACE_FILE once
+        static bool isEnabled();
+
+        // Microseconds since tracing started
+        static uint64_t now();
+
+        // A span of the calling thread. The strings must be literals.
+        static void record(const char *name, const char *category, uint64_t startUs, uint64_t endUs,
+                           const char *argName = NULL, uint64_t argValue = 0);
+
+        // Catches QRYPT_TRACE_SIGNAL, if set; false if it is invalid
+        static bool installSignalHandler();
+
+        // Writes the trace to QRYPT_TRACE_FILE
+        static void dump();
+};
+
+// Records the enclosing scope as a span
+class TraceSpan {
+    public:
+        TraceSpan(const char *name, const char *category, const char *argName = NULL, uint64_t argValue = 0);
+        ~TraceSpan();
+    private:
+        const char *name;
+        const char *category;
+        const char *argName;
+        uint64_t argValue;
+        uint64_t startUs;
+};
+
+#endif /* !_QRYPT_WRAPPER_TRACER_H */
@@ -0,0 +1,53 @@
+#include <stdlib.h>             // valloc, free
+#include <string.h>             // memcpy
+#include <new>                  // std::bad_alloc
+#include <stdexcept>            // std::runtime_error
+#include <sys/mman.h>           // m(un)lock
+
+#include <openssl/crypto.h>     // OPENSSL_cleanse
+
+#include "UpdateBuffer.h"
+
+UpdateBuffer::UpdateBuffer(size_t capacity) {
+    // Allocate the buffer on a page boundary
+    this->buffer = (CK_BYTE_PTR)valloc(capacity);
+    if(this->buffer == NULL) throw std::bad_alloc();
+
+    // Lock the buffer so it won't go to disk
+    if(mlock(this->buffer, capacity) != 0) {
+        free(this->buffer);
+        throw std::runtime_error("Could not mlock UpdateBuffer");
+    }
+
+    this->capacity = capacity;
+    this->size = 0;
+}
+
+UpdateBuffer::~UpdateBuffer() {
+    OPENSSL_cleanse(this->buffer, this->capacity);
+
+    munlock(this->buffer, this->capacity);
+    free(this->buffer);
+}
+
+bool UpdateBuffer::fits(CK_ULONG len) {
+    return len <= this->capacity - this->size;
+}
+
+void UpdateBuffer::append(CK_BYTE_PTR data, CK_ULONG len) {
+    memcpy(this->buffer + this->size, data, len);
+    this->size += len;
+}
+
+CK_BYTE_PTR UpdateBuffer::getData() {
+    return this->buffer;
+}
+
+CK_ULONG UpdateBuffer::getSize() {
+    return this->size;
+}
+
+void UpdateBuffer::clear() {
+    OPENSSL_cleanse(this->buffer, this->size);
+    this->size = 0;
+}
@@ -0,0 +1,38 @@
+/**
+ * This class gathers the data of small C_*Update calls so that it
+ * can be passed to the base HSM in one call. The data may be
+ * secret (a message being MACed, say), so the buffer is locked in
+ * memory and wiped whenever it is emptied.
+ */
+
+#ifndef _QRYPT_WRAPPER_UPDATEBUFFER_H
+#define _QRYPT_WRAPPER_UPDATEBUFFER_H
+
+#include <stddef.h>     // size_t
+
+#include "cryptoki.h"   // PKCS#11 types
+
+class UpdateBuffer {
+    public:
+        // Throws std::runtime_error if the buffer can't be locked
+        UpdateBuffer(size_t capacity);
+        ~UpdateBuffer();
+
+        UpdateBuffer(UpdateBuffer const&)  = delete;
+        void operator=(UpdateBuffer const&) = delete;
+
+        bool fits(CK_ULONG len);
+        void append(CK_BYTE_PTR data, CK_ULONG len);
+
+        CK_BYTE_PTR getData();
+        CK_ULONG getSize();
+
+        // Empties and wipes the buffer
+        void clear();
+    private:
+        CK_BYTE_PTR buffer;
+        size_t capacity;
+        size_t size;
+};
+
+#endif /* !_QRYPT_WRAPPER_UPDATEBUFFER_H */
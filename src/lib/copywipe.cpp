@@ -0,0 +1,151 @@
+#include <string.h>             // memcpy
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QRYPT_COPYWIPE_X86
+#include <immintrin.h>          // _mm256_*
+#endif
+
+#include "copywipe.h"
+
+// Keeps the compiler from dropping stores to memory it can prove is
+// never read again, such as a buffer about to be freed
+static inline void keepStores(void *memory) {
+#ifdef __GNUC__
+    __asm__ __volatile__("" : : "r"(memory) : "memory");
+#else
+    (void)memory;
+#endif
+}
+
+// Moves the first and last Size bytes of n, Size <= n <= 2 * Size.
+// Both are loaded before either is zeroed, so they may overlap; the
+// fixed-size memcpys compile to single loads and stores.
+template <size_t Size>
+static inline void copyAndWipeEnds(uint8_t *dest, uint8_t *source, size_t n) {
+    static const uint8_t zero[Size] = {0};
+    uint8_t head[Size], tail[Size];
+
+    memcpy(head, source, Size);
+    memcpy(tail, &source[n - Size], Size);
+
+    memcpy(dest, head, Size);
+    memcpy(&dest[n - Size], tail, Size);
+
+    memcpy(source, zero, Size);
+    memcpy(&source[n - Size], zero, Size);
+}
+
+// Each 16 bytes is loaded once, stored to dest and overwritten with
+// zeroes in source; what is left is moved as overlapping ends
+static void copyAndWipeChunks(uint8_t *dest, uint8_t *source, size_t n) {
+    static const uint8_t zero[16] = {0};
+    uint8_t chunk[16];
+
+    for(; n > 32; n -= 16, dest += 16, source += 16) {
+        memcpy(chunk, source, 16);
+        memcpy(dest, chunk, 16);
+        memcpy(source, zero, 16);
+    }
+
+    if(n >= 16) {
+        copyAndWipeEnds<16>(dest, source, n);
+    } else if(n >= 8) {
+        copyAndWipeEnds<8>(dest, source, n);
+    } else if(n >= 4) {
+        copyAndWipeEnds<4>(dest, source, n);
+    } else {
+        for(size_t i = 0; i < n; i++) {
+            dest[i] = source[i];
+            source[i] = 0;
+        }
+    }
+}
+
+#ifdef QRYPT_COPYWIPE_X86
+// As copyAndWipeChunks, 32 bytes at a time and four at once so that
+// loads and stores overlap, for n >= 32. The stores to dest are
+// aligned; the first and last 32 bytes, loaded before anything is
+// zeroed, cover the unaligned ends. With stream set, dest is written
+// around the cache.
+__attribute__((target("avx2")))
+static inline void copyAndWipeAvx2(uint8_t *dest, uint8_t *source, size_t n, bool stream) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i head = _mm256_loadu_si256((const __m256i *)source);
+    __m256i tail = _mm256_loadu_si256((const __m256i *)&source[n - 32]);
+
+    size_t i = 32 - ((uintptr_t)dest & 31);
+
+    for(; i + 128 <= n; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&source[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&source[i + 32]);
+        __m256i c = _mm256_loadu_si256((const __m256i *)&source[i + 64]);
+        __m256i d = _mm256_loadu_si256((const __m256i *)&source[i + 96]);
+
+        if(stream) {
+            _mm256_stream_si256((__m256i *)&dest[i], a);
+            _mm256_stream_si256((__m256i *)&dest[i + 32], b);
+            _mm256_stream_si256((__m256i *)&dest[i + 64], c);
+            _mm256_stream_si256((__m256i *)&dest[i + 96], d);
+        } else {
+            _mm256_store_si256((__m256i *)&dest[i], a);
+            _mm256_store_si256((__m256i *)&dest[i + 32], b);
+            _mm256_store_si256((__m256i *)&dest[i + 64], c);
+            _mm256_store_si256((__m256i *)&dest[i + 96], d);
+        }
+
+        _mm256_storeu_si256((__m256i *)&source[i], zero);
+        _mm256_storeu_si256((__m256i *)&source[i + 32], zero);
+        _mm256_storeu_si256((__m256i *)&source[i + 64], zero);
+        _mm256_storeu_si256((__m256i *)&source[i + 96], zero);
+    }
+
+    for(; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&source[i]);
+        _mm256_store_si256((__m256i *)&dest[i], a);
+        _mm256_storeu_si256((__m256i *)&source[i], zero);
+    }
+
+    // Streamed stores are weakly ordered; make them visible before
+    // the ends overwrite some of them, and before the caller reads
+    // dest or hands it to another thread
+    if(stream) _mm_sfence();
+
+    _mm256_storeu_si256((__m256i *)dest, head);
+    _mm256_storeu_si256((__m256i *)&dest[n - 32], tail);
+    _mm256_storeu_si256((__m256i *)source, zero);
+    _mm256_storeu_si256((__m256i *)&source[n - 32], zero);
+}
+
+__attribute__((target("avx2")))
+static void copyAndWipeCached(uint8_t *dest, uint8_t *source, size_t n) {
+    copyAndWipeAvx2(dest, source, n, false);
+}
+
+__attribute__((target("avx2")))
+static void copyAndWipeStreaming(uint8_t *dest, uint8_t *source, size_t n) {
+    copyAndWipeAvx2(dest, source, n, true);
+}
+
+static bool hasAvx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+void copyAndWipe(uint8_t *dest, uint8_t *source, size_t n) {
+#ifdef QRYPT_COPYWIPE_X86
+    if(n > WIDE_COPY_THRESHOLD && hasAvx2()) {
+        if(n >= NON_TEMPORAL_COPY_THRESHOLD)
+            copyAndWipeStreaming(dest, source, n);
+        else
+            copyAndWipeCached(dest, source, n);
+    } else {
+        copyAndWipeChunks(dest, source, n);
+    }
+#else
+    copyAndWipeChunks(dest, source, n);
+#endif
+
+    keepStores(source);
+}
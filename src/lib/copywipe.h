@@ -0,0 +1,30 @@
+/*****************************************************************************
+ copywipe.h
+
+ Moves random out of Qryptoki's buffers and zeroes it where it was.
+ Moves are done in one pass, each chunk copied to the caller's memory
+ and zeroed in the source while it is in a register; a memcpy followed
+ by a memset would go over the source twice.
+ *****************************************************************************/
+
+#ifndef _QRYPT_WRAPPER_COPYWIPE_H
+#define _QRYPT_WRAPPER_COPYWIPE_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint8_t
+
+// Moves of more than this many bytes go 32 bytes at a time where the
+// CPU has AVX2; smaller ones 16 at a time, which costs less to start
+const size_t WIDE_COPY_THRESHOLD = 128;
+
+// Moves of at least this many bytes are written around the cache, as
+// they would otherwise push out most of it for data the caller may not
+// read soon
+const size_t NON_TEMPORAL_COPY_THRESHOLD = 1024 * 1024;
+
+// Copies n bytes from source to dest and zeroes them in source. The
+// zeroing is kept even if source is freed straight after. The ranges
+// must not overlap.
+void copyAndWipe(uint8_t *dest, uint8_t *source, size_t n);
+
+#endif /* !_QRYPT_WRAPPER_COPYWIPE_H */
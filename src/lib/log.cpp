@@ -1,11 +1,69 @@
-#include <stdarg.h>   // va_*
-#include <iostream>   // std::cerr
-#include <sstream>    // std::stringstream
+#include <stdarg.h>             // va_*
+#include <stdint.h>             // intptr_t
+#include <stdio.h>              // snprintf, vsnprintf
+#include <stdlib.h>             // getenv, strtol
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::milliseconds
+#include <condition_variable>   // std::condition_variable
+#include <iostream>             // std::cerr
+#include <mutex>                // std::mutex
+#include <thread>               // std::thread
 
 #include "log.h"
 
 const int DEFAULT_MAX_LOG_LEVEL = LOG_INFO;
 
+// Messages waiting for the writer; more are dropped and counted
+const size_t LOG_RING_SLOTS = 128;
+const size_t LOG_MESSAGE_SIZE = 4096;
+
+// How long the writer sleeps when it may have missed a wakeup
+const std::chrono::milliseconds LOG_WRITER_POLL(100);
+
+struct LogSlot {
+	// Equal to the ticket being written for a free slot, one more once
+	// its message is ready
+	std::atomic<size_t> sequence;
+	size_t length;
+	char text[LOG_MESSAGE_SIZE];
+};
+
+static LogSlot ring[LOG_RING_SLOTS];
+
+// Frees every slot for the first lap of tickets. Runs before
+// qryptokiMaxLogLevel below is loaded; until then it is 0, and
+// nothing is logged.
+static bool initializeRing() {
+	for(size_t i = 0; i < LOG_RING_SLOTS; i++) ring[i].sequence = i;
+	return true;
+}
+
+static bool ringInitialized = initializeRing();
+static std::atomic<size_t> enqueueTicket(0);
+static size_t dequeueTicket = 0;                // The writer's alone
+
+static std::atomic<bool> writerRunning(false);
+static std::atomic<bool> writerWaiting(false);
+static std::atomic<unsigned long> dropped(0);
+
+static std::thread writer;
+static std::mutex writerMutex;
+static std::condition_variable messageAdded;
+static bool writerStopping = false;
+
+static int loadMaxLogLevel() {
+	const char *max_level_c_str = getenv("QRYPT_LOG_LEVEL");
+	if(max_level_c_str == NULL) return DEFAULT_MAX_LOG_LEVEL;
+
+	char *end;
+	long max_level = strtol(max_level_c_str, &end, 10);
+	if(end == max_level_c_str) return DEFAULT_MAX_LOG_LEVEL;
+
+	return (int)max_level;
+}
+
+int qryptokiMaxLogLevel = loadMaxLogLevel();
+
 const char *logLevelToString(const int loglevel) {
 	switch (loglevel) {
 		case LOG_ERR:
@@ -21,30 +79,144 @@ const char *logLevelToString(const int loglevel) {
 	}
 }
 
+// Formats "Level: message\n" into text, truncating long messages
+static size_t formatMessage(char *text, const int level, const char *format, va_list args) {
+	int prefix = snprintf(text, LOG_MESSAGE_SIZE, "%s: ", logLevelToString(level));
+	if(prefix < 0) prefix = 0;
+
+	int message = vsnprintf(&text[prefix], LOG_MESSAGE_SIZE - prefix - 1, format, args);
+	if(message < 0) message = 0;
+
+	size_t length = prefix + message;
+	if(length > LOG_MESSAGE_SIZE - 2) length = LOG_MESSAGE_SIZE - 2;
+
+	text[length++] = '\n';
+	text[length] = '\0';
+	return length;
+}
+
+// Takes a free slot without locking, or returns NULL if the ring is full
+static LogSlot *claimSlot(size_t &ticket) {
+	ticket = enqueueTicket.load(std::memory_order_relaxed);
+
+	while(true) {
+		LogSlot &slot = ring[ticket % LOG_RING_SLOTS];
+		intptr_t lag = (intptr_t)(slot.sequence.load(std::memory_order_acquire) - ticket);
+
+		if(lag == 0) {
+			if(enqueueTicket.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) return &slot;
+		} else if(lag < 0) {
+			return NULL;
+		} else {
+			ticket = enqueueTicket.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// Writes out the messages that are ready, in order. Only one thread
+// drains at a time: the writer, or the thread stopping it.
+static void drainRing() {
+	while(true) {
+		LogSlot &slot = ring[dequeueTicket % LOG_RING_SLOTS];
+		if(slot.sequence.load(std::memory_order_acquire) != dequeueTicket + 1) break;
+
+		std::cerr.write(slot.text, slot.length);
+
+		slot.sequence.store(dequeueTicket + LOG_RING_SLOTS, std::memory_order_release);
+		dequeueTicket++;
+	}
+
+	static unsigned long reported = 0;
+	unsigned long droppedNow = dropped.load(std::memory_order_relaxed);
+
+	if(droppedNow != reported) {
+		std::cerr << logLevelToString(LOG_WARNING) << ": Dropped " << droppedNow - reported << " log messages, the log writer fell behind." << std::endl;
+		reported = droppedNow;
+	}
+
+	std::cerr.flush();
+}
+
+static bool ringHasMessage() {
+	return ring[dequeueTicket % LOG_RING_SLOTS].sequence.load(std::memory_order_acquire) == dequeueTicket + 1;
+}
+
+static void writeLog() {
+	std::unique_lock<std::mutex> lock(writerMutex);
+
+	while(!writerStopping) {
+		lock.unlock();
+		drainRing();
+		lock.lock();
+
+		writerWaiting.store(true);
+		messageAdded.wait_for(lock, LOG_WRITER_POLL, [] { return writerStopping || ringHasMessage(); });
+		writerWaiting.store(false);
+	}
+}
+
 void qryptokiLog(const int level, const char* format, ...)
 {
-	int max_level = DEFAULT_MAX_LOG_LEVEL;
+	if(!qryptokiLogEnabled(level)) return;
 
-	const char *max_level_c_str = getenv("QRYPT_LOG_LEVEL");
-	if(max_level_c_str != NULL) {
-		try {
-			max_level = std::stoi(std::string(max_level_c_str));
-		} catch (...) {}
+	va_list args;
+	va_start(args, format);
+
+	if(!writerRunning.load(std::memory_order_acquire)) {
+		char message[LOG_MESSAGE_SIZE];
+		size_t length = formatMessage(message, level, format, args);
+		va_end(args);
+
+		std::cerr.write(message, length);
+		return;
 	}
 
-	if(level > max_level) return;
+	size_t ticket;
+	LogSlot *slot = claimSlot(ticket);
 
-	// Print the format to a log message
-	char message[4096];
-	va_list args;
+	if(slot == NULL) {
+		va_end(args);
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
 
-	va_start(args, format);
-	vsnprintf(message, 4096, format, args);
+	slot->length = formatMessage(slot->text, level, format, args);
 	va_end(args);
 
-	std::stringstream stream;
-	stream << logLevelToString(level) << ": " << message << std::endl;
+	slot->sequence.store(ticket + 1, std::memory_order_release);
+
+	if(writerWaiting.load()) messageAdded.notify_one();
+}
+
+void qryptokiStartLogWriter()
+{
+	std::lock_guard<std::mutex> lock(writerMutex);
+	if(writer.joinable()) return;
+
+	writerStopping = false;
+	writer = std::thread(writeLog);
+
+	writerRunning.store(true, std::memory_order_release);
+}
+
+void qryptokiStopLogWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		if(!writer.joinable()) return;
+
+		writerStopping = true;
+	}
+
+	writerRunning.store(false, std::memory_order_release);
+	messageAdded.notify_one();
+	writer.join();
 
-	std::cerr << stream.str();
+	// Messages published while the writer was stopping
+	drainRing();
 }
 
+// Writes out what is left if the application never calls C_Finalize
+static struct LogWriterStopper {
+	~LogWriterStopper() { qryptokiStopLogWriter(); }
+} logWriterStopper;
@@ -2,21 +2,79 @@
 #define _QRYPTOKI_LOG_H
 
 #include <syslog.h>     // LOG_ERR, etc.
+#include <string>       // std::string, std::to_string
+
+/* Messages above this level are compiled out; set by the
+ * QRYPT_COMPILED_LOG_LEVEL CMake option */
+#ifndef QRYPT_COMPILED_LOG_LEVEL
+#define QRYPT_COMPILED_LOG_LEVEL LOG_DEBUG
+#endif
+
+/* The arguments are only evaluated if the message will be logged */
+#define QRYPT_LOG(level, ...) do { if((level) <= QRYPT_COMPILED_LOG_LEVEL && qryptokiLogEnabled(level)) qryptokiLog(level, __VA_ARGS__); } while(0)
 
 /* Logging errors */
-#define ERROR_MSG(...) qryptokiLog(LOG_ERR, __VA_ARGS__);
+#define ERROR_MSG(...) QRYPT_LOG(LOG_ERR, __VA_ARGS__)
 
 /* Logging warnings */
-#define WARNING_MSG(...) qryptokiLog(LOG_WARNING, __VA_ARGS__);
+#define WARNING_MSG(...) QRYPT_LOG(LOG_WARNING, __VA_ARGS__)
 
 /* Logging information */
-#define INFO_MSG(...) qryptokiLog(LOG_INFO, __VA_ARGS__);
+#define INFO_MSG(...) QRYPT_LOG(LOG_INFO, __VA_ARGS__)
 
 /* Logging debug information */
-#define DEBUG_MSG(...) qryptokiLog(LOG_DEBUG, __VA_ARGS__);
+#define DEBUG_MSG(...) QRYPT_LOG(LOG_DEBUG, __VA_ARGS__)
+
+/* Logging an event name and key/value pairs, as "event key=value ...",
+ * formatted only if the message will be logged */
+#define LOG_EVENT(level, ...) do { if((level) <= QRYPT_COMPILED_LOG_LEVEL && qryptokiLogEnabled(level)) qryptokiLogEvent(level, __VA_ARGS__); } while(0)
+
+/* QRYPT_LOG_LEVEL, read once when the library is loaded */
+extern int qryptokiMaxLogLevel;
+
+inline bool qryptokiLogEnabled(const int level) {
+	return level <= qryptokiMaxLogLevel;
+}
 
 /* Function definitions */
 void qryptokiLog(const int level, const char* format, ...);
 
-#endif /* !_QRYPTOKI_LOG_H */
+inline void qryptokiAppendLogValue(std::string &line, const char *value) {
+	line += value;
+}
+
+inline void qryptokiAppendLogValue(std::string &line, const std::string &value) {
+	line += value;
+}
 
+template <typename Value>
+void qryptokiAppendLogValue(std::string &line, const Value &value) {
+	line += std::to_string(value);
+}
+
+inline void qryptokiAppendLogFields(std::string &) {}
+
+template <typename Value, typename... Fields>
+void qryptokiAppendLogFields(std::string &line, const char *key, const Value &value, const Fields&... fields) {
+	line += ' ';
+	line += key;
+	line += '=';
+	qryptokiAppendLogValue(line, value);
+	qryptokiAppendLogFields(line, fields...);
+}
+
+template <typename... Fields>
+void qryptokiLogEvent(const int level, const char *event, const Fields&... fields) {
+	std::string line(event);
+	qryptokiAppendLogFields(line, fields...);
+	qryptokiLog(level, "%s", line.c_str());
+}
+
+/* Messages go through a ring written out by a thread of its own while
+ * it runs, and straight to std::cerr otherwise. Starting throws
+ * std::system_error if the thread can't be created; stopping writes
+ * out what is left. */
+void qryptokiStartLogWriter();
+void qryptokiStopLogWriter();
+
+#endif /* !_QRYPTOKI_LOG_H */
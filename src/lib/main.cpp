@@ -38,12 +38,22 @@
 #define CRYPTOKI_EXPORTS
 
 #include <stdlib.h>
+#include <algorithm>       // std::copy, std::copy_n
+#include <chrono>          // std::chrono::milliseconds
 #include <cstring>         // strncpy, memset
+#include <memory>          // std::unique_ptr
+#include <stdexcept>       // std::runtime_error
+#include <string>          // std::string
+#include <thread>          // std::this_thread::sleep_for
+#include <vector>          // std::vector
 
 #include "cryptoki.h"                    // PKCS#11 types
 #include "qryptoki_pkcs11_vendor_defs.h" // CKR_QRYPT_*
 #include "log.h"                         // logging macros
 #include "GlobalData.h"                  // GlobalData
+#include "BatchRunner.h"                 // BatchRunner
+#include "EntropyStats.h"                // EntropyStats
+#include "LatencyStats.h"                // LatencyStats
 
 #if defined(__GNUC__) && \
 	(__GNUC__ >= 4 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 3)) || \
@@ -53,6 +63,214 @@
 #define PKCS_API
 #endif
 
+// How often C_WaitForSlotEvent polls when there are several base HSMs
+const int SLOT_EVENT_POLL_MS = 100;
+
+// Called when a slot event was seen or the token was (re)initialized
+static void slotChanged(CK_SLOT_ID slotID) {
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) metadataCache->slotChanged(slotID);
+}
+
+// Called when the token's flags or free memory may have changed
+static void tokenChanged(CK_SLOT_ID slotID) {
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) metadataCache->tokenChanged(slotID);
+}
+
+// Called when objects on a slot may have been added, removed or
+// modified, to drop cached search results
+static void objectsChanged(CK_SLOT_ID slotID) {
+	FindCache *findCache = GlobalData::getInstance().getFindCache();
+	if(findCache != NULL) findCache->invalidate(slotID);
+
+	tokenChanged(slotID);
+}
+
+// Called when the application may have lost (or gained) access to
+// a slot's objects, or their handles may be reused, to drop
+// everything cached about them
+static void accessChanged(CK_SLOT_ID slotID) {
+	objectsChanged(slotID);
+
+	AttributeCache *attributeCache = GlobalData::getInstance().getAttributeCache();
+	if(attributeCache != NULL) attributeCache->invalidate(slotID);
+
+	PublicKeyCache *publicKeyCache = GlobalData::getInstance().getPublicKeyCache();
+	if(publicKeyCache != NULL) publicKeyCache->invalidate(slotID);
+}
+
+// Called when one object was destroyed or modified
+static void objectChanged(CK_SLOT_ID slotID, CK_OBJECT_HANDLE hObject) {
+	objectsChanged(slotID);
+
+	AttributeCache *attributeCache = GlobalData::getInstance().getAttributeCache();
+	if(attributeCache != NULL) attributeCache->invalidate(slotID, hObject);
+
+	PublicKeyCache *publicKeyCache = GlobalData::getInstance().getPublicKeyCache();
+	if(publicKeyCache != NULL) publicKeyCache->invalidate(slotID, hObject);
+}
+
+// Logs out the login that the session pool's idle sessions kept after
+// the application closed its last session on the slot
+static CK_RV logOutPool(Session &session) {
+	// Pooled key pairs can only be destroyed while the token is logged in
+	KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+	if(keyPairPool != NULL) keyPairPool->drain(session.slotID);
+
+	CK_C_Logout Base_C_Logout = (CK_C_Logout)session.module->getFunction("C_Logout");
+	if(Base_C_Logout == NULL) return CKR_GENERAL_ERROR;
+
+	// Another thread may have logged it out first
+	CK_RV rv = (*Base_C_Logout)(session.baseSession);
+	if(rv != CKR_OK && rv != CKR_USER_NOT_LOGGED_IN) return rv;
+
+	GlobalData::getInstance().getSessionPool()->forgetLogin(session.slotID);
+	accessChanged(session.slotID);
+
+	return CKR_OK;
+}
+
+// Whether a call that returns output finished its operation; a length
+// query or a too-small buffer leaves the operation active
+static bool operationEnded(CK_RV rv, CK_BYTE_PTR pOutput) {
+	return !(rv == CKR_BUFFER_TOO_SMALL || (rv == CKR_OK && pOutput == NULL_PTR));
+}
+
+// Per BufferedOperationType: the base HSM function taking its update
+// data, the SESSION_OP_* flag and the ReplicaOperationType
+static const char *const BUFFERED_UPDATE_FUNCTIONS[BUFFERED_OP_COUNT] = {"C_DigestUpdate", "C_SignUpdate", "C_VerifyUpdate"};
+static const unsigned BUFFERED_SESSION_OPS[BUFFERED_OP_COUNT] = {SESSION_OP_DIGEST, SESSION_OP_SIGN, SESSION_OP_VERIFY};
+static const ReplicaOperationType BUFFERED_REPLICA_OPS[BUFFERED_OP_COUNT] = {REPLICA_OP_COUNT, REPLICA_OP_SIGN, REPLICA_OP_VERIFY};
+
+static bool bufferedOperationActive(Session &session, BufferedOperationType type) {
+	ReplicaOperationType replicaType = BUFFERED_REPLICA_OPS[type];
+
+	if(session.replicaGroup != NULL && replicaType != REPLICA_OP_COUNT) return session.operations[replicaType].active;
+
+	return session.activeOperations & BUFFERED_SESSION_OPS[type];
+}
+
+// Passes update data straight to the base HSM
+static CK_RV sendUpdate(Session &session, BufferedOperationType type, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+	// C_DigestUpdate, C_SignUpdate and C_VerifyUpdate take the same arguments
+	const char *functionName = BUFFERED_UPDATE_FUNCTIONS[type];
+	ReplicaOperationType replicaType = BUFFERED_REPLICA_OPS[type];
+
+	if(session.replicaGroup != NULL && replicaType != REPLICA_OP_COUNT) {
+		CK_RV rv = session.replicaGroup->run(session, replicaType, false, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+			CK_C_DigestUpdate Base_C_Update = (CK_C_DigestUpdate)module->getFunction(functionName);
+			if(Base_C_Update == NULL) return CKR_GENERAL_ERROR;
+
+			return (*Base_C_Update)(hBaseSession, pPart, ulPartLen);
+		});
+
+		if(rv != CKR_OK) session.replicaGroup->end(session, replicaType);
+		return rv;
+	}
+
+	CK_C_DigestUpdate Base_C_Update = (CK_C_DigestUpdate)session.module->getFunction(functionName);
+	if(Base_C_Update == NULL) return CKR_GENERAL_ERROR;
+
+	// A failed update ends the operation, so later updates aren't buffered
+	CK_RV rv = (*Base_C_Update)(session.baseSession, pPart, ulPartLen);
+	if(rv != CKR_OK) session.activeOperations &= ~BUFFERED_SESSION_OPS[type];
+
+	return rv;
+}
+
+// Passes on the update data gathered so far. Called before any call
+// that the base HSM must see after that data.
+static CK_RV flushUpdates(Session &session, BufferedOperationType type) {
+	UpdateBuffer *buffer = session.pendingUpdates[type].get();
+	if(buffer == NULL || buffer->getSize() == 0) return CKR_OK;
+
+	CK_RV rv;
+	try {
+		rv = sendUpdate(session, type, buffer->getData(), buffer->getSize());
+	} catch (std::bad_alloc &ex) {
+		rv = CKR_HOST_MEMORY;
+	} catch (...) {
+		rv = CKR_GENERAL_ERROR;
+	}
+
+	buffer->clear();
+	return rv;
+}
+
+// Gathers small parts in the session's update buffer, so the base HSM
+// sees a few large C_*Update calls instead of many small ones
+static CK_RV bufferUpdate(Session &session, BufferedOperationType type, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+	size_t capacity = GlobalData::getInstance().getUpdateBufferSize();
+
+	// Let the base HSM report updates without a C_*Init
+	if(capacity == 0 || !bufferedOperationActive(session, type)) return sendUpdate(session, type, pPart, ulPartLen);
+
+	std::unique_ptr<UpdateBuffer> &buffer = session.pendingUpdates[type];
+
+	if(!buffer && ulPartLen < capacity) {
+		try {
+			buffer = std::make_unique<UpdateBuffer>(capacity);
+		} catch (std::runtime_error &ex) {
+			// Out of lockable memory, so pass this part on unbuffered
+			DEBUG_MSG("%s", ex.what());
+		}
+	}
+
+	// Large parts (and bad arguments) go straight on, after the data before them
+	if(!buffer || ulPartLen >= capacity || pPart == NULL_PTR) {
+		CK_RV rv = flushUpdates(session, type);
+		if(rv != CKR_OK) return rv;
+
+		return sendUpdate(session, type, pPart, ulPartLen);
+	}
+
+	if(!buffer->fits(ulPartLen)) {
+		CK_RV rv = flushUpdates(session, type);
+		if(rv != CKR_OK) return rv;
+	}
+
+	buffer->append(pPart, ulPartLen);
+	return CKR_OK;
+}
+
+// Whether a software digest or verification is under way
+template<class T> static bool softwareActive(const std::unique_ptr<T> &operation) {
+	return operation && operation->isActive();
+}
+
+// Starts a verification in software if offload is on and the key and
+// mechanism allow it; returns false if the base HSM should do it
+static bool softwareVerifyInit(Session &session, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey, bool recover, std::unique_ptr<SoftwareVerify> &operation, CK_RV &rv) {
+	PublicKeyCache *publicKeyCache = GlobalData::getInstance().getPublicKeyCache();
+	if(publicKeyCache == NULL || pMechanism == NULL_PTR) return false;
+
+	// Let the base HSM report an operation it already has under way
+	bool baseActive;
+	if(recover)
+		baseActive = session.activeOperations & SESSION_OP_VERIFY_RECOVER;
+	else if(session.replicaGroup != NULL)
+		baseActive = session.operations[REPLICA_OP_VERIFY].active;
+	else
+		baseActive = session.activeOperations & SESSION_OP_VERIFY;
+
+	if(baseActive) return false;
+
+	// Only raw PKCS #1 v1.5 signatures hold recoverable data
+	if(recover && pMechanism->mechanism != CKM_RSA_PKCS) return false;
+
+	PublicKey publicKey;
+	if(!publicKeyCache->getPublicKey(session, hKey, publicKey) || !publicKey.key) return false;
+	if(!(recover ? publicKey.canVerifyRecover : publicKey.canVerify)) return false;
+	if(!SoftwareVerify::supports(pMechanism, publicKey.keyType)) return false;
+
+	std::unique_ptr<SoftwareVerify> verify = std::make_unique<SoftwareVerify>(publicKey.key);
+	rv = verify->init(pMechanism);
+	if(rv == CKR_OK) operation = std::move(verify);
+
+	return true;
+}
+
 // PKCS #11 function list
 static CK_FUNCTION_LIST functionList =
 {
@@ -129,6 +347,18 @@ static CK_FUNCTION_LIST functionList =
 	C_WaitForSlotEvent
 };
 
+// Qryptoki's own functions (see qryptoki_pkcs11_vendor_defs.h)
+static CK_QRYPT_FUNCTION_LIST qryptFunctionList =
+{
+	{ 1, 3 },
+	C_QryptProcessBatch,
+	C_QryptSubmit,
+	C_QryptGetCompletionFd,
+	C_QryptPollCompletions,
+	C_QryptGetLatencyReport,
+	C_QryptGetStatistics
+};
+
 // General-purpose functions
 PKCS_API CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 {
@@ -142,17 +372,39 @@ PKCS_API CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 			return rv;
 		}
 
-		// Initialize base HSM
-		CK_C_Initialize Base_C_Initialize = (CK_C_Initialize)GlobalData::getInstance().getBaseFunction("C_Initialize");
-		if(Base_C_Initialize == NULL) {
-			GlobalData::getInstance().finalize();
-			return CKR_GENERAL_ERROR;
+		// Initialize base HSMs
+		size_t moduleCount = GlobalData::getInstance().getModuleCount();
+		for(size_t i = 0; i < moduleCount; i++) {
+			CK_C_Initialize Base_C_Initialize = (CK_C_Initialize)GlobalData::getInstance().getModule(i)->getFunction("C_Initialize");
+			rv = Base_C_Initialize == NULL ? CKR_GENERAL_ERROR : (*Base_C_Initialize)(pInitArgs);
+
+			if(rv != CKR_OK) {
+				// Undo the base HSMs that did initialize
+				for(size_t j = 0; j < i; j++) {
+					CK_C_Finalize Base_C_Finalize = (CK_C_Finalize)GlobalData::getInstance().getModule(j)->getFunction("C_Finalize");
+					if(Base_C_Finalize != NULL) (*Base_C_Finalize)(NULL_PTR);
+				}
+
+				GlobalData::getInstance().finalize();
+				return rv;
+			}
 		}
 
-		rv = (*Base_C_Initialize)(pInitArgs);
-		if(rv != CKR_OK) GlobalData::getInstance().finalize();
+		rv = GlobalData::getInstance().startSlotEventWatcher();
+		if(rv == CKR_OK) rv = GlobalData::getInstance().startAsyncQueue();
+		if(rv == CKR_OK) rv = GlobalData::getInstance().startKeyPairPool();
+		if(rv == CKR_OK) rv = GlobalData::getInstance().startMetricsExporter();
+		if(rv != CKR_OK) {
+			for(size_t i = 0; i < moduleCount; i++) {
+				CK_C_Finalize Base_C_Finalize = (CK_C_Finalize)GlobalData::getInstance().getModule(i)->getFunction("C_Finalize");
+				if(Base_C_Finalize != NULL) (*Base_C_Finalize)(NULL_PTR);
+			}
 
-		return rv;
+			GlobalData::getInstance().finalize();
+			return rv;
+		}
+
+		return CKR_OK;
 	} catch (std::bad_alloc &ex) {
 		return CKR_HOST_MEMORY;
 	} catch (...) {
@@ -165,12 +417,33 @@ PKCS_API CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	try {
 		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-		CK_C_Finalize Base_C_Finalize = (CK_C_Finalize)GlobalData::getInstance().getBaseFunction("C_Finalize");
-		if(Base_C_Finalize == NULL) return CKR_GENERAL_ERROR;
+		// Wake up the application's blocked C_WaitForSlotEvent calls
+		SlotEventWatcher *slotEventWatcher = GlobalData::getInstance().getSlotEventWatcher();
+		if(slotEventWatcher != NULL) slotEventWatcher->requestStop();
 
-		CK_RV rv = (*Base_C_Finalize)(pReserved);
+		// Let the async workers finish with their base sessions
+		AsyncQueue *asyncQueue = GlobalData::getInstance().getAsyncQueue();
+		if(asyncQueue != NULL) asyncQueue->stop();
 
-		if(rv != CKR_OK) return rv;
+		// Pooled key pairs nobody took would be left on the token
+		KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+		if(keyPairPool != NULL) {
+			keyPairPool->stop();
+			keyPairPool->drainAll();
+		}
+
+		// Finalize every base HSM, reporting the first failure
+		CK_RV firstFailure = CKR_OK;
+
+		size_t moduleCount = GlobalData::getInstance().getModuleCount();
+		for(size_t i = 0; i < moduleCount; i++) {
+			CK_C_Finalize Base_C_Finalize = (CK_C_Finalize)GlobalData::getInstance().getModule(i)->getFunction("C_Finalize");
+			CK_RV rv = Base_C_Finalize == NULL ? CKR_GENERAL_ERROR : (*Base_C_Finalize)(pReserved);
+
+			if(rv != CKR_OK && firstFailure == CKR_OK) firstFailure = rv;
+		}
+
+		if(firstFailure != CKR_OK) return firstFailure;
 		
 		return GlobalData::getInstance().finalize();
 	} catch (std::bad_alloc &ex) {
@@ -234,7 +507,10 @@ PKCS_API CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
     if (ppFunctionList == NULL_PTR) return CKR_ARGUMENTS_BAD;
 
-    *ppFunctionList = &functionList;
+    if (LatencyStats::wrapsFunctionList())
+        *ppFunctionList = LatencyStats::getTimedFunctionList(functionList);
+    else
+        *ppFunctionList = &functionList;
 
     return CKR_OK;
 }
@@ -245,10 +521,14 @@ PKCS_API CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_UL
 	try {
 		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-		CK_C_SeedRandom Base_C_SeedRandom = (CK_C_SeedRandom)GlobalData::getInstance().getBaseFunction("C_SeedRandom");
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		CK_C_SeedRandom Base_C_SeedRandom = (CK_C_SeedRandom)session->module->getFunction("C_SeedRandom");
 		if(Base_C_SeedRandom == NULL) return CKR_GENERAL_ERROR;
 
-		CK_RV rv = (*Base_C_SeedRandom)(hSession, pSeed, 0);
+		rv = (*Base_C_SeedRandom)(session->baseSession, pSeed, 0);
 		switch (rv) {
 			case CKR_DEVICE_ERROR:
 			case CKR_DEVICE_MEMORY:
@@ -285,10 +565,14 @@ PKCS_API CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pRandomD
 	try {
 		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-		CK_C_GenerateRandom Base_C_GenerateRandom = (CK_C_GenerateRandom)GlobalData::getInstance().getBaseFunction("C_GenerateRandom");
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		CK_C_GenerateRandom Base_C_GenerateRandom = (CK_C_GenerateRandom)session->module->getFunction("C_GenerateRandom");
 		if(Base_C_GenerateRandom == NULL) return CKR_GENERAL_ERROR;
 
-		CK_RV rv = (*Base_C_GenerateRandom)(hSession, pRandomData, 0);
+		rv = (*Base_C_GenerateRandom)(session->baseSession, pRandomData, 0);
 		switch (rv) {
 			case CKR_DEVICE_ERROR:
 			case CKR_DEVICE_MEMORY:
@@ -311,6 +595,12 @@ PKCS_API CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pRandomD
 				return rv;
 		}
 
+		// Served from the random buffer without its mutex if it can be
+		if(GlobalData::getInstance().takeReservedRandom(pRandomData, ulRandomLen)) {
+			DEBUG_MSG("Retrieved %lu bytes from Qrypt Entropy API.", ulRandomLen);
+			return CKR_OK;
+		}
+
 		rv = GlobalData::getInstance().lockRandomBufferMutex();
 		if(rv != CKR_OK) return rv;
 
@@ -339,7 +629,7 @@ PKCS_API CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pRandomD
 		rv = GlobalData::getInstance().unlockRandomBufferMutex();
 		if(rv != CKR_OK) return rv;
 
-		INFO_MSG("Retrieved %lu bytes from Qrypt Entropy API.", ulRandomLen);
+		DEBUG_MSG("Retrieved %lu bytes from Qrypt Entropy API.", ulRandomLen);
 		return CKR_OK;
 	} catch (std::bad_alloc &ex) {
 		return CKR_HOST_MEMORY;
@@ -351,621 +641,1886 @@ PKCS_API CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pRandomD
 // Other functions (these all look the same)
 PKCS_API CK_RV C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_GetSlotList Base_C_GetSlotList = (CK_C_GetSlotList)GlobalData::getInstance().getBaseFunction("C_GetSlotList");
-	if(Base_C_GetSlotList == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_GetSlotList)(tokenPresent, pSlotList, pulCount);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+
+		// A single base HSM's slot IDs are used as-is
+		if(metadataCache == NULL && GlobalData::getInstance().getModuleCount() == 1 && !GlobalData::getInstance().hasReplicaGroups()) {
+			CK_C_GetSlotList Base_C_GetSlotList = (CK_C_GetSlotList)GlobalData::getInstance().getBaseFunction("C_GetSlotList");
+			if(Base_C_GetSlotList == NULL) return CKR_GENERAL_ERROR;
+
+			return (*Base_C_GetSlotList)(tokenPresent, pSlotList, pulCount);
+		}
+
+		if(pulCount == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		std::vector<CK_SLOT_ID> slotList;
+		CK_RV rv = metadataCache != NULL ? metadataCache->getSlotList(tokenPresent, slotList) : GlobalData::getInstance().getSlotList(tokenPresent, slotList);
+		if(rv != CKR_OK) return rv;
+
+		if(pSlotList == NULL_PTR) {
+			*pulCount = slotList.size();
+			return CKR_OK;
+		}
+
+		if(*pulCount < slotList.size()) {
+			*pulCount = slotList.size();
+			return CKR_BUFFER_TOO_SMALL;
+		}
+
+		std::copy(slotList.begin(), slotList.end(), pSlotList);
+		*pulCount = slotList.size();
+
+		return CKR_OK;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetSlotInfo Base_C_GetSlotInfo = (CK_C_GetSlotInfo)GlobalData::getInstance().getBaseFunction("C_GetSlotInfo");
+	BaseHSM *module;
+	CK_SLOT_ID baseSlotID;
+	CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+	if(rv != CKR_OK) return rv;
+
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) {
+		if(pInfo == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		try {
+			return metadataCache->getSlotInfo(slotID, module, baseSlotID, *pInfo);
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_GetSlotInfo Base_C_GetSlotInfo = (CK_C_GetSlotInfo)module->getFunction("C_GetSlotInfo");
 	if(Base_C_GetSlotInfo == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetSlotInfo)(slotID, pInfo);
+	return (*Base_C_GetSlotInfo)(baseSlotID, pInfo);
 }
 
 PKCS_API CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetTokenInfo Base_C_GetTokenInfo = (CK_C_GetTokenInfo)GlobalData::getInstance().getBaseFunction("C_GetTokenInfo");
+	BaseHSM *module;
+	CK_SLOT_ID baseSlotID;
+	CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+	if(rv != CKR_OK) return rv;
+
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) {
+		if(pInfo == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		try {
+			rv = metadataCache->getTokenInfo(slotID, module, baseSlotID, *pInfo);
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+		if(rv != CKR_OK) return rv;
+
+		// Cached session counts would be stale, and the base HSM's
+		// would include idle pooled sessions anyway
+		CK_ULONG sessionCount, rwSessionCount;
+		rv = GlobalData::getInstance().countSlotSessions(slotID, sessionCount, rwSessionCount);
+		if(rv != CKR_OK) return rv;
+
+		if(pInfo->ulSessionCount != CK_UNAVAILABLE_INFORMATION) pInfo->ulSessionCount = sessionCount;
+		if(pInfo->ulRwSessionCount != CK_UNAVAILABLE_INFORMATION) pInfo->ulRwSessionCount = rwSessionCount;
+
+		return CKR_OK;
+	}
+	
+	CK_C_GetTokenInfo Base_C_GetTokenInfo = (CK_C_GetTokenInfo)module->getFunction("C_GetTokenInfo");
 	if(Base_C_GetTokenInfo == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetTokenInfo)(slotID, pInfo);
+	return (*Base_C_GetTokenInfo)(baseSlotID, pInfo);
 }
 
 PKCS_API CK_RV C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetMechanismList Base_C_GetMechanismList = (CK_C_GetMechanismList)GlobalData::getInstance().getBaseFunction("C_GetMechanismList");
+	BaseHSM *module;
+	CK_SLOT_ID baseSlotID;
+	CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+	if(rv != CKR_OK) return rv;
+
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) {
+		if(pulCount == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		try {
+			std::vector<CK_MECHANISM_TYPE> mechanisms;
+			rv = metadataCache->getMechanismList(slotID, module, baseSlotID, mechanisms);
+			if(rv != CKR_OK) return rv;
+
+			if(pMechanismList == NULL_PTR) {
+				*pulCount = mechanisms.size();
+				return CKR_OK;
+			}
+
+			if(*pulCount < mechanisms.size()) {
+				*pulCount = mechanisms.size();
+				return CKR_BUFFER_TOO_SMALL;
+			}
+
+			std::copy(mechanisms.begin(), mechanisms.end(), pMechanismList);
+			*pulCount = mechanisms.size();
+
+			return CKR_OK;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_GetMechanismList Base_C_GetMechanismList = (CK_C_GetMechanismList)module->getFunction("C_GetMechanismList");
 	if(Base_C_GetMechanismList == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetMechanismList)(slotID, pMechanismList, pulCount);
+	return (*Base_C_GetMechanismList)(baseSlotID, pMechanismList, pulCount);
 }
 
 PKCS_API CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetMechanismInfo Base_C_GetMechanismInfo = (CK_C_GetMechanismInfo)GlobalData::getInstance().getBaseFunction("C_GetMechanismInfo");
+	BaseHSM *module;
+	CK_SLOT_ID baseSlotID;
+	CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+	if(rv != CKR_OK) return rv;
+
+	MetadataCache *metadataCache = GlobalData::getInstance().getMetadataCache();
+	if(metadataCache != NULL) {
+		if(pInfo == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		try {
+			return metadataCache->getMechanismInfo(slotID, module, baseSlotID, type, *pInfo);
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_GetMechanismInfo Base_C_GetMechanismInfo = (CK_C_GetMechanismInfo)module->getFunction("C_GetMechanismInfo");
 	if(Base_C_GetMechanismInfo == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetMechanismInfo)(slotID, type, pInfo);
+	return (*Base_C_GetMechanismInfo)(baseSlotID, type, pInfo);
 }
 
 PKCS_API CK_RV C_InitToken(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_InitToken Base_C_InitToken = (CK_C_InitToken)GlobalData::getInstance().getBaseFunction("C_InitToken");
+	BaseHSM *module;
+	CK_SLOT_ID baseSlotID;
+	CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+	if(rv != CKR_OK) return rv;
+	
+	// Idle pooled sessions would make the base HSM refuse with CKR_SESSION_EXISTS
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+	if(sessionPool != NULL) {
+		rv = sessionPool->closeIdle(slotID);
+		if(rv != CKR_OK) return rv;
+	}
+
+	KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+	if(keyPairPool != NULL) keyPairPool->drain(slotID);
+
+	CK_C_InitToken Base_C_InitToken = (CK_C_InitToken)module->getFunction("C_InitToken");
 	if(Base_C_InitToken == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_InitToken)(slotID, pPin, ulPinLen, pLabel);
+	rv = (*Base_C_InitToken)(baseSlotID, pPin, ulPinLen, pLabel);
+
+	accessChanged(slotID);
+	slotChanged(slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_InitPIN Base_C_InitPIN = (CK_C_InitPIN)GlobalData::getInstance().getBaseFunction("C_InitPIN");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_InitPIN Base_C_InitPIN = (CK_C_InitPIN)session->module->getFunction("C_InitPIN");
 	if(Base_C_InitPIN == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_InitPIN)(hSession, pPin, ulPinLen);
+	rv = (*Base_C_InitPIN)(session->baseSession, pPin, ulPinLen);
+	tokenChanged(session->slotID);
+
+	// A PIN remembered by the session pool may be out of date now
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+	if(rv == CKR_OK && sessionPool != NULL) sessionPool->forgetLogin(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SetPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SetPIN Base_C_SetPIN = (CK_C_SetPIN)GlobalData::getInstance().getBaseFunction("C_SetPIN");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SetPIN Base_C_SetPIN = (CK_C_SetPIN)session->module->getFunction("C_SetPIN");
 	if(Base_C_SetPIN == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SetPIN)(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen);
+	rv = (*Base_C_SetPIN)(session->baseSession, pOldPin, ulOldLen, pNewPin, ulNewLen);
+	tokenChanged(session->slotID);
+
+	// A PIN remembered by the session pool may be out of date now
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+	if(rv == CKR_OK && sessionPool != NULL) sessionPool->forgetLogin(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify, CK_SESSION_HANDLE_PTR phSession)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)GlobalData::getInstance().getBaseFunction("C_OpenSession");
-	if(Base_C_OpenSession == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_OpenSession)(slotID, flags, pApplication, notify, phSession);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		if(phSession == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		std::shared_ptr<Session> session = std::make_shared<Session>();
+		session->slotID = slotID;
+		session->flags = flags;
+		session->reusable = true;
+		session->activeOperations = 0;
+		session->findActive = false;
+		session->findPosition = 0;
+		session->replicaGroup = NULL;
+
+		CK_RV rv = GlobalData::getInstance().getSlot(slotID, session->module, session->baseSlotID);
+		if(rv != CKR_OK) return rv;
+
+		// Replica groups hold several base sessions each, so they are not pooled
+		ReplicaGroup *replicaGroup = GlobalData::getInstance().getReplicaGroup(slotID);
+		SessionPool *sessionPool = replicaGroup == NULL ? GlobalData::getInstance().getSessionPool() : NULL;
+
+		if(replicaGroup != NULL) {
+			rv = replicaGroup->openSession(*session, flags, pApplication, notify);
+			if(rv != CKR_OK) {
+				replicaGroup->closeSession(*session);
+				return rv;
+			}
+		} else if(sessionPool != NULL) {
+			rv = sessionPool->lease(*session, flags, pApplication, notify);
+			if(rv != CKR_OK) return rv;
+		} else {
+			CK_C_OpenSession Base_C_OpenSession = (CK_C_OpenSession)session->module->getFunction("C_OpenSession");
+			if(Base_C_OpenSession == NULL) return CKR_GENERAL_ERROR;
+
+			rv = (*Base_C_OpenSession)(session->baseSlotID, flags, pApplication, notify, &session->baseSession);
+			if(rv != CKR_OK) return rv;
+		}
+
+		rv = GlobalData::getInstance().addSession(session);
+		if(rv != CKR_OK) {
+			if(replicaGroup != NULL) {
+				replicaGroup->closeSession(*session);
+			} else if(sessionPool != NULL) {
+				sessionPool->release(*session);
+			} else {
+				CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)session->module->getFunction("C_CloseSession");
+				if(Base_C_CloseSession != NULL) (*Base_C_CloseSession)(session->baseSession);
+			}
+			return rv;
+		}
+
+		*phSession = session->handle;
+		return CKR_OK;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
 	
-	CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)GlobalData::getInstance().getBaseFunction("C_CloseSession");
-	if(Base_C_CloseSession == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_CloseSession)(hSession);
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+
+	if(session->replicaGroup != NULL) {
+		rv = session->replicaGroup->closeSession(*session);
+	} else if(sessionPool != NULL) {
+		try {
+			rv = sessionPool->release(*session);
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	} else {
+		CK_C_CloseSession Base_C_CloseSession = (CK_C_CloseSession)session->module->getFunction("C_CloseSession");
+		if(Base_C_CloseSession == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_CloseSession)(session->baseSession);
+	}
+
+	if(rv != CKR_OK && rv != CKR_SESSION_HANDLE_INVALID && rv != CKR_SESSION_CLOSED) return rv;
+
+	// The base session is gone either way, so forget about it
+	CK_RV removeRv = GlobalData::getInstance().removeSession(hSession);
+
+	// Closing a session destroys the objects it created, and closing
+	// the application's last session on the slot logs the token out;
+	// idle pooled sessions don't count, as the application can't see them
+	bool lastSession = !GlobalData::getInstance().hasSlotSessions(session->slotID);
+	if(!session->reusable || lastSession) accessChanged(session->slotID);
+
+	// Pooled key pairs go with the application's login, and the key pair
+	// pool's session would keep the token logged in. Idle pooled
+	// sessions still hold the login, so they can be destroyed.
+	KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+	if(lastSession && keyPairPool != NULL) keyPairPool->drain(session->slotID);
+
+	// Leaving the login to the pool's idle sessions
+	if(lastSession && sessionPool != NULL) sessionPool->lastSessionClosed(session->slotID);
+
+	return rv != CKR_OK ? rv : removeRv;
 }
 
 PKCS_API CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_CloseAllSessions Base_C_CloseAllSessions = (CK_C_CloseAllSessions)GlobalData::getInstance().getBaseFunction("C_CloseAllSessions");
-	if(Base_C_CloseAllSessions == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_CloseAllSessions)(slotID);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		BaseHSM *module;
+		CK_SLOT_ID baseSlotID;
+		CK_RV rv = GlobalData::getInstance().getSlot(slotID, module, baseSlotID);
+		if(rv != CKR_OK) return rv;
+
+		// Pooled key pairs can only be destroyed while the token is logged in
+		KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+		if(keyPairPool != NULL) keyPairPool->drain(slotID);
+
+		ReplicaGroup *replicaGroup = GlobalData::getInstance().getReplicaGroup(slotID);
+		if(replicaGroup != NULL) {
+			rv = replicaGroup->closeAllSessions();
+		} else {
+			CK_C_CloseAllSessions Base_C_CloseAllSessions = (CK_C_CloseAllSessions)module->getFunction("C_CloseAllSessions");
+			if(Base_C_CloseAllSessions == NULL) return CKR_GENERAL_ERROR;
+
+			rv = (*Base_C_CloseAllSessions)(baseSlotID);
+		}
+		if(rv != CKR_OK) return rv;
+
+		// That closed the pool's idle sessions too
+		SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+		if(sessionPool != NULL) sessionPool->resetSlot(slotID);
+
+		accessChanged(slotID);
+		return GlobalData::getInstance().removeSlotSessions(slotID);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
 	
-	CK_C_GetSessionInfo Base_C_GetSessionInfo = (CK_C_GetSessionInfo)GlobalData::getInstance().getBaseFunction("C_GetSessionInfo");
+	CK_C_GetSessionInfo Base_C_GetSessionInfo = (CK_C_GetSessionInfo)session->module->getFunction("C_GetSessionInfo");
 	if(Base_C_GetSessionInfo == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetSessionInfo)(hSession, pInfo);
+	rv = (*Base_C_GetSessionInfo)(session->baseSession, pInfo);
+
+	// Report the slot ID the application knows
+	if(rv == CKR_OK) pInfo->slotID = session->slotID;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetOperationState Base_C_GetOperationState = (CK_C_GetOperationState)GlobalData::getInstance().getBaseFunction("C_GetOperationState");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	// Base HSMs can't save operations done in software
+	if(softwareActive(session->softwareDigest) || softwareActive(session->softwareVerify) || softwareActive(session->softwareVerifyRecover))
+		return CKR_STATE_UNSAVEABLE;
+
+	// The saved state must include every update passed so far
+	for(int type = 0; type < BUFFERED_OP_COUNT; type++) {
+		rv = flushUpdates(*session, (BufferedOperationType)type);
+		if(rv != CKR_OK) return rv;
+	}
+	
+	CK_C_GetOperationState Base_C_GetOperationState = (CK_C_GetOperationState)session->module->getFunction("C_GetOperationState");
 	if(Base_C_GetOperationState == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetOperationState)(hSession, pOperationState, pulOperationStateLen);
+	return (*Base_C_GetOperationState)(session->baseSession, pOperationState, pulOperationStateLen);
 }
 
 PKCS_API CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SetOperationState Base_C_SetOperationState = (CK_C_SetOperationState)GlobalData::getInstance().getBaseFunction("C_SetOperationState");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SetOperationState Base_C_SetOperationState = (CK_C_SetOperationState)session->module->getFunction("C_SetOperationState");
 	if(Base_C_SetOperationState == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SetOperationState)(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey);
+	rv = (*Base_C_SetOperationState)(session->baseSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey);
+	if(rv == CKR_OK) session->reusable = false;
+
+	// Updates gathered for the replaced operations no longer apply,
+	// and neither do operations done in software
+	if(rv == CKR_OK) {
+		for(auto &buffer : session->pendingUpdates) {
+			if(buffer) buffer->clear();
+		}
+
+		session->softwareDigest.reset();
+		session->softwareVerify.reset();
+		session->softwareVerifyRecover.reset();
+	}
+
+	return rv;
 }
 
 PKCS_API CK_RV C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_Login Base_C_Login = (CK_C_Login)GlobalData::getInstance().getBaseFunction("C_Login");
+
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		rv = session->replicaGroup->login(*session, userType, pPin, ulPinLen);
+		if(rv == CKR_OK) accessChanged(session->slotID);
+		else tokenChanged(session->slotID);
+
+		return rv;
+	}
+
+	CK_C_Login Base_C_Login = (CK_C_Login)session->module->getFunction("C_Login");
 	if(Base_C_Login == NULL) return CKR_GENERAL_ERROR;
+
+	// Idle pooled sessions keep the token logged in after the
+	// application closed its last session, which it can't know about.
+	// Base HSMs answer CKR_USER_ALREADY_LOGGED_IN before checking the
+	// PIN, so that login is dropped and this one checked afresh.
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+	if(sessionPool != NULL && sessionPool->isLoginHeld(session->slotID)) {
+		rv = logOutPool(*session);
+		if(rv != CKR_OK) return rv;
+	}
 	
-	return (*Base_C_Login)(hSession, userType, pPin, ulPinLen);
+	rv = (*Base_C_Login)(session->baseSession, userType, pPin, ulPinLen);
+
+	if(rv == CKR_OK) accessChanged(session->slotID);
+	else tokenChanged(session->slotID);  // PIN counter flags may have changed
+	if(rv == CKR_OK && sessionPool != NULL) sessionPool->recordLogin(session->slotID, userType);
+
+	KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+	if(rv == CKR_OK && keyPairPool != NULL) keyPairPool->wake();
+
+	return rv;
 }
 
 PKCS_API CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		rv = session->replicaGroup->logout(*session);
+		accessChanged(session->slotID);
+
+		return rv;
+	}
 	
-	CK_C_Logout Base_C_Logout = (CK_C_Logout)GlobalData::getInstance().getBaseFunction("C_Logout");
-	if(Base_C_Logout == NULL) return CKR_GENERAL_ERROR;
+	// The application never logged in to a login the pool holds
+	SessionPool *sessionPool = GlobalData::getInstance().getSessionPool();
+	if(sessionPool != NULL && sessionPool->isLoginHeld(session->slotID)) {
+		rv = logOutPool(*session);
+		return rv != CKR_OK ? rv : CKR_USER_NOT_LOGGED_IN;
+	}
 	
-	return (*Base_C_Logout)(hSession);
+	// Pooled key pairs can only be destroyed while the token is logged in
+	KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+	if(keyPairPool != NULL) keyPairPool->drain(session->slotID);
+
+	CK_C_Logout Base_C_Logout = (CK_C_Logout)session->module->getFunction("C_Logout");
+	if(Base_C_Logout == NULL) return CKR_GENERAL_ERROR;
+	
+	rv = (*Base_C_Logout)(session->baseSession);
+	accessChanged(session->slotID);
+
+	if((rv == CKR_OK || rv == CKR_USER_NOT_LOGGED_IN) && sessionPool != NULL) sessionPool->forgetLogin(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_CreateObject Base_C_CreateObject = (CK_C_CreateObject)GlobalData::getInstance().getBaseFunction("C_CreateObject");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_CreateObject Base_C_CreateObject = (CK_C_CreateObject)session->module->getFunction("C_CreateObject");
 	if(Base_C_CreateObject == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_CreateObject)(hSession, pTemplate, ulCount, phObject);
+	rv = (*Base_C_CreateObject)(session->baseSession, pTemplate, ulCount, phObject);
+	if(rv == CKR_OK) session->reusable = false;
+
+	objectsChanged(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_CopyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_CopyObject Base_C_CopyObject = (CK_C_CopyObject)GlobalData::getInstance().getBaseFunction("C_CopyObject");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_CopyObject Base_C_CopyObject = (CK_C_CopyObject)session->module->getFunction("C_CopyObject");
 	if(Base_C_CopyObject == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_CopyObject)(hSession, hObject, pTemplate, ulCount, phNewObject);
+	rv = (*Base_C_CopyObject)(session->baseSession, hObject, pTemplate, ulCount, phNewObject);
+	if(rv == CKR_OK) session->reusable = false;
+
+	objectsChanged(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
 	
-	CK_C_DestroyObject Base_C_DestroyObject = (CK_C_DestroyObject)GlobalData::getInstance().getBaseFunction("C_DestroyObject");
+	CK_C_DestroyObject Base_C_DestroyObject = (CK_C_DestroyObject)session->module->getFunction("C_DestroyObject");
 	if(Base_C_DestroyObject == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DestroyObject)(hSession, hObject);
+	rv = (*Base_C_DestroyObject)(session->baseSession, hObject);
+
+	// The handle may be reused for a different key
+	if(rv == CKR_OK && session->replicaGroup != NULL) session->replicaGroup->forgetKey(hObject);
+
+	objectChanged(session->slotID, hObject);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetObjectSize Base_C_GetObjectSize = (CK_C_GetObjectSize)GlobalData::getInstance().getBaseFunction("C_GetObjectSize");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_GetObjectSize Base_C_GetObjectSize = (CK_C_GetObjectSize)session->module->getFunction("C_GetObjectSize");
 	if(Base_C_GetObjectSize == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetObjectSize)(hSession, hObject, pulSize);
+	return (*Base_C_GetObjectSize)(session->baseSession, hObject, pulSize);
 }
 
 PKCS_API CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)GlobalData::getInstance().getBaseFunction("C_GetAttributeValue");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	AttributeCache *attributeCache = GlobalData::getInstance().getAttributeCache();
+	if(attributeCache != NULL) {
+		try {
+			return attributeCache->getAttributeValue(*session, hObject, pTemplate, ulCount);
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_GetAttributeValue Base_C_GetAttributeValue = (CK_C_GetAttributeValue)session->module->getFunction("C_GetAttributeValue");
 	if(Base_C_GetAttributeValue == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetAttributeValue)(hSession, hObject, pTemplate, ulCount);
+	return (*Base_C_GetAttributeValue)(session->baseSession, hObject, pTemplate, ulCount);
 }
 
 PKCS_API CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SetAttributeValue Base_C_SetAttributeValue = (CK_C_SetAttributeValue)GlobalData::getInstance().getBaseFunction("C_SetAttributeValue");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SetAttributeValue Base_C_SetAttributeValue = (CK_C_SetAttributeValue)session->module->getFunction("C_SetAttributeValue");
 	if(Base_C_SetAttributeValue == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SetAttributeValue)(hSession, hObject, pTemplate, ulCount);
+	rv = (*Base_C_SetAttributeValue)(session->baseSession, hObject, pTemplate, ulCount);
+
+	objectChanged(session->slotID, hObject);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_FindObjectsInit Base_C_FindObjectsInit = (CK_C_FindObjectsInit)GlobalData::getInstance().getBaseFunction("C_FindObjectsInit");
-	if(Base_C_FindObjectsInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_FindObjectsInit)(hSession, pTemplate, ulCount);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		// With the find cache on, the whole search runs here and
+		// C_FindObjects/C_FindObjectsFinal are answered from memory
+		FindCache *findCache = GlobalData::getInstance().getFindCache();
+		std::string cacheKey;
+
+		if(findCache != NULL && FindCache::makeKey(session->slotID, pTemplate, ulCount, cacheKey)) {
+			if(session->findActive) return CKR_OPERATION_ACTIVE;
+
+			rv = findCache->search(*session, pTemplate, ulCount, cacheKey, session->findResults);
+			if(rv != CKR_OK) return rv;
+
+			session->findActive = true;
+			session->findPosition = 0;
+			return CKR_OK;
+		}
+
+		CK_C_FindObjectsInit Base_C_FindObjectsInit = (CK_C_FindObjectsInit)session->module->getFunction("C_FindObjectsInit");
+		if(Base_C_FindObjectsInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_FindObjectsInit)(session->baseSession, pTemplate, ulCount);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_FIND;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_FindObjects Base_C_FindObjects = (CK_C_FindObjects)GlobalData::getInstance().getBaseFunction("C_FindObjects");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	if(session->findActive) {
+		if(phObject == NULL_PTR || pulObjectCount == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		size_t remaining = session->findResults.size() - session->findPosition;
+		CK_ULONG count = remaining < ulMaxObjectCount ? remaining : ulMaxObjectCount;
+
+		std::copy_n(session->findResults.begin() + session->findPosition, count, phObject);
+		session->findPosition += count;
+
+		*pulObjectCount = count;
+		return CKR_OK;
+	}
+	
+	CK_C_FindObjects Base_C_FindObjects = (CK_C_FindObjects)session->module->getFunction("C_FindObjects");
 	if(Base_C_FindObjects == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_FindObjects)(hSession, phObject, ulMaxObjectCount, pulObjectCount);
+	return (*Base_C_FindObjects)(session->baseSession, phObject, ulMaxObjectCount, pulObjectCount);
 }
 
 PKCS_API CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_FindObjectsFinal Base_C_FindObjectsFinal = (CK_C_FindObjectsFinal)GlobalData::getInstance().getBaseFunction("C_FindObjectsFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	if(session->findActive) {
+		session->findActive = false;
+		session->findResults.clear();
+		return CKR_OK;
+	}
+	
+	CK_C_FindObjectsFinal Base_C_FindObjectsFinal = (CK_C_FindObjectsFinal)session->module->getFunction("C_FindObjectsFinal");
 	if(Base_C_FindObjectsFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_FindObjectsFinal)(hSession);
+	rv = (*Base_C_FindObjectsFinal)(session->baseSession);
+	if(rv == CKR_OK) session->activeOperations &= ~SESSION_OP_FIND;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hObject)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_EncryptInit Base_C_EncryptInit = (CK_C_EncryptInit)GlobalData::getInstance().getBaseFunction("C_EncryptInit");
-	if(Base_C_EncryptInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_EncryptInit)(hSession, pMechanism, hObject);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		if(session->replicaGroup != NULL) return session->replicaGroup->init(*session, REPLICA_OP_ENCRYPT, pMechanism, hObject);
+
+		CK_C_EncryptInit Base_C_EncryptInit = (CK_C_EncryptInit)session->module->getFunction("C_EncryptInit");
+		if(Base_C_EncryptInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_EncryptInit)(session->baseSession, pMechanism, hObject);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_ENCRYPT;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_Encrypt Base_C_Encrypt = (CK_C_Encrypt)GlobalData::getInstance().getBaseFunction("C_Encrypt");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_ENCRYPT, true, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_Encrypt Base_C_Encrypt = (CK_C_Encrypt)module->getFunction("C_Encrypt");
+				if(Base_C_Encrypt == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_Encrypt)(hBaseSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+			});
+
+			if(operationEnded(rv, pEncryptedData)) session->replicaGroup->end(*session, REPLICA_OP_ENCRYPT);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_Encrypt Base_C_Encrypt = (CK_C_Encrypt)session->module->getFunction("C_Encrypt");
 	if(Base_C_Encrypt == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_Encrypt)(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	rv = (*Base_C_Encrypt)(session->baseSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	if(operationEnded(rv, pEncryptedData)) session->activeOperations &= ~SESSION_OP_ENCRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_EncryptUpdate Base_C_EncryptUpdate = (CK_C_EncryptUpdate)GlobalData::getInstance().getBaseFunction("C_EncryptUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_ENCRYPT, false, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_EncryptUpdate Base_C_EncryptUpdate = (CK_C_EncryptUpdate)module->getFunction("C_EncryptUpdate");
+				if(Base_C_EncryptUpdate == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_EncryptUpdate)(hBaseSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+			});
+
+			if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->replicaGroup->end(*session, REPLICA_OP_ENCRYPT);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_EncryptUpdate Base_C_EncryptUpdate = (CK_C_EncryptUpdate)session->module->getFunction("C_EncryptUpdate");
 	if(Base_C_EncryptUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_EncryptUpdate)(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	rv = (*Base_C_EncryptUpdate)(session->baseSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~SESSION_OP_ENCRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_EncryptFinal Base_C_EncryptFinal = (CK_C_EncryptFinal)GlobalData::getInstance().getBaseFunction("C_EncryptFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_ENCRYPT, false, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_EncryptFinal Base_C_EncryptFinal = (CK_C_EncryptFinal)module->getFunction("C_EncryptFinal");
+				if(Base_C_EncryptFinal == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_EncryptFinal)(hBaseSession, pEncryptedData, pulEncryptedDataLen);
+			});
+
+			if(operationEnded(rv, pEncryptedData)) session->replicaGroup->end(*session, REPLICA_OP_ENCRYPT);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_EncryptFinal Base_C_EncryptFinal = (CK_C_EncryptFinal)session->module->getFunction("C_EncryptFinal");
 	if(Base_C_EncryptFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_EncryptFinal)(hSession, pEncryptedData, pulEncryptedDataLen);
+	rv = (*Base_C_EncryptFinal)(session->baseSession, pEncryptedData, pulEncryptedDataLen);
+	if(operationEnded(rv, pEncryptedData)) session->activeOperations &= ~SESSION_OP_ENCRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hObject)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DecryptInit Base_C_DecryptInit = (CK_C_DecryptInit)GlobalData::getInstance().getBaseFunction("C_DecryptInit");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DecryptInit Base_C_DecryptInit = (CK_C_DecryptInit)session->module->getFunction("C_DecryptInit");
 	if(Base_C_DecryptInit == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DecryptInit)(hSession, pMechanism, hObject);
+	rv = (*Base_C_DecryptInit)(session->baseSession, pMechanism, hObject);
+	if(rv == CKR_OK) session->activeOperations |= SESSION_OP_DECRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_Decrypt Base_C_Decrypt = (CK_C_Decrypt)GlobalData::getInstance().getBaseFunction("C_Decrypt");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_Decrypt Base_C_Decrypt = (CK_C_Decrypt)session->module->getFunction("C_Decrypt");
 	if(Base_C_Decrypt == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_Decrypt)(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+	rv = (*Base_C_Decrypt)(session->baseSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+	if(operationEnded(rv, pData)) session->activeOperations &= ~SESSION_OP_DECRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DecryptUpdate Base_C_DecryptUpdate = (CK_C_DecryptUpdate)GlobalData::getInstance().getBaseFunction("C_DecryptUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DecryptUpdate Base_C_DecryptUpdate = (CK_C_DecryptUpdate)session->module->getFunction("C_DecryptUpdate");
 	if(Base_C_DecryptUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DecryptUpdate)(hSession, pEncryptedData, ulEncryptedDataLen, pData, pDataLen);
+	rv = (*Base_C_DecryptUpdate)(session->baseSession, pEncryptedData, ulEncryptedDataLen, pData, pDataLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~SESSION_OP_DECRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG_PTR pDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DecryptFinal Base_C_DecryptFinal = (CK_C_DecryptFinal)GlobalData::getInstance().getBaseFunction("C_DecryptFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DecryptFinal Base_C_DecryptFinal = (CK_C_DecryptFinal)session->module->getFunction("C_DecryptFinal");
 	if(Base_C_DecryptFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DecryptFinal)(hSession, pData, pDataLen);
+	rv = (*Base_C_DecryptFinal)(session->baseSession, pData, pDataLen);
+	if(operationEnded(rv, pData)) session->activeOperations &= ~SESSION_OP_DECRYPT;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_DigestInit Base_C_DigestInit = (CK_C_DigestInit)GlobalData::getInstance().getBaseFunction("C_DigestInit");
-	if(Base_C_DigestInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_DigestInit)(hSession, pMechanism);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		if(softwareActive(session->softwareDigest)) return CKR_OPERATION_ACTIVE;
+
+		// SHA-2 digests need no key, so with offload on they are done in
+		// software unless the base HSM may have a digest under way
+		const EVP_MD *md = GlobalData::getInstance().getPublicKeyCache() != NULL ? SoftwareDigest::getDigest(pMechanism) : NULL;
+		if(md != NULL && !(session->activeOperations & SESSION_OP_DIGEST)) {
+			session->softwareDigest = std::make_unique<SoftwareDigest>(md);
+			return CKR_OK;
+		}
+
+		CK_C_DigestInit Base_C_DigestInit = (CK_C_DigestInit)session->module->getFunction("C_DigestInit");
+		if(Base_C_DigestInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_DigestInit)(session->baseSession, pMechanism);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_DIGEST;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_Digest Base_C_Digest = (CK_C_Digest)GlobalData::getInstance().getBaseFunction("C_Digest");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareDigest)) {
+		rv = session->softwareDigest->digest(pData, ulDataLen, pDigest, pulDigestLen);
+		if(!session->softwareDigest->isActive()) session->softwareDigest.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_DIGEST);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_Digest Base_C_Digest = (CK_C_Digest)session->module->getFunction("C_Digest");
 	if(Base_C_Digest == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_Digest)(hSession, pData, ulDataLen, pDigest, pulDigestLen);
+	rv = (*Base_C_Digest)(session->baseSession, pData, ulDataLen, pDigest, pulDigestLen);
+	if(operationEnded(rv, pDigest)) session->activeOperations &= ~SESSION_OP_DIGEST;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DigestUpdate Base_C_DigestUpdate = (CK_C_DigestUpdate)GlobalData::getInstance().getBaseFunction("C_DigestUpdate");
-	if(Base_C_DigestUpdate == NULL) return CKR_GENERAL_ERROR;
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	if(softwareActive(session->softwareDigest)) {
+		rv = session->softwareDigest->update(pPart, ulPartLen);
+		if(!session->softwareDigest->isActive()) session->softwareDigest.reset();
+		return rv;
+	}
 	
-	return (*Base_C_DigestUpdate)(hSession, pPart, ulPartLen);
+	try {
+		return bufferUpdate(*session, BUFFERED_OP_DIGEST, pPart, ulPartLen);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DigestKey Base_C_DigestKey = (CK_C_DigestKey)GlobalData::getInstance().getBaseFunction("C_DigestKey");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	// Secret keys can't be read out to digest them in software
+	if(softwareActive(session->softwareDigest)) {
+		session->softwareDigest.reset();
+		return CKR_KEY_INDIGESTIBLE;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_DIGEST);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DigestKey Base_C_DigestKey = (CK_C_DigestKey)session->module->getFunction("C_DigestKey");
 	if(Base_C_DigestKey == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DigestKey)(hSession, hObject);
+	rv = (*Base_C_DigestKey)(session->baseSession, hObject);
+	if(rv != CKR_OK) session->activeOperations &= ~SESSION_OP_DIGEST;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DigestFinal Base_C_DigestFinal = (CK_C_DigestFinal)GlobalData::getInstance().getBaseFunction("C_DigestFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareDigest)) {
+		rv = session->softwareDigest->final(pDigest, pulDigestLen);
+		if(!session->softwareDigest->isActive()) session->softwareDigest.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_DIGEST);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DigestFinal Base_C_DigestFinal = (CK_C_DigestFinal)session->module->getFunction("C_DigestFinal");
 	if(Base_C_DigestFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DigestFinal)(hSession, pDigest, pulDigestLen);
+	rv = (*Base_C_DigestFinal)(session->baseSession, pDigest, pulDigestLen);
+	if(operationEnded(rv, pDigest)) session->activeOperations &= ~SESSION_OP_DIGEST;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_SignInit Base_C_SignInit = (CK_C_SignInit)GlobalData::getInstance().getBaseFunction("C_SignInit");
-	if(Base_C_SignInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_SignInit)(hSession, pMechanism, hKey);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		if(session->replicaGroup != NULL) return session->replicaGroup->init(*session, REPLICA_OP_SIGN, pMechanism, hKey);
+
+		CK_C_SignInit Base_C_SignInit = (CK_C_SignInit)session->module->getFunction("C_SignInit");
+		if(Base_C_SignInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_SignInit)(session->baseSession, pMechanism, hKey);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_SIGN;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_Sign Base_C_Sign = (CK_C_Sign)GlobalData::getInstance().getBaseFunction("C_Sign");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	rv = flushUpdates(*session, BUFFERED_OP_SIGN);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_SIGN, true, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_Sign Base_C_Sign = (CK_C_Sign)module->getFunction("C_Sign");
+				if(Base_C_Sign == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_Sign)(hBaseSession, pData, ulDataLen, pSignature, pulSignatureLen);
+			});
+
+			if(operationEnded(rv, pSignature)) session->replicaGroup->end(*session, REPLICA_OP_SIGN);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_Sign Base_C_Sign = (CK_C_Sign)session->module->getFunction("C_Sign");
 	if(Base_C_Sign == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_Sign)(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	rv = (*Base_C_Sign)(session->baseSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	if(operationEnded(rv, pSignature)) session->activeOperations &= ~SESSION_OP_SIGN;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SignUpdate Base_C_SignUpdate = (CK_C_SignUpdate)GlobalData::getInstance().getBaseFunction("C_SignUpdate");
-	if(Base_C_SignUpdate == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_SignUpdate)(hSession, pPart, ulPartLen);
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	try {
+		return bufferUpdate(*session, BUFFERED_OP_SIGN, pPart, ulPartLen);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SignFinal Base_C_SignFinal = (CK_C_SignFinal)GlobalData::getInstance().getBaseFunction("C_SignFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	rv = flushUpdates(*session, BUFFERED_OP_SIGN);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_SIGN, false, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_SignFinal Base_C_SignFinal = (CK_C_SignFinal)module->getFunction("C_SignFinal");
+				if(Base_C_SignFinal == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_SignFinal)(hBaseSession, pSignature, pulSignatureLen);
+			});
+
+			if(operationEnded(rv, pSignature)) session->replicaGroup->end(*session, REPLICA_OP_SIGN);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_SignFinal Base_C_SignFinal = (CK_C_SignFinal)session->module->getFunction("C_SignFinal");
 	if(Base_C_SignFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SignFinal)(hSession, pSignature, pulSignatureLen);
+	rv = (*Base_C_SignFinal)(session->baseSession, pSignature, pulSignatureLen);
+	if(operationEnded(rv, pSignature)) session->activeOperations &= ~SESSION_OP_SIGN;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SignRecoverInit Base_C_SignRecoverInit = (CK_C_SignRecoverInit)GlobalData::getInstance().getBaseFunction("C_SignRecoverInit");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SignRecoverInit Base_C_SignRecoverInit = (CK_C_SignRecoverInit)session->module->getFunction("C_SignRecoverInit");
 	if(Base_C_SignRecoverInit == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SignRecoverInit)(hSession, pMechanism, hKey);
+	rv = (*Base_C_SignRecoverInit)(session->baseSession, pMechanism, hKey);
+	if(rv == CKR_OK) session->activeOperations |= SESSION_OP_SIGN_RECOVER;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SignRecover Base_C_SignRecover = (CK_C_SignRecover)GlobalData::getInstance().getBaseFunction("C_SignRecover");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SignRecover Base_C_SignRecover = (CK_C_SignRecover)session->module->getFunction("C_SignRecover");
 	if(Base_C_SignRecover == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SignRecover)(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	rv = (*Base_C_SignRecover)(session->baseSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	if(operationEnded(rv, pSignature)) session->activeOperations &= ~SESSION_OP_SIGN_RECOVER;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_VerifyInit Base_C_VerifyInit = (CK_C_VerifyInit)GlobalData::getInstance().getBaseFunction("C_VerifyInit");
-	if(Base_C_VerifyInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_VerifyInit)(hSession, pMechanism, hKey);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		if(softwareActive(session->softwareVerify)) return CKR_OPERATION_ACTIVE;
+		if(softwareVerifyInit(*session, pMechanism, hKey, false, session->softwareVerify, rv)) return rv;
+
+		if(session->replicaGroup != NULL) return session->replicaGroup->init(*session, REPLICA_OP_VERIFY, pMechanism, hKey);
+
+		CK_C_VerifyInit Base_C_VerifyInit = (CK_C_VerifyInit)session->module->getFunction("C_VerifyInit");
+		if(Base_C_VerifyInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_VerifyInit)(session->baseSession, pMechanism, hKey);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_VERIFY;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_Verify Base_C_Verify = (CK_C_Verify)GlobalData::getInstance().getBaseFunction("C_Verify");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareVerify)) {
+		try {
+			rv = session->softwareVerify->verify(pData, ulDataLen, pSignature, ulSignatureLen);
+		} catch (std::bad_alloc &ex) {
+			rv = CKR_HOST_MEMORY;
+		}
+
+		if(!session->softwareVerify->isActive()) session->softwareVerify.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_VERIFY);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_VERIFY, true, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_Verify Base_C_Verify = (CK_C_Verify)module->getFunction("C_Verify");
+				if(Base_C_Verify == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_Verify)(hBaseSession, pData, ulDataLen, pSignature, ulSignatureLen);
+			});
+
+			session->replicaGroup->end(*session, REPLICA_OP_VERIFY);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_Verify Base_C_Verify = (CK_C_Verify)session->module->getFunction("C_Verify");
 	if(Base_C_Verify == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_Verify)(hSession, pData, ulDataLen, pSignature, ulSignatureLen);
+	// Verifying ends the operation whatever the outcome
+	rv = (*Base_C_Verify)(session->baseSession, pData, ulDataLen, pSignature, ulSignatureLen);
+	session->activeOperations &= ~SESSION_OP_VERIFY;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_VerifyUpdate Base_C_VerifyUpdate = (CK_C_VerifyUpdate)GlobalData::getInstance().getBaseFunction("C_VerifyUpdate");
-	if(Base_C_VerifyUpdate == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_VerifyUpdate)(hSession, pPart, ulPartLen);
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareVerify)) {
+		rv = session->softwareVerify->update(pPart, ulPartLen);
+		if(!session->softwareVerify->isActive()) session->softwareVerify.reset();
+		return rv;
+	}
+
+	try {
+		return bufferUpdate(*session, BUFFERED_OP_VERIFY, pPart, ulPartLen);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_VerifyFinal Base_C_VerifyFinal = (CK_C_VerifyFinal)GlobalData::getInstance().getBaseFunction("C_VerifyFinal");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareVerify)) {
+		try {
+			rv = session->softwareVerify->final(pSignature, ulSignatureLen);
+		} catch (std::bad_alloc &ex) {
+			rv = CKR_HOST_MEMORY;
+		}
+
+		if(!session->softwareVerify->isActive()) session->softwareVerify.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_VERIFY);
+	if(rv != CKR_OK) return rv;
+
+	if(session->replicaGroup != NULL) {
+		try {
+			rv = session->replicaGroup->run(*session, REPLICA_OP_VERIFY, false, [&](BaseHSM *module, CK_SESSION_HANDLE hBaseSession) {
+				CK_C_VerifyFinal Base_C_VerifyFinal = (CK_C_VerifyFinal)module->getFunction("C_VerifyFinal");
+				if(Base_C_VerifyFinal == NULL) return CKR_GENERAL_ERROR;
+
+				return (*Base_C_VerifyFinal)(hBaseSession, pSignature, ulSignatureLen);
+			});
+
+			session->replicaGroup->end(*session, REPLICA_OP_VERIFY);
+			return rv;
+		} catch (std::bad_alloc &ex) {
+			return CKR_HOST_MEMORY;
+		} catch (...) {
+			return CKR_GENERAL_ERROR;
+		}
+	}
+	
+	CK_C_VerifyFinal Base_C_VerifyFinal = (CK_C_VerifyFinal)session->module->getFunction("C_VerifyFinal");
 	if(Base_C_VerifyFinal == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_VerifyFinal)(hSession, pSignature, ulSignatureLen);
+	rv = (*Base_C_VerifyFinal)(session->baseSession, pSignature, ulSignatureLen);
+	session->activeOperations &= ~SESSION_OP_VERIFY;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
-	
-	CK_C_VerifyRecoverInit Base_C_VerifyRecoverInit = (CK_C_VerifyRecoverInit)GlobalData::getInstance().getBaseFunction("C_VerifyRecoverInit");
-	if(Base_C_VerifyRecoverInit == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_VerifyRecoverInit)(hSession, pMechanism, hKey);
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		if(softwareActive(session->softwareVerifyRecover)) return CKR_OPERATION_ACTIVE;
+		if(softwareVerifyInit(*session, pMechanism, hKey, true, session->softwareVerifyRecover, rv)) return rv;
+
+		CK_C_VerifyRecoverInit Base_C_VerifyRecoverInit = (CK_C_VerifyRecoverInit)session->module->getFunction("C_VerifyRecoverInit");
+		if(Base_C_VerifyRecoverInit == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_VerifyRecoverInit)(session->baseSession, pMechanism, hKey);
+		if(rv == CKR_OK) session->activeOperations |= SESSION_OP_VERIFY_RECOVER;
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_VerifyRecover Base_C_VerifyRecover = (CK_C_VerifyRecover)GlobalData::getInstance().getBaseFunction("C_VerifyRecover");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	if(softwareActive(session->softwareVerifyRecover)) {
+		try {
+			rv = session->softwareVerifyRecover->verifyRecover(pSignature, ulSignatureLen, pData, pulDataLen);
+		} catch (std::bad_alloc &ex) {
+			rv = CKR_HOST_MEMORY;
+		}
+
+		if(!session->softwareVerifyRecover->isActive()) session->softwareVerifyRecover.reset();
+		return rv;
+	}
+
+	CK_C_VerifyRecover Base_C_VerifyRecover = (CK_C_VerifyRecover)session->module->getFunction("C_VerifyRecover");
 	if(Base_C_VerifyRecover == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_VerifyRecover)(hSession, pSignature, ulSignatureLen, pData, pulDataLen);
+	rv = (*Base_C_VerifyRecover)(session->baseSession, pSignature, ulSignatureLen, pData, pulDataLen);
+	if(operationEnded(rv, pData)) session->activeOperations &= ~SESSION_OP_VERIFY_RECOVER;
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DigestEncryptUpdate Base_C_DigestEncryptUpdate = (CK_C_DigestEncryptUpdate)GlobalData::getInstance().getBaseFunction("C_DigestEncryptUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	// The base HSM only encrypts when the digest is done in software
+	if(softwareActive(session->softwareDigest)) {
+		CK_C_EncryptUpdate Base_C_EncryptUpdate = (CK_C_EncryptUpdate)session->module->getFunction("C_EncryptUpdate");
+		if(Base_C_EncryptUpdate == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_EncryptUpdate)(session->baseSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+		if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~SESSION_OP_ENCRYPT;
+		if(rv == CKR_OK && pEncryptedPart != NULL_PTR) rv = session->softwareDigest->update(pPart, ulPartLen);
+
+		if(!session->softwareDigest->isActive()) session->softwareDigest.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_DIGEST);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DigestEncryptUpdate Base_C_DigestEncryptUpdate = (CK_C_DigestEncryptUpdate)session->module->getFunction("C_DigestEncryptUpdate");
 	if(Base_C_DigestEncryptUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DigestEncryptUpdate)(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	rv = (*Base_C_DigestEncryptUpdate)(session->baseSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~(SESSION_OP_DIGEST | SESSION_OP_ENCRYPT);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pDecryptedPart, CK_ULONG_PTR pulDecryptedPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DecryptDigestUpdate Base_C_DecryptDigestUpdate = (CK_C_DecryptDigestUpdate)GlobalData::getInstance().getBaseFunction("C_DecryptDigestUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareDigest)) {
+		CK_C_DecryptUpdate Base_C_DecryptUpdate = (CK_C_DecryptUpdate)session->module->getFunction("C_DecryptUpdate");
+		if(Base_C_DecryptUpdate == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_DecryptUpdate)(session->baseSession, pPart, ulPartLen, pDecryptedPart, pulDecryptedPartLen);
+		if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~SESSION_OP_DECRYPT;
+		if(rv == CKR_OK && pDecryptedPart != NULL_PTR) rv = session->softwareDigest->update(pDecryptedPart, *pulDecryptedPartLen);
+
+		if(!session->softwareDigest->isActive()) session->softwareDigest.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_DIGEST);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DecryptDigestUpdate Base_C_DecryptDigestUpdate = (CK_C_DecryptDigestUpdate)session->module->getFunction("C_DecryptDigestUpdate");
 	if(Base_C_DecryptDigestUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DecryptDigestUpdate)(hSession, pPart, ulPartLen, pDecryptedPart, pulDecryptedPartLen);
+	rv = (*Base_C_DecryptDigestUpdate)(session->baseSession, pPart, ulPartLen, pDecryptedPart, pulDecryptedPartLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~(SESSION_OP_DECRYPT | SESSION_OP_DIGEST);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_SignEncryptUpdate Base_C_SignEncryptUpdate = (CK_C_SignEncryptUpdate)GlobalData::getInstance().getBaseFunction("C_SignEncryptUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	rv = flushUpdates(*session, BUFFERED_OP_SIGN);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_SignEncryptUpdate Base_C_SignEncryptUpdate = (CK_C_SignEncryptUpdate)session->module->getFunction("C_SignEncryptUpdate");
 	if(Base_C_SignEncryptUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_SignEncryptUpdate)(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	rv = (*Base_C_SignEncryptUpdate)(session->baseSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~(SESSION_OP_SIGN | SESSION_OP_ENCRYPT);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DecryptVerifyUpdate Base_C_DecryptVerifyUpdate = (CK_C_DecryptVerifyUpdate)GlobalData::getInstance().getBaseFunction("C_DecryptVerifyUpdate");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+
+	if(softwareActive(session->softwareVerify)) {
+		CK_C_DecryptUpdate Base_C_DecryptUpdate = (CK_C_DecryptUpdate)session->module->getFunction("C_DecryptUpdate");
+		if(Base_C_DecryptUpdate == NULL) return CKR_GENERAL_ERROR;
+
+		rv = (*Base_C_DecryptUpdate)(session->baseSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+		if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~SESSION_OP_DECRYPT;
+		if(rv == CKR_OK && pPart != NULL_PTR) rv = session->softwareVerify->update(pPart, *pulPartLen);
+
+		if(!session->softwareVerify->isActive()) session->softwareVerify.reset();
+		return rv;
+	}
+
+	rv = flushUpdates(*session, BUFFERED_OP_VERIFY);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DecryptVerifyUpdate Base_C_DecryptVerifyUpdate = (CK_C_DecryptVerifyUpdate)session->module->getFunction("C_DecryptVerifyUpdate");
 	if(Base_C_DecryptVerifyUpdate == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DecryptVerifyUpdate)(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+	rv = (*Base_C_DecryptVerifyUpdate)(session->baseSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+	if(rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) session->activeOperations &= ~(SESSION_OP_DECRYPT | SESSION_OP_VERIFY);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GenerateKey Base_C_GenerateKey = (CK_C_GenerateKey)GlobalData::getInstance().getBaseFunction("C_GenerateKey");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_GenerateKey Base_C_GenerateKey = (CK_C_GenerateKey)session->module->getFunction("C_GenerateKey");
 	if(Base_C_GenerateKey == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GenerateKey)(hSession, pMechanism, pTemplate, ulCount, phKey);
+	rv = (*Base_C_GenerateKey)(session->baseSession, pMechanism, pTemplate, ulCount, phKey);
+	if(rv == CKR_OK) session->reusable = false;
+
+	objectsChanged(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey)
 {
-	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GenerateKeyPair Base_C_GenerateKeyPair = (CK_C_GenerateKeyPair)GlobalData::getInstance().getBaseFunction("C_GenerateKeyPair");
-	if(Base_C_GenerateKeyPair == NULL) return CKR_GENERAL_ERROR;
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
 	
-	return (*Base_C_GenerateKeyPair)(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey);
+		// A matching request gets a pair generated ahead of time
+		KeyPairPool *keyPairPool = GlobalData::getInstance().getKeyPairPool();
+		if(keyPairPool != NULL && keyPairPool->take(*session, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey, rv)) {
+			session->reusable = false;
+			objectsChanged(session->slotID);
+			return rv;
+		}
+
+		CK_C_GenerateKeyPair Base_C_GenerateKeyPair = (CK_C_GenerateKeyPair)session->module->getFunction("C_GenerateKeyPair");
+		if(Base_C_GenerateKeyPair == NULL) return CKR_GENERAL_ERROR;
+	
+		rv = (*Base_C_GenerateKeyPair)(session->baseSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey);
+		if(rv == CKR_OK) session->reusable = false;
+
+		objectsChanged(session->slotID);
+
+		return rv;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
 PKCS_API CK_RV C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_WrapKey Base_C_WrapKey = (CK_C_WrapKey)GlobalData::getInstance().getBaseFunction("C_WrapKey");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_WrapKey Base_C_WrapKey = (CK_C_WrapKey)session->module->getFunction("C_WrapKey");
 	if(Base_C_WrapKey == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_WrapKey)(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen);
+	return (*Base_C_WrapKey)(session->baseSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen);
 }
 
 PKCS_API CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_UnwrapKey Base_C_UnwrapKey = (CK_C_UnwrapKey)GlobalData::getInstance().getBaseFunction("C_UnwrapKey");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_UnwrapKey Base_C_UnwrapKey = (CK_C_UnwrapKey)session->module->getFunction("C_UnwrapKey");
 	if(Base_C_UnwrapKey == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_UnwrapKey)(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulCount, phKey);
+	rv = (*Base_C_UnwrapKey)(session->baseSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulCount, phKey);
+	if(rv == CKR_OK) session->reusable = false;
+
+	objectsChanged(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_DeriveKey Base_C_DeriveKey = (CK_C_DeriveKey)GlobalData::getInstance().getBaseFunction("C_DeriveKey");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_DeriveKey Base_C_DeriveKey = (CK_C_DeriveKey)session->module->getFunction("C_DeriveKey");
 	if(Base_C_DeriveKey == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_DeriveKey)(hSession, pMechanism, hBaseKey, pTemplate, ulCount, phKey);
+	rv = (*Base_C_DeriveKey)(session->baseSession, pMechanism, hBaseKey, pTemplate, ulCount, phKey);
+	if(rv == CKR_OK) session->reusable = false;
+
+	objectsChanged(session->slotID);
+
+	return rv;
 }
 
 PKCS_API CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_GetFunctionStatus Base_C_GetFunctionStatus = (CK_C_GetFunctionStatus)GlobalData::getInstance().getBaseFunction("C_GetFunctionStatus");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_GetFunctionStatus Base_C_GetFunctionStatus = (CK_C_GetFunctionStatus)session->module->getFunction("C_GetFunctionStatus");
 	if(Base_C_GetFunctionStatus == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_GetFunctionStatus)(hSession);
+	return (*Base_C_GetFunctionStatus)(session->baseSession);
 }
 
 PKCS_API CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_CancelFunction Base_C_CancelFunction = (CK_C_CancelFunction)GlobalData::getInstance().getBaseFunction("C_CancelFunction");
+	std::shared_ptr<Session> session;
+	CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+	if(rv != CKR_OK) return rv;
+	
+	CK_C_CancelFunction Base_C_CancelFunction = (CK_C_CancelFunction)session->module->getFunction("C_CancelFunction");
 	if(Base_C_CancelFunction == NULL) return CKR_GENERAL_ERROR;
 	
-	return (*Base_C_CancelFunction)(hSession);
+	return (*Base_C_CancelFunction)(session->baseSession);
 }
 
 PKCS_API CK_RV C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved)
 {
 	if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	
-	CK_C_WaitForSlotEvent Base_C_WaitForSlotEvent = (CK_C_WaitForSlotEvent)GlobalData::getInstance().getBaseFunction("C_WaitForSlotEvent");
-	if(Base_C_WaitForSlotEvent == NULL) return CKR_GENERAL_ERROR;
-	
-	return (*Base_C_WaitForSlotEvent)(flags, pSlot, pReserved);
+	// The watcher threads take every event from the base HSMs
+	SlotEventWatcher *slotEventWatcher = GlobalData::getInstance().getSlotEventWatcher();
+	if(slotEventWatcher != NULL) {
+		if(pReserved != NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		return slotEventWatcher->waitForEvent(flags, pSlot);
+	}
+
+	if(GlobalData::getInstance().getModuleCount() == 1) {
+		CK_C_WaitForSlotEvent Base_C_WaitForSlotEvent = (CK_C_WaitForSlotEvent)GlobalData::getInstance().getBaseFunction("C_WaitForSlotEvent");
+		if(Base_C_WaitForSlotEvent == NULL) return CKR_GENERAL_ERROR;
+		
+		CK_RV rv = (*Base_C_WaitForSlotEvent)(flags, pSlot, pReserved);
+		if(rv == CKR_OK) slotChanged(*pSlot);
+
+		return rv;
+	}
+
+	if(pSlot == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+	// No base HSM call can wait on the others, so poll them all
+	while(true) {
+		bool anySupported = false;
+
+		size_t moduleCount = GlobalData::getInstance().getModuleCount();
+		for(size_t i = 0; i < moduleCount; i++) {
+			CK_C_WaitForSlotEvent Base_C_WaitForSlotEvent = (CK_C_WaitForSlotEvent)GlobalData::getInstance().getModule(i)->getFunction("C_WaitForSlotEvent");
+			if(Base_C_WaitForSlotEvent == NULL) return CKR_GENERAL_ERROR;
+
+			CK_SLOT_ID baseSlotID;
+			CK_RV rv = (*Base_C_WaitForSlotEvent)(flags | CKF_DONT_BLOCK, &baseSlotID, pReserved);
+
+			if(rv == CKR_FUNCTION_NOT_SUPPORTED) continue;
+			anySupported = true;
+
+			if(rv == CKR_NO_EVENT) continue;
+			if(rv != CKR_OK) return rv;
+
+			if(!GlobalData::getInstance().canMapSlot(baseSlotID)) continue;
+
+			*pSlot = GlobalData::getInstance().toSlotID(i, baseSlotID);
+			slotChanged(*pSlot);
+
+			return CKR_OK;
+		}
+
+		if(!anySupported) return CKR_FUNCTION_NOT_SUPPORTED;
+		if(flags & CKF_DONT_BLOCK) return CKR_NO_EVENT;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(SLOT_EVENT_POLL_MS));
+
+		// C_Finalize wakes up blocked callers
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+}
+
+// Vendor functions
+
+PKCS_API CK_RV C_QryptGetFunctionList(CK_QRYPT_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	if(ppFunctionList == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+	*ppFunctionList = &qryptFunctionList;
+
+	return CKR_OK;
+}
+
+PKCS_API CK_RV C_QryptProcessBatch(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItems, CK_ULONG ulCount)
+{
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		if(pItems == NULL_PTR && ulCount != 0) return CKR_ARGUMENTS_BAD;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		BatchRunner runner(*session, GlobalData::getInstance().getBatchWorkers());
+		return runner.run(pItems, ulCount);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
 }
 
+PKCS_API CK_RV C_QryptSubmit(CK_SESSION_HANDLE hSession, CK_QRYPT_BATCH_ITEM_PTR pItem, CK_VOID_PTR pCookie)
+{
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		AsyncQueue *asyncQueue = GlobalData::getInstance().getAsyncQueue();
+		if(asyncQueue == NULL) return CKR_FUNCTION_NOT_SUPPORTED;
+
+		if(pItem == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		std::shared_ptr<Session> session;
+		CK_RV rv = GlobalData::getInstance().getSession(hSession, session);
+		if(rv != CKR_OK) return rv;
+
+		return asyncQueue->submit(session, pItem, pCookie);
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
+}
+
+PKCS_API CK_RV C_QryptGetCompletionFd(int *pFd)
+{
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		AsyncQueue *asyncQueue = GlobalData::getInstance().getAsyncQueue();
+		if(asyncQueue == NULL) return CKR_FUNCTION_NOT_SUPPORTED;
+
+		if(pFd == NULL) return CKR_ARGUMENTS_BAD;
+
+		*pFd = asyncQueue->getCompletionFd();
+		return CKR_OK;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
+}
+
+PKCS_API CK_RV C_QryptPollCompletions(CK_QRYPT_COMPLETION_PTR pCompletions, CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount)
+{
+	try {
+		if(!GlobalData::getInstance().isCryptokiInitialized()) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+		AsyncQueue *asyncQueue = GlobalData::getInstance().getAsyncQueue();
+		if(asyncQueue == NULL) return CKR_FUNCTION_NOT_SUPPORTED;
+
+		if(pulCount == NULL_PTR || (pCompletions == NULL_PTR && ulMaxCount != 0)) return CKR_ARGUMENTS_BAD;
+
+		*pulCount = asyncQueue->poll(pCompletions, ulMaxCount);
+		return CKR_OK;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
+}
+
+PKCS_API CK_RV C_QryptGetLatencyReport(CK_UTF8CHAR_PTR pReport, CK_ULONG_PTR pulReportLen)
+{
+	try {
+		if(!LatencyStats::isEnabled()) return CKR_FUNCTION_NOT_SUPPORTED;
+
+		if(pulReportLen == NULL_PTR) return CKR_ARGUMENTS_BAD;
+
+		std::string report = LatencyStats::report();
+
+		if(pReport == NULL_PTR) {
+			*pulReportLen = report.size();
+			return CKR_OK;
+		}
+
+		if(*pulReportLen < report.size()) {
+			*pulReportLen = report.size();
+			return CKR_BUFFER_TOO_SMALL;
+		}
+
+		std::copy(report.begin(), report.end(), pReport);
+		*pulReportLen = report.size();
+		return CKR_OK;
+	} catch (std::bad_alloc &ex) {
+		return CKR_HOST_MEMORY;
+	} catch (...) {
+		return CKR_GENERAL_ERROR;
+	}
+}
+
+PKCS_API CK_RV C_QryptGetStatistics(CK_QRYPT_STATISTICS_PTR pStatistics, CK_ULONG ulSize)
+{
+	if(pStatistics == NULL_PTR || ulSize < sizeof(CK_VERSION)) return CKR_ARGUMENTS_BAD;
+
+	CK_QRYPT_STATISTICS statistics;
+	EntropyStats::getInstance().getStatistics(statistics);
+
+	// Older callers know of fewer fields
+	memcpy(pStatistics, &statistics, std::min((size_t)ulSize, sizeof(statistics)));
+
+	return CKR_OK;
+}
@@ -29,6 +29,11 @@
  osmutex.cpp
 
  Contains OS-specific implementations of intraprocess mutex functions.
+
+ On Linux the mutex is an adaptive lock: a thread that finds it taken
+ spins for a short while, since Qryptoki holds its locks briefly (the
+ random path only for a memcpy when the buffer has the bytes), and
+ only then parks on a futex. Elsewhere it is a POSIX mutex.
  *****************************************************************************/
 
 #include "log.h" // logging macros
@@ -38,6 +43,158 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#ifdef __linux__
+#include <linux/futex.h>	// FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#include <sys/syscall.h>	// SYS_futex
+#include <unistd.h>		// syscall, sysconf
+
+#include <atomic>		// std::atomic
+#include <new>			// placement new
+#endif
+
+#ifdef __linux__
+
+/* Times a waiting thread checks the lock again before parking, if
+ * there is another CPU the holder could be running on */
+#define MUTEX_SPINS 128
+
+static int mutexSpins()
+{
+	static const int spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MUTEX_SPINS : 0;
+
+	return spins;
+}
+
+/* On a cache line of its own, so that neighbouring data doesn't
+ * bounce between the cores taking the lock */
+struct alignas(64) AdaptiveMutex
+{
+	/* 0 unlocked, 1 locked, 2 locked and a thread may be parked */
+	std::atomic<int> state;
+};
+
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static long futex(std::atomic<int>* state, int op, int value)
+{
+	return syscall(SYS_futex, reinterpret_cast<int*>(state), op, value, NULL, NULL, 0);
+}
+
+CK_RV OSCreateMutex(CK_VOID_PTR_PTR newMutex)
+{
+	void* memory = NULL;
+
+	/* Allocate memory */
+	if (posix_memalign(&memory, alignof(AdaptiveMutex), sizeof(AdaptiveMutex)) != 0)
+	{
+		ERROR_MSG("Failed to allocate memory for a new mutex");
+
+		return CKR_HOST_MEMORY;
+	}
+
+	AdaptiveMutex* adaptiveMutex = new (memory) AdaptiveMutex;
+	adaptiveMutex->state.store(0, std::memory_order_relaxed);
+
+	*newMutex = adaptiveMutex;
+
+	return CKR_OK;
+}
+
+CK_RV OSDestroyMutex(CK_VOID_PTR mutex)
+{
+	AdaptiveMutex* adaptiveMutex = (AdaptiveMutex*) mutex;
+
+	if (adaptiveMutex == NULL)
+	{
+		ERROR_MSG("Cannot destroy NULL mutex");
+
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	if (adaptiveMutex->state.load(std::memory_order_acquire) != 0)
+	{
+		ERROR_MSG("Failed to destroy mutex %p, which is locked", mutex);
+
+		return CKR_GENERAL_ERROR;
+	}
+
+	adaptiveMutex->~AdaptiveMutex();
+	free(adaptiveMutex);
+
+	return CKR_OK;
+}
+
+CK_RV OSLockMutex(CK_VOID_PTR mutex)
+{
+	AdaptiveMutex* adaptiveMutex = (AdaptiveMutex*) mutex;
+
+	if (adaptiveMutex == NULL)
+	{
+		ERROR_MSG("Cannot lock NULL mutex");
+
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	int state = 0;
+	if (adaptiveMutex->state.compare_exchange_strong(state, 1, std::memory_order_acquire)) return CKR_OK;
+
+	/* Spin on plain loads, so the cache line stays shared until the
+	 * holder lets go */
+	for (int i = 0; i < mutexSpins() && state != 2; i++)
+	{
+		cpuRelax();
+
+		state = adaptiveMutex->state.load(std::memory_order_relaxed);
+		if (state == 0 && adaptiveMutex->state.compare_exchange_weak(state, 1, std::memory_order_acquire)) return CKR_OK;
+	}
+
+	/* Park until unlocked, leaving the state at 2 so that the thread
+	 * unlocking after us wakes the next waiter */
+	if (state != 2) state = adaptiveMutex->state.exchange(2, std::memory_order_acquire);
+
+	while (state != 0)
+	{
+		futex(&adaptiveMutex->state, FUTEX_WAIT_PRIVATE, 2);
+		state = adaptiveMutex->state.exchange(2, std::memory_order_acquire);
+	}
+
+	return CKR_OK;
+}
+
+CK_RV OSUnlockMutex(CK_VOID_PTR mutex)
+{
+	AdaptiveMutex* adaptiveMutex = (AdaptiveMutex*) mutex;
+
+	if (adaptiveMutex == NULL)
+	{
+		ERROR_MSG("Cannot unlock NULL mutex");
+
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	int state = adaptiveMutex->state.exchange(0, std::memory_order_release);
+
+	if (state == 2) futex(&adaptiveMutex->state, FUTEX_WAKE_PRIVATE, 1);
+
+	if (state == 0)
+	{
+		ERROR_MSG("Failed to unlock mutex %p, which is not locked", mutex);
+
+		return CKR_GENERAL_ERROR;
+	}
+
+	return CKR_OK;
+}
+
+#else
+
 CK_RV OSCreateMutex(CK_VOID_PTR_PTR newMutex)
 {
 	int rv;
@@ -134,3 +291,5 @@ CK_RV OSUnlockMutex(CK_VOID_PTR mutex)
 
 	return CKR_OK;
 }
+
+#endif
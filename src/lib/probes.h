@@ -0,0 +1,36 @@
+/**
+ * USDT probes for bpftrace, perf and SystemTap, under the provider
+ * "qryptoki". The QRYPT_USDT CMake option compiles them in when
+ * sys/sdt.h is available; a probe no tracer is attached to is then a
+ * single nop. Otherwise they compile to nothing, arguments included.
+ *
+ *   call__entry(index, name)            Through the function list from
+ *   call__return(index, name, rv)       C_GetFunctionList
+ *   fetch__start(bytes)                 An EaaS request
+ *   fetch__done(bytes, httpCode, us)    httpCode is -1 if curl failed
+ *   reservoir__hit(bytes, fill)         Bytes served from the random buffer
+ *   reservoir__miss(bytes)              Bytes that must come from EaaS
+ *   mutex__wait(mutex)                  Around GlobalData's mutexes
+ *   mutex__acquired(mutex)
+ *   mutex__release(mutex)
+ */
+
+#ifndef _QRYPT_WRAPPER_PROBES_H
+#define _QRYPT_WRAPPER_PROBES_H
+
+#ifdef QRYPT_HAVE_SDT
+
+#define SDT_USE_VARIADIC
+#include <sys/sdt.h>
+
+#define QRYPT_HAVE_PROBES 1
+#define QRYPT_PROBE(...) STAP_PROBEV(qryptoki, __VA_ARGS__)
+
+#else
+
+#define QRYPT_HAVE_PROBES 0
+#define QRYPT_PROBE(...) do {} while(0)
+
+#endif
+
+#endif /* !_QRYPT_WRAPPER_PROBES_H */